@@ -0,0 +1,1452 @@
+/*
+    BENCHMARKS
+
+ Every design decision in this program is about speed, so we need to be
+ able to measure things. Run with "--benchmark <name>" to run one of the
+ benchmarks below, or "--benchmark all" to run all of them.
+
+ They are run against synthetic traffic generated in memory, and write
+ to a temporary file named with "-w" (in the current directory by
+ default). Point that at the disk you actually plan to capture to.
+*/
+#include "benchmark.h"
+#include "compress-dict.h"
+#include "compress-pool.h"
+#include "file-service.h"
+#include "flow-cutoff.h"
+#include "output-file.h"
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#include "rawsock-pcapfile.h"
+#include "readfiles.h"
+#include "snap-policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+#ifndef UNUSEDPARM
+#define UNUSEDPARM(x) x=(x)
+#endif
+
+/***************************************************************************
+ * A simple, deterministic random number generator, so that runs
+ * are repeatable.
+ ***************************************************************************/
+static uint64_t
+bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static const char *http_text[] = {
+    "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:54.0) Gecko/20100101 Firefox/54.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\nAccept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n\r\n",
+    "HTTP/1.1 200 OK\r\nServer: nginx/1.10.3\r\nDate: Wed, 21 Jun 2017 12:00:00 GMT\r\n"
+    "Content-Type: text/html; charset=utf-8\r\nTransfer-Encoding: chunked\r\n"
+    "Connection: keep-alive\r\nCache-Control: no-cache\r\n\r\n"
+    "<!DOCTYPE html>\n<html>\n<head>\n<title>Example Domain</title>\n"
+    "<meta charset=\"utf-8\" />\n<meta name=\"viewport\" content=\"width=device-width\" />\n"
+    "</head>\n<body>\n<div>\n<h1>Example Domain</h1>\n<p>This domain is for use in "
+    "illustrative examples in documents.</p>\n</div>\n</body>\n</html>\n",
+};
+
+/***************************************************************************
+ * Write the Ethernet/IPv4/TCP-or-UDP headers for a packet in the
+ * given flow.
+ ***************************************************************************/
+static unsigned
+bench_headers(unsigned char *px, unsigned flow, unsigned proto,
+              unsigned payload_length, unsigned seqno)
+{
+    unsigned ip_length = 20 + (proto == 6 ? 20 : 8) + payload_length;
+    unsigned client = 0x0a000000 + (flow % 251) + 1;
+    unsigned server = 0xc0a80000 + (flow % 17) + 1;
+    unsigned sport = 32768 + (flow * 7919) % 28000;
+    unsigned dport = (proto == 17) ? 53 : ((flow & 1) ? 443 : 80);
+
+    memcpy(px + 0, "\x00\x1b\x21\x3c\x9d\xf8", 6);
+    memcpy(px + 6, "\x00\x0c\x29\x4f\x8e\x35", 6);
+    px[12] = 0x08; px[13] = 0x00;
+
+    px[14] = 0x45; px[15] = 0x00;
+    px[16] = (unsigned char)(ip_length >> 8);
+    px[17] = (unsigned char)(ip_length >> 0);
+    px[18] = (unsigned char)(seqno >> 8);
+    px[19] = (unsigned char)(seqno >> 0);
+    px[20] = 0x40; px[21] = 0x00;
+    px[22] = 64;
+    px[23] = (unsigned char)proto;
+    px[24] = (unsigned char)(seqno >> 3);
+    px[25] = (unsigned char)(flow);
+    px[26] = (unsigned char)(client >> 24); px[27] = (unsigned char)(client >> 16);
+    px[28] = (unsigned char)(client >> 8);  px[29] = (unsigned char)(client >> 0);
+    px[30] = (unsigned char)(server >> 24); px[31] = (unsigned char)(server >> 16);
+    px[32] = (unsigned char)(server >> 8);  px[33] = (unsigned char)(server >> 0);
+
+    px[34] = (unsigned char)(sport >> 8); px[35] = (unsigned char)(sport >> 0);
+    px[36] = (unsigned char)(dport >> 8); px[37] = (unsigned char)(dport >> 0);
+    if (proto == 6) {
+        unsigned seq = flow * 2654435761U + seqno * 1448;
+        px[38] = (unsigned char)(seq >> 24); px[39] = (unsigned char)(seq >> 16);
+        px[40] = (unsigned char)(seq >> 8);  px[41] = (unsigned char)(seq >> 0);
+        px[42] = (unsigned char)(flow >> 8); px[43] = 0x12;
+        px[44] = (unsigned char)(seqno >> 8); px[45] = (unsigned char)(seqno);
+        px[46] = 0x50; px[47] = payload_length ? 0x18 : 0x10;
+        px[48] = 0x01; px[49] = 0xf5;
+        px[50] = (unsigned char)(seq >> 5); px[51] = (unsigned char)(flow >> 3);
+        px[52] = 0; px[53] = 0;
+        return 54;
+    } else {
+        unsigned udp_length = 8 + payload_length;
+        px[38] = (unsigned char)(udp_length >> 8);
+        px[39] = (unsigned char)(udp_length >> 0);
+        px[40] = (unsigned char)(seqno >> 8); px[41] = (unsigned char)(flow);
+        return 42;
+    }
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct BenchTraffic *
+bench_traffic_create(size_t count, unsigned fixed_size)
+{
+    struct BenchTraffic *traffic;
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    unsigned long long secs = 1498046400; /* 2017-06-21 */
+    unsigned long long usecs = 0;
+    size_t max_size = fixed_size ? fixed_size : 1514;
+    size_t offset = 0;
+    size_t i;
+
+    traffic = calloc(1, sizeof(*traffic));
+    if (traffic == NULL)
+        exit(1);
+    traffic->count = count;
+    traffic->hdrs = calloc(count, sizeof(traffic->hdrs[0]));
+    traffic->packets = calloc(count, sizeof(traffic->packets[0]));
+    traffic->buf = malloc(count * max_size);
+    if (traffic->hdrs == NULL || traffic->packets == NULL || traffic->buf == NULL)
+        exit(1);
+
+    for (i=0; i<count; i++) {
+        unsigned char *px = traffic->buf + offset;
+        uint64_t r = bench_rand(&seed);
+        unsigned flow = (unsigned)((r >> 8) % 1000);
+        unsigned kind = (unsigned)(r % 100);
+        unsigned header_length;
+        unsigned payload_length;
+        unsigned length;
+        unsigned j;
+
+        /* Choose the type of packet */
+        if (fixed_size) {
+            kind = (fixed_size < 128) ? 0 : 99;
+            payload_length = fixed_size > 54 ? fixed_size - 54 : 0;
+        } else if (kind < 35)
+            payload_length = 0;
+        else if (kind < 50)
+            payload_length = 30 + (unsigned)(r >> 40) % 90;
+        else if (kind < 70)
+            payload_length = 300 + (unsigned)(r >> 40) % 1100;
+        else
+            payload_length = 1460;
+
+        header_length = bench_headers(px, flow,
+                                      (kind >= 35 && kind < 50) ? 17 : 6,
+                                      payload_length, (unsigned)i);
+
+        /* Fill in the payload: text for DNS and HTTP, random for TLS */
+        if (kind >= 35 && kind < 70) {
+            const char *text = http_text[(r >> 20) & 1];
+            size_t text_length = strlen(text);
+            for (j=0; j<payload_length; j++)
+                px[header_length + j] = text[j % text_length];
+        } else {
+            for (j=0; j<payload_length; j += 8) {
+                uint64_t x = bench_rand(&seed);
+                memcpy(px + header_length + j, &x,
+                       (payload_length - j < 8) ? payload_length - j : 8);
+            }
+        }
+
+        /* Ethernet minimum frame size */
+        length = header_length + payload_length;
+        if (length < 60) {
+            memset(px + length, 0, 60 - length);
+            length = 60;
+        }
+        if (fixed_size && length > fixed_size)
+            length = fixed_size;
+
+        usecs += 1 + (unsigned)(r >> 50) % 20;
+        traffic->hdrs[i].ts.tv_sec = (long)(secs + usecs / 1000000);
+        traffic->hdrs[i].ts.tv_usec = (long)(usecs % 1000000);
+        traffic->hdrs[i].caplen = length;
+        traffic->hdrs[i].len = length;
+        traffic->packets[i] = px;
+        traffic->total_bytes += length;
+        offset += length;
+    }
+
+    return traffic;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+bench_traffic_destroy(struct BenchTraffic *traffic)
+{
+    if (traffic == NULL)
+        return;
+    free(traffic->hdrs);
+    free(traffic->packets);
+    free(traffic->buf);
+    free(traffic);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static const char *
+bench_filename(const struct PacketDump *conf)
+{
+    if (conf->filename && conf->filename[0])
+        return conf->filename;
+    else
+        return "packetdump-benchmark.tmp";
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static uint64_t
+bench_file_size(const char *filename)
+{
+    struct stat s;
+    if (stat(filename, &s) != 0)
+        return 0;
+    return (uint64_t)s.st_size;
+}
+
+/***************************************************************************
+ * Write all the traffic to a file with the given options.
+ * @return the microseconds that took, or 0 if it failed
+ ***************************************************************************/
+static uint64_t
+bench_write_file(const char *filename,
+                 const struct BenchTraffic *traffic,
+                 int compression_type,
+                 const struct PcapFileOptions *options)
+{
+    struct PcapFile *fp;
+    uint64_t start, elapsed;
+    size_t i;
+
+    start = pixie_gettime();
+    fp = pcapfile_openwrite_ex(filename, 1, compression_type, options);
+    if (fp == NULL)
+        return 0;
+    for (i=0; i<traffic->count; i++) {
+        const struct pcap_pkthdr *hdr = &traffic->hdrs[i];
+        ssize_t x;
+
+        x = pcapfile_writeframe(fp, traffic->packets[i],
+                                hdr->caplen, hdr->len,
+                                hdr->ts.tv_sec, hdr->ts.tv_usec);
+        if (x < 0) {
+            fprintf(stderr, "%s: write failed\n", filename);
+            break;
+        }
+    }
+    pcapfile_close(fp);
+    elapsed = pixie_gettime() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+    return elapsed;
+}
+
+/***************************************************************************
+ * Write all the traffic to a file with the given options, and print
+ * how fast that was and how well it compressed.
+ ***************************************************************************/
+static void
+bench_write(const struct PacketDump *conf,
+            const struct BenchTraffic *traffic,
+            const char *description,
+            int compression_type,
+            const struct PcapFileOptions *options)
+{
+    const char *filename = bench_filename(conf);
+    uint64_t elapsed;
+    uint64_t file_size;
+    uint64_t total_bytes;
+
+    elapsed = bench_write_file(filename, traffic, compression_type, options);
+    if (elapsed == 0)
+        return;
+
+    file_size = bench_file_size(filename);
+    total_bytes = 24 + traffic->total_bytes + 16 * traffic->count;
+    printf("%-24s %10.0f pkts/sec %8.1f MB/sec  ratio %5.2f\n",
+           description,
+           traffic->count * 1000000.0 / elapsed,
+           total_bytes * 1.0 / elapsed,
+           file_size ? total_bytes * 1.0 / file_size : 0.0);
+    remove(filename);
+}
+
+/***************************************************************************
+ * Compare compressing each packet individually (the original behavior)
+ * with compressing packets in blocks.
+ ***************************************************************************/
+static void
+bench_compress(const struct PacketDump *conf)
+{
+    static const size_t block_sizes[] = {
+        64*1024, 256*1024, 1024*1024, 4*1024*1024, 0};
+    struct BenchTraffic *traffic;
+    struct PcapFileOptions options;
+    size_t i;
+
+    traffic = bench_traffic_create(1000000, 0);
+    printf("-- compress: %u packets, %llu bytes --\n",
+           (unsigned)traffic->count,
+           (unsigned long long)traffic->total_bytes);
+
+    memset(&options, 0, sizeof(options));
+    bench_write(conf, traffic, "uncompressed", PCAPFILE_NO_COMPRESSION, &options);
+    bench_write(conf, traffic, "lz4 per-packet", PCAPFILE_LZ4, &options);
+
+    for (i=0; block_sizes[i]; i++) {
+        char description[64];
+
+        options.block_size = block_sizes[i];
+        snprintf(description, sizeof(description), "lz4 block=%uk",
+                 (unsigned)(block_sizes[i] / 1024));
+        bench_write(conf, traffic, description, PCAPFILE_LZ4, &options);
+    }
+
+    bench_traffic_destroy(traffic);
+}
+
+/***************************************************************************
+ * Compress 1-megabyte blocks on a growing number of worker threads, for
+ * both the fast LZ4 level and LZ4HC. The LZ4HC throughput should scale
+ * with the number of cores, until the writing thread becomes the limit.
+ ***************************************************************************/
+static void
+bench_parallel(const struct PacketDump *conf)
+{
+    static const int levels[] = {0, COMPRESS_LEVEL_HC_DEFAULT};
+    unsigned max_threads = pixie_cpu_get_count();
+    struct BenchTraffic *traffic;
+    struct PcapFileOptions options;
+    size_t i;
+
+    if (conf->compress_threads)
+        max_threads = (unsigned)conf->compress_threads;
+
+    traffic = bench_traffic_create(1000000, 0);
+    printf("-- parallel: %u packets, %llu bytes, %u cpus --\n",
+           (unsigned)traffic->count,
+           (unsigned long long)traffic->total_bytes,
+           pixie_cpu_get_count());
+
+    for (i=0; i<sizeof(levels)/sizeof(levels[0]); i++) {
+        unsigned thread_count;
+
+        memset(&options, 0, sizeof(options));
+        options.block_size = 1024*1024;
+        options.compression_level = levels[i];
+        for (thread_count=0; thread_count<=max_threads; thread_count = thread_count?thread_count*2:1) {
+            char description[64];
+
+            if (thread_count)
+                options.pool = compresspool_create(thread_count);
+            snprintf(description, sizeof(description), "level=%d threads=%u",
+                     levels[i], thread_count);
+            bench_write(conf, traffic, description, PCAPFILE_LZ4, &options);
+            compresspool_destroy(options.pool);
+            options.pool = NULL;
+        }
+    }
+
+    bench_traffic_destroy(traffic);
+}
+
+/***************************************************************************
+ * Compare the ways of getting bytes to the disk, both for uncompressed
+ * output, where the writing dominates, and compressed output. Note that
+ * the buffered engines may look faster than they really are, because
+ * the data is still in the page cache when we stop the clock.
+ ***************************************************************************/
+static void
+bench_output(const struct PacketDump *conf)
+{
+    static const struct {
+        const char *name;
+        int engine;
+    } engines[] = {
+        {"stdio", OUTPUT_STDIO},
+        {"uring", OUTPUT_URING},
+        {"direct", OUTPUT_DIRECT},
+        {0, 0}
+    };
+    struct BenchTraffic *traffic;
+    struct PcapFileOptions options;
+    size_t i;
+
+    traffic = bench_traffic_create(1000000, 0);
+    printf("-- output: %u packets, %llu bytes --\n",
+           (unsigned)traffic->count,
+           (unsigned long long)traffic->total_bytes);
+
+    for (i=0; engines[i].name; i++) {
+        char description[64];
+
+        memset(&options, 0, sizeof(options));
+        options.output.engine = engines[i].engine;
+        options.output.buffer_size = (size_t)conf->output_buffer_size;
+        options.output.buffer_count = (unsigned)conf->output_buffers;
+
+        snprintf(description, sizeof(description), "%s uncompressed",
+                 engines[i].name);
+        bench_write(conf, traffic, description, PCAPFILE_NO_COMPRESSION, &options);
+
+        options.block_size = 256*1024;
+        snprintf(description, sizeof(description), "%s lz4 block=256k",
+                 engines[i].name);
+        bench_write(conf, traffic, description, PCAPFILE_LZ4, &options);
+    }
+
+    bench_traffic_destroy(traffic);
+}
+
+/***************************************************************************
+ * Write uncompressed records the way we used to, with a separate write
+ * for each header and each packet, to compare with gathering them.
+ ***************************************************************************/
+static void
+bench_write_unbatched(const struct PacketDump *conf,
+                      const struct BenchTraffic *traffic,
+                      const char *description)
+{
+    static const unsigned char file_header[24] =
+            "\xd4\xc3\xb2\xa1\x02\x00\x04\x00"
+            "\x00\x00\x00\x00\x00\x00\x00\x00"
+            "\xff\xff\x00\x00\x01\x00\x00\x00";
+    const char *filename = bench_filename(conf);
+    struct OutputOptions options;
+    struct OutputFile *out;
+    uint64_t start, elapsed;
+    uint64_t total_bytes;
+    size_t i;
+
+    memset(&options, 0, sizeof(options));
+    start = pixie_gettime();
+    out = outfile_open(filename, &options);
+    if (out == NULL)
+        return;
+    outfile_write(out, file_header, sizeof(file_header));
+    for (i=0; i<traffic->count; i++) {
+        const struct pcap_pkthdr *hdr = &traffic->hdrs[i];
+        unsigned char header[16];
+        unsigned values[4];
+        unsigned j;
+
+        values[0] = (unsigned)hdr->ts.tv_sec;
+        values[1] = (unsigned)hdr->ts.tv_usec;
+        values[2] = hdr->caplen;
+        values[3] = hdr->len;
+        for (j=0; j<16; j++)
+            header[j] = (unsigned char)(values[j/4] >> (8 * (j%4)));
+
+        if (outfile_write(out, header, 16) != 16
+            || outfile_write(out, traffic->packets[i], hdr->caplen) != (ssize_t)hdr->caplen) {
+            fprintf(stderr, "%s: write failed\n", filename);
+            break;
+        }
+    }
+    outfile_close(out);
+    elapsed = pixie_gettime() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    total_bytes = 24 + traffic->total_bytes + 16 * traffic->count;
+    printf("%-24s %10.0f pkts/sec %8.1f MB/sec\n",
+           description,
+           traffic->count * 1000000.0 / elapsed,
+           total_bytes * 1.0 / elapsed);
+    remove(filename);
+}
+
+/***************************************************************************
+ * Uncompressed writing, with a write per header and packet, versus
+ * gathering records and writing them with writev(), either copying
+ * everything or pointing to the larger packets where they are. Small
+ * packets are where the per-write overhead shows.
+ ***************************************************************************/
+static void
+bench_gather(const struct PacketDump *conf)
+{
+    static const unsigned sizes[] = {64, 0};
+    size_t i;
+
+    for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+        struct BenchTraffic *traffic;
+        struct PcapFileOptions options;
+
+        traffic = bench_traffic_create(sizes[i] ? 4000000 : 1000000, sizes[i]);
+        printf("-- gather: %u packets, %s, %llu bytes --\n",
+               (unsigned)traffic->count,
+               sizes[i] ? "64 bytes each" : "mixed sizes",
+               (unsigned long long)traffic->total_bytes);
+
+        bench_write_unbatched(conf, traffic, "write per record");
+
+        memset(&options, 0, sizeof(options));
+        bench_write(conf, traffic, "writev copied", PCAPFILE_NO_COMPRESSION, &options);
+        options.is_zerocopy = 1;
+        bench_write(conf, traffic, "writev zero-copy", PCAPFILE_NO_COMPRESSION, &options);
+
+        bench_traffic_destroy(traffic);
+    }
+}
+
+#if defined(__linux__)
+/***************************************************************************
+ * Force the file to disk, then drop it from the page cache, so that
+ * reading it back measures the disk and not memory.
+ ***************************************************************************/
+static void
+bench_drop_cache(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/***************************************************************************
+ * The number of extents the filesystem used for the file, which is how
+ * fragmented it is.
+ ***************************************************************************/
+static unsigned
+bench_extent_count(const char *filename)
+{
+    struct fiemap fm;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    memset(&fm, 0, sizeof(fm));
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+    fm.fm_flags = FIEMAP_FLAG_SYNC;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm) != 0)
+        fm.fm_mapped_extents = 0;
+    close(fd);
+    return fm.fm_mapped_extents;
+}
+
+/***************************************************************************
+ * Read the file sequentially
+ * @return the number of bytes read
+ ***************************************************************************/
+static uint64_t
+bench_read_file(const char *filename)
+{
+    static unsigned char buf[1024*1024];
+    uint64_t total = 0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    for (;;) {
+        ssize_t x = read(fd, buf, sizeof(buf));
+        if (x <= 0)
+            break;
+        total += (uint64_t)x;
+    }
+    close(fd);
+    return total;
+}
+
+/***************************************************************************
+ * Write several files at once, the way a sensor with many capture
+ * threads does, so that their appends are interleaved on the disk.
+ * Then read them back, one at a time, the way they are analyzed later.
+ ***************************************************************************/
+static void
+bench_prealloc_run(const struct PacketDump *conf,
+                   const struct BenchTraffic *traffic,
+                   const char *description,
+                   int is_preallocate)
+{
+    enum {FILE_COUNT = 4};
+    struct PcapFile *files[FILE_COUNT];
+    char filenames[FILE_COUNT][256];
+    struct PcapFileOptions options;
+    uint64_t total_bytes = 0;
+    uint64_t start, write_elapsed, read_elapsed;
+    unsigned extents = 0;
+    size_t i;
+
+    memset(&options, 0, sizeof(options));
+    if (is_preallocate) {
+        /* The size we'd configure with -C */
+        options.output.preallocate = 24 + (traffic->total_bytes
+                                    + 16 * traffic->count) / FILE_COUNT + 1024*1024;
+    }
+
+    start = pixie_gettime();
+    for (i=0; i<FILE_COUNT; i++) {
+        snprintf(filenames[i], sizeof(filenames[i]), "%s.%u",
+                 bench_filename(conf), (unsigned)i);
+        files[i] = pcapfile_openwrite_ex(filenames[i], 1,
+                                         PCAPFILE_NO_COMPRESSION, &options);
+        if (files[i] == NULL)
+            exit(1);
+    }
+    for (i=0; i<traffic->count; i++) {
+        const struct pcap_pkthdr *hdr = &traffic->hdrs[i];
+        pcapfile_writeframe(files[i % FILE_COUNT], traffic->packets[i],
+                            hdr->caplen, hdr->len,
+                            hdr->ts.tv_sec, hdr->ts.tv_usec);
+    }
+    for (i=0; i<FILE_COUNT; i++) {
+        pcapfile_close(files[i]);
+        bench_drop_cache(filenames[i]);
+    }
+    write_elapsed = pixie_gettime() - start;
+
+    start = pixie_gettime();
+    for (i=0; i<FILE_COUNT; i++)
+        total_bytes += bench_read_file(filenames[i]);
+    read_elapsed = pixie_gettime() - start;
+
+    for (i=0; i<FILE_COUNT; i++) {
+        extents += bench_extent_count(filenames[i]);
+        remove(filenames[i]);
+    }
+
+    printf("%-24s write %8.1f MB/sec   read %8.1f MB/sec   %5u extents\n",
+           description,
+           total_bytes * 1.0 / (write_elapsed ? write_elapsed : 1),
+           total_bytes * 1.0 / (read_elapsed ? read_elapsed : 1),
+           extents);
+}
+#endif
+
+/***************************************************************************
+ * Compare files that grow by appending with files whose space was
+ * reserved up front with fallocate().
+ ***************************************************************************/
+static void
+bench_prealloc(const struct PacketDump *conf)
+{
+#if defined(__linux__)
+    struct BenchTraffic *traffic;
+
+    traffic = bench_traffic_create(1000000, 0);
+    printf("-- prealloc: %u packets into 4 files at once --\n",
+           (unsigned)traffic->count);
+    bench_prealloc_run(conf, traffic, "appended", 0);
+    bench_prealloc_run(conf, traffic, "preallocated", 1);
+    bench_traffic_destroy(traffic);
+#else
+    UNUSEDPARM(conf);
+    printf("-- prealloc: only on Linux --\n");
+#endif
+}
+
+/***************************************************************************
+ * Write the traffic into several files, rotating between them, and
+ * record the worst time it took to write any one packet, which is
+ * what decides whether packets get dropped, as well as the worst time
+ * for just the packets that caused a rotation.
+ ***************************************************************************/
+static void
+bench_rotate_run(const struct PacketDump *conf,
+                 const struct BenchTraffic *traffic,
+                 const char *description,
+                 struct FileService *service)
+{
+    enum {FILE_COUNT = 8};
+    const struct PcapFileOptions *options;
+    struct PcapFileOptions file_options;
+    struct FileOpenRequest next[1];
+    char filenames[2][256];
+    size_t packets_per_file = traffic->count / FILE_COUNT;
+    struct PcapFile *fp = NULL;
+    uint64_t worst = 0;
+    uint64_t worst_rotation = 0;
+    uint64_t start = pixie_gettime();
+    uint64_t elapsed;
+    size_t i;
+
+    memset(&file_options, 0, sizeof(file_options));
+    file_options.block_size = 256*1024;
+    options = &file_options;
+    memset(next, 0, sizeof(next));
+    for (i=0; i<2; i++)
+        snprintf(filenames[i], sizeof(filenames[i]), "%s.%u",
+                 bench_filename(conf), (unsigned)i);
+
+    for (i=0; i<traffic->count; i++) {
+        const struct pcap_pkthdr *hdr = &traffic->hdrs[i];
+        size_t file_index = i / packets_per_file;
+        uint64_t before = pixie_gettime();
+        uint64_t latency;
+
+        /* Rotate, the same way 'handle_packet()' does */
+        if (i % packets_per_file == 0) {
+            if (fp && service)
+                fileservice_close(service, fp, NULL);
+            else if (fp)
+                pcapfile_close(fp);
+            fp = fileservice_wait(next);
+            if (fp == NULL)
+                fp = pcapfile_openwrite_ex(filenames[file_index % 2], 1,
+                                           PCAPFILE_LZ4, options);
+            if (fp == NULL)
+                break;
+        }
+
+        if (pcapfile_writeframe(fp, traffic->packets[i],
+                                hdr->caplen, hdr->len,
+                                hdr->ts.tv_sec, hdr->ts.tv_usec) < 0) {
+            fprintf(stderr, "%s: write failed\n", filenames[file_index % 2]);
+            break;
+        }
+
+        /* Open the next file ahead of time, when this one is almost full */
+        if (service && !next->is_pending
+            && i % packets_per_file == packets_per_file - packets_per_file/8) {
+            next->filename = filenames[(file_index + 1) % 2];
+            next->linktype = 1;
+            next->compression_type = PCAPFILE_LZ4;
+            next->options = *options;
+            fileservice_open(service, next);
+        }
+
+        latency = pixie_gettime() - before;
+        if (i == 0)
+            continue; /* opening the first file isn't a rotation */
+        if (worst < latency)
+            worst = latency;
+        if (i % packets_per_file == 0 && worst_rotation < latency)
+            worst_rotation = latency;
+    }
+    if (fp)
+        pcapfile_close(fp);
+    fp = fileservice_wait(next);
+    if (fp)
+        pcapfile_close(fp);
+    elapsed = pixie_gettime() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("%-24s %10.0f pkts/sec  worst packet %6u usecs, at rotation %6u usecs\n",
+           description,
+           traffic->count * 1000000.0 / elapsed,
+           (unsigned)worst,
+           (unsigned)worst_rotation);
+}
+
+/***************************************************************************
+ * Compare rotating files inline with closing them in the background and
+ * opening the next one ahead of time.
+ ***************************************************************************/
+static void
+bench_rotate(const struct PacketDump *conf)
+{
+    struct BenchTraffic *traffic;
+    struct FileService *service;
+    unsigned i;
+
+    traffic = bench_traffic_create(1000000, 0);
+    printf("-- rotate: %u packets into 8 files --\n",
+           (unsigned)traffic->count);
+
+    bench_rotate_run(conf, traffic, "inline rotation", NULL);
+
+    service = fileservice_create();
+    bench_rotate_run(conf, traffic, "background rotation", service);
+    fileservice_destroy(service);
+
+    for (i=0; i<2; i++) {
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s.%u", bench_filename(conf), i);
+        remove(filename);
+    }
+    bench_traffic_destroy(traffic);
+}
+
+/***************************************************************************
+ * Load the packets from a capture file, so that a benchmark can be run
+ * against real traffic instead of our synthetic mix.
+ ***************************************************************************/
+static struct BenchTraffic *
+bench_traffic_load(const char *filename)
+{
+    struct BenchTraffic *traffic;
+    struct CaptureReader *reader;
+    struct pcap_pkthdr hdr;
+    const unsigned char *buf;
+    size_t max_count = 1024;
+    size_t buf_size = 1024 * 1024;
+    size_t offset = 0;
+    size_t i;
+
+    reader = capreader_open(filename);
+    if (reader == NULL)
+        return NULL;
+
+    traffic = calloc(1, sizeof(*traffic));
+    if (traffic == NULL)
+        exit(1);
+    traffic->hdrs = malloc(max_count * sizeof(traffic->hdrs[0]));
+    traffic->buf = malloc(buf_size);
+    if (traffic->hdrs == NULL || traffic->buf == NULL)
+        exit(1);
+
+    while (capreader_next(reader, &hdr, &buf) > 0) {
+        if (traffic->count >= max_count) {
+            max_count *= 2;
+            traffic->hdrs = realloc(traffic->hdrs,
+                                    max_count * sizeof(traffic->hdrs[0]));
+            if (traffic->hdrs == NULL)
+                exit(1);
+        }
+        while (offset + hdr.caplen > buf_size) {
+            buf_size *= 2;
+            traffic->buf = realloc(traffic->buf, buf_size);
+            if (traffic->buf == NULL)
+                exit(1);
+        }
+        memcpy(traffic->buf + offset, buf, hdr.caplen);
+        traffic->hdrs[traffic->count++] = hdr;
+        traffic->total_bytes += hdr.caplen;
+        offset += hdr.caplen;
+    }
+    capreader_close(reader);
+
+    /* Now that the buffer has stopped moving */
+    traffic->packets = calloc(traffic->count + 1, sizeof(traffic->packets[0]));
+    if (traffic->packets == NULL)
+        exit(1);
+    for (offset=0, i=0; i<traffic->count; i++) {
+        traffic->packets[i] = traffic->buf + offset;
+        offset += traffic->hdrs[i].caplen;
+    }
+    return traffic;
+}
+
+/***************************************************************************
+ * Write the traffic, then read it back, printing the speed both ways.
+ * Reading checks that every packet came back exactly as it went in.
+ ***************************************************************************/
+static void
+bench_pdz_run(const struct PacketDump *conf,
+              const struct BenchTraffic *traffic,
+              const char *description,
+              int compression_type,
+              const struct PcapFileOptions *options)
+{
+    const char *filename = bench_filename(conf);
+    struct CaptureReader *reader;
+    struct pcap_pkthdr hdr;
+    const unsigned char *buf;
+    uint64_t write_elapsed, read_elapsed;
+    uint64_t file_size;
+    uint64_t total_bytes;
+    uint64_t start;
+    size_t count = 0;
+
+    write_elapsed = bench_write_file(filename, traffic,
+                                     compression_type, options);
+    if (write_elapsed == 0)
+        return;
+    file_size = bench_file_size(filename);
+
+    start = pixie_gettime();
+    reader = capreader_open(filename);
+    if (reader == NULL) {
+        remove(filename);
+        return;
+    }
+    while (count < traffic->count && capreader_next(reader, &hdr, &buf) > 0) {
+        const struct pcap_pkthdr *expected = &traffic->hdrs[count];
+
+        if (hdr.ts.tv_sec != expected->ts.tv_sec
+            || hdr.ts.tv_usec != expected->ts.tv_usec
+            || hdr.caplen != expected->caplen || hdr.len != expected->len
+            || memcmp(buf, traffic->packets[count], hdr.caplen) != 0) {
+            fprintf(stderr, "%s: packet %u differs\n", description,
+                    (unsigned)count);
+            break;
+        }
+        count++;
+    }
+    capreader_close(reader);
+    read_elapsed = pixie_gettime() - start;
+    if (read_elapsed == 0)
+        read_elapsed = 1;
+    if (count != traffic->count)
+        fprintf(stderr, "%s: read %u packets, expected %u\n", description,
+                (unsigned)count, (unsigned)traffic->count);
+
+    total_bytes = 24 + traffic->total_bytes + 16 * traffic->count;
+    printf("%-24s write %8.1f MB/sec  read %8.1f MB/sec  ratio %5.2f\n",
+           description,
+           total_bytes * 1.0 / write_elapsed,
+           total_bytes * 1.0 / read_elapsed,
+           file_size ? total_bytes * 1.0 / file_size : 0.0);
+    remove(filename);
+}
+
+/***************************************************************************
+ * Compare LZ4 blocks of plain pcap with the .pdz format, which moves
+ * the record headers into their own delta-encoded stream, and the .pdc
+ * format, which also splits the TCP/IP headers into columns. Run with
+ * "-r <file>" to measure real traffic instead of synthetic.
+ ***************************************************************************/
+static void
+bench_pdz(const struct PacketDump *conf)
+{
+    static const int levels[] = {0, COMPRESS_LEVEL_HC_DEFAULT};
+    struct BenchTraffic *traffic;
+    struct PcapFileOptions options;
+    size_t i;
+
+    if (conf->readfiles && conf->readfiles[0])
+        traffic = bench_traffic_load(conf->readfiles[0]);
+    else
+        traffic = bench_traffic_create(1000000, 0);
+    if (traffic == NULL)
+        return;
+    printf("-- pdz: %u packets, %llu bytes --\n",
+           (unsigned)traffic->count,
+           (unsigned long long)traffic->total_bytes);
+
+    memset(&options, 0, sizeof(options));
+    options.block_size = 256 * 1024;
+    for (i=0; i<sizeof(levels)/sizeof(levels[0]); i++) {
+        char description[64];
+
+        options.compression_level = levels[i];
+        snprintf(description, sizeof(description), "lz4 level=%d",
+                 levels[i]);
+        bench_pdz_run(conf, traffic, description, PCAPFILE_LZ4, &options);
+        snprintf(description, sizeof(description), "pdz level=%d",
+                 levels[i]);
+        bench_pdz_run(conf, traffic, description, PCAPFILE_PDZ, &options);
+        snprintf(description, sizeof(description), "pdc level=%d",
+                 levels[i]);
+        bench_pdz_run(conf, traffic, description, PCAPFILE_PDC, &options);
+    }
+
+    bench_traffic_destroy(traffic);
+}
+
+/***************************************************************************
+ * Compare small blocks compressed with and without a preset dictionary,
+ * either the built-in one, or one trained from the first 5% of the
+ * packets. Run with "-r <file>" to measure real traffic instead of
+ * synthetic.
+ ***************************************************************************/
+static void
+bench_dict(const struct PacketDump *conf)
+{
+    static const size_t block_sizes[] = {4*1024, 16*1024, 64*1024, 0};
+    struct BenchTraffic *traffic;
+    struct PcapFileOptions options;
+    const struct CompressDict *dicts[3];
+    static const char *names[3] = {"none", "builtin", "trained"};
+    size_t i, j;
+
+    if (conf->readfiles && conf->readfiles[0])
+        traffic = bench_traffic_load(conf->readfiles[0]);
+    else
+        traffic = bench_traffic_create(1000000, 0);
+    if (traffic == NULL)
+        return;
+    printf("-- dict: %u packets, %llu bytes --\n",
+           (unsigned)traffic->count,
+           (unsigned long long)traffic->total_bytes);
+
+    dicts[0] = NULL;
+    dicts[1] = compressdict_builtin();
+    dicts[2] = compressdict_train(traffic->packets, traffic->hdrs,
+                                  traffic->count / 20 + 1);
+
+    memset(&options, 0, sizeof(options));
+    for (i=0; block_sizes[i]; i++) {
+        for (j=0; j<3; j++) {
+            char description[64];
+
+            options.block_size = block_sizes[i];
+            options.dict = dicts[j];
+            snprintf(description, sizeof(description), "block=%uk dict=%s",
+                     (unsigned)(block_sizes[i] / 1024), names[j]);
+            bench_write(conf, traffic, description, PCAPFILE_LZ4, &options);
+        }
+    }
+
+    compressdict_cleanup();
+    bench_traffic_destroy(traffic);
+}
+
+/***************************************************************************
+ * Compare zstd with LZ4 and LZ4HC on the same traffic, both the speed
+ * writing and reading, and the ratio. Zstd is also run on its own
+ * worker threads, one per CPU. Run with "-r <file>" to measure real
+ * traffic instead of synthetic.
+ ***************************************************************************/
+static void
+bench_zstd(const struct PacketDump *conf)
+{
+    static const struct {
+        const char *name;
+        int compression_type;
+        int level;
+        unsigned is_threaded;
+    } runs[] = {
+        {"lz4",         PCAPFILE_LZ4,   0,                          0},
+        {"lz4hc",       PCAPFILE_LZ4,   COMPRESS_LEVEL_HC_DEFAULT,  0},
+        {"zstd",        PCAPFILE_ZSTD,  1,                          0},
+        {"zstd",        PCAPFILE_ZSTD,  3,                          0},
+        {"zstd",        PCAPFILE_ZSTD,  9,                          0},
+        {"zstd",        PCAPFILE_ZSTD,  3,                          1},
+        {"zstd",        PCAPFILE_ZSTD,  9,                          1},
+        {0}
+    };
+    struct BenchTraffic *traffic;
+    struct PcapFileOptions options;
+    size_t i;
+
+    if (conf->readfiles && conf->readfiles[0])
+        traffic = bench_traffic_load(conf->readfiles[0]);
+    else
+        traffic = bench_traffic_create(1000000, 0);
+    if (traffic == NULL)
+        return;
+    printf("-- zstd: %u packets, %llu bytes, %u cpus --\n",
+           (unsigned)traffic->count,
+           (unsigned long long)traffic->total_bytes,
+           pixie_cpu_get_count());
+
+    for (i=0; runs[i].name; i++) {
+        char description[64];
+
+        memset(&options, 0, sizeof(options));
+        options.block_size = 256 * 1024;
+        options.compression_level = runs[i].level;
+        if (runs[i].is_threaded)
+            options.threads = pixie_cpu_get_count();
+        snprintf(description, sizeof(description), "%s level=%d threads=%u",
+                 runs[i].name, runs[i].level, options.threads);
+        bench_pdz_run(conf, traffic, description,
+                      runs[i].compression_type, &options);
+    }
+
+    bench_traffic_destroy(traffic);
+}
+
+/***************************************************************************
+ * Write the traffic, deciding how much of each packet to keep first, as
+ * the capture does, and print how fast that was and how much it wrote.
+ ***************************************************************************/
+static void
+bench_snap_run(const struct PacketDump *conf,
+               const struct BenchTraffic *traffic,
+               const char *description,
+               const struct SnapPolicy *policy,
+               const struct PcapFileOptions *options)
+{
+    const char *filename = bench_filename(conf);
+    struct PcapFile *fp;
+    uint64_t start, elapsed;
+    uint64_t kept_bytes = 0;
+    uint64_t total_bytes;
+    uint64_t file_size;
+    size_t i;
+
+    start = pixie_gettime();
+    fp = pcapfile_openwrite_ex(filename, 1, PCAPFILE_LZ4, options);
+    if (fp == NULL)
+        return;
+    for (i=0; i<traffic->count; i++) {
+        const struct pcap_pkthdr *hdr = &traffic->hdrs[i];
+        unsigned caplen = hdr->caplen;
+
+        if (policy)
+            caplen = snappolicy_caplen(policy, 1, traffic->packets[i], caplen);
+        kept_bytes += caplen;
+        if (pcapfile_writeframe(fp, traffic->packets[i], caplen, hdr->len,
+                                hdr->ts.tv_sec, hdr->ts.tv_usec) < 0) {
+            fprintf(stderr, "%s: write failed\n", filename);
+            break;
+        }
+    }
+    pcapfile_close(fp);
+    elapsed = pixie_gettime() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    file_size = bench_file_size(filename);
+    total_bytes = 24 + traffic->total_bytes + 16 * traffic->count;
+    printf("%-20s %8.1f MB/sec  kept %5.1f%%  compressed %8.1f MB/sec"
+           "  written %6.1f MB\n",
+           description,
+           total_bytes * 1.0 / elapsed,
+           kept_bytes * 100.0 / traffic->total_bytes,
+           kept_bytes * 1.0 / elapsed,
+           file_size / 1000000.0);
+    remove(filename);
+}
+
+/***************************************************************************
+ * Compare keeping whole packets with keeping only the headers and the
+ * start of the payload, except for DNS, TLS handshakes, and HTTP headers.
+ * The speed is of the captured traffic going in, and includes deciding
+ * how much to keep. Run with "-r <file>" to measure real traffic
+ * instead of synthetic.
+ ***************************************************************************/
+static void
+bench_snap(const struct PacketDump *conf)
+{
+    static const unsigned payloads[] = {0, 256, 64, 16};
+    struct BenchTraffic *traffic;
+    struct PcapFileOptions options;
+    size_t i;
+
+    if (conf->readfiles && conf->readfiles[0])
+        traffic = bench_traffic_load(conf->readfiles[0]);
+    else
+        traffic = bench_traffic_create(1000000, 0);
+    if (traffic == NULL)
+        return;
+    printf("-- snap: %u packets, %llu bytes --\n",
+           (unsigned)traffic->count,
+           (unsigned long long)traffic->total_bytes);
+
+    memset(&options, 0, sizeof(options));
+    options.block_size = 256 * 1024;
+    for (i=0; i<sizeof(payloads)/sizeof(payloads[0]); i++) {
+        struct SnapPolicy *policy = NULL;
+        char description[64];
+
+        if (payloads[i]) {
+            policy = snappolicy_create(conf->snap_keep, payloads[i]);
+            if (policy == NULL)
+                break;
+            snprintf(description, sizeof(description), "payload=%u",
+                     payloads[i]);
+        } else
+            snprintf(description, sizeof(description), "whole packets");
+        bench_snap_run(conf, traffic, description, policy, &options);
+        snappolicy_destroy(policy);
+    }
+
+    bench_traffic_destroy(traffic);
+}
+
+/***************************************************************************
+ * Count the packets against the flow table, as the capture does, and
+ * print how fast the lookups were and how much was dropped.
+ ***************************************************************************/
+static void
+bench_flows_run(const unsigned char *packets, unsigned packet_size,
+                const unsigned short *lengths, size_t count,
+                unsigned passes, uint64_t cutoff, uint64_t memory)
+{
+    struct FlowTable *table;
+    uint64_t start, elapsed;
+    size_t dropped = 0;
+    unsigned pass;
+    size_t i;
+
+    table = flowtable_create(cutoff, memory, 0);
+    start = pixie_gettime();
+    for (pass=0; pass<passes; pass++) {
+        for (i=0; i<count; i++) {
+            if (!flowtable_admit(table, 1, packets + i * packet_size,
+                                 packet_size, lengths[i],
+                                 1498046400 + pass))
+                dropped++;
+        }
+    }
+    elapsed = pixie_gettime() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("memory=%-4lluMB flows=%-8llu %6.2f Mpps %6.1f ns/pkt"
+           "  dropped %5.1f%%  evicted %llu\n",
+           (unsigned long long)(memory >> 20),
+           (unsigned long long)flowtable_capacity(table),
+           count * passes * 1.0 / elapsed,
+           elapsed * 1000.0 / (count * passes),
+           dropped * 100.0 / (count * passes),
+           (unsigned long long)flowtable_evictions(table));
+    flowtable_destroy(table);
+}
+
+/***************************************************************************
+ * The flow-table lookup that --flow-cutoff does for every packet. Flow
+ * sizes on real links are heavy-tailed: a few elephants carry most of
+ * the packets, while most flows are a handful of packets. So the
+ * packets are drawn from a million flows with a Zipf distribution,
+ * where the n'th most popular flow gets 1/n as many packets as the
+ * first. They're laid out one after another, as in the capture ring,
+ * and replayed a second later each pass. Tables smaller than the
+ * number of flows show what happens when they have to forget flows.
+ ***************************************************************************/
+static void
+bench_flows(const struct PacketDump *conf)
+{
+    static const uint64_t memories[] = {1 << 20, 16 << 20, 64 << 20};
+    enum {
+        FLOW_COUNT = 1000000,
+        PACKET_COUNT = 2000000,
+        PACKET_SIZE = 64,
+        PASSES = 5,
+    };
+    unsigned char *packets;
+    unsigned short *lengths;
+    double *cdf;
+    double sum = 0;
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    uint64_t cutoff = conf->flow_cutoff ? conf->flow_cutoff : 20000;
+    size_t i;
+
+    packets = calloc(PACKET_COUNT, PACKET_SIZE);
+    lengths = malloc(PACKET_COUNT * sizeof(lengths[0]));
+    cdf = malloc(FLOW_COUNT * sizeof(cdf[0]));
+    if (packets == NULL || lengths == NULL || cdf == NULL)
+        exit(1);
+
+    for (i=0; i<FLOW_COUNT; i++) {
+        sum += 1.0 / (double)(i + 1);
+        cdf[i] = sum;
+    }
+    for (i=0; i<PACKET_COUNT; i++) {
+        unsigned char *px = packets + i * PACKET_SIZE;
+        uint64_t r = bench_rand(&seed);
+        double x = (double)(r >> 11) / (double)(1ULL << 53) * sum;
+        size_t lo = 0, hi = FLOW_COUNT - 1;
+        unsigned flow;
+        unsigned client;
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cdf[mid] < x)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        /* Scatter the popular flows, and give every flow its own
+         * client address and port */
+        flow = (unsigned)((lo * 2654435761U) % FLOW_COUNT);
+        client = 0x0a000000 + (flow >> 4);
+        bench_headers(px, flow, (flow % 10) ? 6 : 17, 0, (unsigned)i);
+        px[26] = (unsigned char)(client >> 24); px[27] = (unsigned char)(client >> 16);
+        px[28] = (unsigned char)(client >> 8);  px[29] = (unsigned char)(client >> 0);
+        px[34] = (unsigned char)(0x80 | (flow & 0x0F));
+        lengths[i] = (r & 1) ? 60 : (unsigned short)(60 + (r >> 1) % 1455);
+    }
+    free(cdf);
+
+    printf("-- flows: %u packets x %u, %u flows (Zipf), cutoff %llu bytes --\n",
+           PACKET_COUNT, PASSES, FLOW_COUNT, (unsigned long long)cutoff);
+    for (i=0; i<sizeof(memories)/sizeof(memories[0]); i++)
+        bench_flows_run(packets, PACKET_SIZE, lengths, PACKET_COUNT,
+                        PASSES, cutoff, memories[i]);
+
+    free(packets);
+    free(lengths);
+}
+
+/***************************************************************************
+ * Write the traffic either a frame at a time, or in batches of the given
+ * size, and print how fast that was.
+ ***************************************************************************/
+static void
+bench_batch_run(const struct PacketDump *conf,
+                const struct BenchTraffic *traffic,
+                const struct PcapFrame *frames,
+                int compression_type,
+                const struct PcapFileOptions *options,
+                unsigned batch)
+{
+    const char *filename = bench_filename(conf);
+    struct PcapFile *fp;
+    uint64_t start, elapsed;
+    uint64_t total_bytes;
+    char description[64];
+    size_t i;
+
+    start = pixie_gettime();
+    fp = pcapfile_openwrite_ex(filename, 1, compression_type, options);
+    if (fp == NULL)
+        return;
+    for (i=0; i<traffic->count; ) {
+        ssize_t x;
+
+        if (batch == 0) {
+            const struct pcap_pkthdr *hdr = &traffic->hdrs[i];
+            x = pcapfile_writeframe(fp, traffic->packets[i],
+                                    hdr->caplen, hdr->len,
+                                    hdr->ts.tv_sec, hdr->ts.tv_usec);
+            i++;
+        } else {
+            unsigned n = batch;
+            if (n > traffic->count - i)
+                n = (unsigned)(traffic->count - i);
+            x = pcapfile_writeframes(fp, frames + i, n);
+            i += n;
+        }
+        if (x < 0) {
+            fprintf(stderr, "%s: write failed\n", filename);
+            break;
+        }
+    }
+    pcapfile_close(fp);
+    elapsed = pixie_gettime() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    if (batch)
+        snprintf(description, sizeof(description), "%s writeframes(%u)",
+                 compression_type ? "lz4" : "none", batch);
+    else
+        snprintf(description, sizeof(description), "%s writeframe",
+                 compression_type ? "lz4" : "none");
+    total_bytes = 24 + traffic->total_bytes + 16 * traffic->count;
+    printf("%-24s %8.1f MB/sec %7.2f Mpps\n",
+           description,
+           total_bytes * 1.0 / elapsed,
+           traffic->count * 1.0 / elapsed);
+    remove(filename);
+}
+
+/***************************************************************************
+ * The per-packet cost of the write API: one call per frame, with its
+ * record header encoded byte by byte, versus one call per batch, with
+ * all the headers encoded in one pass and the records added to the
+ * block together. Small packets show the overhead, full-sized packets
+ * show it doesn't get in the way of the copying.
+ ***************************************************************************/
+static void
+bench_batch(const struct PacketDump *conf)
+{
+    static const unsigned sizes[] = {64, 1500};
+    static const unsigned batches[] = {0, 16, 64, 256};
+    static const int types[] = {PCAPFILE_NO_COMPRESSION, PCAPFILE_LZ4};
+    size_t s;
+
+    for (s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+        size_t count = (sizes[s] < 128) ? 4000000 : 400000;
+        struct BenchTraffic *traffic;
+        struct PcapFrame *frames;
+        size_t i, j, t;
+
+        traffic = bench_traffic_create(count, sizes[s]);
+        frames = calloc(count, sizeof(frames[0]));
+        if (frames == NULL)
+            exit(1);
+        for (i=0; i<count; i++) {
+            frames[i].time_sec = (uint32_t)traffic->hdrs[i].ts.tv_sec;
+            frames[i].time_usec = (uint32_t)traffic->hdrs[i].ts.tv_usec;
+            frames[i].buffer_size = traffic->hdrs[i].caplen;
+            frames[i].original_length = traffic->hdrs[i].len;
+            frames[i].buffer = traffic->packets[i];
+        }
+        printf("-- batch: %u packets of %u bytes --\n",
+               (unsigned)count, sizes[s]);
+
+        for (t=0; t<sizeof(types)/sizeof(types[0]); t++) {
+            for (j=0; j<sizeof(batches)/sizeof(batches[0]); j++) {
+                struct PcapFileOptions options;
+
+                memset(&options, 0, sizeof(options));
+                options.block_size = 256 * 1024;
+                bench_batch_run(conf, traffic, frames, types[t], &options,
+                                batches[j]);
+            }
+        }
+
+        free(frames);
+        bench_traffic_destroy(traffic);
+    }
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static const struct Benchmark {
+    const char *name;
+    void (*func)(const struct PacketDump *conf);
+    const char *description;
+} benchmarks[] = {
+    {"compress", bench_compress, "LZ4 per-packet versus block compression"},
+    {"parallel", bench_parallel, "LZ4/LZ4HC block compression on worker threads"},
+    {"rotate", bench_rotate, "worst packet latency when rotating files"},
+    {"output", bench_output, "stdio versus io_uring versus O_DIRECT writing"},
+    {"gather", bench_gather, "uncompressed writes per record versus writev()"},
+    {"prealloc", bench_prealloc, "fragmentation of appended versus fallocate()d files"},
+    {"pdz", bench_pdz, "LZ4 pcap versus .pdz headers versus .pdc columns"},
+    {"dict", bench_dict, "small LZ4 blocks with and without a dictionary"},
+    {"zstd", bench_zstd, "zstd levels and threads versus LZ4 and LZ4HC"},
+    {"snap", bench_snap, "whole packets versus protocol-aware truncation"},
+    {"flows", bench_flows, "flow-table lookups for --flow-cutoff, Zipf flow sizes"},
+    {"batch", bench_batch, "pcapfile_writeframe() versus pcapfile_writeframes()"},
+    {0}
+};
+
+/***************************************************************************
+ ***************************************************************************/
+int
+benchmark(const struct PacketDump *conf)
+{
+    const char *name = conf->benchmark;
+    int is_found = 0;
+    size_t i;
+
+    for (i=0; benchmarks[i].name; i++) {
+        if (strcmp(name, "all") == 0 || strcmp(name, benchmarks[i].name) == 0) {
+            benchmarks[i].func(conf);
+            is_found = 1;
+        }
+    }
+
+    if (!is_found) {
+        fprintf(stderr, "%s: unknown benchmark, expected one of:\n", name);
+        fprintf(stderr, "  %-12s %s\n", "all", "all of the following");
+        for (i=0; benchmarks[i].name; i++)
+            fprintf(stderr, "  %-12s %s\n", benchmarks[i].name, benchmarks[i].description);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef benchmark_h
+#define benchmark_h
+#include "packetdump.h"
+#include "rawsock-pcap.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Synthetic traffic for benchmarks, generated in memory so that we
+ * are measuring the writing and not the capture. The mix is meant
+ * to roughly match what a sensor sees: lots of small ACKs, some DNS,
+ * some plain-text HTTP, and a lot of (incompressible) encrypted data.
+ */
+struct BenchTraffic
+{
+    struct pcap_pkthdr *hdrs;
+    const unsigned char **packets;
+    size_t count;
+
+    /** Total packet bytes (caplen), not including pcap record headers */
+    uint64_t total_bytes;
+
+    unsigned char *buf;
+};
+
+/**
+ * Generate packets.
+ * @param count
+ *      The number of packets.
+ * @param fixed_size
+ *      If non-zero, all packets are this size, otherwise there's a
+ *      mix of sizes.
+ */
+struct BenchTraffic *
+bench_traffic_create(size_t count, unsigned fixed_size);
+
+void
+bench_traffic_destroy(struct BenchTraffic *traffic);
+
+/**
+ * Run the named benchmark, or "all" of them, printing the results.
+ * The '-w' filename is used for temporary output, if specified.
+ * @return 0 on success, 1 if the benchmark isn't known
+ */
+int
+benchmark(const struct PacketDump *conf);
+
+#endif /* benchmark_h */
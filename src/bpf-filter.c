@@ -0,0 +1,452 @@
+/*
+    Classic BPF programs
+
+ This follows the semantics of libpcap's 'bpf_filter()': loads are
+ big-endian, loads outside the packet or division by zero make the
+ program return 0, and there are 16 words of scratch memory.
+*/
+#include "bpf-filter.h"
+#include "rawsock-pcap.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    BPF_MAX_INSNS = 4096,
+    BPF_MEMWORDS = 16,
+    BPF_MAX_TEXT = 64 * 1024,
+};
+
+/* Instruction classes */
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD      0x00
+#define BPF_LDX     0x01
+#define BPF_ST      0x02
+#define BPF_STX     0x03
+#define BPF_ALU     0x04
+#define BPF_JMP     0x05
+#define BPF_RET     0x06
+#define BPF_MISC    0x07
+
+/* Load sizes and modes */
+#define BPF_SIZE(code) ((code) & 0x18)
+#define BPF_W       0x00
+#define BPF_H       0x08
+#define BPF_B       0x10
+#define BPF_MODE(code) ((code) & 0xe0)
+#define BPF_IMM     0x00
+#define BPF_ABS     0x20
+#define BPF_IND     0x40
+#define BPF_MEM     0x60
+#define BPF_LEN     0x80
+#define BPF_MSH     0xa0
+
+/* ALU and jump operations */
+#define BPF_OP(code) ((code) & 0xf0)
+#define BPF_ADD     0x00
+#define BPF_SUB     0x10
+#define BPF_MUL     0x20
+#define BPF_DIV     0x30
+#define BPF_OR      0x40
+#define BPF_AND     0x50
+#define BPF_LSH     0x60
+#define BPF_RSH     0x70
+#define BPF_NEG     0x80
+#define BPF_MOD     0x90
+#define BPF_XOR     0xa0
+#define BPF_JA      0x00
+#define BPF_JEQ     0x10
+#define BPF_JGT     0x20
+#define BPF_JGE     0x30
+#define BPF_JSET    0x40
+#define BPF_SRC(code) ((code) & 0x08)
+#define BPF_K       0x00
+#define BPF_X       0x08
+
+/* Return values and register transfers */
+#define BPF_RVAL(code) ((code) & 0x18)
+#define BPF_A       0x10
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define BPF_TAX     0x00
+#define BPF_TXA     0x80
+
+/***************************************************************************
+ * Make sure the program can't run off the end, or touch memory it
+ * shouldn't.
+ ***************************************************************************/
+static int
+bpf_validate(const struct BpfProgram *program)
+{
+    unsigned i;
+
+    if (program->count == 0 || program->count > BPF_MAX_INSNS)
+        return 0;
+
+    for (i=0; i<program->count; i++) {
+        const struct BpfInsn *insn = &program->insns[i];
+        unsigned remaining = program->count - i - 1;
+
+        switch (BPF_CLASS(insn->code)) {
+        case BPF_LD:
+        case BPF_LDX:
+            if (BPF_MODE(insn->code) == BPF_MEM && insn->k >= BPF_MEMWORDS)
+                return 0;
+            break;
+        case BPF_ST:
+        case BPF_STX:
+            if (insn->k >= BPF_MEMWORDS)
+                return 0;
+            break;
+        case BPF_ALU:
+            if ((BPF_OP(insn->code) == BPF_DIV || BPF_OP(insn->code) == BPF_MOD)
+                && BPF_SRC(insn->code) == BPF_K && insn->k == 0)
+                return 0;
+            break;
+        case BPF_JMP:
+            if (BPF_OP(insn->code) == BPF_JA) {
+                if (insn->k >= remaining)
+                    return 0;
+            } else if (insn->jt >= remaining || insn->jf >= remaining)
+                return 0;
+            break;
+        }
+    }
+
+    return BPF_CLASS(program->insns[program->count - 1].code) == BPF_RET;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct BpfProgram *
+bpf_load_file(const char *filename)
+{
+    struct BpfProgram *program;
+    unsigned count;
+    unsigned i;
+    FILE *fp;
+
+    fp = fopen(filename, "rt");
+    if (fp == NULL) {
+        perror(filename);
+        return NULL;
+    }
+
+    if (fscanf(fp, "%u", &count) != 1 || count == 0 || count > BPF_MAX_INSNS) {
+        fprintf(stderr, "%s: expected the number of instructions, as from 'tcpdump -ddd'\n",
+                filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    program = calloc(1, sizeof(*program));
+    if (program == NULL)
+        exit(1);
+    program->count = count;
+    program->insns = calloc(count, sizeof(program->insns[0]));
+    if (program->insns == NULL)
+        exit(1);
+
+    for (i=0; i<count; i++) {
+        unsigned code, jt, jf, k;
+
+        if (fscanf(fp, "%u %u %u %u", &code, &jt, &jf, &k) != 4
+            || code > 0xFFFF || jt > 0xFF || jf > 0xFF) {
+            fprintf(stderr, "%s: bad instruction #%u\n", filename, i);
+            fclose(fp);
+            bpf_free(program);
+            return NULL;
+        }
+        program->insns[i].code = (uint16_t)code;
+        program->insns[i].jt = (uint8_t)jt;
+        program->insns[i].jf = (uint8_t)jf;
+        program->insns[i].k = k;
+    }
+    fclose(fp);
+
+    if (!bpf_validate(program)) {
+        fprintf(stderr, "%s: not a valid BPF program\n", filename);
+        bpf_free(program);
+        return NULL;
+    }
+    return program;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct BpfProgram *
+bpf_compile(const char *expression, int linktype, unsigned snaplen)
+{
+    struct BpfProgram *program;
+    struct bpf_program code;
+    pcap_t *p;
+    unsigned i;
+
+    if (!PCAP.is_available) {
+        fprintf(stderr, "FAIL: compiling '%s' needs libpcap\n", expression);
+        fprintf(stderr, "  hint: use 'tcpdump -ddd <filter>' where it's installed,"
+                " and --bpf-file with the result\n");
+        return NULL;
+    }
+
+    /* We don't need a real adapter to compile for one */
+    p = PCAP.open_dead(linktype, (int)snaplen);
+    if (p == NULL) {
+        fprintf(stderr, "pcap: can't compile for link type %d\n", linktype);
+        return NULL;
+    }
+    if (PCAP.compile(p, &code, expression, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+        fprintf(stderr, "FAIL: bad filter '%s': %s\n", expression,
+                PCAP.geterr(p));
+        PCAP.close(p);
+        return NULL;
+    }
+    PCAP.close(p);
+
+    program = calloc(1, sizeof(*program));
+    if (program == NULL)
+        exit(1);
+    program->count = code.bf_len;
+    program->insns = calloc(code.bf_len + 1, sizeof(program->insns[0]));
+    if (program->insns == NULL)
+        exit(1);
+    for (i=0; i<code.bf_len; i++) {
+        program->insns[i].code = code.bf_insns[i].code;
+        program->insns[i].jt = code.bf_insns[i].jt;
+        program->insns[i].jf = code.bf_insns[i].jf;
+        program->insns[i].k = code.bf_insns[i].k;
+    }
+    PCAP.freecode(&code);
+
+    if (!bpf_validate(program)) {
+        fprintf(stderr, "FAIL: bad filter '%s'\n", expression);
+        bpf_free(program);
+        return NULL;
+    }
+    return program;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct BpfProgram *
+bpf_load_filter(const char *filename, int linktype, unsigned snaplen)
+{
+    struct BpfProgram *program;
+    char *text;
+    size_t length;
+    size_t i, j;
+    FILE *fp;
+
+    fp = fopen(filename, "rt");
+    if (fp == NULL) {
+        perror(filename);
+        return NULL;
+    }
+    text = malloc(BPF_MAX_TEXT + 1);
+    if (text == NULL)
+        exit(1);
+    length = fread(text, 1, BPF_MAX_TEXT + 1, fp);
+    fclose(fp);
+    if (length > BPF_MAX_TEXT) {
+        fprintf(stderr, "%s: filter too long\n", filename);
+        free(text);
+        return NULL;
+    }
+
+    /* A program from 'tcpdump -ddd' starts with a line that's just the
+     * instruction count, which no expression is */
+    for (i=0; i<length && isspace(text[i] & 0xFF); i++)
+        ;
+    for (j=i; j<length && isdigit(text[j] & 0xFF); j++)
+        ;
+    if (j > i && (j == length || text[j] == '\n' || text[j] == '\r')) {
+        free(text);
+        return bpf_load_file(filename);
+    }
+
+    /* Remove the comments, and join the lines */
+    for (i=0, j=0; i<length; i++) {
+        if (text[i] == '#') {
+            while (i < length && text[i] != '\n')
+                i++;
+        }
+        text[j++] = (i < length && text[i] != '\n' && text[i] != '\r') ? text[i] : ' ';
+    }
+    while (j && isspace(text[j-1] & 0xFF))
+        j--;
+    text[j] = '\0';
+
+    program = bpf_compile(text, linktype, snaplen);
+    free(text);
+    return program;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+bpf_free(struct BpfProgram *program)
+{
+    if (program == NULL)
+        return;
+    free(program->insns);
+    free(program);
+}
+
+/***************************************************************************
+ * Load 1, 2, or 4 bytes, big-endian, or return 0 if that goes past the
+ * end of the captured data.
+ ***************************************************************************/
+static int
+bpf_load(const unsigned char *px, unsigned buflen, uint32_t offset,
+         unsigned size, uint32_t *result)
+{
+    if (offset > buflen || size > buflen - offset)
+        return 0;
+    px += offset;
+    switch (size) {
+    case 1:
+        *result = px[0];
+        break;
+    case 2:
+        *result = (uint32_t)px[0]<<8 | px[1];
+        break;
+    default:
+        *result = (uint32_t)px[0]<<24 | (uint32_t)px[1]<<16
+                | (uint32_t)px[2]<<8 | px[3];
+        break;
+    }
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+bpf_filter(const struct BpfProgram *program,
+           const unsigned char *px,
+           unsigned wirelen,
+           unsigned buflen)
+{
+    const struct BpfInsn *pc = program->insns;
+    uint32_t mem[BPF_MEMWORDS];
+    uint32_t A = 0;
+    uint32_t X = 0;
+    uint32_t value;
+
+    memset(mem, 0, sizeof(mem));
+
+    for (;; pc++) {
+        uint32_t src;
+        unsigned size;
+
+        switch (BPF_CLASS(pc->code)) {
+        case BPF_RET:
+            if (BPF_RVAL(pc->code) == BPF_A)
+                return A;
+            if (BPF_RVAL(pc->code) == BPF_X)
+                return X;
+            return pc->k;
+
+        case BPF_LD:
+        case BPF_LDX:
+            size = (BPF_SIZE(pc->code) == BPF_B) ? 1
+                 : (BPF_SIZE(pc->code) == BPF_H) ? 2 : 4;
+            switch (BPF_MODE(pc->code)) {
+            case BPF_IMM:
+                value = pc->k;
+                break;
+            case BPF_ABS:
+                if (!bpf_load(px, buflen, pc->k, size, &value))
+                    return 0;
+                break;
+            case BPF_IND:
+                if (!bpf_load(px, buflen, X + pc->k, size, &value))
+                    return 0;
+                break;
+            case BPF_MEM:
+                value = mem[pc->k];
+                break;
+            case BPF_LEN:
+                value = wirelen;
+                break;
+            case BPF_MSH:
+                /* The IPv4 header length, 'ldxb 4*([k]&0xf)' */
+                if (!bpf_load(px, buflen, pc->k, 1, &value))
+                    return 0;
+                value = (value & 0xf) << 2;
+                break;
+            default:
+                return 0;
+            }
+            if (BPF_CLASS(pc->code) == BPF_LD)
+                A = value;
+            else
+                X = value;
+            break;
+
+        case BPF_ST:
+            mem[pc->k] = A;
+            break;
+
+        case BPF_STX:
+            mem[pc->k] = X;
+            break;
+
+        case BPF_ALU:
+            src = (BPF_SRC(pc->code) == BPF_X) ? X : pc->k;
+            switch (BPF_OP(pc->code)) {
+            case BPF_ADD: A += src; break;
+            case BPF_SUB: A -= src; break;
+            case BPF_MUL: A *= src; break;
+            case BPF_DIV:
+                if (src == 0)
+                    return 0;
+                A /= src;
+                break;
+            case BPF_MOD:
+                if (src == 0)
+                    return 0;
+                A %= src;
+                break;
+            case BPF_OR:  A |= src; break;
+            case BPF_AND: A &= src; break;
+            case BPF_XOR: A ^= src; break;
+            case BPF_LSH: A = (src < 32) ? A << src : 0; break;
+            case BPF_RSH: A = (src < 32) ? A >> src : 0; break;
+            case BPF_NEG: A = (uint32_t)-(int32_t)A; break;
+            default:
+                return 0;
+            }
+            break;
+
+        case BPF_JMP:
+            src = (BPF_SRC(pc->code) == BPF_X) ? X : pc->k;
+            switch (BPF_OP(pc->code)) {
+            case BPF_JA:
+                pc += pc->k;
+                break;
+            case BPF_JEQ:
+                pc += (A == src) ? pc->jt : pc->jf;
+                break;
+            case BPF_JGT:
+                pc += (A > src) ? pc->jt : pc->jf;
+                break;
+            case BPF_JGE:
+                pc += (A >= src) ? pc->jt : pc->jf;
+                break;
+            case BPF_JSET:
+                pc += (A & src) ? pc->jt : pc->jf;
+                break;
+            default:
+                return 0;
+            }
+            break;
+
+        case BPF_MISC:
+            if (BPF_MISCOP(pc->code) == BPF_TAX)
+                X = A;
+            else
+                A = X;
+            break;
+        }
+    }
+}
@@ -0,0 +1,87 @@
+/*
+    Classic BPF programs
+
+ This runs the same filter programs that the kernel and libpcap run,
+ so that we can match packets ourselves, such as to trigger something
+ when a particular packet is seen, rather than just to filter what's
+ captured.
+
+ Programs are read in the format printed by 'tcpdump -ddd', which is
+ the number of instructions followed by one instruction per line, as
+ four decimal numbers: code, jt, jf, k. That way, any filter expression
+ can be used without compiling it ourselves:
+
+    tcpdump -ddd 'tcp[tcpflags] & tcp-rst != 0' > rst.bpf
+
+ Filter expressions can also be compiled with libpcap, when it's
+ installed, and the result handed to the kernel to filter captures.
+*/
+#ifndef BPF_FILTER_H
+#define BPF_FILTER_H
+#include <stdint.h>
+
+/**
+ * A single instruction, with the same layout as the kernel's
+ * 'struct sock_filter' and libpcap's 'struct bpf_insn'.
+ */
+struct BpfInsn
+{
+    uint16_t code;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+};
+
+struct BpfProgram
+{
+    unsigned count;
+    struct BpfInsn *insns;
+};
+
+/**
+ * Read a program in 'tcpdump -ddd' format from a file, and check that
+ * it's valid: every jump lands inside the program, and it ends with a
+ * return.
+ * @return the program, or NULL on error, after printing a message
+ */
+struct BpfProgram *bpf_load_file(const char *filename);
+
+/**
+ * Compile a filter expression, like "not port 873", with libpcap.
+ * @param linktype
+ *      The data link of the packets it'll see, like DLT_EN10MB.
+ * @return the program, or NULL on error, after printing a message
+ */
+struct BpfProgram *bpf_compile(const char *expression,
+                               int linktype, unsigned snaplen);
+
+/**
+ * Read a filter from a file, either the expression text (like tcpdump's
+ * -F option, with '#' comments), or a program in 'tcpdump -ddd' format,
+ * which doesn't need libpcap.
+ * @return the program, or NULL on error, after printing a message
+ */
+struct BpfProgram *bpf_load_filter(const char *filename,
+                                   int linktype, unsigned snaplen);
+
+/**
+ * Free a program from 'bpf_load_file()' and friends.
+ */
+void bpf_free(struct BpfProgram *program);
+
+/**
+ * Run the program on a packet.
+ * @param wirelen
+ *      The original length of the packet.
+ * @param buflen
+ *      How much of it was captured. Loads past this make the program
+ *      return 0.
+ * @return what the program returns, which is 0 if the packet doesn't
+ * match, or else how many bytes of it to keep.
+ */
+unsigned bpf_filter(const struct BpfProgram *program,
+                    const unsigned char *px,
+                    unsigned wirelen,
+                    unsigned buflen);
+
+#endif
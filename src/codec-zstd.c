@@ -0,0 +1,362 @@
+/*
+    Zstandard codec
+
+ We only need the streaming API, which has been stable since v1.4, so
+ we declare the few types and functions here instead of needing the
+ library's headers, and load them from the shared library the first
+ time a .zst file is opened.
+
+ The whole file is a single zstd frame, which the standard 'zstd' tool
+ decompresses. Flushing (once a second by default) ends a zstd block,
+ so that everything written so far can be decompressed while the
+ capture is still running.
+*/
+#include "codec-zstd.h"
+#include "output-file.h"
+#include "logger.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+
+typedef struct {
+    const void *src;
+    size_t size;
+    size_t pos;
+} ZSTD_inBuffer;
+
+typedef struct {
+    void *dst;
+    size_t size;
+    size_t pos;
+} ZSTD_outBuffer;
+
+/* From zstd.h, these values are part of the stable API */
+enum {
+    ZSTD_c_compressionLevel = 100,
+    ZSTD_c_checksumFlag = 201,
+    ZSTD_c_nbWorkers = 400,
+};
+
+typedef ZSTD_CCtx *(*ZSTD_CREATECCTX)(void);
+typedef size_t (*ZSTD_FREECCTX)(ZSTD_CCtx *cctx);
+typedef size_t (*ZSTD_CCTX_SETPARAMETER)(ZSTD_CCtx *cctx, int param, int value);
+typedef size_t (*ZSTD_COMPRESSSTREAM2)(ZSTD_CCtx *cctx, ZSTD_outBuffer *output,
+                                       ZSTD_inBuffer *input, int end_op);
+typedef size_t (*ZSTD_CSTREAMOUTSIZE)(void);
+typedef ZSTD_DCtx *(*ZSTD_CREATEDCTX)(void);
+typedef size_t (*ZSTD_FREEDCTX)(ZSTD_DCtx *dctx);
+typedef size_t (*ZSTD_DECOMPRESSSTREAM)(ZSTD_DCtx *dctx, ZSTD_outBuffer *output,
+                                        ZSTD_inBuffer *input);
+typedef unsigned (*ZSTD_ISERROR)(size_t code);
+typedef const char *(*ZSTD_GETERRORNAME)(size_t code);
+typedef unsigned (*ZSTD_VERSIONNUMBER)(void);
+
+static struct {
+    ZSTD_CREATECCTX createCCtx;
+    ZSTD_FREECCTX freeCCtx;
+    ZSTD_CCTX_SETPARAMETER CCtx_setParameter;
+    ZSTD_COMPRESSSTREAM2 compressStream2;
+    ZSTD_CSTREAMOUTSIZE CStreamOutSize;
+    ZSTD_CREATEDCTX createDCtx;
+    ZSTD_FREEDCTX freeDCtx;
+    ZSTD_DECOMPRESSSTREAM decompressStream;
+    ZSTD_ISERROR isError;
+    ZSTD_GETERRORNAME getErrorName;
+    ZSTD_VERSIONNUMBER versionNumber;
+
+    /** 1 if loaded, -1 if loading failed */
+    int status;
+} ZSTD;
+
+struct ZstdEncoder
+{
+    ZSTD_CCtx *cctx;
+    unsigned char *out;
+    size_t out_size;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+zstd_load(void)
+{
+#ifdef WIN32
+    static const char *possible_names[] = {
+        "libzstd.dll",
+        "zstd.dll",
+        0
+    };
+    HMODULE hLibzstd = 0;
+#else
+    static const char *possible_names[] = {
+        "libzstd.so.1",
+        "libzstd.so",
+        "libzstd.1.dylib",
+        "libzstd.dylib",
+        0
+    };
+    void *hLibzstd = 0;
+#endif
+    unsigned i;
+
+    ZSTD.status = -1;
+
+    for (i=0; possible_names[i]; i++) {
+#ifdef WIN32
+        hLibzstd = LoadLibraryA(possible_names[i]);
+#else
+        hLibzstd = dlopen(possible_names[i], RTLD_LAZY);
+#endif
+        if (hLibzstd) {
+            LOG(1, "zstd: found library: %s\n", possible_names[i]);
+            break;
+        } else {
+            LOG(2, "zstd: failed to load: %s\n", possible_names[i]);
+        }
+    }
+    if (hLibzstd == NULL) {
+        fprintf(stderr, "zstd: failed to load libzstd shared library\n");
+        fprintf(stderr, "    HINT: you must install libzstd, or use .lz4\n");
+        return;
+    }
+
+#ifdef WIN32
+#define DYNLINK(name, TYPE) \
+    ZSTD.name = (TYPE)GetProcAddress(hLibzstd, "ZSTD_"#name); \
+    if (ZSTD.name == NULL) { \
+        fprintf(stderr, "zstd: ZSTD_%s: not found\n", #name); \
+        fprintf(stderr, "    HINT: libzstd v1.4 or later is needed\n"); \
+        return; \
+    }
+#else
+#define DYNLINK(name, TYPE) \
+    ZSTD.name = (TYPE)dlsym(hLibzstd, "ZSTD_"#name); \
+    if (ZSTD.name == NULL) { \
+        fprintf(stderr, "zstd: ZSTD_%s: not found\n", #name); \
+        fprintf(stderr, "    HINT: libzstd v1.4 or later is needed\n"); \
+        return; \
+    }
+#endif
+    DYNLINK(createCCtx, ZSTD_CREATECCTX);
+    DYNLINK(freeCCtx, ZSTD_FREECCTX);
+    DYNLINK(CCtx_setParameter, ZSTD_CCTX_SETPARAMETER);
+    DYNLINK(compressStream2, ZSTD_COMPRESSSTREAM2);
+    DYNLINK(CStreamOutSize, ZSTD_CSTREAMOUTSIZE);
+    DYNLINK(createDCtx, ZSTD_CREATEDCTX);
+    DYNLINK(freeDCtx, ZSTD_FREEDCTX);
+    DYNLINK(decompressStream, ZSTD_DECOMPRESSSTREAM);
+    DYNLINK(isError, ZSTD_ISERROR);
+    DYNLINK(getErrorName, ZSTD_GETERRORNAME);
+    DYNLINK(versionNumber, ZSTD_VERSIONNUMBER);
+#undef DYNLINK
+
+    LOG(1, "zstd: version %u\n", ZSTD.versionNumber());
+    ZSTD.status = 1;
+}
+
+/***************************************************************************
+ * Load the library the first time. When capturing, this is called before
+ * the capture threads start, so that they only check whether it worked.
+ ***************************************************************************/
+static int
+zstd_init(void)
+{
+    if (ZSTD.status == 0)
+        zstd_load();
+    return (ZSTD.status > 0) ? 0 : -1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+zstd_encoder_destroy(void *encoder)
+{
+    struct ZstdEncoder *z = (struct ZstdEncoder *)encoder;
+
+    if (z == NULL)
+        return;
+    if (z->cctx)
+        ZSTD.freeCCtx(z->cctx);
+    free(z->out);
+    free(z);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void *
+zstd_encoder_create(int level, unsigned threads)
+{
+    struct ZstdEncoder *z;
+    size_t err;
+
+    z = calloc(1, sizeof(*z));
+    if (z == NULL) {
+        fprintf(stderr, "[-] out of memory\n");
+        exit(1);
+    }
+    z->out_size = ZSTD.CStreamOutSize();
+    z->out = malloc(z->out_size);
+    if (z->out == NULL) {
+        fprintf(stderr, "[-] out of memory\n");
+        exit(1);
+    }
+    z->cctx = ZSTD.createCCtx();
+    if (z->cctx == NULL) {
+        fprintf(stderr, "zstd: couldn't create compressor\n");
+        zstd_encoder_destroy(z);
+        return NULL;
+    }
+
+    err = ZSTD.CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, level);
+    if (ZSTD.isError(err)) {
+        fprintf(stderr, "zstd: level %d: %s\n", level, ZSTD.getErrorName(err));
+        zstd_encoder_destroy(z);
+        return NULL;
+    }
+    ZSTD.CCtx_setParameter(z->cctx, ZSTD_c_checksumFlag, 1);
+
+    /* Some builds of the library don't have threads, in which case we
+     * still work, just slower */
+    if (threads) {
+        err = ZSTD.CCtx_setParameter(z->cctx, ZSTD_c_nbWorkers, (int)threads);
+        if (ZSTD.isError(err))
+            LOG(0, "zstd: %u threads: %s\n", threads, ZSTD.getErrorName(err));
+    }
+
+    return z;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static ssize_t
+zstd_encode(void *encoder, struct OutputFile *out,
+            const void *buf, size_t length, int mode)
+{
+    struct ZstdEncoder *z = (struct ZstdEncoder *)encoder;
+    ZSTD_inBuffer input;
+    ssize_t total = 0;
+
+    input.src = buf;
+    input.size = length;
+    input.pos = 0;
+
+    for (;;) {
+        ZSTD_outBuffer output;
+        size_t remaining;
+
+        output.dst = z->out;
+        output.size = z->out_size;
+        output.pos = 0;
+
+        remaining = ZSTD.compressStream2(z->cctx, &output, &input, mode);
+        if (ZSTD.isError(remaining)) {
+            fprintf(stderr, "zstd: %s\n", ZSTD.getErrorName(remaining));
+            return -1;
+        }
+        if (output.pos) {
+            if (outfile_write(out, z->out, output.pos) != (ssize_t)output.pos)
+                return -1;
+            total += output.pos;
+        }
+
+        /* When continuing, the library may keep some of the input
+         * buffered; otherwise it's done when nothing remains */
+        if (mode == CODEC_CONTINUE) {
+            if (input.pos == input.size)
+                break;
+        } else if (remaining == 0)
+            break;
+    }
+
+    return total;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void *
+zstd_decoder_create(void)
+{
+    ZSTD_DCtx *dctx;
+
+    dctx = ZSTD.createDCtx();
+    if (dctx == NULL)
+        fprintf(stderr, "zstd: couldn't create decompressor\n");
+    return dctx;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static int
+zstd_decode(void *decoder, void *dst, size_t *dst_size,
+            const void *src, size_t *src_size)
+{
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    size_t err;
+
+    input.src = src;
+    input.size = *src_size;
+    input.pos = 0;
+    output.dst = dst;
+    output.size = *dst_size;
+    output.pos = 0;
+
+    err = ZSTD.decompressStream((ZSTD_DCtx *)decoder, &output, &input);
+    if (ZSTD.isError(err)) {
+        fprintf(stderr, "zstd: %s\n", ZSTD.getErrorName(err));
+        return -1;
+    }
+
+    *src_size = input.pos;
+    *dst_size = output.pos;
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+zstd_decoder_destroy(void *decoder)
+{
+    if (decoder)
+        ZSTD.freeDCtx((ZSTD_DCtx *)decoder);
+}
+
+const struct StreamCodec zstd_codec = {
+    "zstd",
+    {0x28, 0xb5, 0x2f, 0xfd},
+    zstd_init,
+    zstd_encoder_create,
+    zstd_encode,
+    zstd_encoder_destroy,
+    zstd_decoder_create,
+    zstd_decode,
+    zstd_decoder_destroy,
+};
+
+/***************************************************************************
+ ***************************************************************************/
+const struct StreamCodec *
+streamcodec_find(const unsigned char *magic)
+{
+    static const struct StreamCodec * const codecs[] = {
+        &zstd_codec,
+        0
+    };
+    unsigned i;
+
+    for (i=0; codecs[i]; i++) {
+        if (memcmp(codecs[i]->magic, magic, 4) == 0)
+            return codecs[i];
+    }
+    return NULL;
+}
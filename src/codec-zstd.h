@@ -0,0 +1,14 @@
+/*
+    Zstandard codec
+
+ For archives, where the better ratio is worth the CPU. The library
+ is loaded at runtime, like libpcap, so that building doesn't need its
+ development package.
+*/
+#ifndef CODEC_ZSTD_H
+#define CODEC_ZSTD_H
+#include "stream-codec.h"
+
+extern const struct StreamCodec zstd_codec;
+
+#endif
@@ -0,0 +1,172 @@
+/*
+    Adaptive compression level
+
+ Moving down is immediate, since a burst can fill the queue in a
+ fraction of a second, but only one step every so often, so that
+ one slow block doesn't throw away all the compression. Moving up
+ waits for a full second of low pressure, so that we don't bounce
+ between two levels.
+*/
+#include "compress-control.h"
+#include "compress-pool.h"
+#include "logger.h"
+#include "pixie-timer.h"
+#include <stdlib.h>
+
+enum {
+    /* Pressure, in thousandths */
+    CONTROL_LOW = 250,
+    CONTROL_HIGH = 700,
+    CONTROL_OVERFLOW = 900,
+
+    /* Microseconds between steps down, and of low pressure before a
+     * step up */
+    CONTROL_DOWN_USECS = 50000,
+    CONTROL_UP_USECS = 1000000,
+};
+
+/**
+ * From fastest to best. The negative levels are LZ4 acceleration.
+ */
+static const int ladder[] = {
+    COMPRESS_LEVEL_STORE,
+    -64,
+    -16,
+    -4,
+    COMPRESS_LEVEL_FAST,
+    COMPRESS_LEVEL_HC_MIN,
+    6,
+    COMPRESS_LEVEL_HC_DEFAULT,
+    COMPRESS_LEVEL_HC_MAX,
+};
+
+struct CompressControl
+{
+    /** The top of the ladder for us */
+    unsigned top;
+    unsigned index;
+
+    /** Written by other threads */
+    volatile unsigned queue;
+
+    /** When we last moved down, and when pressure was last not low */
+    uint64_t last_down;
+    uint64_t last_pressure;
+
+    /** Read by the statistics thread */
+    volatile int level;
+    volatile uint64_t changes;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+struct CompressControl *
+compresscontrol_create(int max_level)
+{
+    struct CompressControl *ctl;
+    unsigned i;
+
+    if (max_level == 0)
+        max_level = COMPRESS_LEVEL_HC_DEFAULT;
+
+    ctl = calloc(1, sizeof(*ctl));
+    if (ctl == NULL)
+        exit(1);
+
+    /* Start at the normal LZ4 level, or the top, if that's lower */
+    for (i=0; i+1<sizeof(ladder)/sizeof(ladder[0]); i++) {
+        if (ladder[i+1] > max_level)
+            break;
+    }
+    ctl->top = i;
+    for (i=0; i<ctl->top && ladder[i] < COMPRESS_LEVEL_FAST; i++)
+        ;
+    ctl->index = i;
+    ctl->level = ladder[ctl->index];
+    ctl->last_pressure = pixie_gettime();
+    return ctl;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+compresscontrol_destroy(struct CompressControl *ctl)
+{
+    free(ctl);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+compresscontrol_queue(struct CompressControl *ctl, unsigned permille)
+{
+    ctl->queue = permille;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+control_move(struct CompressControl *ctl, unsigned index, unsigned pressure)
+{
+    LOG(1, "compression level %d -> %d, pressure=%u\n",
+        ladder[ctl->index], ladder[index], pressure);
+    ctl->index = index;
+    ctl->level = ladder[index];
+    ctl->changes++;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+compresscontrol_next(struct CompressControl *ctl,
+                     unsigned backlog, unsigned busy)
+{
+    unsigned fill = ctl->queue;
+    unsigned pressure;
+    uint64_t now = pixie_gettime();
+
+    if (fill < backlog)
+        fill = backlog;
+    pressure = (fill < busy) ? busy : fill;
+
+    if (pressure >= CONTROL_LOW)
+        ctl->last_pressure = now;
+
+    /* Being busy isn't a reason to panic, but something about to
+     * overflow is */
+    if (fill >= CONTROL_OVERFLOW) {
+        if (ctl->index > 0) {
+            control_move(ctl, 0, pressure);
+            ctl->last_down = now;
+        }
+    } else if (pressure >= CONTROL_HIGH) {
+        if (ctl->index > 0 && now - ctl->last_down >= CONTROL_DOWN_USECS) {
+            control_move(ctl, ctl->index - 1, pressure);
+            ctl->last_down = now;
+        }
+    } else if (pressure < CONTROL_LOW) {
+        if (ctl->index < ctl->top
+            && now - ctl->last_pressure >= CONTROL_UP_USECS) {
+            control_move(ctl, ctl->index + 1, pressure);
+            ctl->last_pressure = now;
+        }
+    }
+
+    return ladder[ctl->index];
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+compresscontrol_level(const struct CompressControl *ctl)
+{
+    return ctl->level;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+uint64_t
+compresscontrol_changes(const struct CompressControl *ctl)
+{
+    return ctl->changes;
+}
@@ -0,0 +1,67 @@
+/*
+    Adaptive compression level
+
+ The best compression level depends on how busy we are. When traffic
+ is light, there's time for LZ4HC, which makes files a third smaller.
+ During a burst, even the default LZ4 level may be too slow, and it's
+ better to write a block with less compression, or none at all, than
+ to drop packets.
+
+ The controller chooses the level for each block as it's submitted,
+ from a ladder that goes from storing the block uncompressed, through
+ LZ4 with decreasing acceleration, up to the LZ4HC levels. It watches
+ three kinds of pressure, each as how full or busy something is, in
+ thousandths:
+
+    queue   - how full the writer's packet queue is
+    backlog - how many blocks are waiting for the compression workers
+    busy    - how much of the time the writing thread spends compressing
+
+ When any of them is high, it moves down the ladder, straight to the
+ bottom if the queue or backlog is about to overflow. Once they've all been low for a
+ while, it moves back up, one step at a time.
+
+ Since LZ4 frame blocks are independent, each block can be compressed
+ at a different level, and the files are still read by the normal
+ 'lz4' tool.
+*/
+#ifndef COMPRESS_CONTROL_H
+#define COMPRESS_CONTROL_H
+#include <stdint.h>
+
+struct CompressControl;
+
+/**
+ * @param max_level
+ *      The slowest, best level to go up to, or 0 for the default LZ4HC
+ *      level.
+ */
+struct CompressControl *compresscontrol_create(int max_level);
+
+void compresscontrol_destroy(struct CompressControl *ctl);
+
+/**
+ * Report how full the writer's queue is, in thousandths. This can be
+ * called from a different thread than the one compressing.
+ */
+void compresscontrol_queue(struct CompressControl *ctl, unsigned permille);
+
+/**
+ * Choose the level for the next block. Only one thread may call this.
+ * @param backlog
+ *      Blocks in flight, in thousandths of how many can be in flight.
+ * @param busy
+ *      Thousandths of the time spent compressing the last block.
+ * @return the level, as used by 'compress_block()'
+ */
+int compresscontrol_next(struct CompressControl *ctl,
+                         unsigned backlog, unsigned busy);
+
+/**
+ * The current level, and how many times it's changed, for the
+ * statistics.
+ */
+int compresscontrol_level(const struct CompressControl *ctl);
+uint64_t compresscontrol_changes(const struct CompressControl *ctl);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+    LZ4 preset dictionaries
+
+ Training simply keeps the start of each packet, which is where the
+ headers are, from the last packets of the capture. That's what LZ4
+ needs: byte strings that will appear again. There's no point in being
+ cleverer, since LZ4 only matches exact strings of 4 bytes or more,
+ and any 2-byte offset into the 64k is as cheap as any other.
+
+ Dictionaries are kept in a small list for the life of the program, so
+ that readers can find them by ID.
+*/
+#include "compress-dict.h"
+#include "readfiles.h"
+#include "lz4/lz4.h"
+#include "lz4/xxhash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    /* How much of each packet to keep when training */
+    DICT_SAMPLE = 96,
+
+    DICT_LIST_MAX = 16,
+};
+
+static struct CompressDict *dict_list[DICT_LIST_MAX];
+static unsigned dict_count;
+static const struct CompressDict *builtin;
+
+/**
+ * Common bytes of the headers of common protocols. Later bytes are
+ * no cheaper to reference than earlier ones, so the order is only for
+ * readability.
+ */
+static const char builtin_data[] =
+    /* Ethernet type, then IPv4 with the common flags, TTLs and protocols */
+    "\x08\x00\x45\x00\x00\x28\x00\x00\x40\x00\x40\x06"
+    "\x08\x00\x45\x00\x00\x34\x00\x00\x40\x00\x40\x06"
+    "\x08\x00\x45\x00\x05\xdc\x00\x00\x40\x00\x40\x06"
+    "\x08\x00\x45\x00\x00\x3c\x00\x00\x40\x00\x80\x06"
+    "\x08\x00\x45\x00\x00\x00\x00\x00\x00\x00\x40\x11"
+    "\x08\x00\x45\x00\x00\x00\x00\x00\x40\x00\x40\x11"
+    "\x08\x00\x45\x00\x00\x00\x00\x00\x40\x00\x80\x11"
+    "\x08\x00\x45\x00\x00\x00\x00\x00\x40\x00\x3f\x06"
+    "\x08\x00\x45\x00\x00\x00\x00\x00\x40\x00\x7f\x06"
+    "\x08\x00\x45\x00\x00\x54\x00\x00\x40\x00\x40\x01"
+    "\x81\x00\x00\x00\x08\x00\x45\x00"
+    "\x86\xdd\x60\x00\x00\x00\x00\x00\x06\x40\x20\x01"
+    "\x86\xdd\x60\x00\x00\x00\x00\x00\x11\x40\xfe\x80\x00\x00\x00\x00\x00\x00"
+    /* ARP */
+    "\x08\x06\x00\x01\x08\x00\x06\x04\x00\x01\x00\x00\x00\x00\x00\x00"
+    "\x08\x06\x00\x01\x08\x00\x06\x04\x00\x02"
+    /* TCP flags and windows, SYN options, and timestamps */
+    "\x50\x10\x01\xf5\x00\x00\x00\x00"
+    "\x50\x18\x01\xf5\x00\x00\x00\x00"
+    "\x50\x10\xff\xff\x00\x00\x00\x00"
+    "\x80\x10\x01\xf5\x00\x00\x01\x01\x08\x0a"
+    "\x80\x18\x01\xf5\x00\x00\x01\x01\x08\x0a"
+    "\xa0\x02\xfa\xf0\x00\x00\x02\x04\x05\xb4\x04\x02\x08\x0a"
+    "\xa0\x12\xfe\x88\x00\x00\x02\x04\x05\xb4\x04\x02\x08\x0a"
+    "\x00\x00\x00\x00\x01\x03\x03\x07"
+    "\x02\x04\x05\xb4\x01\x03\x03\x08\x01\x01\x04\x02"
+    "\x02\x04\x05\xb4\x01\x01\x04\x02"
+    /* Ethernet padding */
+    "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+    /* DNS queries and answers */
+    "\x00\x35\x00\x00\x00\x00\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+    "\x00\x35\x00\x00\x00\x00\x01\x20\x00\x01\x00\x00\x00\x00\x00\x01"
+    "\x81\x80\x00\x01\x00\x01\x00\x00\x00\x00"
+    "\x81\x80\x00\x01\x00\x02\x00\x00\x00\x00"
+    "\x81\x83\x00\x01\x00\x00\x00\x01\x00\x00"
+    "\x03www\x06google\x03" "com\x00\x00\x01\x00\x01"
+    "\x03www\x08" "facebook\x03" "com\x00\x00\x1c\x00\x01"
+    "\xc0\x0c\x00\x01\x00\x01\x00\x00\x01\x2c\x00\x04"
+    "\xc0\x0c\x00\x05\x00\x01\x00\x00\x0e\x10"
+    "\x00\x00\x29\x10\x00\x00\x00\x00\x00\x00\x00"
+    /* TLS records and handshakes */
+    "\x17\x03\x03\x00"
+    "\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03"
+    "\x16\x03\x03\x00\x7a\x02\x00\x00\x76\x03\x03"
+    "\x14\x03\x03\x00\x01\x01"
+    "\x15\x03\x03\x00\x02\x02\x28"
+    "\x00\x00\x00\x0e\x00\x0c\x00\x00\x09localhost"
+    "\x00\x17\x00\x00\xff\x01\x00\x01\x00\x00\x0a\x00\x08\x00\x06\x00\x1d\x00\x17\x00\x18"
+    "\x00\x0b\x00\x02\x01\x00\x00\x23\x00\x00\x00\x10\x00\x0e\x00\x0c\x02h2\x08http/1.1"
+    "\x00\x05\x00\x05\x01\x00\x00\x00\x00\x00\x0d"
+    "\x00\x2b\x00\x03\x02\x03\x04\x00\x33\x00\x26\x00\x24\x00\x1d\x00\x20"
+    "\x13\x01\x13\x02\x13\x03\xc0\x2b\xc0\x2f\xc0\x2c\xc0\x30\xcc\xa9\xcc\xa8"
+    /* HTTP */
+    "GET / HTTP/1.1\r\nHost: www."
+    ".com\r\nUser-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+    "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: \r\nReferer: https://www.\r\n"
+    "POST /api/v1/ HTTP/1.1\r\nContent-Type: application/json\r\n"
+    "If-Modified-Since: \r\nIf-None-Match: \"\r\n\r\n"
+    "HTTP/1.1 200 OK\r\nDate: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+    "Server: nginx\r\nServer: Apache\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: \r\nLast-Modified: \r\nETag: \"\r\n"
+    "Cache-Control: max-age=0, no-cache, private\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Set-Cookie: ; path=/; HttpOnly\r\n"
+    "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"
+    "HTTP/1.1 304 Not Modified\r\n"
+    "HTTP/1.1 301 Moved Permanently\r\nLocation: https://\r\n"
+    "HTTP/1.1 404 Not Found\r\n"
+    "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>"
+    "</title>\n</head>\n<body>\n<div class=\"\"></div>\n</body>\n</html>\n"
+    ;
+
+/***************************************************************************
+ * Make a dictionary from the last 64k of these bytes, and add it to the
+ * list.
+ ***************************************************************************/
+static struct CompressDict *
+dict_create(const unsigned char *data, size_t size)
+{
+    struct CompressDict *dict;
+    unsigned i;
+
+    if (size > COMPRESS_DICT_MAX) {
+        data += size - COMPRESS_DICT_MAX;
+        size = COMPRESS_DICT_MAX;
+    }
+
+    dict = calloc(1, sizeof(*dict));
+    if (dict == NULL)
+        exit(1);
+    dict->data = malloc(size ? size : 1);
+    dict->prepared = malloc(sizeof(LZ4_stream_t));
+    if (dict->data == NULL || dict->prepared == NULL)
+        exit(1);
+    memcpy(dict->data, data, size);
+    dict->size = size;
+    dict->id = XXH32(data, size, 0);
+    LZ4_resetStream((LZ4_stream_t *)dict->prepared);
+    LZ4_loadDict((LZ4_stream_t *)dict->prepared,
+                 (const char *)dict->data, (int)dict->size);
+
+    /* If it's already there, such as the same file given twice, use
+     * that one */
+    for (i=0; i<dict_count; i++) {
+        if (dict_list[i]->id == dict->id && dict_list[i]->size == size
+            && memcmp(dict_list[i]->data, data, size) == 0) {
+            free(dict->data);
+            free(dict->prepared);
+            free(dict);
+            return dict_list[i];
+        }
+    }
+    if (dict_count >= DICT_LIST_MAX) {
+        fprintf(stderr, "dictionary: too many\n");
+        exit(1);
+    }
+    dict_list[dict_count++] = dict;
+    return dict;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+const struct CompressDict *
+compressdict_builtin(void)
+{
+    if (builtin == NULL)
+        builtin = dict_create((const unsigned char *)builtin_data,
+                              sizeof(builtin_data) - 1);
+    return builtin;
+}
+
+/***************************************************************************
+ * Collects the samples when training, keeping only the most recent.
+ ***************************************************************************/
+struct DictTraining
+{
+    unsigned char buf[2 * COMPRESS_DICT_MAX];
+    size_t length;
+};
+
+static void
+train_add(struct DictTraining *t, const unsigned char *px, unsigned caplen)
+{
+    size_t length = (caplen < DICT_SAMPLE) ? caplen : DICT_SAMPLE;
+
+    if (t->length + length > sizeof(t->buf)) {
+        memmove(t->buf, t->buf + t->length - COMPRESS_DICT_MAX,
+                COMPRESS_DICT_MAX);
+        t->length = COMPRESS_DICT_MAX;
+    }
+    memcpy(t->buf + t->length, px, length);
+    t->length += length;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+const struct CompressDict *
+compressdict_train(const unsigned char * const *packets,
+                   const struct pcap_pkthdr *hdrs, size_t count)
+{
+    struct DictTraining *t;
+    const struct CompressDict *dict;
+    size_t i;
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        exit(1);
+    for (i=0; i<count; i++)
+        train_add(t, packets[i], hdrs[i].caplen);
+    dict = dict_create(t->buf, t->length);
+    free(t);
+    return dict;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+const struct CompressDict *
+compressdict_load(const char *filename)
+{
+    const struct CompressDict *dict;
+    struct DictTraining *t;
+    struct CaptureReader *reader;
+    unsigned char magic[4] = {0};
+    FILE *fp;
+    int is_capture;
+
+    if (strcmp(filename, "builtin") == 0)
+        return compressdict_builtin();
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        perror(filename);
+        return NULL;
+    }
+    is_capture = fread(magic, 1, 4, fp) == 4
+                 && (memcmp(magic, "\xd4\xc3\xb2\xa1", 4) == 0
+                     || memcmp(magic, "\xa1\xb2\xc3\xd4", 4) == 0
+                     || memcmp(magic, "\x4d\x3c\xb2\xa1", 4) == 0
+                     || memcmp(magic, "\xa1\xb2\x3c\x4d", 4) == 0
+                     || memcmp(magic, "\x04\x22\x4d\x18", 4) == 0
+                     || memcmp(magic, "PDZ\x01", 4) == 0);
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        exit(1);
+
+    if (is_capture) {
+        struct pcap_pkthdr hdr;
+        const unsigned char *buf;
+        int x;
+
+        fclose(fp);
+        reader = capreader_open(filename);
+        if (reader == NULL) {
+            free(t);
+            return NULL;
+        }
+        while ((x = capreader_next(reader, &hdr, &buf)) > 0)
+            train_add(t, buf, hdr.caplen);
+        capreader_close(reader);
+        if (x < 0 || t->length == 0) {
+            fprintf(stderr, "%s: no packets to train a dictionary from\n",
+                    filename);
+            free(t);
+            return NULL;
+        }
+    } else {
+        /* Any other file is the dictionary itself, keeping the end */
+        size_t bytes_read;
+
+        rewind(fp);
+        while ((bytes_read = fread(t->buf + t->length, 1,
+                                   sizeof(t->buf) - t->length, fp)) > 0) {
+            t->length += bytes_read;
+            if (t->length == sizeof(t->buf)) {
+                memmove(t->buf, t->buf + COMPRESS_DICT_MAX, COMPRESS_DICT_MAX);
+                t->length = COMPRESS_DICT_MAX;
+            }
+        }
+        fclose(fp);
+    }
+
+    dict = dict_create(t->buf, t->length);
+    free(t);
+    return dict;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+const struct CompressDict *
+compressdict_find(uint32_t id)
+{
+    unsigned i;
+
+    compressdict_builtin();
+    for (i=0; i<dict_count; i++) {
+        if (dict_list[i]->id == id)
+            return dict_list[i];
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+compressdict_cleanup(void)
+{
+    unsigned i;
+
+    for (i=0; i<dict_count; i++) {
+        free(dict_list[i]->data);
+        free(dict_list[i]->prepared);
+        free(dict_list[i]);
+    }
+    dict_count = 0;
+    builtin = NULL;
+}
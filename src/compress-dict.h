@@ -0,0 +1,73 @@
+/*
+    LZ4 preset dictionaries
+
+ A small block has little history for LZ4 to find matches in, so the
+ first packets of every block compress badly. A dictionary is data that
+ the compressor pretends came just before the block, so that even the
+ first packet finds the Ethernet/IP/TCP header bytes, the TCP options,
+ and the HTTP headers it's likely to contain.
+
+ There's a built-in dictionary of common protocol bytes, or one can be
+ trained from an earlier capture of the same network, which works much
+ better because it has the actual addresses.
+
+ The dictionary's ID (the XXH32 hash of its bytes) goes into the LZ4
+ frame header, so that the reader can tell which one it needs. The
+ standard 'lz4' tool can also read such files, given the dictionary
+ with its '-D' option.
+*/
+#ifndef COMPRESS_DICT_H
+#define COMPRESS_DICT_H
+#include "rawsock-pcap.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    /* LZ4 can't look further back than this */
+    COMPRESS_DICT_MAX = 64 * 1024,
+};
+
+struct CompressDict
+{
+    unsigned char *data;
+    size_t size;
+    uint32_t id;
+
+    /** The fast compressor's state with the dictionary already loaded,
+     * copied for each block instead of hashing the dictionary again */
+    void *prepared;
+};
+
+/**
+ * The built-in dictionary.
+ */
+const struct CompressDict *compressdict_builtin(void);
+
+/**
+ * Load a dictionary. If the file is a capture file, the dictionary is
+ * trained from its packets, otherwise the (last 64k) bytes of the file
+ * are the dictionary. The name "builtin" means the built-in one.
+ * @return the dictionary, or NULL on error, after printing a message
+ */
+const struct CompressDict *compressdict_load(const char *filename);
+
+/**
+ * Train a dictionary from packets in memory.
+ */
+const struct CompressDict *
+compressdict_train(const unsigned char * const *packets,
+                   const struct pcap_pkthdr *hdrs, size_t count);
+
+/**
+ * Find a dictionary that was loaded or trained, or the built-in one,
+ * by its ID.
+ * @return the dictionary, or NULL if there's none with that ID
+ */
+const struct CompressDict *compressdict_find(uint32_t id);
+
+/**
+ * Free all the dictionaries.
+ */
+void compressdict_cleanup(void);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+    Parallel LZ4 block compression
+
+ Jobs are placed in a small ring protected by a spinlock. The lock is
+ held for only a few instructions, so there's little contention, even
+ with several capture threads submitting to the same pool.
+
+ Workers poll the ring, sleeping briefly when it's empty. When a worker
+ finishes a job, it sets the job's 'is_done' flag, after a write
+ barrier so that the submitter sees the completed output.
+
+ Each job gets its own independent LZ4 block. The LZ4 frame format
+ says that each block starts with a 4-byte little-endian length, where
+ the high bit means the block is stored uncompressed.
+*/
+#include "compress-pool.h"
+#include "compress-dict.h"
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#include "lz4/lz4.h"
+#include "lz4/lz4hc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    POOL_RING_SIZE = 1024,
+};
+
+struct CompressWorker
+{
+    struct CompressPool *pool;
+    size_t thread_handle;
+};
+
+struct CompressPool
+{
+    struct CompressJob *ring[POOL_RING_SIZE];
+    volatile unsigned head;
+    volatile unsigned tail;
+    volatile unsigned lock;
+    volatile unsigned is_stopping;
+
+    unsigned worker_count;
+    struct CompressWorker *workers;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+pool_lock(struct CompressPool *pool)
+{
+    while (!rte_atomic32_cmpset(&pool->lock, 0, 1))
+        rte_pause();
+}
+static void
+pool_unlock(struct CompressPool *pool)
+{
+    rte_wmb();
+    pool->lock = 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+compress_block_bound(size_t src_length)
+{
+    return 4 + LZ4_compressBound((int)src_length);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+compress_block(struct CompressState *state,
+               const void *src, size_t src_length,
+               void *dst, size_t dst_size,
+               int level)
+{
+    return compress_block_dict(state, NULL, src, src_length,
+                               dst, dst_size, level);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+compress_block_dict(struct CompressState *state,
+                    const struct CompressDict *dict,
+                    const void *src, size_t src_length,
+                    void *dst, size_t dst_size,
+                    int level)
+{
+    unsigned char *px = (unsigned char *)dst;
+    int compressed_length;
+    size_t block_length;
+
+    if (level <= COMPRESS_LEVEL_STORE)
+        compressed_length = 0;
+    else if (dict && level >= COMPRESS_LEVEL_HC_MIN) {
+        if (state->stream_hc == NULL) {
+            state->stream_hc = malloc(sizeof(LZ4_streamHC_t));
+            if (state->stream_hc == NULL)
+                exit(1);
+        }
+        LZ4_resetStreamHC(state->stream_hc, level);
+        LZ4_loadDictHC(state->stream_hc, (const char *)dict->data,
+                       (int)dict->size);
+        compressed_length = LZ4_compress_HC_continue(state->stream_hc,
+                                    (const char *)src, (char *)px + 4,
+                                    (int)src_length, (int)dst_size - 4);
+    } else if (dict) {
+        if (state->stream == NULL) {
+            state->stream = malloc(sizeof(LZ4_stream_t));
+            if (state->stream == NULL)
+                exit(1);
+        }
+        /* Much cheaper than loading the dictionary again */
+        memcpy(state->stream, dict->prepared, sizeof(LZ4_stream_t));
+        compressed_length = LZ4_compress_fast_continue(state->stream,
+                                    (const char *)src, (char *)px + 4,
+                                    (int)src_length, (int)dst_size - 4,
+                                    (level < 0) ? -level : 1);
+    } else if (level >= COMPRESS_LEVEL_HC_MIN) {
+        if (state->hc == NULL) {
+            state->hc = malloc(LZ4_sizeofStateHC());
+            if (state->hc == NULL)
+                exit(1);
+        }
+        compressed_length = LZ4_compress_HC_extStateHC(state->hc,
+                                    (const char *)src, (char *)px + 4,
+                                    (int)src_length, (int)dst_size - 4,
+                                    level);
+    } else {
+        if (state->fast == NULL) {
+            state->fast = malloc(LZ4_sizeofState());
+            if (state->fast == NULL)
+                exit(1);
+        }
+        compressed_length = LZ4_compress_fast_extState(state->fast,
+                                    (const char *)src, (char *)px + 4,
+                                    (int)src_length, (int)dst_size - 4,
+                                    (level < 0) ? -level : 1);
+    }
+
+    /*
+     * If it didn't compress, store it uncompressed
+     */
+    if (compressed_length <= 0 || (size_t)compressed_length >= src_length) {
+        memcpy(px + 4, src, src_length);
+        block_length = src_length | 0x80000000;
+        compressed_length = (int)src_length;
+    } else
+        block_length = (size_t)compressed_length;
+
+    px[0] = (unsigned char)(block_length >> 0);
+    px[1] = (unsigned char)(block_length >> 8);
+    px[2] = (unsigned char)(block_length >> 16);
+    px[3] = (unsigned char)(block_length >> 24);
+    return 4 + (size_t)compressed_length;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+compress_job(struct CompressState *state, struct CompressJob *job)
+{
+    size_t length = 0;
+
+    if (job->meta_length)
+        length = compress_block_dict(state, job->dict,
+                                     job->meta, job->meta_length,
+                                     job->dst, job->dst_size, job->level);
+    length += compress_block_dict(state, job->dict,
+                                  job->src, job->src_length,
+                                  job->dst + length, job->dst_size - length,
+                                  job->level);
+    return length;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+compress_state_cleanup(struct CompressState *state)
+{
+    free(state->fast);
+    free(state->hc);
+    free(state->stream);
+    free(state->stream_hc);
+    state->fast = NULL;
+    state->hc = NULL;
+    state->stream = NULL;
+    state->stream_hc = NULL;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static struct CompressJob *
+pool_take(struct CompressPool *pool)
+{
+    struct CompressJob *job = NULL;
+
+    if (pool->head == pool->tail)
+        return NULL;
+
+    pool_lock(pool);
+    if (pool->head != pool->tail) {
+        job = pool->ring[pool->tail % POOL_RING_SIZE];
+        pool->tail++;
+    }
+    pool_unlock(pool);
+    return job;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+compress_worker_thread(void *userdata)
+{
+    struct CompressWorker *worker = (struct CompressWorker *)userdata;
+    struct CompressPool *pool = worker->pool;
+    struct CompressState state = {0};
+
+    while (!pool->is_stopping) {
+        struct CompressJob *job;
+
+        job = pool_take(pool);
+        if (job == NULL) {
+            pixie_usleep(20);
+            continue;
+        }
+
+        job->dst_length = compress_job(&state, job);
+        rte_wmb();
+        job->is_done = 1;
+    }
+
+    compress_state_cleanup(&state);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct CompressPool *
+compresspool_create(unsigned worker_count)
+{
+    struct CompressPool *pool;
+    unsigned i;
+
+    if (worker_count == 0)
+        worker_count = 1;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        exit(1);
+    pool->worker_count = worker_count;
+    pool->workers = calloc(worker_count, sizeof(pool->workers[0]));
+    if (pool->workers == NULL)
+        exit(1);
+
+    for (i=0; i<worker_count; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].thread_handle = pixie_begin_thread(
+                                            compress_worker_thread,
+                                            0,
+                                            &pool->workers[i]);
+    }
+    return pool;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+compresspool_destroy(struct CompressPool *pool)
+{
+    unsigned i;
+
+    if (pool == NULL)
+        return;
+    pool->is_stopping = 1;
+    for (i=0; i<pool->worker_count; i++)
+        pixie_thread_join(pool->workers[i].thread_handle);
+    free(pool->workers);
+    free(pool);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+compresspool_workers(const struct CompressPool *pool)
+{
+    return pool->worker_count;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+compresspool_submit(struct CompressPool *pool, struct CompressJob *job)
+{
+    job->is_done = 0;
+
+    for (;;) {
+        pool_lock(pool);
+        if (pool->head - pool->tail < POOL_RING_SIZE) {
+            pool->ring[pool->head % POOL_RING_SIZE] = job;
+            rte_wmb();
+            pool->head++;
+            pool_unlock(pool);
+            return;
+        }
+        pool_unlock(pool);
+
+        /* The ring is full, so wait for the workers to catch up */
+        pixie_usleep(20);
+    }
+}
@@ -0,0 +1,141 @@
+/*
+    Parallel LZ4 block compression
+
+ A single core can't compress fast enough to keep up with 10gbps,
+ especially with the slower high-compression levels. Therefore, we
+ compress independent LZ4 blocks on a pool of worker threads.
+
+ The file writer submits blocks in order, and writes the results in
+ that same order, so the output is a normal LZ4 frame with independent
+ blocks, readable by the standard 'lz4' tool.
+*/
+#ifndef COMPRESS_POOL_H
+#define COMPRESS_POOL_H
+#include <stddef.h>
+
+struct CompressPool;
+struct CompressDict;
+
+/**
+ * Compression levels. Zero is the default fast LZ4 mode. Negative
+ * numbers are even faster ("acceleration"), trading ratio for speed.
+ * Levels from 3 up to 12 use LZ4HC. The "store" level doesn't compress
+ * at all, but copies the block as it is.
+ */
+enum {
+    COMPRESS_LEVEL_STORE = -1000,
+    COMPRESS_LEVEL_FAST = 0,
+    COMPRESS_LEVEL_HC_MIN = 3,
+    COMPRESS_LEVEL_HC_DEFAULT = 9,
+    COMPRESS_LEVEL_HC_MAX = 12,
+};
+
+/**
+ * One block of data to compress. The 'src' and 'dst' buffers are owned
+ * by whoever submits the job.
+ */
+struct CompressJob
+{
+    unsigned char *src;
+    size_t src_length;
+
+    /** If not empty, compressed as a separate block in front of 'src',
+     * such as the record headers of a .pdz chunk */
+    unsigned char *meta;
+    size_t meta_length;
+
+    /** Output, as an LZ4 frame block, including the 4-byte block header.
+     * Must be at least 'compress_block_bound(src_length)' bytes, plus
+     * the same for 'meta'. */
+    unsigned char *dst;
+    size_t dst_size;
+    size_t dst_length;
+
+    int level;
+
+    /** If not NULL, the preset dictionary for both blocks */
+    const struct CompressDict *dict;
+
+    /** Set by the worker when the output is ready */
+    volatile unsigned is_done;
+};
+
+/**
+ * Per-thread compression state, so that the compressor doesn't have to
+ * allocate hash tables on each block.
+ */
+struct CompressState
+{
+    void *fast;
+    void *hc;
+
+    /** The same, for compressing with a dictionary */
+    void *stream;
+    void *stream_hc;
+};
+
+/**
+ * The size of the output buffer needed to compress a block of this
+ * size, including the block header.
+ */
+size_t compress_block_bound(size_t src_length);
+
+/**
+ * Compress a block within the current thread, formatting the output as
+ * an LZ4 frame block (a 4-byte little-endian length, followed by the
+ * data). If the data doesn't compress, it's stored uncompressed, as the
+ * frame format allows.
+ * @return
+ *      The number of bytes of output.
+ */
+size_t compress_block(struct CompressState *state,
+                      const void *src, size_t src_length,
+                      void *dst, size_t dst_size,
+                      int level);
+
+/**
+ * The same, but as if the dictionary came right before the block, so
+ * that it has to be decompressed with the same dictionary.
+ */
+size_t compress_block_dict(struct CompressState *state,
+                           const struct CompressDict *dict,
+                           const void *src, size_t src_length,
+                           void *dst, size_t dst_size,
+                           int level);
+
+/**
+ * Compress a job's blocks within the current thread.
+ * @return
+ *      The number of bytes of output.
+ */
+size_t compress_job(struct CompressState *state, struct CompressJob *job);
+
+/**
+ * Free the hash tables.
+ */
+void compress_state_cleanup(struct CompressState *state);
+
+/**
+ * Start the worker threads.
+ */
+struct CompressPool *compresspool_create(unsigned worker_count);
+
+/**
+ * Stop the workers and free everything. All the submitted jobs must
+ * be finished first.
+ */
+void compresspool_destroy(struct CompressPool *pool);
+
+/**
+ * The number of worker threads.
+ */
+unsigned compresspool_workers(const struct CompressPool *pool);
+
+/**
+ * Queue a block to be compressed by one of the workers. When it's done,
+ * the worker sets 'job->is_done'. This can be called by many threads
+ * at once.
+ */
+void compresspool_submit(struct CompressPool *pool, struct CompressJob *job);
+
+#endif
@@ -41,6 +41,38 @@ static const struct ConfigurationOptions options[] = {
     {"bpf-file",    CONF_STR,   VAR(bpf_file)},
     {"compress",    CONF_BOOL,  VAR(is_compression)},
     {"gmt",         CONF_BOOL,  VAR(is_gmt)},
+    {"tpacket",     CONF_BOOL,  VAR(is_tpacket)},
+    {"ring-block-size", CONF_NUM, VAR(ring_block_size)},
+    {"ring-blocks", CONF_NUM,   VAR(ring_block_count)},
+    {"ring-timeout",CONF_NUM,   VAR(ring_block_timeout)},
+    {"threads",     CONF_NUM,   VAR(capture_threads)},
+    {"fanout",      CONF_STR,   VAR(fanout_mode)},
+    {"batch",       CONF_NUM,   VAR(capture_batch)},
+    {"queue-depth", CONF_NUM,   VAR(queue_depth)},
+    {"queue-memory",CONF_NUM,   VAR(queue_memory)},
+    {"queue-full",  CONF_STR,   VAR(queue_full)},
+    {"compress-block-size", CONF_NUM, VAR(compress_block_size)},
+    {"flush-latency", CONF_NUM, VAR(flush_latency)},
+    {"compress-threads", CONF_NUM, VAR(compress_threads)},
+    {"compress-level", CONF_NUM, VAR(compress_level)},
+    {"compress-adaptive", CONF_BOOL, VAR(is_compress_adaptive)},
+    {"compress-dict", CONF_STR, VAR(compress_dict)},
+    {"output-engine", CONF_STR, VAR(output_engine)},
+    {"output-buffer-size", CONF_NUM, VAR(output_buffer_size)},
+    {"output-buffers", CONF_NUM, VAR(output_buffers)},
+    {"preallocate", CONF_BOOL, VAR(is_preallocate)},
+    {"write-behind", CONF_NUM, VAR(write_behind)},
+    {"stripe",      CONF_STR,   VAR(stripe)},
+    {"stripe-mode", CONF_STR,   VAR(stripe_mode)},
+    {"flight-recorder", CONF_NUM, VAR(flight_memory)},
+    {"flight-seconds", CONF_NUM, VAR(flight_seconds)},
+    {"flight-socket", CONF_STR, VAR(flight_socket)},
+    {"flight-trigger", CONF_STR, VAR(flight_trigger)},
+    {"snap-keep",   CONF_STR,   VAR(snap_keep)},
+    {"snap-payload",CONF_NUM,   VAR(snap_payload)},
+    {"flow-cutoff", CONF_NUM,   VAR(flow_cutoff)},
+    {"flow-memory", CONF_NUM,   VAR(flow_memory)},
+    {"flow-timeout",CONF_NUM,   VAR(flow_timeout)},
     
     
     {"monitor-mode",CONF_BOOL,  VAR(is_monitor_mode)},
@@ -51,6 +83,7 @@ static const struct ConfigurationOptions options[] = {
     {"version",     CONF_BOOL,  VAR(is_version), CONF_NOECHO},
     {"list-interfaces",CONF_BOOL,VAR(is_iflist), CONF_NOECHO},
     {"echo",        CONF_BOOL,  VAR(is_echo), CONF_NOECHO},
+    {"benchmark",   CONF_STR,   VAR(benchmark), CONF_NOECHO},
     
     {"readfile",    CONF_FILES, VAR(readfiles)},
     {0}
@@ -216,6 +249,8 @@ parse_option(const char *name, const char *value, struct PacketDump *conf)
         case CONF_NUM:
             num = MEMBERAT(conf, options[i].offset, uint64_t);
             *num = strtoull(value, 0, 0);
+            if (options[i].offset == VAR(snap_payload))
+                conf->is_snap_payload = 1;
             break;
         
         case CONF_BOOL:
@@ -382,6 +417,19 @@ read_configuration(int argc, char **argv, struct PacketDump *conf)
      */
     if (conf->filename && is_ending(conf->filename, ".lz4"))
         conf->is_compression = 1;
+    if (conf->filename && is_ending(conf->filename, ".pdz")) {
+        conf->is_compression = 1;
+        conf->is_pdz = 1;
+    }
+    if (conf->filename && is_ending(conf->filename, ".pdc")) {
+        conf->is_compression = 1;
+        conf->is_pdz = 1;
+        conf->is_pdc = 1;
+    }
+    if (conf->filename && is_ending(conf->filename, ".zst")) {
+        conf->is_compression = 1;
+        conf->is_zstd = 1;
+    }
 }
 
 /***************************************************************************
@@ -397,8 +445,29 @@ configuration_help(void)
            " -D\n"
            " --list-interfaces\n"
            "   Prints list of possible packet capture interfaces.\n"
-           " -F <filename>\n"
-           "   Read BPF filter rules from this file.\n"
+           " --bpf <expression>\n"
+           "   Only capture packets matching this filter, like 'not port 873',\n"
+           "   which the kernel applies before they're copied to us. Compiling\n"
+           "   it needs libpcap.\n"
+           " -F <filename>, --bpf-file <filename>\n"
+           "   Read the filter from this file, either the expression, or the\n"
+           "   output of 'tcpdump -ddd <expression>', which doesn't need libpcap.\n"
+           " --snap-payload <bytes>\n"
+           "   Keep only the headers and this much payload of each packet\n"
+           "   (default 64, or 0 for just the headers), except for those in\n"
+           "   --snap-keep. The original length is still recorded.\n"
+           " --snap-keep <list>\n"
+           "   Packets to keep whole, from: dns, tls (handshakes), http\n"
+           "   (headers), icmp, and ports like 8080, tcp/8443, or udp/123\n"
+           "   (default dns,tls,http,icmp).\n"
+           " --flow-cutoff <bytes>\n"
+           "   Record only the first this many bytes of each TCP or UDP flow,\n"
+           "   counting both directions, and drop the rest.\n"
+           " --flow-memory <bytes>\n"
+           "   The size of each capture thread's flow table, where each flow\n"
+           "   takes 16 bytes (default 67108864, for 4 million flows).\n"
+           " --flow-timeout <seconds>\n"
+           "   How long a flow can be idle before it's forgotten (default 300).\n"
            " -G <seconds>\n"
            "   Rotate file after this number of seconds.\n"
            " -i <ifname>\n"
@@ -412,14 +481,92 @@ configuration_help(void)
            "   Do NOT put the adapter into promiscuous mode.\n"
            " -r <filename>\n"
            "   Read packets from a file.\n"
+           " --tpacket\n"
+           "   Capture with the native Linux TPACKET_V3 ring instead of libpcap.\n"
+           "   Same as putting 'tpacket:' in front of the interface name.\n"
+           " --ring-block-size <bytes>\n"
+           " --ring-blocks <count>\n"
+           " --ring-timeout <milliseconds>\n"
+           "   Size and number of TPACKET_V3 ring blocks, and how long before\n"
+           "   the kernel hands over a partially filled block.\n"
+           " --threads <count>\n"
+           "   Number of capture threads, each writing its own files, joined\n"
+           "   into a PACKET_FANOUT group. Implies --tpacket.\n"
+           " --fanout <hash|cpu|rollover>\n"
+           "   How packets are spread across capture threads.\n"
+           " --batch <count>\n"
+           "   Hand packets from the capture to the writer this many at a\n"
+           "   time (default 64, at most 256), or one at a time with 1.\n"
+           " --queue-depth <count>\n"
+           " --queue-memory <bytes>\n"
+           "   Hand packets to a separate writer thread through a queue of\n"
+           "   this many packets, with this much memory for packet contents.\n"
+           " --queue-full <block|drop|truncate>\n"
+           "   What to do with new packets when the writer falls behind.\n"
+           " --compress-block-size <bytes>\n"
+           "   Compress packets in blocks of this size (up to 4m, default 256k).\n"
+           " --flush-latency <milliseconds>\n"
+           "   Maximum time a packet waits in a block before being written.\n"
+           " --compress-threads <n>\n"
+           "   Compress blocks in parallel on this many worker threads. For\n"
+           "   zstd, this many of the library's own threads are used instead.\n"
+           " --compress-level <n>\n"
+           "   LZ4 level: 0 is the default, 3 to 12 use LZ4HC for better\n"
+           "   compression, and negative (--compress-level=-4) is faster.\n"
+           "   For zstd, the zstd level from 1 to 22 (0 is zstd's default, 3).\n"
+           " --compress-adaptive\n"
+           "   Choose the level of each block from how far behind we are, from\n"
+           "   not compressing at all up to --compress-level (default 9).\n"
+           " --compress-dict <file|builtin>\n"
+           "   Compress each block with a preset dictionary, which helps small\n"
+           "   blocks. From a capture file, one is trained from its packets.\n"
+           "   Reading the output with -r needs the same --compress-dict.\n"
+           " --output-engine <stdio|uring|direct>\n"
+           "   How files are written. With 'uring', several buffers are written\n"
+           "   in the background with io_uring. With 'direct', they are also\n"
+           "   written with O_DIRECT, bypassing the page cache (default stdio).\n"
+           " --output-buffer-size <bytes>, --output-buffers <n>\n"
+           "   The size and number of output buffers (default 1m, 4 or 3).\n"
+           " --preallocate\n"
+           "   With -C, reserve the disk space for each file when it's opened,\n"
+           "   to reduce fragmentation.\n"
+           " --write-behind <bytes>\n"
+           "   Every time this many bytes are written, start writing them to\n"
+           "   disk and drop the previous ones from the page cache.\n"
+           " --stripe <dir>[,<dir>...]\n"
+           "   Spread the files across these directories, putting each -w\n"
+           "   filename under the next one when rotating.\n"
+           " --stripe-mode <roundrobin|weighted>\n"
+           "   Take turns (default), or give each directory a share of the\n"
+           "   files in proportion to how fast it's been writing them.\n"
+           " --flight-recorder <bytes>\n"
+           "   Keep this much compressed traffic in memory instead of writing\n"
+           "   files, and dump it to the -w file on SIGUSR1 or a trigger.\n"
+           " --flight-seconds <n>\n"
+           "   How many seconds back to dump (default everything in memory).\n"
+           " --flight-socket <path>\n"
+           "   Also dump when 'dump [seconds]' is sent to this local socket.\n"
+           " --flight-trigger <file>\n"
+           "   Also dump when a packet matches this BPF program, in the format\n"
+           "   from 'tcpdump -ddd <filter>'.\n"
            " -w <filename>\n"
            "  Write packets to a file.\n"
            " -W <count>\n"
-           "  Creates ring-buffer with this number of files.\n"
+           "  Creates ring-buffer with this number of files. Once there are\n"
+           "  this many, the oldest is removed, or with --preallocate, reused\n"
+           "  for the next file. Use %%N in the filename for the file number.\n"
            " --version\n"
            "  Print version info.\n"
+           " --benchmark <name>\n"
+           "  Measure performance with synthetic traffic. Use 'all' to run\n"
+           "  everything, or 'list' to see the choices. Writes to the '-w' file.\n"
            " -z [compression type]\n"
            "  Enable compression. Not needed if file suffix indicates compression.\n"
+           "  A '.pdz' suffix writes packetdump's own format, which compresses\n"
+           "  better, and can be turned back into a pcap file with -r. A '.pdc'\n"
+           "  suffix also splits TCP/IP headers into columns, for the best ratio.\n"
+           "  A '.zst' suffix compresses with zstd, slower than LZ4 but smaller,\n"
+           "  if libzstd is installed.\n"
            " -Z <user>\n"
            " --relinquish-privileges=user\n"
            "   Drops root privileges to those of this user\n"
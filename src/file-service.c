@@ -0,0 +1,248 @@
+/*
+    Background opening and closing of output files
+
+ Requests are kept on a linked list protected by a spinlock. Submitting
+ just pushes onto the front of the list. The service thread takes the
+ entire list at once, reverses it so that requests are handled in the
+ order they were submitted, and handles them without holding the lock.
+*/
+#include "file-service.h"
+#include "logger.h"
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct FileRequest
+{
+    /** If set, a file to close. Otherwise, if there's a filename, it's
+     * a file to remove */
+    struct PcapFile *fp;
+    char *filename;
+
+    /** If set, a file to open */
+    struct FileOpenRequest *open;
+
+    struct FileRequest *next;
+};
+
+struct FileService
+{
+    struct FileRequest *list;
+    volatile unsigned lock;
+    volatile unsigned is_stopping;
+    uint64_t max_usecs;
+    size_t thread_handle;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+service_lock(struct FileService *service)
+{
+    while (!rte_atomic32_cmpset(&service->lock, 0, 1))
+        rte_pause();
+}
+static void
+service_unlock(struct FileService *service)
+{
+    rte_wmb();
+    service->lock = 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+service_push(struct FileService *service, struct FileRequest *item)
+{
+    service_lock(service);
+    item->next = service->list;
+    service->list = item;
+    service_unlock(service);
+}
+
+/***************************************************************************
+ * Take everything on the list, in the order it was submitted.
+ ***************************************************************************/
+static struct FileRequest *
+service_take_all(struct FileService *service)
+{
+    struct FileRequest *list;
+    struct FileRequest *reversed = NULL;
+
+    service_lock(service);
+    list = service->list;
+    service->list = NULL;
+    service_unlock(service);
+
+    while (list) {
+        struct FileRequest *next = list->next;
+        list->next = reversed;
+        reversed = list;
+        list = next;
+    }
+    return reversed;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+service_close(struct FileService *service, struct FileRequest *item)
+{
+    uint64_t start = pixie_gettime();
+    uint64_t elapsed;
+
+    pcapfile_close(item->fp);
+    elapsed = pixie_gettime() - start;
+    if (service->max_usecs < elapsed)
+        service->max_usecs = elapsed;
+    if (item->filename) {
+        LOG(1, "%s: closed in %u milliseconds\n",
+            item->filename, (unsigned)(elapsed / 1000));
+        free(item->filename);
+    }
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+service_open(struct FileOpenRequest *request)
+{
+    request->fp = pcapfile_openwrite_ex(request->filename,
+                                        request->linktype,
+                                        request->compression_type,
+                                        &request->options);
+    rte_wmb();
+    request->is_done = 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+service_thread(void *userdata)
+{
+    struct FileService *service = (struct FileService *)userdata;
+
+    for (;;) {
+        struct FileRequest *list;
+        unsigned is_stopping = service->is_stopping;
+
+        list = service_take_all(service);
+        if (list == NULL) {
+            if (is_stopping)
+                break;
+            pixie_usleep(1000);
+            continue;
+        }
+
+        while (list) {
+            struct FileRequest *next = list->next;
+
+            if (list->open)
+                service_open(list->open);
+            else if (list->fp)
+                service_close(service, list);
+            else {
+                if (remove(list->filename) != 0)
+                    perror(list->filename);
+                free(list->filename);
+            }
+            free(list);
+            list = next;
+        }
+    }
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct FileService *
+fileservice_create(void)
+{
+    struct FileService *service;
+
+    service = calloc(1, sizeof(*service));
+    if (service == NULL)
+        exit(1);
+    service->thread_handle = pixie_begin_thread(service_thread, 0, service);
+    return service;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+fileservice_destroy(struct FileService *service)
+{
+    if (service == NULL)
+        return;
+    service->is_stopping = 1;
+    pixie_thread_join(service->thread_handle);
+    if (service->max_usecs) {
+        LOG(1, "longest file close took %u milliseconds\n",
+            (unsigned)(service->max_usecs / 1000));
+    }
+    free(service);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+fileservice_close(struct FileService *service,
+                  struct PcapFile *fp,
+                  char *filename)
+{
+    struct FileRequest *item;
+
+    item = calloc(1, sizeof(*item));
+    if (item == NULL)
+        exit(1);
+    item->fp = fp;
+    item->filename = filename;
+    service_push(service, item);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+fileservice_remove(struct FileService *service, char *filename)
+{
+    struct FileRequest *item;
+
+    item = calloc(1, sizeof(*item));
+    if (item == NULL)
+        exit(1);
+    item->filename = filename;
+    service_push(service, item);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+fileservice_open(struct FileService *service,
+                 struct FileOpenRequest *request)
+{
+    struct FileRequest *item;
+
+    item = calloc(1, sizeof(*item));
+    if (item == NULL)
+        exit(1);
+    item->open = request;
+    request->fp = NULL;
+    request->is_done = 0;
+    request->is_pending = 1;
+    service_push(service, item);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct PcapFile *
+fileservice_wait(struct FileOpenRequest *request)
+{
+    if (!request->is_pending)
+        return NULL;
+    while (!request->is_done)
+        pixie_usleep(100);
+    rte_rmb();
+    request->is_pending = 0;
+    return request->fp;
+}
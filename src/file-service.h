@@ -0,0 +1,92 @@
+/*
+    Background opening and closing of output files
+
+ Closing a big capture file is slow: the last block has to be
+ compressed, the LZ4 end mark written, and then 'fclose()' has to push
+ out whatever the operating system hasn't written yet. Opening one
+ isn't free either: there's the 'fopen()', setting up the compressor,
+ allocating buffers, and writing the headers. If this happens in the
+ thread writing packets, packets back up and get dropped while it
+ waits.
+
+ Therefore, when we rotate files, the old file is handed to this thread
+ to close. And as a file nears the point where it'll be rotated, this
+ thread opens the next one ahead of time, so that the rotation itself
+ is just swapping a pointer. Old files that are no longer wanted are
+ deleted here too.
+
+ Requests are handled in the order they were submitted, so a file can
+ be safely reopened or deleted after it's been handed over to close.
+*/
+#ifndef FILE_SERVICE_H
+#define FILE_SERVICE_H
+#include "rawsock-pcapfile.h"
+struct FileService;
+
+/**
+ * A request to open a file ahead of time. The requester fills in the
+ * first fields, then checks 'is_done' to see when the file is ready.
+ */
+struct FileOpenRequest
+{
+    /** Malloced name of the file to open. This belongs to the requester,
+     * and isn't freed by the service. */
+    char *filename;
+    unsigned linktype;
+    int compression_type;
+    struct PcapFileOptions options;
+
+    /** The opened file, or NULL if it couldn't be opened */
+    struct PcapFile *fp;
+
+    /** Set when the request has been submitted */
+    unsigned is_pending;
+
+    /** Set by the service thread once 'fp' has been filled in */
+    volatile unsigned is_done;
+};
+
+/**
+ * Start the service thread.
+ */
+struct FileService *fileservice_create(void);
+
+/**
+ * Finish all the requests that are still waiting, then stop the thread
+ * and free everything.
+ */
+void fileservice_destroy(struct FileService *service);
+
+/**
+ * Hand a file to the service thread to close. The caller must not touch
+ * the file afterwards. This can be called by many threads at once.
+ * @param filename
+ *      The name of the file, for logging. The service takes ownership
+ *      of this string and frees it, so it must have been malloced.
+ *      It can be NULL.
+ */
+void fileservice_close(struct FileService *service,
+                       struct PcapFile *fp,
+                       char *filename);
+
+/**
+ * Hand a file to the service thread to delete, since deleting a big
+ * file can take a while. The service takes ownership of the malloced
+ * filename.
+ */
+void fileservice_remove(struct FileService *service, char *filename);
+
+/**
+ * Ask the service thread to open a file. The request must stay valid
+ * until 'is_done' is set.
+ */
+void fileservice_open(struct FileService *service,
+                      struct FileOpenRequest *request);
+
+/**
+ * Wait for an open request to finish, returning the file, or NULL
+ * if it couldn't be opened. Afterwards, the request can be reused.
+ */
+struct PcapFile *fileservice_wait(struct FileOpenRequest *request);
+
+#endif
@@ -0,0 +1,458 @@
+/*
+    In-memory flight recorder
+
+ The compressed blocks are kept back-to-back in one big ring of memory.
+ A new block goes right after the newest one, or back at the start of
+ the ring if there isn't room before the end. Before it's written, the
+ oldest blocks in its way are thrown away. Each block has a sequence
+ number, so that the dumping thread can tell when a block it wanted
+ has been thrown away in the meantime.
+
+ The block is compressed straight into the ring, after making room for
+ the most it could possibly take.
+
+ Unlike the file writer, records are never split across blocks, so
+ that a dump can start with any block.
+*/
+#include "flight-recorder.h"
+#include "compress-pool.h"
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(WIN32)
+#else
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef UNUSEDPARM
+#define UNUSEDPARM(x) x=(x)
+#endif
+
+struct FlightBlock
+{
+    size_t offset;
+    size_t length;
+
+    /** The timestamp of the last packet */
+    time_t last;
+};
+
+struct FlightRecorder
+{
+    unsigned char *ring;
+    size_t ring_size;
+
+    /** Where the next block goes */
+    size_t head;
+
+    /** The blocks in the ring, block 'seq' being at index
+     * 'seq % block_max' */
+    struct FlightBlock *blocks;
+    size_t block_max;
+    uint64_t first_seq;
+    uint64_t next_seq;
+
+    /** Packets waiting to be compressed */
+    unsigned char *staging;
+    size_t staging_size;
+    size_t staging_length;
+    time_t staging_last;
+
+    struct CompressState compress_state;
+    int compression_level;
+
+    /** Protects the list of blocks, between adding blocks and dumping */
+    volatile unsigned lock;
+
+    /** Set by the dumping thread to ask for the packets waiting to be
+     * compressed, cleared once they have been */
+    volatile unsigned is_flush_requested;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+recorder_lock(struct FlightRecorder *rec)
+{
+    while (!rte_atomic32_cmpset(&rec->lock, 0, 1))
+        rte_pause();
+}
+static void
+recorder_unlock(struct FlightRecorder *rec)
+{
+    rte_wmb();
+    rec->lock = 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct FlightRecorder *
+flightrec_create(size_t memory, size_t block_size, int compression_level)
+{
+    struct FlightRecorder *rec;
+    size_t min_memory;
+
+    if (block_size == 0)
+        block_size = 256 * 1024;
+    if (block_size > 4*1024*1024)
+        block_size = 4*1024*1024;
+
+    /* Room for at least a few blocks, so that a dump is never empty */
+    min_memory = 4 * compress_block_bound(block_size);
+    if (memory < min_memory) {
+        fprintf(stderr, "flight-recorder: %llu bytes is too small, using %llu\n",
+                (unsigned long long)memory, (unsigned long long)min_memory);
+        memory = min_memory;
+    }
+
+    rec = calloc(1, sizeof(*rec));
+    if (rec == NULL)
+        exit(1);
+    rec->ring_size = memory;
+    rec->ring = malloc(memory);
+    rec->staging_size = block_size;
+    rec->staging = malloc(block_size);
+    rec->compression_level = compression_level;
+
+    /* Even tiny blocks, from flushing, take a descriptor */
+    rec->block_max = memory / 1024 + 16;
+    rec->blocks = calloc(rec->block_max, sizeof(rec->blocks[0]));
+    if (rec->ring == NULL || rec->staging == NULL || rec->blocks == NULL) {
+        fprintf(stderr, "flight-recorder: out of memory\n");
+        exit(1);
+    }
+    return rec;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+flightrec_destroy(struct FlightRecorder *rec)
+{
+    if (rec == NULL)
+        return;
+    compress_state_cleanup(&rec->compress_state);
+    free(rec->ring);
+    free(rec->staging);
+    free(rec->blocks);
+    free(rec);
+}
+
+/***************************************************************************
+ * Throw away the oldest block. Must hold the lock.
+ ***************************************************************************/
+static void
+recorder_evict(struct FlightRecorder *rec)
+{
+    rec->first_seq++;
+}
+
+static struct FlightBlock *
+recorder_oldest(struct FlightRecorder *rec)
+{
+    if (rec->first_seq == rec->next_seq)
+        return NULL;
+    return &rec->blocks[rec->first_seq % rec->block_max];
+}
+
+/***************************************************************************
+ * Compress the waiting packets into the ring.
+ ***************************************************************************/
+static void
+recorder_compress(struct FlightRecorder *rec)
+{
+    struct FlightBlock *block;
+    struct FlightBlock *oldest;
+    size_t bound;
+    size_t length;
+
+    if (rec->staging_length == 0)
+        return;
+    bound = compress_block_bound(rec->staging_length);
+
+    /* Make room for the block */
+    recorder_lock(rec);
+    if (rec->next_seq - rec->first_seq >= rec->block_max)
+        recorder_evict(rec);
+    if (rec->head + bound > rec->ring_size) {
+        /* The blocks at the end of the ring are the oldest */
+        while ((oldest = recorder_oldest(rec)) != NULL
+               && oldest->offset >= rec->head)
+            recorder_evict(rec);
+        rec->head = 0;
+    }
+    while ((oldest = recorder_oldest(rec)) != NULL
+           && oldest->offset >= rec->head
+           && oldest->offset < rec->head + bound)
+        recorder_evict(rec);
+    recorder_unlock(rec);
+
+    /* Nobody else looks at this part of the ring now */
+    length = compress_block(&rec->compress_state,
+                            rec->staging, rec->staging_length,
+                            rec->ring + rec->head, bound,
+                            rec->compression_level);
+
+    recorder_lock(rec);
+    block = &rec->blocks[rec->next_seq % rec->block_max];
+    block->offset = rec->head;
+    block->length = length;
+    block->last = rec->staging_last;
+    rec->next_seq++;
+    rec->head += length;
+    recorder_unlock(rec);
+
+    rec->staging_length = 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+flightrec_write(struct FlightRecorder *rec,
+                const struct pcap_pkthdr *hdr,
+                const void *buf)
+{
+    unsigned char *header;
+    unsigned caplen = hdr->caplen;
+    unsigned values[4];
+    unsigned i;
+
+    /* Start a new block if the record doesn't fit. A record that's
+     * bigger than a whole block is truncated */
+    if (16 + caplen > rec->staging_size - rec->staging_length)
+        recorder_compress(rec);
+    if (16 + caplen > rec->staging_size)
+        caplen = (unsigned)rec->staging_size - 16;
+
+    /* The same little-endian record header as the file writer uses */
+    header = rec->staging + rec->staging_length;
+    values[0] = (unsigned)hdr->ts.tv_sec;
+    values[1] = (unsigned)hdr->ts.tv_usec;
+    values[2] = caplen;
+    values[3] = hdr->len;
+    for (i=0; i<4; i++) {
+        header[i*4 + 0] = (unsigned char)(values[i] >> 0);
+        header[i*4 + 1] = (unsigned char)(values[i] >> 8);
+        header[i*4 + 2] = (unsigned char)(values[i] >> 16);
+        header[i*4 + 3] = (unsigned char)(values[i] >> 24);
+    }
+
+    memcpy(header + 16, buf, caplen);
+    rec->staging_length += 16 + caplen;
+    rec->staging_last = (time_t)hdr->ts.tv_sec;
+
+    if (rec->is_flush_requested)
+        flightrec_idle(rec);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+flightrec_idle(struct FlightRecorder *rec)
+{
+    if (!rec->is_flush_requested)
+        return;
+    recorder_compress(rec);
+    rte_wmb();
+    rec->is_flush_requested = 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+flightrec_dump(struct FlightRecorder *rec,
+               const char *filename,
+               unsigned linktype,
+               unsigned seconds,
+               const struct PcapFileOptions *options)
+{
+    struct PcapFileOptions file_options = *options;
+    struct PcapFile *fp;
+    unsigned char *block;
+    uint64_t seq;
+    uint64_t end_seq;
+    uint64_t waited = 0;
+    uint64_t blocks_lost = 0;
+    int result = 0;
+
+    /* Get the packets that are still waiting to be compressed. If the
+     * capture thread is stuck, go without them. */
+    rec->is_flush_requested = 1;
+    while (rec->is_flush_requested && waited < 500000) {
+        pixie_usleep(1000);
+        waited += 1000;
+    }
+
+    /* Find the first block that's recent enough */
+    recorder_lock(rec);
+    end_seq = rec->next_seq;
+    seq = rec->first_seq;
+    if (seconds && seq < end_seq) {
+        time_t newest = rec->blocks[(end_seq - 1) % rec->block_max].last;
+        while (seq < end_seq
+               && rec->blocks[seq % rec->block_max].last + (time_t)seconds < newest)
+            seq++;
+    }
+    recorder_unlock(rec);
+
+    /* The blocks are already compressed, without a dictionary, and the
+     * pool and level control belong to the capture thread, which is
+     * still using them */
+    file_options.block_size = rec->staging_size;
+    file_options.pool = NULL;
+    file_options.control = NULL;
+    file_options.dict = NULL;
+    file_options.output.preallocate = 0;
+    file_options.output.recycle = NULL;
+    fp = pcapfile_openwrite_ex(filename, linktype, PCAPFILE_LZ4, &file_options);
+    if (fp == NULL)
+        return -1;
+
+    block = malloc(compress_block_bound(rec->staging_size));
+    if (block == NULL)
+        exit(1);
+
+    for (; seq < end_seq; seq++) {
+        size_t length;
+
+        /* Copy the block out, unless it's been thrown away */
+        recorder_lock(rec);
+        if (seq < rec->first_seq) {
+            blocks_lost += rec->first_seq - seq;
+            seq = rec->first_seq;
+            if (seq >= end_seq) {
+                recorder_unlock(rec);
+                break;
+            }
+        }
+        length = rec->blocks[seq % rec->block_max].length;
+        memcpy(block, rec->ring + rec->blocks[seq % rec->block_max].offset, length);
+        recorder_unlock(rec);
+
+        if (pcapfile_writeblock(fp, block, length) < 0) {
+            fprintf(stderr, "%s: write failed\n", filename);
+            result = -1;
+            break;
+        }
+    }
+    free(block);
+    pcapfile_close(fp);
+
+    if (blocks_lost)
+        fprintf(stderr, "%s: %llu blocks overwritten before they could be written\n",
+                filename, (unsigned long long)blocks_lost);
+    return result;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+flightrec_listen(const char *path)
+{
+#if defined(WIN32)
+    UNUSEDPARM(path);
+    fprintf(stderr, "flight-recorder: control socket not supported\n");
+    return -1;
+#else
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: control socket name too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(fd, 4) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+#endif
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+flightrec_accept(int fd, unsigned *r_seconds)
+{
+#if defined(WIN32)
+    UNUSEDPARM(fd);
+    UNUSEDPARM(r_seconds);
+    return -1;
+#else
+    struct timeval timeout = {1, 0};
+    char line[64];
+    ssize_t length;
+    unsigned seconds;
+    int client;
+
+    client = accept(fd, NULL, NULL);
+    if (client < 0)
+        return -1;
+
+    /* Don't let a client that never says anything hold us up */
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    length = recv(client, line, sizeof(line) - 1, 0);
+    if (length <= 0) {
+        close(client);
+        return -1;
+    }
+    line[length] = '\0';
+
+    if (strncmp(line, "dump", 4) != 0) {
+        static const char reply[] = "ERROR: expected 'dump [seconds]'\n";
+        send(client, reply, sizeof(reply) - 1, 0);
+        close(client);
+        return -1;
+    }
+    if (sscanf(line + 4, "%u", &seconds) == 1)
+        *r_seconds = seconds;
+    return client;
+#endif
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+flightrec_reply(int client, const char *text)
+{
+#if defined(WIN32)
+    UNUSEDPARM(client);
+    UNUSEDPARM(text);
+#else
+    send(client, text, strlen(text), 0);
+#endif
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+flightrec_hangup(int fd)
+{
+#if defined(WIN32)
+    UNUSEDPARM(fd);
+#else
+    close(fd);
+#endif
+}
@@ -0,0 +1,97 @@
+/*
+    In-memory flight recorder
+
+ Often we only need the last few minutes of traffic from around when
+ something happened, and writing everything to disk all the time costs
+ disk bandwidth and space for no reason. In this mode, packets are
+ instead compressed into blocks that are kept in a fixed amount of
+ memory, with the oldest blocks thrown away to make room for new ones.
+
+ When something interesting happens, the last so many seconds are
+ dumped to a file. The dump is done by another thread, while capture
+ carries on. Each block is copied out of the ring while holding the
+ lock, then written without it, so capture only ever waits for the
+ copy of a single block.
+
+ Blocks are compressed the same way as the file writer's blocks, so
+ dumping them is just writing the frame header, the blocks as they
+ are, and the end mark, making a normal '.pcap.lz4' file.
+*/
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+#include "rawsock-pcap.h"
+#include "rawsock-pcapfile.h"
+#include <stddef.h>
+struct FlightRecorder;
+
+/**
+ * Allocate the memory for the recorder.
+ * @param memory
+ *      The total bytes of compressed blocks to keep.
+ * @param block_size
+ *      How many bytes of packets to compress at a time.
+ */
+struct FlightRecorder *flightrec_create(size_t memory, size_t block_size,
+                                        int compression_level);
+
+void flightrec_destroy(struct FlightRecorder *rec);
+
+/**
+ * Add a packet. Only one thread may call this.
+ */
+void flightrec_write(struct FlightRecorder *rec,
+                     const struct pcap_pkthdr *hdr,
+                     const void *buf);
+
+/**
+ * Called by the thread adding packets when there's nothing to add, so
+ * that it can compress the packets waiting in the current block when
+ * they're needed for a dump.
+ */
+void flightrec_idle(struct FlightRecorder *rec);
+
+/**
+ * Write the last so many seconds of packets to a file. This is called
+ * by a different thread than the one adding packets.
+ * @param seconds
+ *      How far back from the newest packet to go, or 0 for everything.
+ * @param options
+ *      How to write the file. The block size is changed to match the
+ *      recorder.
+ * @return 0 on success, or -1 on error, after printing a message
+ */
+int flightrec_dump(struct FlightRecorder *rec,
+                   const char *filename,
+                   unsigned linktype,
+                   unsigned seconds,
+                   const struct PcapFileOptions *options);
+
+/**
+ * Create a local control socket where a dump can be requested, by
+ * connecting and sending "dump", or "dump <seconds>".
+ * @return the listening socket, or -1 on error, after printing a message
+ */
+int flightrec_listen(const char *path);
+
+/**
+ * Check the control socket for a dump request, without waiting.
+ * @param r_seconds
+ *      Set to how many seconds to dump, or left alone if the command
+ *      didn't say.
+ * @return the connection the request came on, which should be sent the
+ * result with 'flightrec_reply()' and then closed with
+ * 'flightrec_hangup()', or -1 if there's no request
+ */
+int flightrec_accept(int fd, unsigned *r_seconds);
+
+/**
+ * Send a line of text back on a connection from 'flightrec_accept()'.
+ */
+void flightrec_reply(int client, const char *text);
+
+/**
+ * Close a connection, or the listening socket.
+ */
+void flightrec_hangup(int fd);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+    Per-flow byte cutoff
+
+ See "flow-cutoff.h" for how the table is organized. The per-packet
+ work is parsing the headers, hashing the addresses and ports, and
+ comparing the 4 keys of one cache line.
+*/
+#include "flow-cutoff.h"
+#include "rawsock-pcap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    FLOW_WAYS = 4,
+    FLOW_CACHE_LINE = 64,
+};
+
+struct FlowEntry
+{
+    /** The hash of the flow's addresses and ports, or 0 if unused */
+    uint64_t key;
+
+    /** How many bytes we've seen, which stops growing at the cutoff */
+    uint32_t bytes;
+
+    /** The timestamp of the flow's last packet */
+    uint32_t last_seen;
+};
+
+struct FlowBucket
+{
+    struct FlowEntry entries[FLOW_WAYS];
+};
+
+struct FlowTable
+{
+    struct FlowBucket *buckets;
+    uint64_t mask;
+    uint32_t cutoff;
+    unsigned timeout;
+
+    /** Flows that were replaced while still active, meaning the table
+     * is too small */
+    uint64_t evictions;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+struct FlowTable *
+flowtable_create(uint64_t cutoff, uint64_t memory, unsigned timeout)
+{
+    struct FlowTable *table;
+    uint64_t count = 1;
+    void *p;
+
+    if (memory == 0)
+        memory = FLOW_DEFAULT_MEMORY;
+    if (timeout == 0)
+        timeout = FLOW_DEFAULT_TIMEOUT;
+
+    /* A power of two, so that the bucket is just the low bits */
+    while (count * 2 * sizeof(struct FlowBucket) <= memory)
+        count *= 2;
+
+    table = calloc(1, sizeof(*table));
+    if (table == NULL) {
+        fprintf(stderr, "[-] out of memory\n");
+        exit(1);
+    }
+    if (posix_memalign(&p, FLOW_CACHE_LINE, count * sizeof(struct FlowBucket)) != 0) {
+        fprintf(stderr, "[-] out of memory\n");
+        exit(1);
+    }
+    memset(p, 0, count * sizeof(struct FlowBucket));
+    table->buckets = (struct FlowBucket *)p;
+    table->mask = count - 1;
+
+    /* Leave room so the count can't wrap */
+    table->cutoff = (cutoff < 0xFFFF0000) ? (uint32_t)cutoff : 0xFFFF0000;
+    table->timeout = timeout;
+    return table;
+}
+
+/***************************************************************************
+ * Mix the bits, so that every bit of the key depends on every bit of
+ * the input (the MurmurHash3 finalizer).
+ ***************************************************************************/
+static uint64_t
+flow_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static uint64_t
+get64(const unsigned char *px)
+{
+    uint64_t x;
+    memcpy(&x, px, 8);
+    return x;
+}
+
+/***************************************************************************
+ * Hash the flow's addresses and ports, the same in both directions.
+ * @return 1 if the packet is TCP or UDP, otherwise 0
+ ***************************************************************************/
+static unsigned
+flow_key(int linktype, const unsigned char *px, unsigned caplen,
+         uint64_t *r_key, unsigned *r_is_syn)
+{
+    unsigned offset = 0;
+    unsigned ethertype;
+    unsigned proto;
+    uint64_t a, b;
+    unsigned port_a, port_b;
+
+    if (linktype == DLT_EN10MB) {
+        if (caplen < 14)
+            return 0;
+        ethertype = px[12] << 8 | px[13];
+        offset = 14;
+        while ((ethertype == 0x8100 || ethertype == 0x88a8)
+               && offset + 4 <= caplen) {
+            ethertype = px[offset + 2] << 8 | px[offset + 3];
+            offset += 4;
+        }
+    } else if (linktype == DLT_RAW) {
+        if (caplen < 1)
+            return 0;
+        ethertype = ((px[0] >> 4) == 6) ? 0x86dd : 0x0800;
+    } else
+        return 0;
+
+    /* Just the addresses, ignoring fragments and IPv6 extension headers,
+     * which are rare enough to keep without counting them */
+    if (ethertype == 0x0800) {
+        if (offset + 20 > caplen || (px[offset] >> 4) != 4)
+            return 0;
+        proto = px[offset + 9];
+        if ((px[offset + 6] & 0x3F) || px[offset + 7])
+            return 0;
+        a = (uint64_t)px[offset + 12] << 24 | (uint64_t)px[offset + 13] << 16
+            | (uint64_t)px[offset + 14] << 8 | px[offset + 15];
+        b = (uint64_t)px[offset + 16] << 24 | (uint64_t)px[offset + 17] << 16
+            | (uint64_t)px[offset + 18] << 8 | px[offset + 19];
+        offset += (px[offset] & 0x0F) * 4;
+    } else if (ethertype == 0x86dd) {
+        if (offset + 40 > caplen || (px[offset] >> 4) != 6)
+            return 0;
+        proto = px[offset + 6];
+        a = flow_mix(get64(px + offset + 8)) ^ get64(px + offset + 16);
+        b = flow_mix(get64(px + offset + 24)) ^ get64(px + offset + 32);
+        offset += 40;
+    } else
+        return 0;
+
+    if (proto != 6 && proto != 17)
+        return 0;
+    if (offset + (proto == 6 ? 14 : 4) > caplen)
+        return 0;
+    port_a = px[offset] << 8 | px[offset + 1];
+    port_b = px[offset + 2] << 8 | px[offset + 3];
+
+    /* The same order in both directions */
+    a = a << 16 | port_a;
+    b = b << 16 | port_b;
+    if (a > b) {
+        uint64_t tmp = a;
+        a = b;
+        b = tmp;
+    }
+    *r_key = flow_mix(a * 0x9e3779b97f4a7c15ULL ^ flow_mix(b) ^ proto);
+    if (*r_key == 0)
+        *r_key = 1;
+
+    /* A SYN without an ACK starts a new connection */
+    *r_is_syn = (proto == 6 && (px[offset + 13] & 0x12) == 0x02);
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+flowtable_admit(struct FlowTable *table, int linktype,
+                const unsigned char *px, unsigned caplen,
+                unsigned len, unsigned now)
+{
+    struct FlowBucket *bucket;
+    struct FlowEntry *victim;
+    uint64_t key;
+    unsigned is_syn;
+    unsigned i;
+
+    if (!flow_key(linktype, px, caplen, &key, &is_syn))
+        return 1;
+
+    bucket = &table->buckets[key & table->mask];
+    victim = &bucket->entries[0];
+    for (i=0; i<FLOW_WAYS; i++) {
+        struct FlowEntry *entry = &bucket->entries[i];
+
+        if (entry->key == key) {
+            /* A new connection with the same addresses and ports as an
+             * old one starts counting again */
+            if ((now > entry->last_seen && now - entry->last_seen > table->timeout)
+                || (is_syn && entry->bytes >= table->cutoff))
+                entry->bytes = 0;
+            entry->last_seen = now;
+            if (entry->bytes >= table->cutoff)
+                return 0;
+            entry->bytes += len;
+            return 1;
+        }
+        if (entry->last_seen < victim->last_seen)
+            victim = entry;
+    }
+
+    /* A new flow takes the slot of the one seen longest ago, which is
+     * either unused, expired, or the least active */
+    if (victim->key && now - victim->last_seen <= table->timeout)
+        table->evictions++;
+    victim->key = key;
+    victim->bytes = len;
+    victim->last_seen = now;
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+uint64_t
+flowtable_capacity(const struct FlowTable *table)
+{
+    return (table->mask + 1) * FLOW_WAYS;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+uint64_t
+flowtable_evictions(const struct FlowTable *table)
+{
+    return table->evictions;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+flowtable_destroy(struct FlowTable *table)
+{
+    if (table == NULL)
+        return;
+    free(table->buckets);
+    free(table);
+}
@@ -0,0 +1,79 @@
+/*
+    Per-flow byte cutoff
+
+ Most of the forensic value of a connection is in its first few
+ kilobytes: the handshakes, the requests, the headers. The rest is
+ usually bulk transfer. So, like the "Time Machine" system, we record
+ only the first N bytes of each TCP or UDP flow, counting both
+ directions, and drop the rest.
+
+ Flows are tracked in a fixed-size table, looked up for every packet,
+ so it's designed to cost a single cache miss at most:
+
+ - Each bucket is one 64-byte cache line, holding 4 flows of 16 bytes.
+   A flow is found by probing only the 4 slots of its bucket.
+ - A flow is identified by a 64-bit hash of its addresses and ports,
+   rather than the addresses themselves, which is what keeps the
+   entries small. Collisions are rare enough not to matter.
+ - There's no timer that scans for old flows. A slot whose flow hasn't
+   been seen for the timeout is simply reused when another flow needs
+   it. When all 4 are busy, the least recently seen is replaced, which
+   means a long flow can be forgotten, and recorded again, when the
+   table is too small for the traffic.
+
+ Packets that aren't TCP or UDP are always kept.
+*/
+#ifndef FLOW_CUTOFF_H
+#define FLOW_CUTOFF_H
+#include <stdint.h>
+
+enum {
+    FLOW_DEFAULT_MEMORY = 64 * 1024 * 1024,
+    FLOW_DEFAULT_TIMEOUT = 300,
+};
+
+struct FlowTable;
+
+/**
+ * @param cutoff
+ *      How many bytes of each flow to record.
+ * @param memory
+ *      The size of the table, rounded down to a power of two number of
+ *      buckets, or zero for the default. Each flow takes 16 bytes.
+ * @param timeout
+ *      Seconds after which an idle flow's slot can be reused, or zero
+ *      for the default.
+ */
+struct FlowTable *flowtable_create(uint64_t cutoff, uint64_t memory,
+                                   unsigned timeout);
+
+/**
+ * Count the packet against its flow.
+ * @param linktype
+ *      The data link, such as DLT_EN10MB. Packets of other link types
+ *      are always kept.
+ * @param len
+ *      The original length of the packet, which is what's counted.
+ * @param now
+ *      The packet's timestamp, in seconds.
+ * @return 1 if the packet should be recorded, or 0 if its flow has
+ * already passed the cutoff.
+ */
+unsigned flowtable_admit(struct FlowTable *table, int linktype,
+                         const unsigned char *px, unsigned caplen,
+                         unsigned len, unsigned now);
+
+/**
+ * The number of flows the table can hold.
+ */
+uint64_t flowtable_capacity(const struct FlowTable *table);
+
+/**
+ * The number of flows that were replaced while still active, which
+ * means the table is too small for the traffic.
+ */
+uint64_t flowtable_evictions(const struct FlowTable *table);
+
+void flowtable_destroy(struct FlowTable *table);
+
+#endif
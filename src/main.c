@@ -1,17 +1,42 @@
 #include "packetdump.h"
+#include "benchmark.h"
+#include "bpf-filter.h"
+#include "codec-zstd.h"
+#include "snap-policy.h"
+#include "flow-cutoff.h"
+#include "packet-batch.h"
+#include "compress-control.h"
+#include "compress-dict.h"
+#include "compress-pool.h"
 #include "config.h"
+#include "file-service.h"
+#include "flight-recorder.h"
 #include "logger.h"
 #include "lz4/lz4.h"
+#include "output-file.h"
+#include "packet-queue.h"
 #include "pixie-threads.h"
 #include "pixie-timer.h"
 #include "rawsock-pcap.h"       /* dynamicly load pcap library */
 #include "rawsock-pcapfile.h"   /* write capture files */
+#include "rawsock-tpacket.h"    /* native linux capture */
 #include "readfiles.h"
+#include "stripe.h"
 #include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#ifndef UNUSEDPARM
+#define UNUSEDPARM(x) x=(x)
+#endif
 
 /*
  * All the globals in this project
@@ -19,14 +44,21 @@
 unsigned control_c_pressed = 0;
 unsigned control_c_pressed_again = 0;
 
+/*
+ * Requests to dump the flight recorder, counted up by SIGUSR1 and by
+ * packets matching the trigger, and counted down as they're handled.
+ */
+volatile unsigned flight_signals = 0;
+volatile unsigned flight_triggers = 0;
+
 /***************************************************************************
  ***************************************************************************/
 static char *
-morph_filename(const struct PacketDump *conf, time_t now, size_t filecount)
+morph_filename(const struct PacketDump *conf, const char *oldfilename,
+               time_t now, size_t filecount)
 {
     struct tm *tm;
     char *newfilename;
-    const char *oldfilename = conf->filename;
     size_t i, j=0;
     
     if (conf->is_gmt) {
@@ -64,6 +96,17 @@ morph_filename(const struct PacketDump *conf, time_t now, size_t filecount)
                 case 'S':
                     j += sprintf(newfilename+j, "%02u", tm->tm_sec);
                     break;
+                case 'N':
+                    /* With -W, the files are numbered around the ring,
+                     * all with the same number of digits */
+                    if (conf->rotate_filecount) {
+                        int width = sprintf(newfilename+j, "%llu",
+                                    (unsigned long long)conf->rotate_filecount - 1);
+                        j += sprintf(newfilename+j, "%0*llu", width,
+                                    (unsigned long long)(filecount % conf->rotate_filecount));
+                    } else
+                        j += sprintf(newfilename+j, "%llu", (unsigned long long)filecount);
+                    break;
                 default:
                     newfilename[j++] = (char)code;
             }
@@ -76,6 +119,33 @@ morph_filename(const struct PacketDump *conf, time_t now, size_t filecount)
     return newfilename;
 }
 
+/***************************************************************************
+ * When there are multiple capture threads, each writes its own files, so
+ * we need a different filename spec for each one. We do this by adding
+ * the thread number to the name, before the first '.' of the extension,
+ * so that "foo-%H.pcap.lz4" becomes "foo-%H-1.pcap.lz4".
+ ***************************************************************************/
+static char *
+thread_filename(const char *filename, unsigned index)
+{
+    const char *basename;
+    char *newfilename;
+    size_t i;
+    
+    basename = strrchr(filename, '/');
+    if (basename == NULL)
+        basename = filename;
+    if (strchr(basename, '.'))
+        i = strchr(basename, '.') - filename;
+    else
+        i = strlen(filename);
+    
+    newfilename = malloc(strlen(filename) + 16);
+    memcpy(newfilename, filename, i);
+    sprintf(newfilename + i, "-%u%s", index, filename + i);
+    return newfilename;
+}
+
 /***************************************************************************
  ***************************************************************************/
 static time_t
@@ -101,6 +171,14 @@ struct WriteContext
      */
     const struct PacketDump *conf;
     
+    /**
+     * The filename spec (with the date/time specifiers) that this context
+     * writes to. This is the configured filename, unless there are
+     * multiple capture threads, in which case it has the thread number
+     * added to it.
+     */
+    const char *filename_spec;
+    
     /**
      * Handle to the file where we are writing packets. This changes while we
      * write packets whenever we need to rotate the file to a new one
@@ -128,11 +206,311 @@ struct WriteContext
      */
     int data_link;
     
+    /**
+     * Options for opening each new file, such as the compression
+     * block size
+     */
+    struct PcapFileOptions file_options;
+    int compression_type;
+    
+    /**
+     * The directories that files are spread across, each with a thread
+     * that the old file is handed to when we rotate, to be closed, and
+     * that opens the next file ahead of time, so that we don't stall
+     * waiting for either. If NULL, files are opened and closed in
+     * this thread.
+     */
+    struct Stripe *stripe;
+    
+    /**
+     * The directory of the current file
+     */
+    unsigned root;
+    
+    /**
+     * The next file, opened ahead of time by the service thread, and
+     * its directory.
+     */
+    struct FileOpenRequest next[1];
+    unsigned next_root;
+    
+    /**
+     * Set when the next file can't be opened ahead of time, because it
+     * would have the same name as the current one.
+     */
+    unsigned is_next_refused:1;
+    
+    /**
+     * The name of the last file handed to the service thread to close,
+     * which it may still be writing the end of.
+     */
+    char *closing_filename;
+    
+    /**
+     * With -W, the names of the files we've written that are still
+     * around, oldest first, including the current one.
+     */
+    char **retained;
+    size_t retained_count;
+    
+    /**
+     * In flight-recorder mode, packets go here instead of to files, and
+     * those that match the trigger make it get dumped.
+     */
+    struct FlightRecorder *recorder;
+    const struct BpfProgram *trigger;
+    
     size_t file_bytes_written;
     size_t file_packets_written;
+    size_t total_packets_written;
     
+    /**
+     * Set when writing fails, so that callbacks can tell the capture
+     * loop to stop.
+     */
+    unsigned is_failed:1;
 };
 
+/***************************************************************************
+ * The source of packets, which is either libpcap, or our own native
+ * TPACKET_V3 ring on Linux.
+ ***************************************************************************/
+struct Sniffer
+{
+    const char *ifname;
+    pcap_t *pcap;
+    struct TPacket *tpacket;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static int
+sniffer_stats(struct Sniffer *sniffer, struct pcap_stat *stats)
+{
+    if (sniffer->tpacket)
+        return tpacket_stats(sniffer->tpacket, stats);
+    else
+        return PCAP.stats(sniffer->pcap, stats);
+}
+
+/***************************************************************************
+ * With -W, remember a file that we've opened, so that it can be removed
+ * once there are too many.
+ ***************************************************************************/
+static void
+retain_file(struct WriteContext *ctx, const char *filename)
+{
+    size_t maxfiles = (size_t)ctx->conf->rotate_filecount;
+    
+    if (maxfiles == 0)
+        return;
+    if (ctx->retained == NULL) {
+        ctx->retained = calloc(maxfiles, sizeof(ctx->retained[0]));
+        if (ctx->retained == NULL)
+            exit(1);
+    }
+    if (ctx->retained_count >= maxfiles) {
+        /* Can't happen, since we always retire one first */
+        free(ctx->retained[0]);
+        memmove(&ctx->retained[0], &ctx->retained[1],
+                (ctx->retained_count - 1) * sizeof(ctx->retained[0]));
+        ctx->retained_count--;
+    }
+    ctx->retained[ctx->retained_count++] = strdup(filename);
+}
+
+/***************************************************************************
+ * With -W, make room for a new file. If the new file has the same name
+ * as one of ours, such as when "%N" wraps around, that's the one that
+ * goes, since it'd be overwritten anyway. Otherwise, once we have the
+ * maximum number of files, it's the oldest.
+ *
+ * With --preallocate, rather than deleting the file, it's returned so
+ * that it can be renamed and overwritten, reusing its disk space.
+ *
+ * @return a malloced filename to recycle, or NULL
+ ***************************************************************************/
+static char *
+retire_file(struct WriteContext *ctx, const char *newfilename, unsigned root)
+{
+    size_t maxfiles = (size_t)ctx->conf->rotate_filecount;
+    char *oldfilename;
+    unsigned oldroot = 0;
+    size_t i;
+    
+    if (maxfiles == 0)
+        return NULL;
+    
+    for (i=0; i<ctx->retained_count; i++) {
+        if (strcmp(ctx->retained[i], newfilename) == 0)
+            break;
+    }
+    if (i == ctx->retained_count) {
+        if (ctx->retained_count < maxfiles)
+            return NULL;
+        i = 0;
+    }
+    
+    oldfilename = ctx->retained[i];
+    memmove(&ctx->retained[i], &ctx->retained[i+1],
+            (ctx->retained_count - i - 1) * sizeof(ctx->retained[0]));
+    ctx->retained_count--;
+    
+    /* A file can only be recycled by the thread that closed it, so
+     * it must be in the same directory */
+    if (ctx->stripe)
+        oldroot = stripe_find(ctx->stripe, oldfilename);
+    if (ctx->conf->is_preallocate && oldroot == root)
+        return oldfilename;
+    
+    if (strcmp(oldfilename, newfilename) == 0)
+        free(oldfilename);
+    else if (ctx->stripe)
+        fileservice_remove(stripe_service(ctx->stripe, oldroot), oldfilename);
+    else {
+        remove(oldfilename);
+        free(oldfilename);
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ * Open a new file in this thread. When recycling an old file, or opening
+ * one with the same name as the file we just rotated out, it may still be
+ * being closed by the service thread, so then the file is opened by that
+ * thread, which will do it after the close.
+ ***************************************************************************/
+static struct PcapFile *
+open_file(struct WriteContext *ctx, char *filename, unsigned root,
+          const char *recycle)
+{
+    struct PcapFileOptions options = ctx->file_options;
+    
+    options.output.recycle = recycle;
+    if (ctx->stripe)
+        options.output.counters = stripe_counters(ctx->stripe, root);
+    
+    if (ctx->stripe
+        && (recycle || (ctx->closing_filename
+                        && strcmp(filename, ctx->closing_filename) == 0))) {
+        struct FileOpenRequest request[1];
+        
+        memset(request, 0, sizeof(request[0]));
+        request->filename = filename;
+        request->linktype = ctx->data_link;
+        request->compression_type = ctx->compression_type;
+        request->options = options;
+        fileservice_open(stripe_service(ctx->stripe, root), request);
+        return fileservice_wait(request);
+    }
+    
+    return pcapfile_openwrite_ex(filename, ctx->data_link,
+                                 ctx->compression_type, &options);
+}
+
+/***************************************************************************
+ * Hand the next file, whose name has been chosen, to the service thread
+ * of its root to open.
+ ***************************************************************************/
+static void
+submit_next_file(struct WriteContext *ctx)
+{
+    const struct PacketDump *conf = ctx->conf;
+    struct FileOpenRequest *next = ctx->next;
+    
+    next->linktype = ctx->data_link;
+    next->compression_type = ctx->compression_type;
+    next->options = ctx->file_options;
+    next->options.output.counters = stripe_counters(ctx->stripe,
+                                                    ctx->next_root);
+    
+    /* A file to be recycled must be chosen now. Otherwise, the oldest
+     * file is only removed once we switch to the new one, in case the
+     * new one doesn't get used. */
+    if (conf->is_preallocate)
+        next->options.output.recycle = retire_file(ctx, next->filename,
+                                                   ctx->next_root);
+    fileservice_open(stripe_service(ctx->stripe, ctx->next_root), next);
+}
+
+/***************************************************************************
+ * When the current file is getting close to rotating, either because of
+ * its size or the time, ask the service thread to open the next file.
+ * For time-based rotation, the new file is named for the time it starts,
+ * otherwise for the time it was opened.
+ ***************************************************************************/
+static void
+prepare_next_file(struct WriteContext *ctx, time_t now)
+{
+    const struct PacketDump *conf = ctx->conf;
+    struct FileOpenRequest *next = ctx->next;
+    time_t next_time;
+    char *filename;
+    
+    if (ctx->stripe == NULL || next->is_pending || ctx->is_next_refused)
+        return;
+    
+    /* With only one file, the one to remove is the current one */
+    if (conf->rotate_filecount == 1)
+        return;
+    
+    if (conf->rotate_size
+        && ctx->file_bytes_written >= conf->rotate_size - conf->rotate_size/8)
+        next_time = now;
+    else if (conf->rotate_seconds && now + 2 >= ctx->rotate_time)
+        next_time = ctx->rotate_time;
+    else
+        return;
+    
+    filename = morph_filename(conf, ctx->filename_spec,
+                              next_time, ctx->total_file_count);
+    ctx->next_root = stripe_choose(ctx->stripe);
+    free(next->filename);
+    next->filename = stripe_filename(ctx->stripe, ctx->next_root, filename);
+    free(filename);
+    
+    /* Opening it now would overwrite the file we are still writing, so
+     * it's left until that file has been handed over to be closed */
+    if (strcmp(next->filename, ctx->filename) == 0) {
+        ctx->is_next_refused = 1;
+        return;
+    }
+    
+    submit_next_file(ctx);
+}
+
+/***************************************************************************
+ * Close the current file, plus the next file if it was already opened,
+ * in which case it's deleted, since it's empty.
+ ***************************************************************************/
+static void
+writecontext_close(struct WriteContext *ctx)
+{
+    struct PcapFile *next_fp;
+    
+    if (ctx->fp)
+        pcapfile_close(ctx->fp);
+    ctx->fp = NULL;
+    
+    next_fp = fileservice_wait(ctx->next);
+    if (next_fp) {
+        pcapfile_close(next_fp);
+        remove(ctx->next->filename);
+    }
+    free(ctx->next->filename);
+    ctx->next->filename = NULL;
+    free((char *)ctx->next->options.output.recycle);
+    ctx->next->options.output.recycle = NULL;
+    
+    free(ctx->closing_filename);
+    ctx->closing_filename = NULL;
+    
+    while (ctx->retained_count)
+        free(ctx->retained[--ctx->retained_count]);
+    free(ctx->retained);
+    ctx->retained = NULL;
+}
+
 /***************************************************************************
  * Write a single packet to the output file.
  *
@@ -147,23 +525,62 @@ handle_packet(struct WriteContext *ctx, const struct pcap_pkthdr *hdr, const voi
     const struct PacketDump *conf = ctx->conf;
     ssize_t bytes_written;
     
+    if (ctx->recorder) {
+        flightrec_write(ctx->recorder, hdr, buf);
+        if (ctx->trigger
+            && bpf_filter(ctx->trigger, buf, hdr->len, hdr->caplen))
+            flight_triggers = 1;
+        ctx->total_packets_written++;
+        return 0;
+    }
+    
     /*
      * open the output file
      */
 again:
     if (ctx->fp == NULL) {
         
-        /* Create a new filename based on timestamp and filecount information */
-        ctx->filename = morph_filename(conf, hdr->ts.tv_sec, ctx->total_file_count);
-        LOG(0, "%s: opening new file\n", ctx->filename);
+        /* The next file has the same name as the one just closed, so
+         * it's opened now, after the close, by the same service thread */
+        if (ctx->is_next_refused)
+            submit_next_file(ctx);
         
-        /* Open the file */
-        ctx->fp = pcapfile_openwrite(ctx->filename, ctx->data_link, PCAPFILE_LZ4);
+        /* Use the file that was opened ahead of time, if there is one */
+        ctx->fp = fileservice_wait(ctx->next);
+        free((char *)ctx->next->options.output.recycle);
+        ctx->next->options.output.recycle = NULL;
+        if (ctx->fp) {
+            ctx->filename = ctx->next->filename;
+            ctx->next->filename = NULL;
+            ctx->root = ctx->next_root;
+            LOG(0, "%s: opening new file\n", ctx->filename);
+            free(retire_file(ctx, ctx->filename, ctx->root));
+        } else {
+            char *recycle;
+            
+            /* Create a new filename based on timestamp and filecount information */
+            ctx->filename = morph_filename(conf, ctx->filename_spec,
+                                           hdr->ts.tv_sec, ctx->total_file_count);
+            if (ctx->stripe) {
+                char *filename = ctx->filename;
+                ctx->root = stripe_choose(ctx->stripe);
+                ctx->filename = stripe_filename(ctx->stripe, ctx->root, filename);
+                free(filename);
+            }
+            LOG(0, "%s: opening new file\n", ctx->filename);
+            
+            /* Open the file */
+            recycle = retire_file(ctx, ctx->filename, ctx->root);
+            ctx->fp = open_file(ctx, ctx->filename, ctx->root, recycle);
+            free(recycle);
+        }
+        ctx->is_next_refused = 0;
         if (ctx->fp == NULL) {
             /* This is bad. I don't know how to recover at this point */
             fprintf(stderr, "%s: couldn't open file\n", ctx->filename);
             return -1;
         }
+        retain_file(ctx, ctx->filename);
         
         /* Calculate the timestamp when the file should next be rotated.
          * Note that his is aligned, so that if "hourly" rotation is desired,
@@ -186,9 +603,19 @@ again:
             ctx->total_file_count,
             ctx->file_bytes_written,
             ctx->file_packets_written);
-        pcapfile_close(ctx->fp);
+        if (ctx->stripe) {
+            /* The service thread may not close it until after the
+             * packets we're pointing to are gone */
+            pcapfile_release_buffers(ctx->fp);
+            free(ctx->closing_filename);
+            ctx->closing_filename = strdup(ctx->filename);
+            fileservice_close(stripe_service(ctx->stripe, ctx->root),
+                              ctx->fp, ctx->filename);
+        } else {
+            pcapfile_close(ctx->fp);
+            free(ctx->filename);
+        }
         ctx->fp = NULL;
-        free(ctx->filename);
         ctx->filename = NULL;
         goto again;
     }
@@ -211,32 +638,415 @@ again:
     
     ctx->file_bytes_written += bytes_written;
     ctx->file_packets_written++;
+    ctx->total_packets_written++;
+    
+    prepare_next_file(ctx, hdr->ts.tv_sec);
+
+    return 0;
+}
+
+/***************************************************************************
+ * Write a batch of packets, doing most of the checks that 'handle_packet()'
+ * does for every packet just once for the whole batch.
+ ***************************************************************************/
+static int
+handle_batch(struct WriteContext *ctx, const struct PacketBatch *batch)
+{
+    const struct PacketDump *conf = ctx->conf;
+    const struct pcap_pkthdr *last;
+    struct PcapFrame frames[PACKET_BATCH_MAX];
+    size_t file_size = ctx->file_bytes_written;
+    ssize_t bytes_written;
+    unsigned i;
+
+    if (batch->count == 0)
+        return 0;
+    last = &batch->hdrs[batch->count - 1];
+
+    /* Opening or rotating a file happens between two packets, so those
+     * batches, and the flight recorder's, go a packet at a time */
+    if (ctx->recorder || ctx->fp == NULL
+        || (conf->rotate_size && ctx->file_bytes_written >= conf->rotate_size)
+        || (ctx->rotate_time && last->ts.tv_sec >= ctx->rotate_time)) {
+        for (i=0; i<batch->count; i++) {
+            if (handle_packet(ctx, &batch->hdrs[i], batch->packets[i]) < 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    for (i=0; i<batch->count; i++) {
+        const struct pcap_pkthdr *hdr = &batch->hdrs[i];
+
+        /* Without compression, we know where the file fills up. With
+         * it, the file may grow past the size by up to one batch */
+        if (conf->rotate_size && file_size >= conf->rotate_size)
+            break;
+        if (ctx->compression_type == PCAPFILE_NO_COMPRESSION)
+            file_size += 16 + hdr->caplen;
+
+        frames[i].time_sec = (uint32_t)hdr->ts.tv_sec;
+        frames[i].time_usec = (uint32_t)hdr->ts.tv_usec;
+        frames[i].buffer_size = hdr->caplen;
+        frames[i].original_length = hdr->len;
+        frames[i].buffer = batch->packets[i];
+    }
+
+    bytes_written = pcapfile_writeframes(ctx->fp, frames, i);
+    if (bytes_written < 0) {
+        fprintf(stderr, "packet write failure\n");
+        return -1;
+    }
+
+    ctx->file_bytes_written += bytes_written;
+    ctx->file_packets_written += i;
+    ctx->total_packets_written += i;
+
+    /* The file filled up part way through */
+    if (i < batch->count) {
+        for (; i<batch->count; i++) {
+            if (handle_packet(ctx, &batch->hdrs[i], batch->packets[i]) < 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    prepare_next_file(ctx, last->ts.tv_sec);
 
     return 0;
 }
 
+/***************************************************************************
+ * Each capture thread has its own socket and its own output files, so
+ * that the threads never have to share anything.
+ ***************************************************************************/
+struct CaptureThread
+{
+    const struct PacketDump *conf;
+    unsigned index;
+    
+    /**
+     * The CPU this thread is pinned to, or -1 if not pinned
+     */
+    int cpu;
+    
+    struct Sniffer sniffer[1];
+    struct WriteContext ctx[1];
+    size_t thread_handle;
+    
+    /**
+     * If configured, packets are handed through this queue to a
+     * separate writer thread, so that compression and disk writes
+     * don't stall the capture.
+     */
+    struct PacketQueue *queue;
+    size_t writer_handle;
+
+    /**
+     * Packets read from the sniffer, waiting to be handed on together
+     */
+    struct PacketBatch *batch;
+
+    /**
+     * If configured, how much of each packet to keep, and how many
+     * bytes that's saved us from writing.
+     */
+    const struct SnapPolicy *snap;
+    uint64_t snap_bytes_cut;
+
+    /**
+     * If configured, the flows this thread has seen, so that only the
+     * first --flow-cutoff bytes of each are written, and how many
+     * packets past that we've dropped.
+     */
+    struct FlowTable *flows;
+    uint64_t flow_packets_cut;
+};
+
+/***************************************************************************
+ * The set of all capture threads, shared with the statistics thread
+ ***************************************************************************/
+struct Capture
+{
+    const struct PacketDump *conf;
+    unsigned thread_count;
+    struct CaptureThread *threads;
+    
+    /** Workers shared by all the output files, or NULL */
+    struct CompressPool *pool;
+    
+    /** The --compress-dict dictionary, or NULL */
+    const struct CompressDict *dict;
+    
+    /** The output directories, each with a thread that opens and closes
+     * rotated files in the background */
+    struct Stripe *stripe;
+    
+    /** In flight-recorder mode, the packet that triggers a dump, and the
+     * socket where dumps can be requested */
+    struct BpfProgram *trigger;
+    int control_fd;
+
+    /** From --bpf or --bpf-file, compiled once and attached to every
+     * thread's sniffer */
+    struct BpfProgram *filter;
+
+    /** From --snap-keep and --snap-payload, shared by every thread */
+    struct SnapPolicy *snap;
+    size_t flight_handle;
+};
+
+/***************************************************************************
+ * Hand a batch of captured packets to the writer, either directly, or
+ * through the queue to the writer thread. Packets may be dropped from
+ * the batch, or shortened, on the way.
+ ***************************************************************************/
+static int
+capture_batch(struct CaptureThread *thread, struct PacketBatch *batch)
+{
+    unsigned count = 0;
+    unsigned i;
+
+    for (i=0; i<batch->count; i++) {
+        struct pcap_pkthdr *hdr = &batch->hdrs[i];
+        const unsigned char *buf = batch->packets[i];
+
+        /* Drop the rest of a flow once we've recorded its start */
+        if (thread->flows
+            && !flowtable_admit(thread->flows, thread->ctx->data_link,
+                                buf, hdr->caplen, hdr->len,
+                                (unsigned)hdr->ts.tv_sec)) {
+            thread->flow_packets_cut++;
+            continue;
+        }
+
+        /* Cut the packet short before it's copied or compressed,
+         * keeping its original length */
+        if (thread->snap) {
+            unsigned caplen = snappolicy_caplen(thread->snap,
+                                                thread->ctx->data_link,
+                                                buf, hdr->caplen);
+            if (caplen < hdr->caplen) {
+                thread->snap_bytes_cut += hdr->caplen - caplen;
+                hdr->caplen = caplen;
+            }
+        }
+
+        if (count != i) {
+            batch->hdrs[count] = *hdr;
+            batch->packets[count] = buf;
+        }
+        count++;
+    }
+    batch->count = count;
+
+    if (thread->queue) {
+        for (i=0; i<count; i++)
+            packetqueue_push(thread->queue, &batch->hdrs[i], batch->packets[i]);
+        return thread->ctx->is_failed ? -1 : 0;
+    } else
+        return handle_batch(thread->ctx, batch);
+}
+
+/***************************************************************************
+ * Hand on whatever packets have been gathered so far.
+ ***************************************************************************/
+static void
+capture_flush(struct CaptureThread *thread)
+{
+    struct PacketBatch *batch = thread->batch;
+
+    if (batch->count && !thread->ctx->is_failed
+        && capture_batch(thread, batch) < 0)
+        thread->ctx->is_failed = 1;
+    packetbatch_clear(batch);
+}
+
+/***************************************************************************
+ * Called by whichever thread is writing packets when no packets have
+ * arrived for a while, so that data doesn't sit unwritten in the
+ * compression block.
+ ***************************************************************************/
+static void
+handle_idle(struct WriteContext *ctx)
+{
+    ssize_t bytes_written;
+    
+    if (ctx->recorder)
+        flightrec_idle(ctx->recorder);
+    if (ctx->fp == NULL)
+        return;
+    bytes_written = pcapfile_flush_stale(ctx->fp);
+    if (bytes_written > 0)
+        ctx->file_bytes_written += bytes_written;
+}
+
+/***************************************************************************
+ * Called by the capture backend for each packet, which is added to the
+ * batch, handing on the batch first if it's full.
+ ***************************************************************************/
+static void
+handle_packet_callback(unsigned char *userdata,
+                       const struct pcap_pkthdr *hdr,
+                       const unsigned char *buf)
+{
+    struct CaptureThread *thread = (struct CaptureThread *)userdata;
+    
+    if (thread->ctx->is_failed)
+        return;
+    if (packetbatch_add(thread->batch, hdr, buf))
+        return;
+    capture_flush(thread);
+    packetbatch_add(thread->batch, hdr, buf);
+}
+
+/***************************************************************************
+ * Called by the capture backend when it's about to reuse the memory of
+ * the packets it's given us.
+ ***************************************************************************/
+static void
+handle_release_callback(unsigned char *userdata)
+{
+    struct CaptureThread *thread = (struct CaptureThread *)userdata;
+    
+    capture_flush(thread);
+    
+    /* With a queue, the packets have been copied into it, and the file
+     * belongs to the writer thread */
+    if (thread->queue)
+        return;
+    if (thread->ctx->fp && pcapfile_release_buffers(thread->ctx->fp) < 0)
+        thread->ctx->is_failed = 1;
+}
+
+/***************************************************************************
+ * Pulls packets from the queue and writes them, so that the capture
+ * thread doesn't have to wait on compression or the disk.
+ ***************************************************************************/
+void
+writer_thread(void *userdata)
+{
+    struct CaptureThread *thread = (struct CaptureThread *)userdata;
+    struct WriteContext *ctx = thread->ctx;
+    struct PacketQueue *queue = thread->queue;
+    struct PacketBatch *batch;
+    
+    batch = packetbatch_create(thread->batch->max, 0);
+    for (;;) {
+        unsigned count;
+        
+        count = packetqueue_peek_batch(queue, batch);
+        if (count == 0) {
+            /* Once the capture thread is done, drain whatever is left */
+            if (packetqueue_is_closed(queue)
+                && packetqueue_peek_batch(queue, batch) == 0)
+                break;
+            handle_idle(ctx);
+            pixie_usleep(100);
+            continue;
+        }
+        
+        if (handle_batch(ctx, batch) < 0) {
+            ctx->is_failed = 1;
+            packetqueue_close(queue);
+            break;
+        }
+        packetqueue_pop_batch(queue, count);
+    }
+    packetbatch_destroy(batch);
+}
+
 /***************************************************************************
  ***************************************************************************/
 void statistics_thread(void *userdata)
 {
+    struct Capture *capture = (struct Capture *)userdata;
     unsigned long long total_packets = 0;
     unsigned long long total_drops = 0;
+    unsigned long long queue_drops = 0;
+    unsigned queue_depth = 0;
+    unsigned queue_high_water = 0;
+    int level_min = 0;
+    int level_max = 0;
+    unsigned long long level_changes = 0;
     
     while (!control_c_pressed) {
-        struct pcap_stat stats = {0};
         size_t bytes_printed;
         size_t i;
         
         pixie_usleep(100000 );
         
-        PCAP.stats(userdata, &stats);
-        
-        total_packets = stats.ps_recv;
-        total_drops = stats.ps_drop + stats.ps_ifdrop;
+        /* Add up the counters from all the threads */
+        total_packets = 0;
+        total_drops = 0;
+        queue_depth = 0;
+        queue_high_water = 0;
+        queue_drops = 0;
+        level_changes = 0;
+        for (i=0; i<capture->thread_count; i++) {
+            struct CaptureThread *thread = &capture->threads[i];
+            struct CompressControl *control = thread->ctx->file_options.control;
+            struct pcap_stat stats = {0};
+            
+            sniffer_stats(thread->sniffer, &stats);
+            total_packets += stats.ps_recv;
+            total_drops += stats.ps_drop + stats.ps_ifdrop;
+            
+            if (thread->queue) {
+                struct PacketQueueStats qstats;
+                packetqueue_stats(thread->queue, &qstats);
+                queue_depth += qstats.depth;
+                if (queue_high_water < qstats.high_water_depth)
+                    queue_high_water = qstats.high_water_depth;
+                queue_drops += qstats.packets_dropped;
+                
+                /* The queue is full when either the packets or the
+                 * memory for them runs out */
+                if (control) {
+                    unsigned permille = 0;
+                    if (qstats.max_depth)
+                        permille = (unsigned)(qstats.depth * 1000ULL / qstats.max_depth);
+                    if (qstats.max_bytes
+                        && permille < qstats.bytes * 1000 / qstats.max_bytes)
+                        permille = (unsigned)(qstats.bytes * 1000 / qstats.max_bytes);
+                    compresscontrol_queue(control, permille);
+                }
+            }
+            
+            if (control) {
+                int level = compresscontrol_level(control);
+                if (i == 0 || level_min > level)
+                    level_min = level;
+                if (i == 0 || level_max < level)
+                    level_max = level;
+                level_changes += compresscontrol_changes(control);
+            }
+        }
         
-        bytes_printed = fprintf(stderr, "packets=%llu, drops=%llu                 ",
+        bytes_printed = fprintf(stderr, "packets=%llu, drops=%llu",
                                 total_packets,
                                 total_drops);
+        if (capture->threads[0].queue)
+            bytes_printed += fprintf(stderr, ", queued=%u, hwm=%u, qdrops=%llu",
+                                queue_depth,
+                                queue_high_water,
+                                queue_drops);
+        if (capture->threads[0].ctx->file_options.control) {
+            if (level_min <= COMPRESS_LEVEL_STORE)
+                bytes_printed += fprintf(stderr, ", level=store");
+            else
+                bytes_printed += fprintf(stderr, ", level=%d", level_min);
+            if (level_max != level_min)
+                bytes_printed += fprintf(stderr, "..%d", level_max);
+            bytes_printed += fprintf(stderr, " (%llu changes)", level_changes);
+        }
+        if (capture->conf->write_behind) {
+            struct OutputStats ostats;
+            outfile_stats(&ostats);
+            bytes_printed += fprintf(stderr, ", writeback=%lluMB",
+                                (unsigned long long)(ostats.bytes_in_flight >> 20));
+        }
+        bytes_printed += fprintf(stderr, "                 ");
         for (i=0; i<bytes_printed; i++) {
             fprintf(stderr, "\b");
         }
@@ -245,78 +1055,520 @@ void statistics_thread(void *userdata)
 }
 
 /***************************************************************************
+ * In flight-recorder mode, waits for a request to dump what's been
+ * recorded, then writes a file for each capture thread, named from the
+ * '-w' filename. A trigger packet is ignored if it comes too soon after
+ * the last dump, since that dump would already have covered most of the
+ * same time.
  ***************************************************************************/
-void
-capture_thread(const struct PacketDump *conf)
+static void
+flight_thread(void *userdata)
 {
-    pcap_t *p;
-    char errbuf[PCAP_ERRBUF_SIZE];
-    size_t total_packets_written = 0;
-    struct WriteContext ctx[1] = {0};
-    size_t t;
+    struct Capture *capture = (struct Capture *)userdata;
+    const struct PacketDump *conf = capture->conf;
+    unsigned signals_handled = 0;
+    size_t dump_count = 0;
+    time_t last_dump = 0;
+    time_t holdoff = (time_t)conf->flight_seconds;
+    
+    /* When dumping everything, there's no natural interval */
+    if (holdoff == 0)
+        holdoff = 10;
+    
+    while (!control_c_pressed) {
+        unsigned seconds = (unsigned)conf->flight_seconds;
+        int client = -1;
+        time_t now;
+        size_t i;
+        
+        pixie_usleep(10000);
+        now = time(0);
+        
+        if (capture->control_fd >= 0)
+            client = flightrec_accept(capture->control_fd, &seconds);
+        if (client < 0 && signals_handled == flight_signals) {
+            if (!flight_triggers)
+                continue;
+            flight_triggers = 0;
+            if (now < last_dump + holdoff)
+                continue;
+            LOG(0, "flight-recorder: triggered\n");
+        }
+        signals_handled = flight_signals;
+        last_dump = now;
+        
+        for (i=0; i<capture->thread_count; i++) {
+            struct WriteContext *ctx = capture->threads[i].ctx;
+            char *filename;
+            int x;
+            
+            filename = morph_filename(conf, ctx->filename_spec,
+                                      now, dump_count);
+            x = flightrec_dump(ctx->recorder, filename, ctx->data_link,
+                               seconds, &ctx->file_options);
+            if (x == 0)
+                LOG(0, "%s: flight recorder dumped\n", filename);
+            if (client >= 0) {
+                char reply[1024];
+                snprintf(reply, sizeof(reply), "%s %s\n",
+                         (x == 0) ? "OK" : "ERROR", filename);
+                flightrec_reply(client, reply);
+            }
+            free(filename);
+        }
+        dump_count++;
+        if (client >= 0)
+            flightrec_hangup(client);
+    }
+}
 
-    /*
-     * open the network adapter
-     */
-    p = PCAP.open_live(
+/***************************************************************************
+ * Open the network adapter, either with our own native ring or
+ * with libpcap.
+ * @return 0 on success, -1 on failure
+ ***************************************************************************/
+static int
+sniffer_open(struct Sniffer *sniffer, const struct PacketDump *conf,
+             unsigned thread_count, int *r_data_link)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    
+    sniffer->ifname = conf->ifname;
+    if (conf->is_tpacket || thread_count > 1
+        || strncmp(conf->ifname, "tpacket:", 8) == 0) {
+        sniffer->tpacket = tpacket_open(
+                       conf->ifname,
+                       65536,   /* snap length */
+                       1,       /* promiscuous mode */
+                       (unsigned)conf->ring_block_size,
+                       (unsigned)conf->ring_block_count,
+                       (unsigned)conf->ring_block_timeout,
+                       errbuf);
+        if (sniffer->tpacket == NULL) {
+            fprintf(stderr, "%s\n", errbuf);
+            return -1;
+        }
+        
+        /* Join all the threads' sockets into one group, using our
+         * process id as the group id, so multiple instances of this
+         * program don't collide */
+        if (thread_count > 1) {
+            int x;
+            x = tpacket_set_fanout(sniffer->tpacket,
+                                   (unsigned)getpid(),
+                                   conf->fanout_mode,
+                                   errbuf);
+            if (x < 0) {
+                fprintf(stderr, "%s\n", errbuf);
+                return -1;
+            }
+        }
+        *r_data_link = tpacket_datalink(sniffer->tpacket);
+    } else {
+        sniffer->pcap = PCAP.open_live(
                        conf->ifname, /* network adapter to sniff from*/
                        65536,   /* snap length */
                        1,       /* promiscuous mode */
                        10,      /* read timeout in milliseconds */
                        errbuf   /* error buffer */
                        );
-    if (p == NULL) {
-        fprintf(stderr, "%s: %s\n", conf->ifname, errbuf);
-        return;
-    } else {
+        if (sniffer->pcap == NULL) {
+            fprintf(stderr, "%s: %s\n", conf->ifname, errbuf);
+            return -1;
+        }
         //fprintf(stderr, "%s: buffsize = %d\n", conf->ifname, PCAP.bufsize(p));
-        fprintf(stderr, "%s: capture started\n", conf->ifname);
+        *r_data_link = PCAP.datalink(sniffer->pcap);
     }
-    
-    /*
-     * Start a statistics thread
-     */
-    t = pixie_begin_thread(statistics_thread, 0, p);
-    
-    /*
-     * Setup the context
-     */
-    ctx->conf = conf;
-    ctx->data_link = PCAP.datalink(p);
-    
+    return 0;
+}
+
+/***************************************************************************
+ * Have the kernel (or libpcap) drop the packets we don't want, before
+ * they cost us a copy.
+ * @return 0 on success, -1 on failure
+ ***************************************************************************/
+static int
+sniffer_set_filter(struct Sniffer *sniffer, const struct BpfProgram *filter)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+
+    if (sniffer->tpacket) {
+        if (tpacket_set_filter(sniffer->tpacket, filter, errbuf) < 0) {
+            fprintf(stderr, "%s\n", errbuf);
+            return -1;
+        }
+    } else {
+        struct bpf_program code;
+
+        /* Our instructions have the same layout as libpcap's */
+        code.bf_len = filter->count;
+        code.bf_insns = (struct bpf_insn *)filter->insns;
+        if (PCAP.setfilter(sniffer->pcap, &code) != 0) {
+            fprintf(stderr, "%s: %s\n", sniffer->ifname,
+                    PCAP.geterr(sniffer->pcap));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+sniffer_close(struct Sniffer *sniffer)
+{
+    if (sniffer->pcap)
+        PCAP.close(sniffer->pcap);
+    if (sniffer->tpacket)
+        tpacket_close(sniffer->tpacket);
+    sniffer->pcap = NULL;
+    sniffer->tpacket = NULL;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+capture_thread(void *userdata)
+{
+    struct CaptureThread *thread = (struct CaptureThread *)userdata;
+    const struct PacketDump *conf = thread->conf;
+    struct Sniffer *sniffer = thread->sniffer;
+    struct WriteContext *ctx = thread->ctx;
+
+    if (thread->cpu >= 0)
+        pixie_cpu_set_affinity((unsigned)thread->cpu);
+
     /*
      * now loop reading packets
      */
-    while (!control_c_pressed) {
-        struct pcap_pkthdr *hdr;
-        const unsigned char *buf;
+    while (sniffer->tpacket && !control_c_pressed && !ctx->is_failed) {
         int x;
         
         /*
-         * Read the next packet
+         * Read the next block of packets
          */
-        x = PCAP.next_ex(p, &hdr, &buf);
-        if (x == 0)
-            continue; /* timeout expired */
-        else if (x < 0) {
-            PCAP.perror(p, conf->ifname);
+        x = tpacket_dispatch(sniffer->tpacket, 100,
+                             handle_packet_callback,
+                             handle_release_callback,
+                             (unsigned char *)thread);
+        if (x < 0) {
+            perror(conf->ifname);
+            break;
+        } else if (x == 0 && thread->queue == NULL)
+            handle_idle(ctx);
+    }
+    while (sniffer->pcap && !control_c_pressed && !ctx->is_failed) {
+        int x;
+        
+        /*
+         * Read the next batch of packets, which libpcap may overwrite
+         * once it returns, so the batch has copies
+         */
+        x = PCAP.dispatch(sniffer->pcap, (int)thread->batch->max,
+                          handle_packet_callback,
+                          (unsigned char *)thread);
+        if (x < 0) {
+            PCAP.perror(sniffer->pcap, conf->ifname);
             break;
         }
+        capture_flush(thread);
+        if (x == 0 && thread->queue == NULL)
+            handle_idle(ctx);
+    }
+    
+    /* If this thread stops because of an error, then stop everything */
+    control_c_pressed = 1;
+    
+    /* Let the writer thread finish writing what's in the queue */
+    if (thread->queue) {
+        packetqueue_close(thread->queue);
+        pixie_thread_join(thread->writer_handle);
+    }
+    
+    writecontext_close(ctx);
+}
+
+/***************************************************************************
+ * Open the adapter(s), then start the capture thread(s). When there is
+ * more than one thread, each gets its own socket within a PACKET_FANOUT
+ * group, its own output file, and its own CPU.
+ ***************************************************************************/
+static void
+capture(const struct PacketDump *conf)
+{
+    struct Capture capture[1] = {{0}};
+    unsigned thread_count = (unsigned)conf->capture_threads;
+    unsigned cpu_count = pixie_cpu_get_count();
+    size_t total_packets_written = 0;
+    uint64_t total_snap_cut = 0;
+    uint64_t total_flow_cut = 0;
+    uint64_t total_evictions = 0;
+    int queue_policy;
+    int output_engine;
+    int stripe_type;
+    size_t t;
+    unsigned i;
+    
+    if (thread_count == 0)
+        thread_count = 1;
+    queue_policy = packetqueue_policy(conf->queue_full);
+    if (queue_policy < 0) {
+        fprintf(stderr, "FAIL: %s: unknown queue policy\n", conf->queue_full);
+        fprintf(stderr, "  hint: expected 'block', 'drop', or 'truncate'\n");
+        return;
+    }
+    /* Load the library now, rather than in each thread as it opens
+     * its first file */
+    if (conf->is_zstd && zstd_codec.init() != 0)
+        return;
+    if (conf->queue_depth && conf->queue_memory
+        && conf->queue_memory < 65536) {
+        fprintf(stderr, "FAIL: --queue-memory %llu: smaller than a packet\n",
+                (unsigned long long)conf->queue_memory);
+        fprintf(stderr, "  hint: it must hold at least 65536 bytes, the snap length\n");
+        return;
+    }
+    output_engine = outfile_engine(conf->output_engine);
+    if (output_engine < 0) {
+        fprintf(stderr, "FAIL: %s: unknown output engine\n", conf->output_engine);
+        fprintf(stderr, "  hint: expected 'stdio', 'uring', or 'direct'\n");
+        return;
+    }
+    stripe_type = stripe_mode(conf->stripe_mode);
+    if (stripe_type < 0) {
+        fprintf(stderr, "FAIL: %s: unknown stripe mode\n", conf->stripe_mode);
+        fprintf(stderr, "  hint: expected 'roundrobin' or 'weighted'\n");
+        return;
+    }
+    if (conf->snap_keep || conf->is_snap_payload) {
+        unsigned payload = (unsigned)conf->snap_payload;
+        if (!conf->is_snap_payload)
+            payload = SNAP_DEFAULT_PAYLOAD;
+        capture->snap = snappolicy_create(conf->snap_keep, payload);
+        if (capture->snap == NULL)
+            return;
+    }
+    if (conf->bpf_rule && conf->bpf_file) {
+        fprintf(stderr, "FAIL: both --bpf and --bpf-file\n");
+        fprintf(stderr, "  hint: put the whole filter in one or the other\n");
+        return;
+    }
+    capture->conf = conf;
+    capture->control_fd = -1;
+    if (conf->compress_dict) {
+        capture->dict = compressdict_load(conf->compress_dict);
+        if (capture->dict == NULL)
+            return;
+        LOG(1, "dictionary: %u bytes, ID %08x\n",
+            (unsigned)capture->dict->size, capture->dict->id);
+    }
+    if (conf->flight_trigger) {
+        capture->trigger = bpf_load_file(conf->flight_trigger);
+        if (capture->trigger == NULL)
+            return;
+    }
+    if (conf->flight_memory && conf->flight_socket) {
+        capture->control_fd = flightrec_listen(conf->flight_socket);
+        if (capture->control_fd < 0) {
+            bpf_free(capture->trigger);
+            return;
+        }
+    }
+    capture->threads = calloc(thread_count, sizeof(capture->threads[0]));
+    if (capture->threads == NULL)
+        exit(1);
+    if (conf->compress_threads && !conf->is_zstd)
+        capture->pool = compresspool_create((unsigned)conf->compress_threads);
+    capture->stripe = stripe_create(conf->stripe, stripe_type);
+    
+    /*
+     * Open the sniffers in this thread, so that any errors are reported
+     * before we start anything
+     */
+    for (i=0; i<thread_count; i++) {
+        struct CaptureThread *thread = &capture->threads[i];
+        int x;
         
-        x = handle_packet(ctx, hdr, buf);
+        thread->conf = conf;
+        thread->index = i;
+        thread->snap = capture->snap;
+        if (conf->flow_cutoff)
+            thread->flows = flowtable_create(conf->flow_cutoff,
+                                             conf->flow_memory,
+                                             (unsigned)conf->flow_timeout);
+        thread->cpu = (thread_count > 1) ? (int)(i % cpu_count) : -1;
+        thread->ctx->conf = conf;
+        thread->ctx->file_options.block_size = (size_t)conf->compress_block_size;
+        thread->ctx->file_options.flush_msecs = (unsigned)conf->flush_latency;
+        thread->ctx->file_options.compression_level = (int)conf->compress_level;
+        thread->ctx->file_options.pool = capture->pool;
+        thread->ctx->file_options.dict = capture->dict;
+        if (conf->is_zstd)
+            thread->ctx->file_options.threads = (unsigned)conf->compress_threads;
+        if (conf->is_compress_adaptive && conf->is_compression && !conf->is_zstd)
+            thread->ctx->file_options.control = compresscontrol_create(
+                                                (int)conf->compress_level);
+        thread->ctx->file_options.output.engine = output_engine;
+        thread->ctx->file_options.output.buffer_size = (size_t)conf->output_buffer_size;
+        thread->ctx->file_options.output.buffer_count = (unsigned)conf->output_buffers;
+        if (conf->is_preallocate)
+            thread->ctx->file_options.output.preallocate = conf->rotate_size;
+        thread->ctx->file_options.output.writebehind = conf->write_behind;
+        thread->ctx->stripe = capture->stripe;
+        if (conf->is_pdc)
+            thread->ctx->compression_type = PCAPFILE_PDC;
+        else if (conf->is_pdz)
+            thread->ctx->compression_type = PCAPFILE_PDZ;
+        else if (conf->is_zstd)
+            thread->ctx->compression_type = PCAPFILE_ZSTD;
+        else if (conf->is_compression)
+            thread->ctx->compression_type = PCAPFILE_LZ4;
+        else
+            thread->ctx->compression_type = PCAPFILE_NO_COMPRESSION;
+        if (thread->ctx->file_options.block_size == 0)
+            thread->ctx->file_options.block_size = 256 * 1024;
+        if (thread_count > 1)
+            thread->ctx->filename_spec = thread_filename(conf->filename, i);
+        else
+            thread->ctx->filename_spec = conf->filename;
+        if (conf->flight_memory) {
+            thread->ctx->recorder = flightrec_create((size_t)conf->flight_memory,
+                                    thread->ctx->file_options.block_size,
+                                    thread->ctx->file_options.compression_level);
+            thread->ctx->trigger = capture->trigger;
+        }
+        
+        x = sniffer_open(thread->sniffer, conf, thread_count,
+                         &thread->ctx->data_link);
         if (x < 0)
-            break;
+            goto cleanup;
+        capture->thread_count++;
+
+        /* The filter is compiled for the link type of the first sniffer,
+         * which is the same for all of them */
+        if ((conf->bpf_rule || conf->bpf_file) && capture->filter == NULL) {
+            if (conf->bpf_file)
+                capture->filter = bpf_load_filter(conf->bpf_file,
+                                            thread->ctx->data_link, 65536);
+            else
+                capture->filter = bpf_compile(conf->bpf_rule,
+                                            thread->ctx->data_link, 65536);
+            if (capture->filter == NULL)
+                goto cleanup;
+            LOG(1, "%s: filter: %u instructions\n", conf->ifname,
+                capture->filter->count);
+        }
+        if (capture->filter) {
+            x = sniffer_set_filter(thread->sniffer, capture->filter);
+            if (x < 0)
+                goto cleanup;
+        }
+        
+        if (conf->queue_depth) {
+            size_t queue_memory = (size_t)conf->queue_memory;
+            if (queue_memory == 0)
+                queue_memory = 64 * 1024 * 1024;
+            thread->queue = packetqueue_create((unsigned)conf->queue_depth,
+                                               queue_memory,
+                                               queue_policy);
+        }
+        
+        /* Packets in the ring stay put until we give the block back, so
+         * uncompressed files can be written straight from there. The
+         * queue has its own copy. */
+        if (thread->sniffer->tpacket && thread->queue == NULL)
+            thread->ctx->file_options.is_zerocopy = 1;
+        
+        /* Likewise, batches can point into the ring, but need copies of
+         * what libpcap gives us */
+        thread->batch = packetbatch_create((unsigned)conf->capture_batch,
+                                           thread->sniffer->pcap != NULL);
+    }
+    fprintf(stderr, "%s: capture started\n", conf->ifname);
+    
+    /*
+     * Start a statistics thread
+     */
+    t = pixie_begin_thread(statistics_thread, 0, capture);
+    
+    /*
+     * Start the capture threads
+     */
+    for (i=0; i<thread_count; i++) {
+        struct CaptureThread *thread = &capture->threads[i];
+        if (thread->queue)
+            thread->writer_handle = pixie_begin_thread(writer_thread, 0, thread);
+        thread->thread_handle = pixie_begin_thread(capture_thread, 0, thread);
+    }
+    if (thread_count > 1) {
+        LOG(0, "%s: %u capture threads\n", conf->ifname, thread_count);
+    }
+    if (capture->pool) {
+        LOG(0, "%s: %u compression threads\n", conf->ifname,
+            compresspool_workers(capture->pool));
+    }
+    if (conf->flight_memory) {
+        LOG(0, "%s: flight recorder, %llu megabytes per thread\n",
+            conf->ifname, (unsigned long long)(conf->flight_memory >> 20));
+        capture->flight_handle = pixie_begin_thread(flight_thread, 0, capture);
     }
     
+    /*
+     * Wait for them to finish
+     */
+    for (i=0; i<thread_count; i++) {
+        struct CaptureThread *thread = &capture->threads[i];
+        pixie_thread_join(thread->thread_handle);
+        total_packets_written += thread->ctx->total_packets_written;
+        total_snap_cut += thread->snap_bytes_cut;
+        total_flow_cut += thread->flow_packets_cut;
+        if (thread->flows)
+            total_evictions += flowtable_evictions(thread->flows);
+    }
     pixie_thread_join(t);
+    if (capture->flight_handle)
+        pixie_thread_join(capture->flight_handle);
     fprintf(stderr, "read %u packets\n", (unsigned)total_packets_written);
+    if (capture->snap)
+        LOG(0, "%s: truncation saved %llu bytes\n", conf->ifname,
+            (unsigned long long)total_snap_cut);
+    if (conf->flow_cutoff) {
+        LOG(0, "%s: flow cutoff dropped %llu packets\n", conf->ifname,
+            (unsigned long long)total_flow_cut);
+        if (total_evictions)
+            LOG(0, "%s: %llu active flows were forgotten, the table is too small\n",
+                conf->ifname, (unsigned long long)total_evictions);
+    }
     
-    if (ctx->fp)
-        pcapfile_close(ctx->fp);
-    if (ctx->filename)
-        free(ctx->filename);
-    if (p)
-        PCAP.close(p);
+cleanup:
+    for (i=0; i<thread_count; i++) {
+        struct CaptureThread *thread = &capture->threads[i];
+        
+        sniffer_close(thread->sniffer);
+        packetqueue_destroy(thread->queue);
+        if (thread->ctx->filename)
+            free(thread->ctx->filename);
+        if (thread->ctx->filename_spec != conf->filename)
+            free((char *)thread->ctx->filename_spec);
+        flightrec_destroy(thread->ctx->recorder);
+        compresscontrol_destroy(thread->ctx->file_options.control);
+        flowtable_destroy(thread->flows);
+        packetbatch_destroy(thread->batch);
+    }
+    free(capture->threads);
+    bpf_free(capture->trigger);
+    bpf_free(capture->filter);
+    snappolicy_destroy(capture->snap);
+    if (capture->control_fd >= 0) {
+        flightrec_hangup(capture->control_fd);
+        remove(conf->flight_socket);
+    }
+    
+    /* Wait for the rotated files to finish closing, which may need the
+     * compression workers */
+    stripe_destroy(capture->stripe);
+    compresspool_destroy(capture->pool);
+    compressdict_cleanup();
 }
 
 /***************************************************************************
@@ -339,6 +1591,16 @@ control_c_handler(int x)
     }
 }
 
+/***************************************************************************
+ * SIGUSR1 dumps the flight recorder
+ ***************************************************************************/
+static void
+flight_signal_handler(int x)
+{
+    UNUSEDPARM(x);
+    flight_signals++;
+}
+
 /***************************************************************************
  * This function prints to the command line a list of all the network
  * intefaces/devices.
@@ -415,6 +1677,9 @@ main(int argc, char *argv[])
      * trap <ctrl-c> to pause
      */
     signal(SIGINT, control_c_handler);
+#if defined(SIGUSR1)
+    signal(SIGUSR1, flight_signal_handler);
+#endif
     
 
     /*
@@ -442,9 +1707,12 @@ main(int argc, char *argv[])
     if (statuscount)
         return 1;
     
+    if (conf->benchmark) {
+        return benchmark(conf);
+    }
+    
     if (conf->readfiles) {
-        read_files(conf);
-        return 0;
+        return read_files(conf);
     }
     
     /*
@@ -463,9 +1731,9 @@ main(int argc, char *argv[])
     }
     
     /*
-     * Start the capture thread
+     * Start the capture thread(s)
      */
-    capture_thread(conf);
+    capture(conf);
     
     return 0;
 }
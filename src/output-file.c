@@ -0,0 +1,927 @@
+/*
+    Writing output files
+
+ For io_uring, we don't depend on liburing, since it's often not
+ installed on our sensors. The kernel interface is just three system
+ calls and some shared memory, which is what we use here.
+
+ Each buffer is written with a single IORING_OP_WRITEV at an explicit
+ file offset. The submission ring has one entry per buffer, so it can
+ never overflow. When the kernel reports a short write, the remainder
+ of that buffer is submitted again.
+
+ The "direct" engine opens the file with O_DIRECT, so that what we
+ write bypasses the page cache instead of filling memory with pages
+ that won't be read again soon. That requires that every write be
+ 4k-aligned, in memory, in the file offset, and in length. Since our
+ buffers are aligned and a multiple of 4k, only the last buffer is a
+ problem: we pad it with zeroes to a multiple of 4k, then truncate the
+ file back to its real length once it's written. When io_uring isn't
+ available, the buffers are written synchronously with 'pwrite()'.
+
+ When we know about how big a file will get, because files are rotated
+ by size, we can reserve the space up front with 'fallocate()'. That
+ lets the filesystem give us a few large extents, rather than many
+ small ones interleaved with the other files being written at the same
+ time. FALLOC_FL_KEEP_SIZE means the file's length still only reflects
+ what's been written, and the unused space is released when closing.
+
+ Without O_DIRECT, the kernel is left holding everything we write as
+ dirty pages, which it then writes in big bursts, and then keeps as
+ clean pages that nobody will read. With "write-behind", every time
+ another N megabytes have been written, we ask the kernel to start
+ writing them with 'sync_file_range()', then wait for the previous N
+ megabytes to finish and drop them from the cache with
+ 'posix_fadvise()'. That way, no more than 2*N megabytes of each file
+ are in memory at any time, and the disk sees a steady stream.
+
+ When we only keep the last N files, rather than deleting the oldest
+ and creating a new one, the oldest can be "recycled": renamed to the
+ new name, then overwritten from the start, keeping the blocks already
+ allocated to it. Like preallocated files, it's trimmed when closed.
+*/
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include "output-file.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#if defined(__linux__)
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifndef UNUSEDPARM
+#define UNUSEDPARM(x) x=(x)
+#endif
+
+enum {
+    OUTPUT_DEFAULT_BUFFER_SIZE = 1024 * 1024,
+    OUTPUT_DEFAULT_BUFFER_COUNT = 4,
+    OUTPUT_DIRECT_BUFFER_COUNT = 3,
+    OUTPUT_ALIGN = 4096,
+};
+
+#if defined(__linux__)
+struct OutputBuffer
+{
+    unsigned char *data;
+    size_t length;
+
+    /** Where in the file this buffer goes */
+    uint64_t offset;
+
+    /** How much the kernel has written so far */
+    size_t done;
+
+    struct iovec iov;
+    unsigned is_busy:1;
+};
+
+/**
+ * The io_uring shared memory
+ */
+struct Uring
+{
+    int fd;
+    void *sq_ptr;
+    size_t sq_length;
+    void *cq_ptr;
+    size_t cq_length;
+    struct io_uring_sqe *sqes;
+    size_t sqes_length;
+
+    volatile unsigned *sq_head;
+    volatile unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    volatile unsigned *cq_head;
+    volatile unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct OutputFile
+{
+    int engine;
+    FILE *fp;
+    unsigned is_failed:1;
+    unsigned is_uring:1;
+    unsigned is_direct:1;
+    unsigned is_preallocated:1;
+    unsigned is_recycled:1;
+
+#if defined(__linux__)
+    int fd;
+    struct Uring ring;
+    struct OutputBuffer *buffers;
+    unsigned buffer_count;
+    size_t buffer_size;
+    unsigned current;
+    unsigned in_flight;
+
+    /** The file offset where the current buffer starts */
+    uint64_t offset;
+#endif
+
+    /** Bytes written with stdio */
+    uint64_t position;
+
+    /** The write-behind window. Writeback has been started for
+     * everything before 'wb_started', and everything before 'wb_done'
+     * has been written and dropped from the cache */
+    uint64_t writebehind;
+    uint64_t wb_started;
+    uint64_t wb_done;
+
+    /** If set, where to count the bytes written and the time taken */
+    struct OutputCounters *counters;
+};
+
+/**
+ * Counters for all the files
+ */
+static struct OutputStats global_stats;
+
+/***************************************************************************
+ ***************************************************************************/
+int
+outfile_engine(const char *name)
+{
+    if (name == NULL || name[0] == '\0' || strcmp(name, "stdio") == 0)
+        return OUTPUT_STDIO;
+    if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+        return OUTPUT_URING;
+    if (strcmp(name, "direct") == 0)
+        return OUTPUT_DIRECT;
+    return -1;
+}
+
+#if defined(__linux__)
+/***************************************************************************
+ ***************************************************************************/
+static void
+uring_cleanup(struct Uring *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_length);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_length);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_length);
+    if (ring->fd > 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+}
+
+/***************************************************************************
+ * Create the ring and map its shared memory.
+ * @return 0 on success, or the errno on failure
+ ***************************************************************************/
+static int
+uring_setup(struct Uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    int fd;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return errno;
+    ring->fd = fd;
+
+    ring->sq_length = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_length = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->sq_length < ring->cq_length)
+            ring->sq_length = ring->cq_length;
+        ring->cq_length = ring->sq_length;
+    }
+
+    ring->sq_ptr = mmap(0, ring->sq_length, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        int err = errno;
+        ring->sq_ptr = NULL;
+        uring_cleanup(ring);
+        return err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else {
+        ring->cq_ptr = mmap(0, ring->cq_length, PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            int err = errno;
+            ring->cq_ptr = NULL;
+            uring_cleanup(ring);
+            return err;
+        }
+    }
+    ring->sqes_length = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(0, ring->sqes_length, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        int err = errno;
+        ring->sqes = NULL;
+        uring_cleanup(ring);
+        return err;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+/***************************************************************************
+ * Submit the unwritten part of a buffer
+ ***************************************************************************/
+static int
+uring_submit(struct OutputFile *out, unsigned index)
+{
+    struct Uring *ring = &out->ring;
+    struct OutputBuffer *b = &out->buffers[index];
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+    int x;
+
+    b->iov.iov_base = b->data + b->done;
+    b->iov.iov_len = b->length - b->done;
+
+    tail = *ring->sq_tail;
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = out->fd;
+    sqe->addr = (uint64_t)(size_t)&b->iov;
+    sqe->len = 1;
+    sqe->off = b->offset + b->done;
+    sqe->user_data = index;
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    rte_wmb();
+    *ring->sq_tail = tail + 1;
+    rte_wmb();
+
+    x = (int)syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    if (x < 0)
+        return -1;
+    return 0;
+}
+
+/***************************************************************************
+ * Handle any finished writes.
+ * @param is_wait
+ *      If set, wait for at least one write to finish when none have.
+ ***************************************************************************/
+static void
+uring_reap(struct OutputFile *out, int is_wait)
+{
+    struct Uring *ring = &out->ring;
+    unsigned head;
+
+    if (out->in_flight == 0)
+        return;
+
+    head = *ring->cq_head;
+    rte_rmb();
+    if (head == *ring->cq_tail && is_wait) {
+        syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        rte_rmb();
+    }
+
+    while (head != *ring->cq_tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct OutputBuffer *b = &out->buffers[cqe->user_data];
+        int res = cqe->res;
+
+        head++;
+        if (res <= 0) {
+            /* Writing nothing would just happen again if we retried */
+            errno = res ? -res : EIO;
+            if (!out->is_failed)
+                perror("io_uring: write");
+            out->is_failed = 1;
+            b->is_busy = 0;
+            out->in_flight--;
+            continue;
+        }
+        b->done += (size_t)res;
+        if (b->done < b->length && !out->is_failed) {
+            /* Short write, so write the rest */
+            if (uring_submit(out, (unsigned)cqe->user_data) == 0)
+                continue;
+            out->is_failed = 1;
+        }
+        b->is_busy = 0;
+        out->in_flight--;
+    }
+    rte_wmb();
+    *ring->cq_head = head;
+}
+
+/***************************************************************************
+ * Without io_uring, write the buffer before returning
+ ***************************************************************************/
+static int
+buffer_pwrite(struct OutputFile *out, struct OutputBuffer *b)
+{
+    while (b->done < b->length) {
+        ssize_t x;
+
+        x = pwrite(out->fd, b->data + b->done, b->length - b->done,
+                   (off_t)(b->offset + b->done));
+        if (x <= 0) {
+            if (x < 0 && errno == EINTR)
+                continue;
+            perror("pwrite");
+            out->is_failed = 1;
+            return -1;
+        }
+        b->done += (size_t)x;
+    }
+    b->length = 0;
+    return 0;
+}
+
+/***************************************************************************
+ * Send the current buffer to the kernel, and move to the next one,
+ * waiting if it's still being written.
+ ***************************************************************************/
+static int
+buffer_submit(struct OutputFile *out)
+{
+    struct OutputBuffer *b = &out->buffers[out->current];
+
+    if (b->length == 0)
+        return 0;
+    if (!out->is_uring) {
+        b->offset = out->offset;
+        b->done = 0;
+        out->offset += b->length;
+        return buffer_pwrite(out, b);
+    }
+    b->offset = out->offset;
+    b->done = 0;
+    b->is_busy = 1;
+    out->offset += b->length;
+    out->in_flight++;
+    if (uring_submit(out, out->current) != 0) {
+        perror("io_uring_enter");
+        b->is_busy = 0;
+        out->in_flight--;
+        out->is_failed = 1;
+        return -1;
+    }
+
+    out->current = (out->current + 1) % out->buffer_count;
+    b = &out->buffers[out->current];
+    uring_reap(out, 0);
+    while (b->is_busy)
+        uring_reap(out, 1);
+    b->length = 0;
+    return out->is_failed ? -1 : 0;
+}
+
+/***************************************************************************
+ * Open a file for the "uring" or "direct" engines.
+ * @param is_file_error
+ *      Set when it's the file that couldn't be opened, rather than
+ *      io_uring that isn't available, so there's no point in falling
+ *      back to stdio.
+ ***************************************************************************/
+static struct OutputFile *
+buffered_open(const char *filename, const struct OutputOptions *options,
+              int is_recycled, int *is_file_error)
+{
+    static int is_warned = 0;
+    static int is_direct_warned = 0;
+    struct OutputFile *out;
+    int flags = O_WRONLY|O_CREAT;
+    unsigned i;
+    int err;
+
+    out = calloc(1, sizeof(*out));
+    if (out == NULL)
+        exit(1);
+    out->engine = options->engine;
+    if (!is_recycled)
+        flags |= O_TRUNC;
+    out->buffer_count = options->buffer_count;
+    if (out->buffer_count < 2) {
+        if (out->engine == OUTPUT_DIRECT)
+            out->buffer_count = OUTPUT_DIRECT_BUFFER_COUNT;
+        else
+            out->buffer_count = OUTPUT_DEFAULT_BUFFER_COUNT;
+    }
+    out->buffer_size = options->buffer_size;
+    if (out->buffer_size == 0)
+        out->buffer_size = OUTPUT_DEFAULT_BUFFER_SIZE;
+    out->buffer_size = (out->buffer_size + OUTPUT_ALIGN - 1) & ~(size_t)(OUTPUT_ALIGN - 1);
+
+    if (out->engine == OUTPUT_DIRECT) {
+        out->fd = open(filename, flags|O_DIRECT, 0644);
+        if (out->fd >= 0)
+            out->is_direct = 1;
+        else if (errno == EINVAL) {
+            /* Some filesystems, like tmpfs, don't do O_DIRECT */
+            if (!is_direct_warned) {
+                fprintf(stderr, "%s: O_DIRECT not supported, using page cache\n",
+                        filename);
+                is_direct_warned = 1;
+            }
+            out->fd = open(filename, flags, 0644);
+        }
+    } else
+        out->fd = open(filename, flags, 0644);
+    if (out->fd < 0) {
+        fprintf(stderr, "Could not open capture file\n");
+        perror(filename);
+        free(out);
+        *is_file_error = 1;
+        return NULL;
+    }
+
+    err = uring_setup(&out->ring, out->buffer_count);
+    if (err == 0)
+        out->is_uring = 1;
+    else if (out->engine == OUTPUT_DIRECT) {
+        /* Still bypass the page cache, but write synchronously */
+        if (!is_warned) {
+            fprintf(stderr, "io_uring: %s, using pwrite() instead\n", strerror(err));
+            is_warned = 1;
+        }
+    } else {
+        if (!is_warned) {
+            fprintf(stderr, "io_uring: %s, using stdio instead\n", strerror(err));
+            is_warned = 1;
+        }
+        close(out->fd);
+        free(out);
+        return NULL;
+    }
+
+    out->buffers = calloc(out->buffer_count, sizeof(out->buffers[0]));
+    if (out->buffers == NULL)
+        exit(1);
+    for (i=0; i<out->buffer_count; i++) {
+        void *p;
+        if (posix_memalign(&p, OUTPUT_ALIGN, out->buffer_size) != 0)
+            exit(1);
+        out->buffers[i].data = p;
+    }
+    return out;
+}
+#endif
+
+/***************************************************************************
+ * The offset in the file before which everything has been handed to
+ * the kernel, so that it's safe to write back.
+ ***************************************************************************/
+static uint64_t
+writebehind_ready(struct OutputFile *out)
+{
+    if (out->engine == OUTPUT_STDIO) {
+        if (fflush(out->fp) != 0)
+            return out->wb_started;
+        return out->position;
+    }
+#if defined(__linux__)
+    {
+        uint64_t ready = out->offset;
+        unsigned i;
+
+        for (i=0; i<out->buffer_count; i++) {
+            struct OutputBuffer *b = &out->buffers[i];
+            if (b->is_busy && b->offset < ready)
+                ready = b->offset;
+        }
+        return ready;
+    }
+#else
+    return out->wb_started;
+#endif
+}
+
+/***************************************************************************
+ * Start writeback of another window, after finishing the previous one.
+ * @param is_final
+ *      When closing the file, write back and drop everything.
+ ***************************************************************************/
+static void
+writebehind(struct OutputFile *out, int is_final)
+{
+#if defined(__linux__)
+    int fd = out->fp ? fileno(out->fp) : out->fd;
+    uint64_t ready = writebehind_ready(out);
+
+    for (;;) {
+        uint64_t length = ready - out->wb_started;
+
+        if (length == 0 || (length < out->writebehind && !is_final))
+            break;
+        if (length > out->writebehind && !is_final)
+            length = out->writebehind;
+
+        /* Wait for the previous window, then drop it from the cache */
+        if (out->wb_done < out->wb_started) {
+            uint64_t done_length = out->wb_started - out->wb_done;
+            sync_file_range(fd, (off_t)out->wb_done, (off_t)done_length,
+                            SYNC_FILE_RANGE_WAIT_BEFORE
+                            | SYNC_FILE_RANGE_WRITE
+                            | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, (off_t)out->wb_done, (off_t)done_length,
+                          POSIX_FADV_DONTNEED);
+            pixie_locked_add_u64(&global_stats.bytes_in_flight, -(int64_t)done_length);
+            pixie_locked_add_u64(&global_stats.bytes_written_back, done_length);
+            out->wb_done = out->wb_started;
+        }
+
+        /* Start writing this window, without waiting */
+        sync_file_range(fd, (off_t)out->wb_started, (off_t)length,
+                        SYNC_FILE_RANGE_WRITE);
+        pixie_locked_add_u64(&global_stats.bytes_in_flight, length);
+        out->wb_started += length;
+    }
+
+    if (is_final && out->wb_done < out->wb_started) {
+        uint64_t done_length = out->wb_started - out->wb_done;
+        sync_file_range(fd, (off_t)out->wb_done, (off_t)done_length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE
+                        | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, (off_t)out->wb_done, (off_t)done_length,
+                      POSIX_FADV_DONTNEED);
+        pixie_locked_add_u64(&global_stats.bytes_in_flight, -(int64_t)done_length);
+        pixie_locked_add_u64(&global_stats.bytes_written_back, done_length);
+        out->wb_done = out->wb_started;
+    }
+#else
+    UNUSEDPARM(out);
+    UNUSEDPARM(is_final);
+#endif
+}
+
+/***************************************************************************
+ * Reserve disk space for the file, without changing its length
+ ***************************************************************************/
+static void
+preallocate(struct OutputFile *out, const char *filename, uint64_t size)
+{
+#if defined(__linux__)
+    static int is_warned = 0;
+    int fd = out->fp ? fileno(out->fp) : out->fd;
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0)
+        out->is_preallocated = 1;
+    else if (!is_warned) {
+        fprintf(stderr, "%s: fallocate: %s\n", filename, strerror(errno));
+        is_warned = 1;
+    }
+#else
+    UNUSEDPARM(out);
+    UNUSEDPARM(filename);
+    UNUSEDPARM(size);
+#endif
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct OutputFile *
+outfile_open(const char *filename, const struct OutputOptions *options)
+{
+    static const struct OutputOptions default_options = {0};
+    struct OutputFile *out = NULL;
+    int is_recycled = 0;
+    FILE *fp;
+
+    if (options == NULL)
+        options = &default_options;
+
+    /* If the old file is gone, just create a new one */
+    if (options->recycle) {
+        if (rename(options->recycle, filename) == 0)
+            is_recycled = 1;
+        else if (errno != ENOENT) {
+            perror(options->recycle);
+            remove(options->recycle);
+        }
+    }
+
+#if defined(__linux__)
+    if (options->engine == OUTPUT_URING || options->engine == OUTPUT_DIRECT) {
+        int is_file_error = 0;
+        out = buffered_open(filename, options, is_recycled, &is_file_error);
+        if (is_file_error)
+            return NULL;
+    }
+#endif
+
+    if (out == NULL) {
+        fp = fopen(filename, is_recycled ? "r+b" : "wb");
+        if (fp == NULL) {
+            fprintf(stderr, "Could not open capture file\n");
+            perror(filename);
+            return NULL;
+        }
+        out = outfile_attach(fp);
+    }
+
+    out->is_recycled = is_recycled;
+    if (options->preallocate)
+        preallocate(out, filename, options->preallocate);
+    if (!out->is_direct)
+        out->writebehind = options->writebehind;
+    out->counters = options->counters;
+    return out;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct OutputFile *
+outfile_attach(FILE *fp)
+{
+    struct OutputFile *out;
+
+    out = calloc(1, sizeof(*out));
+    if (out == NULL)
+        exit(1);
+    out->engine = OUTPUT_STDIO;
+    out->fp = fp;
+    return out;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static ssize_t
+output_write(struct OutputFile *out, const void *buf, size_t length)
+{
+    if (out->is_failed)
+        return -1;
+
+    if (out->engine == OUTPUT_STDIO) {
+        if (fwrite(buf, 1, length, out->fp) != length) {
+            out->is_failed = 1;
+            return -1;
+        }
+        out->position += length;
+        if (out->writebehind
+            && out->position - out->wb_started >= out->writebehind)
+            writebehind(out, 0);
+        return (ssize_t)length;
+    }
+
+#if defined(__linux__)
+    {
+        const unsigned char *px = (const unsigned char *)buf;
+        size_t remaining = length;
+
+        while (remaining) {
+            struct OutputBuffer *b = &out->buffers[out->current];
+            size_t n = out->buffer_size - b->length;
+
+            if (n > remaining)
+                n = remaining;
+            memcpy(b->data + b->length, px, n);
+            b->length += n;
+            px += n;
+            remaining -= n;
+
+            if (b->length == out->buffer_size) {
+                if (buffer_submit(out) != 0)
+                    return -1;
+                if (out->writebehind)
+                    writebehind(out, 0);
+            }
+        }
+    }
+#endif
+    return (ssize_t)length;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+ssize_t
+outfile_write(struct OutputFile *out, const void *buf, size_t length)
+{
+    uint64_t start;
+    ssize_t result;
+
+    if (out->counters == NULL)
+        return output_write(out, buf, length);
+
+    start = pixie_gettime();
+    result = output_write(out, buf, length);
+    pixie_locked_add_u64(&out->counters->usecs, pixie_gettime() - start);
+    if (result > 0)
+        pixie_locked_add_u64(&out->counters->bytes, (uint64_t)result);
+    return result;
+}
+
+/***************************************************************************
+ * Write the rest of a single piece, after 'writev()' only wrote some of
+ * it.
+ ***************************************************************************/
+#if defined(__linux__)
+static int
+write_all(int fd, const unsigned char *px, size_t length)
+{
+    while (length) {
+        ssize_t x = write(fd, px, length);
+        if (x < 0 && errno == EINTR)
+            continue;
+        if (x <= 0)
+            return -1;
+        px += x;
+        length -= (size_t)x;
+    }
+    return 0;
+}
+#endif
+
+/***************************************************************************
+ ***************************************************************************/
+static ssize_t
+output_writev(struct OutputFile *out, const struct iovec *iov, int count)
+{
+    size_t total = 0;
+    int i;
+
+    if (out->is_failed)
+        return -1;
+    for (i=0; i<count; i++)
+        total += iov[i].iov_len;
+
+#if defined(__linux__)
+    if (out->engine == OUTPUT_STDIO) {
+        int fd = fileno(out->fp);
+
+        /* Anything still in the stdio buffer goes first */
+        if (fflush(out->fp) != 0) {
+            out->is_failed = 1;
+            return -1;
+        }
+
+        while (count) {
+            ssize_t x;
+
+            x = writev(fd, iov, (count < IOV_MAX) ? count : IOV_MAX);
+            if (x < 0 && errno == EINTR)
+                continue;
+            if (x <= 0) {
+                out->is_failed = 1;
+                return -1;
+            }
+
+            /* Skip what was written. A short write can end in the middle
+             * of a piece, so finish that one by itself */
+            while (count && (size_t)x >= iov->iov_len) {
+                x -= (ssize_t)iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (x) {
+                if (write_all(fd, (const unsigned char *)iov->iov_base + x,
+                              iov->iov_len - (size_t)x) != 0) {
+                    out->is_failed = 1;
+                    return -1;
+                }
+                iov++;
+                count--;
+            }
+        }
+
+        out->position += total;
+        if (out->writebehind
+            && out->position - out->wb_started >= out->writebehind)
+            writebehind(out, 0);
+        return (ssize_t)total;
+    }
+#endif
+
+    /* The buffered engines have to copy into their aligned buffers
+     * anyway, and without writev() stdio does too */
+    for (i=0; i<count; i++) {
+        if (output_write(out, iov[i].iov_base, iov[i].iov_len) < 0)
+            return -1;
+    }
+    return (ssize_t)total;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+ssize_t
+outfile_writev(struct OutputFile *out, const struct iovec *iov, int count)
+{
+    uint64_t start;
+    ssize_t result;
+
+    if (out->counters == NULL)
+        return output_writev(out, iov, count);
+
+    start = pixie_gettime();
+    result = output_writev(out, iov, count);
+    pixie_locked_add_u64(&out->counters->usecs, pixie_gettime() - start);
+    if (result > 0)
+        pixie_locked_add_u64(&out->counters->bytes, (uint64_t)result);
+    return result;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+outfile_close(struct OutputFile *out)
+{
+    struct OutputCounters *counters;
+    uint64_t start = 0;
+    int result = 0;
+
+    if (out == NULL)
+        return -1;
+    counters = out->counters;
+    if (counters)
+        start = pixie_gettime();
+
+    if (out->engine == OUTPUT_STDIO) {
+        if (out->writebehind)
+            writebehind(out, 1);
+#if defined(__linux__)
+        /* Release the space we reserved but didn't use, or the end of
+         * the old file that we didn't overwrite. This uses our own
+         * count, since writev() goes around stdio's idea of where it is */
+        if ((out->is_preallocated || out->is_recycled) && fflush(out->fp) == 0)
+            ftruncate(fileno(out->fp), (off_t)out->position);
+#endif
+        if (fclose(out->fp) != 0)
+            out->is_failed = 1;
+    }
+#if defined(__linux__)
+    else {
+        struct OutputBuffer *b = &out->buffers[out->current];
+        uint64_t file_size = out->offset + b->length;
+        unsigned i;
+
+        /* With O_DIRECT, the last write must be padded to a multiple
+         * of 4k, then the padding removed */
+        if (out->is_direct && (b->length % OUTPUT_ALIGN) != 0) {
+            size_t padded = (b->length + OUTPUT_ALIGN - 1) & ~(size_t)(OUTPUT_ALIGN - 1);
+            memset(b->data + b->length, 0, padded - b->length);
+            b->length = padded;
+        }
+
+        if (!out->is_failed)
+            buffer_submit(out);
+        while (out->in_flight)
+            uring_reap(out, 1);
+        if (out->writebehind)
+            writebehind(out, 1);
+        /* Remove the O_DIRECT padding, and release the space we reserved
+         * but didn't use, or the end of a recycled file */
+        if ((out->is_direct || out->is_preallocated || out->is_recycled)
+            && !out->is_failed
+            && ftruncate(out->fd, (off_t)file_size) != 0) {
+            perror("ftruncate");
+            out->is_failed = 1;
+        }
+        if (close(out->fd) != 0)
+            out->is_failed = 1;
+        if (out->is_uring)
+            uring_cleanup(&out->ring);
+        for (i=0; i<out->buffer_count; i++)
+            free(out->buffers[i].data);
+        free(out->buffers);
+    }
+#endif
+
+    if (out->is_failed)
+        result = -1;
+    free(out);
+
+    if (counters)
+        pixie_locked_add_u64(&counters->usecs, pixie_gettime() - start);
+    return result;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+outfile_stats(struct OutputStats *stats)
+{
+    *stats = global_stats;
+}
@@ -0,0 +1,155 @@
+/*
+    Writing output files
+
+ This is the layer underneath the capture file writer that actually
+ gets the bytes to the disk. The simplest engine is just 'fwrite()',
+ but at 10gbps, making a synchronous system call for every block of
+ data, and copying it through the stdio buffer, gets expensive.
+
+ The "uring" engine instead fills several large, page-aligned buffers,
+ and hands them to the kernel with io_uring, so that the writing
+ happens in the background while we fill the next buffer. We only wait
+ when all the buffers are still being written.
+
+ If io_uring isn't available (old kernel, or disabled by the admin),
+ we fall back to stdio.
+
+ The "direct" engine writes the same aligned buffers with O_DIRECT,
+ bypassing the page cache, so that writing capture files all day
+ doesn't push everything else out of memory, nor build up gigabytes
+ of dirty pages that then get written all at once.
+*/
+#ifndef OUTPUT_FILE_H
+#define OUTPUT_FILE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#if defined(WIN32)
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+struct OutputFile;
+
+enum {
+    OUTPUT_STDIO,
+    OUTPUT_URING,
+    OUTPUT_DIRECT,
+};
+
+/**
+ * How a file is written. A structure that's been zeroed means the
+ * defaults.
+ */
+struct OutputOptions
+{
+    /** OUTPUT_STDIO, OUTPUT_URING, or OUTPUT_DIRECT */
+    int engine;
+
+    /** For the buffered engines, the size of each buffer, rounded up to
+     * a multiple of 4k, and the number of buffers. The defaults are
+     * 1-megabyte and 4 buffers, or 3 buffers for O_DIRECT. */
+    size_t buffer_size;
+    unsigned buffer_count;
+
+    /** If not zero, reserve this many bytes of disk space for the file
+     * when it's opened, so that it's less fragmented. The file is
+     * trimmed to the size actually written when it's closed. */
+    uint64_t preallocate;
+
+    /** If not zero, whenever this many more bytes have been written,
+     * start writing them to disk, then wait for the previous ones and
+     * drop them from the page cache. Not used with O_DIRECT. */
+    uint64_t writebehind;
+
+    /** If set, the name of an old file to rename to the new name and
+     * overwrite, instead of creating a new file */
+    const char *recycle;
+
+    /** If set, count the bytes written and the time spent writing
+     * them here. Can be shared by many files. */
+    struct OutputCounters *counters;
+};
+
+/**
+ * For measuring how fast files are written, such as all the files on
+ * a disk
+ */
+struct OutputCounters
+{
+    volatile uint64_t bytes;
+
+    /** Microseconds spent writing and closing */
+    volatile uint64_t usecs;
+};
+
+/**
+ * Counters for write-behind, added up across all files
+ */
+struct OutputStats
+{
+    /** Bytes that we've started writing back, but haven't yet waited
+     * for and dropped from the page cache */
+    volatile uint64_t bytes_in_flight;
+
+    /** Bytes written back and dropped from the page cache */
+    volatile uint64_t bytes_written_back;
+};
+
+/**
+ * Convert an engine name, like "stdio", "uring", or "direct", into
+ * its value.
+ * A NULL or empty name means the default.
+ * @return the engine, or -1 if the name isn't known
+ */
+int outfile_engine(const char *name);
+
+/**
+ * Create/truncate a file for writing.
+ * @return the file, or NULL on error, after printing a message
+ */
+struct OutputFile *outfile_open(const char *filename,
+                                const struct OutputOptions *options);
+
+/**
+ * Use a file that's already been opened with stdio, such as when
+ * appending to an existing file. The output takes over the 'FILE'.
+ */
+struct OutputFile *outfile_attach(FILE *fp);
+
+/**
+ * Write data to the file. With the buffered engines, this is usually
+ * just copying to the current buffer.
+ * @return the number of bytes written, which is the same as the
+ * length, or -1 on an error
+ */
+ssize_t outfile_write(struct OutputFile *out, const void *buf, size_t length);
+
+/**
+ * Write several pieces of data, one after the other. With stdio, this
+ * is a single 'writev()' straight to the file, without copying through
+ * the stdio buffer, so the caller can gather many small records and
+ * write them with one system call.
+ * @return the total number of bytes written, or -1 on an error
+ */
+ssize_t outfile_writev(struct OutputFile *out,
+                       const struct iovec *iov,
+                       int count);
+
+/**
+ * Finish writing everything, then close the file and free everything.
+ * @return 0 on success, or -1 if anything failed to be written
+ */
+int outfile_close(struct OutputFile *out);
+
+/**
+ * Get the counters for all files.
+ */
+void outfile_stats(struct OutputStats *stats);
+
+#endif
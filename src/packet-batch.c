@@ -0,0 +1,100 @@
+/*
+    A batch of captured packets
+*/
+#include "packet-batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    /* Room for the copies of the largest batch of full-sized Ethernet
+     * frames, and for at least one packet of the largest snap length */
+    PACKET_BATCH_SLAB = 512 * 1024,
+};
+
+/***************************************************************************
+ ***************************************************************************/
+struct PacketBatch *
+packetbatch_create(unsigned max, unsigned is_copy)
+{
+    struct PacketBatch *batch;
+
+    batch = calloc(1, sizeof(*batch));
+    if (batch == NULL) {
+        fprintf(stderr, "[-] out of memory\n");
+        exit(1);
+    }
+    if (max == 0)
+        max = PACKET_BATCH_DEFAULT;
+    batch->max = (max < PACKET_BATCH_MAX) ? max : PACKET_BATCH_MAX;
+
+    if (is_copy) {
+        batch->slab_size = PACKET_BATCH_SLAB;
+        batch->slab = malloc(batch->slab_size);
+        if (batch->slab == NULL) {
+            fprintf(stderr, "[-] out of memory\n");
+            exit(1);
+        }
+    }
+    return batch;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+packetbatch_add(struct PacketBatch *batch,
+                const struct pcap_pkthdr *hdr,
+                const unsigned char *buf)
+{
+    unsigned i = batch->count;
+
+    if (i >= batch->max)
+        return 0;
+
+    if (batch->slab) {
+        unsigned char *copy;
+
+        /* An empty batch always has room, but a packet can't be bigger
+         * than the slab */
+        if (batch->slab_used + hdr->caplen > batch->slab_size) {
+            if (i)
+                return 0;
+            batch->hdrs[0] = *hdr;
+            batch->hdrs[0].caplen = (unsigned)batch->slab_size;
+            memcpy(batch->slab, buf, batch->slab_size);
+            batch->packets[0] = batch->slab;
+            batch->slab_used = batch->slab_size;
+            batch->count = 1;
+            return 1;
+        }
+        copy = batch->slab + batch->slab_used;
+        memcpy(copy, buf, hdr->caplen);
+        batch->slab_used += hdr->caplen;
+        buf = copy;
+    }
+
+    batch->hdrs[i] = *hdr;
+    batch->packets[i] = buf;
+    batch->count = i + 1;
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+packetbatch_clear(struct PacketBatch *batch)
+{
+    batch->count = 0;
+    batch->slab_used = 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+packetbatch_destroy(struct PacketBatch *batch)
+{
+    if (batch == NULL)
+        return;
+    free(batch->slab);
+    free(batch);
+}
@@ -0,0 +1,71 @@
+/*
+    A batch of captured packets
+
+ Rather than handing packets one at a time from the capture loop to the
+ writer, we gather up to a few dozen of them, then hand over the whole
+ batch, so that the checks done between packets (is the file open, is
+ it time to rotate, has something failed) and the calls through the
+ layers are paid once per batch instead of once per packet.
+
+ The batch either points at the packets where the capture backend left
+ them, when they stay put until we're done (our own TPACKET_V3 ring, the
+ queue), or copies them, when they don't (libpcap, whose buffer can be
+ reused as soon as its callback returns).
+*/
+#ifndef PACKET_BATCH_H
+#define PACKET_BATCH_H
+#include "rawsock-pcap.h"
+#include <stddef.h>
+
+enum {
+    /** The most packets in one batch */
+    PACKET_BATCH_MAX = 256,
+
+    /** The default number, small enough that the headers and packets
+     * of a batch stay in the cache */
+    PACKET_BATCH_DEFAULT = 64,
+};
+
+struct PacketBatch
+{
+    /** The number of packets in the batch, and the most it can take */
+    unsigned count;
+    unsigned max;
+
+    /** If not NULL, where the packets are copied to */
+    unsigned char *slab;
+    size_t slab_size;
+    size_t slab_used;
+
+    struct pcap_pkthdr hdrs[PACKET_BATCH_MAX];
+    const unsigned char *packets[PACKET_BATCH_MAX];
+};
+
+/**
+ * @param max
+ *      The most packets in a batch, up to PACKET_BATCH_MAX, or zero for
+ *      the default.
+ * @param is_copy
+ *      Whether the packets are copied into the batch, rather than
+ *      pointed to.
+ */
+struct PacketBatch *packetbatch_create(unsigned max, unsigned is_copy);
+
+/**
+ * Add a packet to the batch, copying it if that's how the batch was
+ * created.
+ * @return 1 if it was added, or 0 if the batch is full, in which case
+ * it must be handled and cleared, then the packet added again.
+ */
+int packetbatch_add(struct PacketBatch *batch,
+                    const struct pcap_pkthdr *hdr,
+                    const unsigned char *buf);
+
+/**
+ * Empty the batch, once its packets have been handled.
+ */
+void packetbatch_clear(struct PacketBatch *batch);
+
+void packetbatch_destroy(struct PacketBatch *batch);
+
+#endif
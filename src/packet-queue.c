@@ -0,0 +1,338 @@
+/*
+    Single-producer/single-consumer packet queue
+
+ The producer owns the 'head' counters, and the consumer owns the 'tail'
+ counters. Each only ever reads the other's counters. The counters
+ only ever increase (and wrap), with the position in the ring being the
+ counter modulo the size.
+
+ The order of operations matters. The producer copies the packet into
+ the ring, then does a write-barrier, then increments 'head'. The
+ consumer reads 'head', does a read-barrier, then reads the packet.
+ The reverse happens when the consumer is done with the packet.
+
+ Each entry remembers where the slab 'head' was after its payload was
+ added, so when the consumer pops the entry, it can set the slab 'tail'
+ to that value. This includes any bytes skipped at the end of the slab
+ because the payload wouldn't fit contiguously.
+*/
+#include "packet-queue.h"
+#include "packet-batch.h"
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct QueueEntry
+{
+    struct pcap_pkthdr hdr;
+
+    /** Where in the slab the payload starts */
+    uint64_t slab_offset;
+
+    /** The slab 'head' after this payload was added */
+    uint64_t slab_end;
+};
+
+struct PacketQueue
+{
+    struct QueueEntry *entries;
+    unsigned char *slab;
+    unsigned mask;
+    uint64_t slab_size;
+    int full_policy;
+
+    /*
+     * Producer side, on its own cache line
+     */
+    char pad0[64];
+    volatile unsigned head;
+    volatile uint64_t slab_head;
+    volatile uint64_t packets_queued;
+    volatile uint64_t packets_dropped;
+    volatile uint64_t packets_truncated;
+    volatile unsigned high_water_depth;
+    volatile uint64_t high_water_bytes;
+
+    /*
+     * Consumer side, on its own cache line
+     */
+    char pad1[64];
+    volatile unsigned tail;
+    volatile uint64_t slab_tail;
+
+    char pad2[64];
+    volatile unsigned is_closed;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+struct PacketQueue *
+packetqueue_create(unsigned depth, size_t slab_size, int full_policy)
+{
+    struct PacketQueue *q;
+    unsigned size = 1;
+
+    while (size < depth)
+        size <<= 1;
+
+    q = malloc(sizeof(*q));
+    if (q == NULL)
+        exit(1);
+    memset(q, 0, sizeof(*q));
+    q->entries = malloc(sizeof(q->entries[0]) * size);
+    q->slab = malloc(slab_size);
+    if (q->entries == NULL || q->slab == NULL) {
+        fprintf(stderr, "queue: out of memory (%u entries, %llu bytes)\n",
+                size, (unsigned long long)slab_size);
+        exit(1);
+    }
+    q->mask = size - 1;
+    q->slab_size = slab_size;
+    q->full_policy = full_policy;
+    return q;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+packetqueue_policy(const char *name)
+{
+    if (name == NULL || strcmp(name, "block") == 0)
+        return QUEUE_FULL_BLOCK;
+    if (strcmp(name, "drop") == 0)
+        return QUEUE_FULL_DROP;
+    if (strcmp(name, "truncate") == 0)
+        return QUEUE_FULL_TRUNCATE;
+    return -1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+packetqueue_destroy(struct PacketQueue *q)
+{
+    if (q == NULL)
+        return;
+    free(q->entries);
+    free(q->slab);
+    free(q);
+}
+
+/***************************************************************************
+ * Find room for 'length' contiguous bytes in the slab.
+ * @return 1 if there's room, with 'r_offset' the location, or 0 if
+ * the slab is too full.
+ ***************************************************************************/
+static int
+slab_reserve(struct PacketQueue *q, unsigned length, uint64_t *r_offset)
+{
+    uint64_t start = q->slab_head;
+    uint64_t pos = start % q->slab_size;
+
+    /* If it won't fit at the end, skip to the start of the slab */
+    if (pos + length > q->slab_size)
+        start += q->slab_size - pos;
+
+    if (start + length - q->slab_tail > q->slab_size)
+        return 0;
+
+    *r_offset = start;
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+packetqueue_push(struct PacketQueue *q,
+                 const struct pcap_pkthdr *hdr,
+                 const unsigned char *buf)
+{
+    struct QueueEntry *entry;
+    unsigned head = q->head;
+    unsigned caplen = hdr->caplen;
+    uint64_t offset;
+    unsigned depth;
+    uint64_t bytes;
+
+    /* Round up so that the next packet starts aligned */
+    unsigned length = (caplen + 7) & ~7U;
+
+    /* It would never fit, whatever the policy */
+    if (length > q->slab_size) {
+        q->packets_dropped++;
+        return 0;
+    }
+
+    for (;;) {
+        int is_full = 0;
+
+        if (head - q->tail > q->mask)
+            is_full = 1;
+        else if (!slab_reserve(q, length, &offset))
+            is_full = 2;
+        if (!is_full)
+            break;
+
+        if (q->is_closed)
+            return 0;
+
+        switch (q->full_policy) {
+            case QUEUE_FULL_BLOCK:
+                rte_pause();
+                pixie_usleep(10);
+                continue;
+            case QUEUE_FULL_TRUNCATE:
+                /* only the payload is in the way, so keep the headers */
+                if (is_full == 2 && caplen > QUEUE_TRUNCATE_LENGTH) {
+                    caplen = QUEUE_TRUNCATE_LENGTH;
+                    length = (caplen + 7) & ~7U;
+                    if (slab_reserve(q, length, &offset)) {
+                        q->packets_truncated++;
+                        break;
+                    }
+                }
+                /* fall through */
+            case QUEUE_FULL_DROP:
+            default:
+                q->packets_dropped++;
+                return 0;
+        }
+        break;
+    }
+
+    /*
+     * Copy the packet into the queue
+     */
+    entry = &q->entries[head & q->mask];
+    entry->hdr = *hdr;
+    entry->hdr.caplen = caplen;
+    entry->slab_offset = offset;
+    entry->slab_end = offset + length;
+    memcpy(q->slab + (offset % q->slab_size), buf, caplen);
+
+    /*
+     * Now publish it
+     */
+    rte_wmb();
+    q->slab_head = entry->slab_end;
+    q->head = head + 1;
+    q->packets_queued++;
+
+    /*
+     * Track the high-water marks
+     */
+    depth = head + 1 - q->tail;
+    bytes = q->slab_head - q->slab_tail;
+    if (q->high_water_depth < depth)
+        q->high_water_depth = depth;
+    if (q->high_water_bytes < bytes)
+        q->high_water_bytes = bytes;
+
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+const unsigned char *
+packetqueue_peek(struct PacketQueue *q, struct pcap_pkthdr *hdr)
+{
+    struct QueueEntry *entry;
+    unsigned tail = q->tail;
+
+    if (tail == q->head)
+        return NULL;
+    rte_rmb();
+
+    entry = &q->entries[tail & q->mask];
+    *hdr = entry->hdr;
+    return q->slab + (entry->slab_offset % q->slab_size);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+packetqueue_pop(struct PacketQueue *q)
+{
+    struct QueueEntry *entry;
+    unsigned tail = q->tail;
+
+    entry = &q->entries[tail & q->mask];
+    rte_wmb();
+    q->slab_tail = entry->slab_end;
+    q->tail = tail + 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+packetqueue_peek_batch(struct PacketQueue *q, struct PacketBatch *batch)
+{
+    unsigned tail = q->tail;
+    unsigned count = q->head - tail;
+    unsigned i;
+
+    packetbatch_clear(batch);
+    if (count == 0)
+        return 0;
+    rte_rmb();
+
+    if (count > batch->max)
+        count = batch->max;
+    for (i=0; i<count; i++) {
+        struct QueueEntry *entry = &q->entries[(tail + i) & q->mask];
+        batch->hdrs[i] = entry->hdr;
+        batch->packets[i] = q->slab + (entry->slab_offset % q->slab_size);
+    }
+    batch->count = count;
+    return count;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+packetqueue_pop_batch(struct PacketQueue *q, unsigned count)
+{
+    struct QueueEntry *entry;
+    unsigned tail = q->tail;
+
+    if (count == 0)
+        return;
+    entry = &q->entries[(tail + count - 1) & q->mask];
+    rte_wmb();
+    q->slab_tail = entry->slab_end;
+    q->tail = tail + count;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+packetqueue_close(struct PacketQueue *q)
+{
+    q->is_closed = 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+packetqueue_is_closed(const struct PacketQueue *q)
+{
+    return q->is_closed;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+packetqueue_stats(const struct PacketQueue *q, struct PacketQueueStats *stats)
+{
+    stats->packets_queued = q->packets_queued;
+    stats->packets_dropped = q->packets_dropped;
+    stats->packets_truncated = q->packets_truncated;
+    stats->depth = q->head - q->tail;
+    stats->bytes = q->slab_head - q->slab_tail;
+    stats->high_water_depth = q->high_water_depth;
+    stats->high_water_bytes = q->high_water_bytes;
+    stats->max_depth = q->mask + 1;
+    stats->max_bytes = q->slab_size;
+}
@@ -0,0 +1,161 @@
+/*
+    Single-producer/single-consumer packet queue
+
+ This sits between a capture thread and a writer thread, so that the
+ compression and disk writes don't stall the receive path. Whenever the
+ disk hiccups, or when a file is being rotated, packets accumulate in
+ the queue rather than being dropped by the kernel.
+
+ There are two rings. The first is a ring of fixed-size entries holding
+ the packet headers. The second is a "slab" of bytes holding the
+ packet contents, where each packet is placed contiguously. Only one
+ thread can push, and only one thread can pop. No locks are used, just
+ memory barriers.
+*/
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+#include "rawsock-pcap.h"
+#include <stdint.h>
+
+struct PacketQueue;
+struct PacketBatch;
+
+/**
+ * What to do when a packet arrives and the queue is full.
+ */
+enum {
+    /** Wait for the writer thread to make room */
+    QUEUE_FULL_BLOCK = 0,
+
+    /** Drop the new packet */
+    QUEUE_FULL_DROP,
+
+    /** Keep just the first bytes of the packet (the protocol headers),
+     * dropping the rest of the payload, if that'll fit. The original
+     * length is still recorded. */
+    QUEUE_FULL_TRUNCATE,
+};
+
+/**
+ * How many bytes are kept by the "truncate" policy.
+ */
+enum {
+    QUEUE_TRUNCATE_LENGTH = 128,
+};
+
+struct PacketQueueStats
+{
+    /** Packets successfully added to the queue */
+    uint64_t packets_queued;
+
+    /** Packets dropped because the queue was full */
+    uint64_t packets_dropped;
+
+    /** Packets where payload was dropped because the queue was full */
+    uint64_t packets_truncated;
+
+    /** The number of packets and bytes waiting to be written */
+    unsigned depth;
+    uint64_t bytes;
+
+    /** The most packets and bytes ever waiting at once */
+    unsigned high_water_depth;
+    uint64_t high_water_bytes;
+
+    /** The configured capacity */
+    unsigned max_depth;
+    uint64_t max_bytes;
+};
+
+/**
+ * Create a queue.
+ * @param depth
+ *      The maximum number of packets in the queue. This is rounded up to a
+ *      power of two.
+ * @param slab_size
+ *      The number of bytes for holding packet contents, which should be
+ *      at least the snap length, since bigger packets are always dropped.
+ * @param full_policy
+ *      One of QUEUE_FULL_BLOCK, QUEUE_FULL_DROP, QUEUE_FULL_TRUNCATE
+ */
+struct PacketQueue *
+packetqueue_create(unsigned depth, size_t slab_size, int full_policy);
+
+/**
+ * Parse the name of a policy ("block", "drop", "truncate").
+ * @return the policy, or -1 if the name isn't known.
+ */
+int
+packetqueue_policy(const char *name);
+
+/**
+ * Free the queue. Both threads must be done with it.
+ */
+void
+packetqueue_destroy(struct PacketQueue *q);
+
+/**
+ * Called by the producer (capture) thread to add a packet, copying both
+ * the header and contents.
+ * @return
+ *      1 if the packet was queued, 0 if it was dropped
+ */
+int
+packetqueue_push(struct PacketQueue *q,
+                 const struct pcap_pkthdr *hdr,
+                 const unsigned char *buf);
+
+/**
+ * Called by the consumer (writer) thread to get the oldest packet
+ * without removing it. The pointer stays valid until 'packetqueue_pop()'.
+ * @return
+ *      The packet contents, or NULL if the queue is empty.
+ */
+const unsigned char *
+packetqueue_peek(struct PacketQueue *q, struct pcap_pkthdr *hdr);
+
+/**
+ * Called by the consumer (writer) thread to remove the oldest packet,
+ * after it's been written.
+ */
+void
+packetqueue_pop(struct PacketQueue *q);
+
+/**
+ * Like 'packetqueue_peek()', but for as many of the oldest packets as
+ * will fit in the batch, which points to them where they are in the
+ * queue. They stay valid until 'packetqueue_pop_batch()'.
+ * @return
+ *      The number of packets, or 0 if the queue is empty.
+ */
+unsigned
+packetqueue_peek_batch(struct PacketQueue *q, struct PacketBatch *batch);
+
+/**
+ * Remove the oldest 'count' packets, after they've been written.
+ */
+void
+packetqueue_pop_batch(struct PacketQueue *q, unsigned count);
+
+/**
+ * Called by either thread to signal it is done. If the producer closes,
+ * the consumer drains the remaining packets. If the consumer closes
+ * (because of an error), the producer stops blocking.
+ */
+void
+packetqueue_close(struct PacketQueue *q);
+
+/**
+ * Whether 'packetqueue_close()' was called.
+ */
+int
+packetqueue_is_closed(const struct PacketQueue *q);
+
+/**
+ * Read the counters. This can be called from any thread, though the
+ * values might be slightly out of date.
+ */
+void
+packetqueue_stats(const struct PacketQueue *q, struct PacketQueueStats *stats);
+
+#endif
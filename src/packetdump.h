@@ -58,11 +58,202 @@ struct PacketDump {
     
     const char *bpf_file;
     
+    /**
+     * Configuration of the native TPACKET_V3 ring, when used instead of
+     * libpcap. The block size must be a multiple of the page size. The
+     * timeout is the number of milliseconds before the kernel hands us
+     * a partially filled block. Zero means use the default.
+     * [packetdump --ring-block-size 1048576]
+     * [packetdump --ring-blocks 64]
+     * [packetdump --ring-timeout 10]
+     */
+    uint64_t ring_block_size;
+    uint64_t ring_block_count;
+    uint64_t ring_block_timeout;
+    
+    /**
+     * The number of capture threads. When more than one, each thread
+     * gets its own socket within a PACKET_FANOUT group, its own CPU,
+     * and its own output files (with the thread number added to the
+     * filename).
+     * [packetdump --threads 4]
+     */
+    uint64_t capture_threads;
+    
+    /**
+     * How the kernel spreads packets across capture threads: "hash",
+     * "cpu", or "rollover".
+     * [packetdump --fanout hash]
+     */
+    const char *fanout_mode;
+
+    /**
+     * The most packets read from the capture at once, and handed to the
+     * writer together.
+     * [packetdump --batch 64]
+     */
+    uint64_t capture_batch;
+    
+    /**
+     * When non-zero, each capture thread hands packets through a queue
+     * of this many packets to its own writer thread. The memory is the
+     * number of bytes for holding packet contents. The policy for when
+     * the queue is full is "block", "drop", or "truncate".
+     * [packetdump --queue-depth 65536]
+     * [packetdump --queue-memory 67108864]
+     * [packetdump --queue-full drop]
+     */
+    uint64_t queue_depth;
+    uint64_t queue_memory;
+    const char *queue_full;
+    
+    /**
+     * Packets are accumulated into blocks of this many bytes, which
+     * are compressed all at once, rather than compressing each packet
+     * separately. The latency is the maximum milliseconds a packet can
+     * wait in a block before it gets written anyway.
+     * [packetdump --compress-block-size 262144]
+     * [packetdump --flush-latency 1000]
+     */
+    uint64_t compress_block_size;
+    uint64_t flush_latency;
+    
+    /**
+     * Blocks are compressed by this many worker threads, so that the
+     * slower, high-ratio levels can keep up. Zero means blocks are
+     * compressed by the thread writing the file. The level is the LZ4
+     * level, where negative is faster, and 3 to 12 use LZ4HC.
+     * [packetdump --compress-threads 4]
+     * [packetdump --compress-level 9]
+     */
+    uint64_t compress_threads;
+    uint64_t compress_level;
+    
+    /**
+     * Choose the level of each block depending upon how busy we are,
+     * anywhere from not compressing at all, up to the level above.
+     * [packetdump --compress-adaptive]
+     */
+    char is_compress_adaptive;
+    
+    /**
+     * A preset dictionary for compressing blocks: a capture file to
+     * train one from, any other file to use as it is, or "builtin".
+     * [packetdump --compress-dict builtin]
+     */
+    const char *compress_dict;
+    
+    /**
+     * How files are written: "stdio" for plain fwrite(), "uring" to
+     * keep several large buffers being written in the background with
+     * io_uring, or "direct" to do the same with O_DIRECT, bypassing
+     * the page cache.
+     * [packetdump --output-engine uring]
+     * [packetdump --output-buffer-size 1048576]
+     * [packetdump --output-buffers 4]
+     */
+    const char *output_engine;
+    uint64_t output_buffer_size;
+    uint64_t output_buffers;
+    
+    /**
+     * Every time this many bytes have been written, start writing them
+     * to disk, and drop the previous ones from the page cache, so that
+     * dirty memory doesn't build up.
+     * [packetdump --write-behind 8388608]
+     */
+    uint64_t write_behind;
+    
+    /**
+     * Spread the output files across these directories, which are
+     * presumably on different disks, either taking turns, or weighted
+     * by how fast each has been writing.
+     * [packetdump --stripe /mnt/nvme0,/mnt/nvme1]
+     * [packetdump --stripe-mode weighted]
+     */
+    const char *stripe;
+    const char *stripe_mode;
+    
+    /**
+     * Instead of writing files, keep this many bytes of compressed
+     * packets in memory (per capture thread), and write the last so
+     * many seconds to a file when SIGUSR1 is received, when "dump" is
+     * sent to the control socket, or when a packet matches the trigger,
+     * a BPF program in 'tcpdump -ddd' format.
+     * [packetdump --flight-recorder 1073741824]
+     * [packetdump --flight-seconds 120]
+     * [packetdump --flight-socket /run/packetdump.sock]
+     * [packetdump --flight-trigger rst.bpf]
+     */
+    uint64_t flight_memory;
+    uint64_t flight_seconds;
+    const char *flight_socket;
+    const char *flight_trigger;
+
+    /**
+     * Protocol-aware truncation, keeping the packets in 'snap_keep'
+     * whole, and only the headers plus 'snap_payload' bytes of the rest.
+     * [packetdump --snap-payload 64 --snap-keep dns,tls,http,tcp/8080]
+     */
+    const char *snap_keep;
+    uint64_t snap_payload;
+    
+    /** Whether --snap-payload was given, since 0 (headers only) is a
+     * legal value, not the default */
+    char is_snap_payload;
+
+    /**
+     * Record only the first 'flow_cutoff' bytes of each flow, tracked
+     * in a table of 'flow_memory' bytes per thread.
+     * [packetdump --flow-cutoff 20000 --flow-memory 67108864]
+     */
+    uint64_t flow_cutoff;
+    uint64_t flow_memory;
+    uint64_t flow_timeout;
+    
     char is_monitor_mode;
     char is_promiscuous_mode;
     char is_compression;
     char is_gmt;
     
+    /**
+     * Write our own ".pdz" format, where the record headers are
+     * compressed separately from the packets. Selected by the suffix
+     * of the '-w' filename.
+     */
+    char is_pdz;
+
+    /**
+     * The ".pdc" variant of that, with the TCP/IP headers stored
+     * as columns.
+     */
+    char is_pdc;
+
+    /**
+     * Compress with zstd instead of LZ4, selected by a ".zst" suffix.
+     */
+    char is_zstd;
+    
+    /**
+     * Capture with the native Linux TPACKET_V3 ring rather than libpcap.
+     * Also selected by putting "tpacket:" in front of the interface name.
+     * [packetdump --tpacket]
+     */
+    char is_tpacket;
+    
+    /**
+     * When rotating by size, reserve the whole file's disk space when
+     * it's opened, so that it's not fragmented.
+     * [packetdump --preallocate]
+     */
+    char is_preallocate;
+    
+    /**
+     * Instead of capturing, run the named benchmark
+     * [packetdump --benchmark compress]
+     */
+    const char *benchmark;
+    
     char is_help;
     char is_version;
     char is_iflist;
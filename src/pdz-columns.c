@@ -0,0 +1,536 @@
+/*
+    Columnar protocol headers (".pdc")
+
+ See "pdz-columns.h" for the format. The writer and reader have to
+ make exactly the same decisions from the same bytes, so the order in
+ which fields are written to a column, and the flow table, must stay
+ in step between 'pdzcol_encode()' and 'pdzcol_decode()'.
+*/
+#include "pdz-columns.h"
+#include "pdz-file.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    COL_HEADERS,
+    COL_KIND,
+    COL_MAC,
+    COL_TOS,
+    COL_IPLEN,
+    COL_IPID,
+    COL_FRAG,
+    COL_TTL,
+    COL_ADDR,
+    COL_CHECKSUM,
+    COL_PORTS,
+    COL_SEQ,
+    COL_ACK,
+    COL_TCPFLAGS,
+    COL_WINDOW,
+    COL_URGENT,
+    COL_OPTIONS,
+    COL_UDPLEN,
+    COLUMN_COUNT
+};
+
+/* The KIND column: what the packet is, and which checksums were right */
+enum {
+    KIND_RAW = 0,
+    KIND_TCP = 1,
+    KIND_UDP = 2,
+    KIND_MASK = 0x0F,
+    KIND_IPSUM = 0x10,
+    KIND_L4SUM = 0x20,
+};
+
+enum {
+    FLOW_BITS = 12,
+    FLOW_COUNT = 1 << FLOW_BITS,
+};
+
+/**
+ * The last values seen for a flow, or rather, for whatever flows hash
+ * to this entry. Collisions only make the differences bigger.
+ */
+struct PdzFlow
+{
+    uint32_t seq;
+    uint32_t ack;
+    uint16_t ipid;
+};
+
+struct PdzColumns
+{
+    unsigned linktype;
+    struct PdzState state;
+    unsigned char *buf[COLUMN_COUNT];
+    size_t length[COLUMN_COUNT];
+    size_t total;
+    struct PdzFlow flows[FLOW_COUNT];
+};
+
+struct PdzColumnReader
+{
+    struct PdzState state;
+    const unsigned char *buf[COLUMN_COUNT];
+    size_t length[COLUMN_COUNT];
+    size_t offset[COLUMN_COUNT];
+    struct PdzFlow flows[FLOW_COUNT];
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static unsigned
+get16(const unsigned char *px)
+{
+    return (unsigned)px[0]<<8 | px[1];
+}
+static uint32_t
+get32(const unsigned char *px)
+{
+    return (uint32_t)px[0]<<24 | (uint32_t)px[1]<<16
+            | (uint32_t)px[2]<<8 | px[3];
+}
+static void
+put16(unsigned char *px, unsigned value)
+{
+    px[0] = (unsigned char)(value >> 8);
+    px[1] = (unsigned char)(value >> 0);
+}
+static void
+put32(unsigned char *px, uint32_t value)
+{
+    px[0] = (unsigned char)(value >> 24);
+    px[1] = (unsigned char)(value >> 16);
+    px[2] = (unsigned char)(value >> 8);
+    px[3] = (unsigned char)(value >> 0);
+}
+
+/***************************************************************************
+ * Hash the addresses and ports, which are next to each other when the
+ * IP header has no options.
+ ***************************************************************************/
+static unsigned
+flow_hash(const unsigned char *px)
+{
+    uint32_t x;
+
+    x = get32(px + 0) * 0x9E3779B1
+        ^ get32(px + 4) * 0x85EBCA6B
+        ^ get32(px + 8) * 0xC2B2AE35;
+    x ^= x >> 15;
+    x *= 0x2C1B3C6D;
+    return x >> (32 - FLOW_BITS);
+}
+
+/***************************************************************************
+ * The Internet checksum, leaving out the checksum field itself.
+ ***************************************************************************/
+static uint32_t
+sum16(const unsigned char *px, size_t length, uint32_t sum)
+{
+    size_t i;
+
+    for (i=0; i+1<length; i += 2)
+        sum += (uint32_t)px[i]<<8 | px[i+1];
+    if (length & 1)
+        sum += (uint32_t)px[length-1]<<8;
+    return sum;
+}
+static unsigned
+fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+static unsigned
+ip_checksum(const unsigned char *ip)
+{
+    return fold(sum16(ip + 12, 8, sum16(ip, 10, 0)));
+}
+static unsigned
+l4_checksum(const unsigned char *ip, unsigned ip_length,
+            unsigned checksum_offset)
+{
+    const unsigned char *l4 = ip + 20;
+    size_t l4_length = ip_length - 20;
+    uint32_t sum;
+
+    /* The pseudo-header */
+    sum = sum16(ip + 12, 8, 0) + ip[9] + (uint32_t)l4_length;
+
+    sum = sum16(l4, checksum_offset, sum);
+    sum = sum16(l4 + checksum_offset + 2,
+                l4_length - checksum_offset - 2, sum);
+    return fold(sum);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct PdzColumns *
+pdzcol_create(unsigned linktype, size_t size)
+{
+    struct PdzColumns *cols;
+    unsigned i;
+
+    cols = calloc(1, sizeof(*cols));
+    if (cols == NULL)
+        exit(1);
+    cols->linktype = linktype;
+
+    /* Any one column could end up with nearly all the bytes */
+    for (i=0; i<COLUMN_COUNT; i++) {
+        cols->buf[i] = malloc(size);
+        if (cols->buf[i] == NULL)
+            exit(1);
+    }
+    return cols;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+pdzcol_destroy(struct PdzColumns *cols)
+{
+    unsigned i;
+
+    if (cols == NULL)
+        return;
+    for (i=0; i<COLUMN_COUNT; i++)
+        free(cols->buf[i]);
+    free(cols);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+col_put(struct PdzColumns *cols, unsigned col,
+        const unsigned char *px, size_t length)
+{
+    memcpy(cols->buf[col] + cols->length[col], px, length);
+    cols->length[col] += length;
+    cols->total += length;
+}
+static void
+col_put_varint(struct PdzColumns *cols, unsigned col, uint32_t value)
+{
+    size_t length;
+
+    length = pdz_put_varint(cols->buf[col] + cols->length[col], value);
+    cols->length[col] += length;
+    cols->total += length;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+pdzcol_encode(struct PdzColumns *cols,
+              uint32_t secs, uint32_t usecs,
+              const unsigned char *px, uint32_t caplen, uint32_t len)
+{
+    const unsigned char *ip = px + 14;
+    const unsigned char *l4 = ip + 20;
+    struct PdzFlow *flow;
+    unsigned char kind = KIND_RAW;
+    size_t header_length = 0;
+    unsigned checksum_offset;
+    unsigned ip_length;
+    unsigned ipid;
+    size_t length;
+
+    length = pdz_encode(&cols->state,
+                        cols->buf[COL_HEADERS] + cols->length[COL_HEADERS],
+                        secs, usecs, caplen, len);
+    cols->length[COL_HEADERS] += length;
+    cols->total += length;
+
+    /* Ethernet, IPv4 without options, and not a fragment */
+    if (cols->linktype == 1 && caplen >= 34
+        && px[12] == 0x08 && px[13] == 0x00
+        && ip[0] == 0x45 && (get16(ip + 6) & 0x3FFF) == 0) {
+        if (ip[9] == 6 && caplen >= 54 && (l4[12] >> 4) >= 5
+            && caplen >= 34 + (l4[12] >> 4) * 4u) {
+            kind = KIND_TCP;
+            header_length = 34 + (l4[12] >> 4) * 4u;
+        } else if (ip[9] == 17 && caplen >= 42) {
+            kind = KIND_UDP;
+            header_length = 42;
+        }
+    }
+    if (kind == KIND_RAW) {
+        col_put(cols, COL_KIND, &kind, 1);
+        return 0;
+    }
+    checksum_offset = (kind == KIND_TCP) ? 16 : 6;
+
+    /* The checksums we can recreate, which for TCP and UDP needs
+     * the whole datagram */
+    ip_length = get16(ip + 2);
+    if (ip_checksum(ip) == get16(ip + 10))
+        kind |= KIND_IPSUM;
+    if (ip_length >= header_length - 14 && 14 + ip_length <= caplen
+        && l4_checksum(ip, ip_length, checksum_offset)
+                == get16(l4 + checksum_offset))
+        kind |= KIND_L4SUM;
+
+    col_put(cols, COL_KIND, &kind, 1);
+    col_put(cols, COL_MAC, px, 12);
+    col_put(cols, COL_TOS, ip + 1, 1);
+    col_put_varint(cols, COL_IPLEN, pdz_zigzag(ip_length - (len - 14)));
+    col_put(cols, COL_FRAG, ip + 6, 2);
+    col_put(cols, COL_TTL, ip + 8, 1);
+    col_put(cols, COL_ADDR, ip + 12, 8);
+    col_put(cols, COL_PORTS, l4, 4);
+    if (!(kind & KIND_IPSUM))
+        col_put(cols, COL_CHECKSUM, ip + 10, 2);
+
+    flow = &cols->flows[flow_hash(ip + 12)];
+    ipid = get16(ip + 4);
+    col_put_varint(cols, COL_IPID,
+                   pdz_zigzag((uint32_t)(int32_t)(int16_t)(ipid - flow->ipid)));
+    flow->ipid = (uint16_t)ipid;
+
+    if ((kind & KIND_MASK) == KIND_TCP) {
+        uint32_t seq = get32(l4 + 4);
+        uint32_t ack = get32(l4 + 8);
+
+        col_put_varint(cols, COL_SEQ, pdz_zigzag(seq - flow->seq));
+        col_put_varint(cols, COL_ACK, pdz_zigzag(ack - flow->ack));
+        flow->seq = seq;
+        flow->ack = ack;
+        col_put(cols, COL_TCPFLAGS, l4 + 12, 2);
+        col_put(cols, COL_WINDOW, l4 + 14, 2);
+        col_put(cols, COL_URGENT, l4 + 18, 2);
+        col_put(cols, COL_OPTIONS, l4 + 20, header_length - 54);
+    } else {
+        col_put_varint(cols, COL_UDPLEN,
+                       pdz_zigzag(get16(l4 + 4) - (ip_length - 20)));
+    }
+    if (!(kind & KIND_L4SUM))
+        col_put(cols, COL_CHECKSUM, l4 + checksum_offset, 2);
+
+    return header_length;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+pdzcol_length(const struct PdzColumns *cols)
+{
+    return 1 + COLUMN_COUNT * 5 + cols->total;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+pdzcol_finish(struct PdzColumns *cols, unsigned char *dst)
+{
+    size_t length = 0;
+    unsigned i;
+
+    dst[length++] = COLUMN_COUNT;
+    for (i=0; i<COLUMN_COUNT; i++)
+        length += pdz_put_varint(dst + length, (uint32_t)cols->length[i]);
+    for (i=0; i<COLUMN_COUNT; i++) {
+        memcpy(dst + length, cols->buf[i], cols->length[i]);
+        length += cols->length[i];
+        cols->length[i] = 0;
+    }
+
+    cols->total = 0;
+    memset(&cols->state, 0, sizeof(cols->state));
+    memset(cols->flows, 0, sizeof(cols->flows));
+    return length;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct PdzColumnReader *
+pdzcol_reader_create(void)
+{
+    struct PdzColumnReader *reader;
+
+    reader = calloc(1, sizeof(*reader));
+    if (reader == NULL)
+        exit(1);
+    return reader;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+pdzcol_reader_destroy(struct PdzColumnReader *reader)
+{
+    free(reader);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+pdzcol_load(struct PdzColumnReader *reader,
+            const unsigned char *px, size_t length)
+{
+    size_t offset = 1;
+    size_t total = 0;
+    unsigned i;
+
+    if (length < 1 || px[0] != COLUMN_COUNT)
+        return 0;
+    for (i=0; i<COLUMN_COUNT; i++) {
+        uint32_t n;
+        if (!pdz_get_varint(px, length, &offset, &n))
+            return 0;
+        reader->length[i] = n;
+        total += n;
+    }
+    if (total != length - offset)
+        return 0;
+
+    for (i=0; i<COLUMN_COUNT; i++) {
+        reader->buf[i] = px + offset;
+        reader->offset[i] = 0;
+        offset += reader->length[i];
+    }
+    memset(&reader->state, 0, sizeof(reader->state));
+    memset(reader->flows, 0, sizeof(reader->flows));
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+pdzcol_is_done(const struct PdzColumnReader *reader)
+{
+    return reader->offset[COL_HEADERS] >= reader->length[COL_HEADERS];
+}
+
+/***************************************************************************
+ * @return 1 on success, or 0 if the column has run out
+ ***************************************************************************/
+static int
+col_get(struct PdzColumnReader *reader, unsigned col,
+        unsigned char *dst, size_t length)
+{
+    if (reader->length[col] - reader->offset[col] < length)
+        return 0;
+    memcpy(dst, reader->buf[col] + reader->offset[col], length);
+    reader->offset[col] += length;
+    return 1;
+}
+static int
+col_get_varint(struct PdzColumnReader *reader, unsigned col, uint32_t *value)
+{
+    return pdz_get_varint(reader->buf[col], reader->length[col],
+                          &reader->offset[col], value);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+pdzcol_decode(struct PdzColumnReader *reader,
+              struct pcap_pkthdr *hdr,
+              const unsigned char *payload, size_t payload_length,
+              size_t *r_used,
+              unsigned char *packet)
+{
+    unsigned char *ip = packet + 14;
+    unsigned char *l4 = ip + 20;
+    struct PdzFlow *flow;
+    unsigned char kind;
+    size_t header_length;
+    unsigned checksum_offset;
+    unsigned ip_length;
+    uint32_t value;
+
+    if (!pdz_decode(&reader->state, reader->buf[COL_HEADERS],
+                    reader->length[COL_HEADERS], &reader->offset[COL_HEADERS],
+                    hdr))
+        return 0;
+    if (hdr->caplen > PDZ_MAX_PACKET || !col_get(reader, COL_KIND, &kind, 1))
+        return 0;
+
+    if ((kind & KIND_MASK) == KIND_RAW) {
+        if (hdr->caplen > payload_length)
+            return 0;
+        memcpy(packet, payload, hdr->caplen);
+        *r_used = hdr->caplen;
+        return 1;
+    } else if ((kind & KIND_MASK) == KIND_TCP) {
+        header_length = 54;
+        checksum_offset = 16;
+    } else if ((kind & KIND_MASK) == KIND_UDP) {
+        header_length = 42;
+        checksum_offset = 6;
+    } else
+        return 0;
+    if (hdr->caplen < header_length)
+        return 0;
+
+    packet[12] = 0x08;
+    packet[13] = 0x00;
+    ip[0] = 0x45;
+    ip[9] = ((kind & KIND_MASK) == KIND_TCP) ? 6 : 17;
+    if (!col_get(reader, COL_MAC, packet, 12)
+        || !col_get(reader, COL_TOS, ip + 1, 1)
+        || !col_get_varint(reader, COL_IPLEN, &value)
+        || !col_get(reader, COL_FRAG, ip + 6, 2)
+        || !col_get(reader, COL_TTL, ip + 8, 1)
+        || !col_get(reader, COL_ADDR, ip + 12, 8)
+        || !col_get(reader, COL_PORTS, l4, 4))
+        return 0;
+    ip_length = (hdr->len - 14 + pdz_unzigzag(value)) & 0xFFFF;
+    put16(ip + 2, ip_length);
+    if (!(kind & KIND_IPSUM) && !col_get(reader, COL_CHECKSUM, ip + 10, 2))
+        return 0;
+
+    flow = &reader->flows[flow_hash(ip + 12)];
+    if (!col_get_varint(reader, COL_IPID, &value))
+        return 0;
+    flow->ipid = (uint16_t)(flow->ipid + pdz_unzigzag(value));
+    put16(ip + 4, flow->ipid);
+
+    if ((kind & KIND_MASK) == KIND_TCP) {
+        uint32_t seq, ack;
+
+        if (!col_get_varint(reader, COL_SEQ, &seq)
+            || !col_get_varint(reader, COL_ACK, &ack)
+            || !col_get(reader, COL_TCPFLAGS, l4 + 12, 2)
+            || !col_get(reader, COL_WINDOW, l4 + 14, 2)
+            || !col_get(reader, COL_URGENT, l4 + 18, 2))
+            return 0;
+        flow->seq += pdz_unzigzag(seq);
+        flow->ack += pdz_unzigzag(ack);
+        put32(l4 + 4, flow->seq);
+        put32(l4 + 8, flow->ack);
+
+        header_length = 34 + (l4[12] >> 4) * 4u;
+        if ((l4[12] >> 4) < 5 || hdr->caplen < header_length
+            || !col_get(reader, COL_OPTIONS, l4 + 20, header_length - 54))
+            return 0;
+    } else {
+        if (!col_get_varint(reader, COL_UDPLEN, &value))
+            return 0;
+        put16(l4 + 4, (ip_length - 20 + pdz_unzigzag(value)) & 0xFFFF);
+    }
+    if (!(kind & KIND_L4SUM)
+        && !col_get(reader, COL_CHECKSUM, l4 + checksum_offset, 2))
+        return 0;
+
+    /* The payload */
+    if (hdr->caplen - header_length > payload_length)
+        return 0;
+    memcpy(packet + header_length, payload, hdr->caplen - header_length);
+    *r_used = hdr->caplen - header_length;
+
+    /* Now that everything they cover is in place */
+    if (kind & KIND_IPSUM)
+        put16(ip + 10, ip_checksum(ip));
+    if (kind & KIND_L4SUM) {
+        if (ip_length < header_length - 14 || 14 + ip_length > hdr->caplen)
+            return 0;
+        put16(l4 + checksum_offset,
+              l4_checksum(ip, ip_length, checksum_offset));
+    }
+    return 1;
+}
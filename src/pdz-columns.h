@@ -0,0 +1,112 @@
+/*
+    Columnar protocol headers (".pdc")
+
+ A variant of the ".pdz" format (file version 2) for Ethernet captures.
+ Each IPv4 packet carrying TCP or UDP is taken apart into its header
+ fields, and each field is appended to its own column: all the MAC
+ addresses of a chunk one after the other, then all the TTLs, then all
+ the ports, and so on. Only the payload after the TCP/UDP header goes
+ into the packet stream. Everything else (ARP, IPv6, fragments,
+ truncated headers) goes into the packet stream whole.
+
+ Within a column the values repeat a lot, which is what LZ4 is good
+ at, whereas interleaved with the payloads they mostly don't. On top
+ of that, some fields are stored as predictions instead of values:
+
+    the IP length, relative to the length of the frame
+
+    the IP ID, and the TCP sequence and acknowledgement numbers, as
+    the difference from the last packet of the same flow in this chunk,
+    using a small hash table that the reader rebuilds the same way
+
+    the UDP length, relative to the IP length
+
+    the checksums, as a flag saying they're correct, so that only
+    wrong ones (such as offloaded ones) are stored
+
+ The chunk's 'headers' block holds the columns: a byte with the number
+ of columns, the length of each as a variable-length integer, then the
+ columns themselves, one after the other. The first column is the
+ record headers, encoded the same way as in a ".pdz" file.
+
+ Reading a chunk gives back exactly the same bytes that were written.
+*/
+#ifndef PDZ_COLUMNS_H
+#define PDZ_COLUMNS_H
+#include "rawsock-pcap.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    PDZ_VERSION_COLUMNS = 2,
+
+    /* The most column bytes a single packet can add, including its
+     * share of the column table */
+    PDZ_COLUMNS_MAX_RECORD = 160,
+};
+
+struct PdzColumns;
+
+/**
+ * Create the columns for writing a chunk, where the columns together
+ * can take up to 'size' bytes.
+ */
+struct PdzColumns *pdzcol_create(unsigned linktype, size_t size);
+
+void pdzcol_destroy(struct PdzColumns *cols);
+
+/**
+ * Add a packet's record header and protocol headers to the columns.
+ * @return the number of bytes at the start of the packet that went
+ *      into the columns. The rest is the payload, for the packet
+ *      stream.
+ */
+size_t pdzcol_encode(struct PdzColumns *cols,
+                     uint32_t secs, uint32_t usecs,
+                     const unsigned char *px, uint32_t caplen, uint32_t len);
+
+/**
+ * The number of bytes 'pdzcol_finish()' would produce now.
+ */
+size_t pdzcol_length(const struct PdzColumns *cols);
+
+/**
+ * Write out the column table and columns, and start over for the next
+ * chunk.
+ * @return the number of bytes
+ */
+size_t pdzcol_finish(struct PdzColumns *cols, unsigned char *dst);
+
+struct PdzColumnReader;
+
+struct PdzColumnReader *pdzcol_reader_create(void);
+
+void pdzcol_reader_destroy(struct PdzColumnReader *reader);
+
+/**
+ * Start reading a chunk's columns. The buffer must stay unchanged
+ * until the chunk is done.
+ * @return 1 on success, or 0 if the column table is corrupt
+ */
+int pdzcol_load(struct PdzColumnReader *reader,
+                const unsigned char *px, size_t length);
+
+/**
+ * Check whether all the records of the chunk have been read.
+ */
+int pdzcol_is_done(const struct PdzColumnReader *reader);
+
+/**
+ * Rebuild the next packet into 'packet', which must hold PDZ_MAX_PACKET
+ * bytes, taking its payload from the packet stream.
+ * @param r_used
+ *      Set to the number of payload bytes used.
+ * @return 1 on success, or 0 if the chunk is corrupt
+ */
+int pdzcol_decode(struct PdzColumnReader *reader,
+                  struct pcap_pkthdr *hdr,
+                  const unsigned char *payload, size_t payload_length,
+                  size_t *r_used,
+                  unsigned char *packet);
+
+#endif
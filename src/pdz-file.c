@@ -0,0 +1,369 @@
+/*
+    Packetdump's own compressed container (".pdz")
+
+ The writing side is in "rawsock-pcapfile.c", which builds the two
+ streams and compresses them like its LZ4 blocks. This has the format
+ details, and the reader.
+*/
+#include "pdz-file.h"
+#include "pdz-columns.h"
+#include "lz4/lz4.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    /* Don't believe a file that wants chunks bigger than this */
+    PDZ_MAX_CHUNK = 64 * 1024 * 1024,
+};
+
+struct PdzReader
+{
+    FILE *fp;
+    char *filename;
+    unsigned linktype;
+    size_t chunk_size;
+
+    /** Holds a compressed block */
+    unsigned char *block;
+
+    /** The current chunk's two streams, and how far we've read */
+    unsigned char *headers;
+    size_t headers_length;
+    size_t headers_offset;
+    unsigned char *packets;
+    size_t packets_length;
+    size_t packets_offset;
+
+    struct PdzState state;
+    unsigned is_done:1;
+
+    /** For version 2 files, the columns in 'headers', and the packet
+     * being put back together from them */
+    struct PdzColumnReader *columns;
+    unsigned char *packet;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+put32(unsigned char *px, uint32_t value)
+{
+    px[0] = (unsigned char)(value >> 0);
+    px[1] = (unsigned char)(value >> 8);
+    px[2] = (unsigned char)(value >> 16);
+    px[3] = (unsigned char)(value >> 24);
+}
+static uint32_t
+get32(const unsigned char *px)
+{
+    return (uint32_t)px[0] | (uint32_t)px[1] << 8
+            | (uint32_t)px[2] << 16 | (uint32_t)px[3] << 24;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+pdz_file_header(unsigned char *px, unsigned version,
+                unsigned linktype, size_t chunk_size)
+{
+    memcpy(px, "PDZ\x01", 4);
+    px[4] = (unsigned char)version;
+    px[5] = 0;
+    px[6] = 0;
+    px[7] = 0;
+    put32(px + 8, linktype);
+    put32(px + 12, (uint32_t)chunk_size);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+pdz_is_pdz(const unsigned char *px, size_t length)
+{
+    return length >= 4 && memcmp(px, "PDZ\x01", 4) == 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+pdz_put_varint(unsigned char *px, uint32_t value)
+{
+    size_t i = 0;
+
+    while (value >= 0x80) {
+        px[i++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    px[i++] = (unsigned char)value;
+    return i;
+}
+uint32_t
+pdz_zigzag(uint32_t value)
+{
+    return (value << 1) ^ (uint32_t)-(int32_t)(value >> 31);
+}
+uint32_t
+pdz_unzigzag(uint32_t value)
+{
+    return (value >> 1) ^ (uint32_t)-(int32_t)(value & 1);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+pdz_encode(struct PdzState *state, unsigned char *px,
+           uint32_t secs, uint32_t usecs,
+           uint32_t caplen, uint32_t len)
+{
+    size_t length = 0;
+
+    length += pdz_put_varint(px + length, pdz_zigzag(secs - state->secs));
+    length += pdz_put_varint(px + length, pdz_zigzag(usecs - state->usecs));
+    length += pdz_put_varint(px + length, caplen);
+    length += pdz_put_varint(px + length, pdz_zigzag(len - caplen));
+    state->secs = secs;
+    state->usecs = usecs;
+    return length;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+pdz_get_varint(const unsigned char *px, size_t length, size_t *offset,
+           uint32_t *result)
+{
+    uint32_t value = 0;
+    unsigned shift;
+
+    for (shift=0; shift<35; shift += 7) {
+        unsigned c;
+        if (*offset >= length)
+            return 0;
+        c = px[(*offset)++];
+        value |= (uint32_t)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0) {
+            *result = value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+pdz_decode(struct PdzState *state, const unsigned char *px, size_t length,
+           size_t *offset, struct pcap_pkthdr *hdr)
+{
+    uint32_t secs, usecs, caplen, extra;
+    size_t i = *offset;
+
+    if (!pdz_get_varint(px, length, &i, &secs)
+        || !pdz_get_varint(px, length, &i, &usecs)
+        || !pdz_get_varint(px, length, &i, &caplen)
+        || !pdz_get_varint(px, length, &i, &extra))
+        return 0;
+    *offset = i;
+
+    state->secs += pdz_unzigzag(secs);
+    state->usecs += pdz_unzigzag(usecs);
+    hdr->ts.tv_sec = (long)state->secs;
+    hdr->ts.tv_usec = (long)state->usecs;
+    hdr->caplen = caplen;
+    hdr->len = caplen + pdz_unzigzag(extra);
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct PdzReader *
+pdzreader_open(const char *filename)
+{
+    struct PdzReader *reader;
+    unsigned char header[PDZ_FILE_HEADER_SIZE];
+    FILE *fp;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        perror(filename);
+        return NULL;
+    }
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header)
+        || !pdz_is_pdz(header, sizeof(header))
+        || (header[4] != 1 && header[4] != PDZ_VERSION_COLUMNS)) {
+        fprintf(stderr, "%s: not a version 1 or 2 .pdz file\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    reader = calloc(1, sizeof(*reader));
+    if (reader == NULL)
+        exit(1);
+    reader->fp = fp;
+    reader->filename = strdup(filename);
+    reader->linktype = get32(header + 8);
+    reader->chunk_size = get32(header + 12);
+    if (reader->chunk_size == 0 || reader->chunk_size > PDZ_MAX_CHUNK) {
+        fprintf(stderr, "%s: bad chunk size %u\n", filename,
+                (unsigned)reader->chunk_size);
+        pdzreader_close(reader);
+        return NULL;
+    }
+    reader->block = malloc(LZ4_compressBound((int)reader->chunk_size));
+    reader->headers = malloc(reader->chunk_size);
+    reader->packets = malloc(reader->chunk_size);
+    if (reader->filename == NULL || reader->block == NULL
+        || reader->headers == NULL || reader->packets == NULL)
+        exit(1);
+    if (header[4] == PDZ_VERSION_COLUMNS) {
+        reader->columns = pdzcol_reader_create();
+        reader->packet = malloc(PDZ_MAX_PACKET);
+        if (reader->packet == NULL)
+            exit(1);
+    }
+    return reader;
+}
+
+/***************************************************************************
+ * Read one block and decompress it into the buffer.
+ * @return 1 on success, 0 at the end mark, or -1 on error
+ ***************************************************************************/
+static int
+read_block(struct PdzReader *reader, unsigned char *buf, size_t *r_length)
+{
+    unsigned char prefix[4];
+    size_t length;
+    int is_stored;
+
+    if (fread(prefix, 1, 4, reader->fp) != 4) {
+        fprintf(stderr, "%s: truncated\n", reader->filename);
+        return -1;
+    }
+    length = get32(prefix) & 0x7FFFFFFF;
+    is_stored = (prefix[3] & 0x80) != 0;
+    if (length == 0 && !is_stored)
+        return 0;
+    if (length > (size_t)LZ4_compressBound((int)reader->chunk_size)
+        || (is_stored && length > reader->chunk_size)) {
+        fprintf(stderr, "%s: bad block length %u\n", reader->filename,
+                (unsigned)length);
+        return -1;
+    }
+
+    if (is_stored) {
+        if (fread(buf, 1, length, reader->fp) != length) {
+            fprintf(stderr, "%s: truncated\n", reader->filename);
+            return -1;
+        }
+        *r_length = length;
+    } else {
+        int x;
+        if (fread(reader->block, 1, length, reader->fp) != length) {
+            fprintf(stderr, "%s: truncated\n", reader->filename);
+            return -1;
+        }
+        x = LZ4_decompress_safe((const char *)reader->block, (char *)buf,
+                                (int)length, (int)reader->chunk_size);
+        if (x < 0) {
+            fprintf(stderr, "%s: corrupt block\n", reader->filename);
+            return -1;
+        }
+        *r_length = (size_t)x;
+    }
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+pdzreader_next(struct PdzReader *reader,
+               struct pcap_pkthdr *hdr,
+               const unsigned char **r_buf)
+{
+    int x;
+
+    if (reader->is_done)
+        return 0;
+
+    /* At the end of a chunk, read the next one */
+    while (reader->columns ? pdzcol_is_done(reader->columns)
+                           : reader->headers_offset >= reader->headers_length) {
+        if (reader->packets_offset != reader->packets_length) {
+            fprintf(stderr, "%s: extra packet data\n", reader->filename);
+            return -1;
+        }
+        x = read_block(reader, reader->headers, &reader->headers_length);
+        if (x == 0) {
+            reader->is_done = 1;
+            return 0;
+        }
+        if (x < 0)
+            return -1;
+        x = read_block(reader, reader->packets, &reader->packets_length);
+        if (x <= 0) {
+            if (x == 0)
+                fprintf(stderr, "%s: truncated chunk\n", reader->filename);
+            return -1;
+        }
+        reader->headers_offset = 0;
+        reader->packets_offset = 0;
+        memset(&reader->state, 0, sizeof(reader->state));
+        if (reader->columns && !pdzcol_load(reader->columns, reader->headers,
+                                            reader->headers_length)) {
+            fprintf(stderr, "%s: corrupt column table\n", reader->filename);
+            return -1;
+        }
+    }
+
+    if (reader->columns) {
+        size_t used;
+
+        if (!pdzcol_decode(reader->columns, hdr,
+                           reader->packets + reader->packets_offset,
+                           reader->packets_length - reader->packets_offset,
+                           &used, reader->packet)) {
+            fprintf(stderr, "%s: corrupt columns\n", reader->filename);
+            return -1;
+        }
+        reader->packets_offset += used;
+        *r_buf = reader->packet;
+        return 1;
+    }
+
+    if (!pdz_decode(&reader->state, reader->headers, reader->headers_length,
+                    &reader->headers_offset, hdr)
+        || hdr->caplen > reader->packets_length - reader->packets_offset) {
+        fprintf(stderr, "%s: corrupt header\n", reader->filename);
+        return -1;
+    }
+
+    *r_buf = reader->packets + reader->packets_offset;
+    reader->packets_offset += hdr->caplen;
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+pdzreader_linktype(const struct PdzReader *reader)
+{
+    return reader->linktype;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+pdzreader_close(struct PdzReader *reader)
+{
+    if (reader == NULL)
+        return;
+    fclose(reader->fp);
+    free(reader->filename);
+    free(reader->block);
+    free(reader->headers);
+    free(reader->packets);
+    free(reader->packet);
+    pdzcol_reader_destroy(reader->columns);
+    free(reader);
+}
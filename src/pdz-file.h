@@ -0,0 +1,136 @@
+/*
+    Packetdump's own compressed container (".pdz")
+
+ In a pcap file, every packet is preceded by a 16-byte record header:
+ seconds, microseconds, captured length, and original length. Those
+ bytes change with every packet, so when they're interleaved with the
+ packet contents, LZ4 finds few matches in them, and they also break up
+ the matches between one packet and the next.
+
+ This format stores the record headers as their own stream, separate
+ from the packet contents. Each header is stored as the difference from
+ the previous one, as variable-length integers, so that a typical header
+ takes 4 or 5 bytes instead of 16. The two streams are compressed as
+ separate LZ4 blocks.
+
+ The file is:
+
+    "PDZ\1", a 16-bit version, 16 reserved bits, the 32-bit link type,
+    and the 32-bit maximum size of either stream in a chunk, all
+    little-endian
+
+    chunks, each being two blocks: first the headers, then the packet
+    contents, one after the other. Each block is a 4-byte little-endian
+    length followed by that many bytes of LZ4 data, or if the high bit
+    of the length is set, the data stored uncompressed, exactly like
+    the blocks of an LZ4 frame.
+
+    4 zero bytes to mark the end
+
+ A record never crosses from one chunk to the next, and each chunk's
+ differences start from zero, so every chunk can be decoded by itself.
+
+ Each header is four variable-length integers (7 bits per byte, low
+ bits first, the high bit set when more bytes follow):
+
+    the change in seconds, zigzag encoded so small negative numbers
+    are small too
+
+    the change in microseconds, zigzag encoded
+
+    the captured length
+
+    the original length minus the captured length, zigzag encoded
+
+ Reading the file gives back exactly the same records that were
+ written.
+*/
+#ifndef PDZ_FILE_H
+#define PDZ_FILE_H
+#include "rawsock-pcap.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    PDZ_FILE_HEADER_SIZE = 16,
+
+    /* The most bytes an encoded record header can take */
+    PDZ_MAX_HEADER = 4 * 5,
+
+    /* The biggest packet there can be, so a chunk must be able to hold
+     * at least this */
+    PDZ_MAX_PACKET = 262144,
+};
+
+/**
+ * The previous header, which the next one is stored relative to. This
+ * is zeroed at the start of each chunk.
+ */
+struct PdzState
+{
+    uint32_t secs;
+    uint32_t usecs;
+};
+
+/**
+ * Format the file header. Version 1 is described here, version 2 in
+ * "pdz-columns.h".
+ */
+void pdz_file_header(unsigned char *px, unsigned version,
+                     unsigned linktype, size_t chunk_size);
+
+/**
+ * Encode a record header into at most PDZ_MAX_HEADER bytes.
+ * @return the number of bytes
+ */
+size_t pdz_encode(struct PdzState *state, unsigned char *px,
+                  uint32_t secs, uint32_t usecs,
+                  uint32_t caplen, uint32_t len);
+
+/**
+ * Decode a record header at 'offset', moving it past the header.
+ * @return 1 on success, or 0 if it runs off the end of the buffer
+ */
+int pdz_decode(struct PdzState *state, const unsigned char *px, size_t length,
+               size_t *offset, struct pcap_pkthdr *hdr);
+
+/**
+ * The variable-length integers, and zigzag encoding for signed values,
+ * which are also used by the columns in "pdz-columns.c".
+ */
+size_t pdz_put_varint(unsigned char *px, uint32_t value);
+int pdz_get_varint(const unsigned char *px, size_t length, size_t *offset,
+                   uint32_t *result);
+uint32_t pdz_zigzag(uint32_t value);
+uint32_t pdz_unzigzag(uint32_t value);
+
+/**
+ * Check whether this is the start of a .pdz file.
+ */
+int pdz_is_pdz(const unsigned char *px, size_t length);
+
+struct PdzReader;
+
+/**
+ * Open a file for reading. The caller has already checked that it
+ * starts with the magic bytes.
+ * @return the reader, or NULL on error, after printing a message
+ */
+struct PdzReader *pdzreader_open(const char *filename);
+
+/**
+ * Get the next record.
+ * @param r_buf
+ *      Set to the packet contents, which stay valid until the next call.
+ * @return 1 for a record, 0 at the end of the file, or -1 if the file
+ * is corrupt or can't be read, after printing a message
+ */
+int pdzreader_next(struct PdzReader *reader,
+                   struct pcap_pkthdr *hdr,
+                   const unsigned char **r_buf);
+
+unsigned pdzreader_linktype(const struct PdzReader *reader);
+
+void pdzreader_close(struct PdzReader *reader);
+
+#endif
@@ -56,7 +56,7 @@ DWORD_PTR result;
 
 /****************************************************************************
  * Set the current thread (implicit) to run exclusively on the explicit
- * process.
+ * processor, numbered starting at zero.
  * http://en.wikipedia.org/wiki/Processor_affinity
  ****************************************************************************/
 void
@@ -65,8 +65,6 @@ pixie_cpu_set_affinity(unsigned processor)
 #if defined WIN32
     DWORD_PTR mask;
     DWORD_PTR result;
-    if (processor > 0)
-        processor--;
     mask = ((size_t)1)<<processor;
 
     //printf("mask(%u) = 0x%08x\n", processor, mask);
@@ -81,7 +79,7 @@ pixie_cpu_set_affinity(unsigned processor)
 
     CPU_ZERO(&cpuset);
 
-    CPU_SET(processor+1, &cpuset);
+    CPU_SET(processor, &cpuset);
 
     x = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
     if (x != 0) {
@@ -100,6 +100,11 @@ DECLARESTUB(setdirection);
 DECLARESTUB(datalink_val_to_name);
 DECLARESTUB(perror);
 DECLARESTUB(stats);
+DECLARESTUB(compile);
+DECLARESTUB(setfilter);
+DECLARESTUB(freecode);
+DECLARESTUB(geterr);
+DECLARESTUB(open_dead);
 
 
 
@@ -292,6 +297,11 @@ pl->func_err=0, pl->datalink = null_##PCAP_DATALINK;
     DYNLINK(sendpacket);
     DYNLINK(setdirection);
     DYNLINK(stats);
+    DYNLINK(compile);
+    DYNLINK(setfilter);
+    DYNLINK(freecode);
+    DYNLINK(geterr);
+    DYNLINK(open_dead);
 
     DYNLINK(create);
     DYNLINK(set_snaplen);
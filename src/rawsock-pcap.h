@@ -66,6 +66,20 @@ struct pcap_pkthdr {
 #endif
 };
 
+/* A compiled filter, as from pcap_compile(). The instructions have the
+ * same layout as our 'struct BpfInsn' and the kernel's 'sock_filter' */
+struct bpf_insn {
+    unsigned short code;
+    unsigned char jt;
+    unsigned char jf;
+    unsigned k;
+};
+struct bpf_program {
+    unsigned bf_len;
+    struct bpf_insn *bf_insns;
+};
+#define PCAP_NETMASK_UNKNOWN 0xffffffff
+
 struct pcap_stat {
     unsigned ps_recv;		/* number of packets received */
     unsigned ps_drop;		/* number of packets dropped */
@@ -103,6 +117,11 @@ typedef void        (*PCAP_perror)(pcap_t *p, const char *prefix);
 typedef int         (*PCAP_sendpacket)(pcap_t *p, const unsigned char *buf, int size);
 typedef int         (*PCAP_setdirection)(pcap_t *, pcap_direction_t);
 typedef int         (*PCAP_stats)(pcap_t *p, struct pcap_stat *ps);
+typedef int         (*PCAP_compile)(pcap_t *p, struct bpf_program *fp, const char *str, int optimize, unsigned netmask);
+typedef int         (*PCAP_setfilter)(pcap_t *p, struct bpf_program *fp);
+typedef void        (*PCAP_freecode)(struct bpf_program *fp);
+typedef char *      (*PCAP_geterr)(pcap_t *p);
+typedef pcap_t *    (*PCAP_open_dead)(int linktype, int snaplen);
 
 /*
  * New PCAP
@@ -163,6 +182,11 @@ struct PcapFunctions {
     PCAP_sendpacket         sendpacket;
     PCAP_setdirection       setdirection;
     PCAP_stats              stats;
+    PCAP_compile            compile;
+    PCAP_setfilter          setfilter;
+    PCAP_freecode           freecode;
+    PCAP_geterr             geterr;
+    PCAP_open_dead          open_dead;
     
     /* New PCAP */
     PCAP_create             create;
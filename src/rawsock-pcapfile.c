@@ -29,7 +29,17 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include "rawsock-pcapfile.h"
+#include "compress-control.h"
+#include "compress-pool.h"
+#include "output-file.h"
+#include "compress-dict.h"
+#include "pdz-columns.h"
+#include "pdz-file.h"
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#include "codec-zstd.h"
 #include "lz4/lz4frame.h"
+#include "lz4/xxhash.h"
 
 /****************************************************************************
  * <PORTABILITY BLOCK>
@@ -135,11 +145,17 @@ Link-layer type:
 
 struct PcapFile
 {
+    /** For reading */
     FILE *fp;
+
+    /** For writing */
+    struct OutputFile *out;
     LZ4F_compressionContext_t ctx;
 
     unsigned is_compression:1;
     unsigned is_file_header_written:1;
+    unsigned is_zerocopy:1;
+    unsigned is_pdz:1;
 
     unsigned start_sec;
     unsigned start_usec;
@@ -158,6 +174,96 @@ struct PcapFile
      */
     unsigned char *aio_buffer;
     size_t aio_buffer_size;
+
+    /**
+     * When compressing in blocks, records accumulate here until there's
+     * a full block, which is then compressed with a single call. The
+     * time is when the oldest data was added, in microseconds. This
+     * points into the 'src' buffer of the current job.
+     */
+    unsigned char *staging;
+    size_t staging_size;
+    size_t staging_length;
+    uint64_t staging_time;
+    uint64_t flush_usecs;
+
+    /**
+     * For .pdz files, the record headers are encoded here, into the
+     * 'meta' buffer of the current job, while the packets go into the
+     * staging buffer.
+     */
+    unsigned char *meta;
+    size_t meta_size;
+    size_t meta_length;
+    struct PdzState pdz_state;
+
+    /** For .pdc files, the protocol headers are split into columns
+     * here, which are copied into 'meta' when the chunk is submitted */
+    struct PdzColumns *columns;
+
+    /**
+     * Without compression, records are instead gathered here, then
+     * written with a single 'writev()'. With zero-copy, the contents of
+     * larger packets aren't copied, but pointed to, and 'references'
+     * counts them. The 'staging_time' above is when the first record
+     * was added, and 'gather_timestamp' is that packet's timestamp.
+     * Checking the packet timestamps rather than the clock is much
+     * cheaper for tiny packets, and just as good while they're arriving.
+     */
+    unsigned char *gather;
+    size_t gather_size;
+    size_t gather_length;
+    struct iovec *iov;
+    unsigned iov_count;
+    unsigned iov_max;
+    unsigned references;
+    uint64_t gather_timestamp;
+
+    /**
+     * Each block is a compression job. Without a pool there's only one
+     * job, compressed in this thread. With a pool, there are several
+     * in flight at once, and they are written to the file in the order
+     * they were submitted, regardless of the order they finish.
+     */
+    struct CompressJob *jobs;
+    unsigned job_count;
+    uint64_t jobs_submitted;
+    uint64_t jobs_written;
+    int compression_level;
+    struct CompressPool *pool;
+    struct CompressState compress_state;
+
+    /**
+     * Chooses the level of each block, if set. Without a pool, it needs
+     * to know how long compressing takes compared to the time between
+     * blocks.
+     */
+    struct CompressControl *control;
+    uint64_t compress_usecs;
+    uint64_t last_submit;
+
+    /**
+     * Holds the compressed output before it's written to the file, big
+     * enough for the worst case.
+     */
+    unsigned char *outbuf;
+    size_t outbuf_size;
+
+    /**
+     * With a streaming codec like zstd, records are staged in the same
+     * way, but in a buffer of our own, and the codec compresses them as
+     * one continuous stream instead of as independent blocks.
+     */
+    const struct StreamCodec *codec;
+    void *encoder;
+};
+
+enum {
+    GATHER_DEFAULT_SIZE = 256 * 1024,
+    GATHER_IOV_MAX = 1024,
+
+    /* Smaller packets are cheaper to copy than to write separately */
+    GATHER_MIN_REFERENCE = 256,
 };
 
 #define CAPFILE_BIGENDIAN       1
@@ -669,96 +775,254 @@ struct PcapFile *pcapfile_openread(const char *capfilename)
 
 
 
+static ssize_t write_jobs(struct PcapFile *capfile, uint64_t until);
+static int gather_flush(struct PcapFile *capfile);
+static ssize_t codec_write(struct PcapFile *capfile, int mode);
+
+/*****************************************************************************
+ * Creating an LZ4 compression context allocates its tables, so rather
+ * than freeing a context when a file is closed, we keep a few around
+ * for the next files we open. Files are opened and closed on different
+ * threads, so this is protected by a spinlock.
+ *****************************************************************************/
+static struct {
+    LZ4F_compressionContext_t list[16];
+    unsigned count;
+    volatile unsigned lock;
+} lz4_contexts;
+
+static size_t
+lz4_context_get(LZ4F_compressionContext_t *ctx)
+{
+    *ctx = NULL;
+    while (!rte_atomic32_cmpset(&lz4_contexts.lock, 0, 1))
+        rte_pause();
+    if (lz4_contexts.count)
+        *ctx = lz4_contexts.list[--lz4_contexts.count];
+    rte_wmb();
+    lz4_contexts.lock = 0;
+
+    if (*ctx)
+        return 0;
+    return LZ4F_createCompressionContext(ctx, LZ4F_VERSION);
+}
+
+/**
+ * Only contexts that have cleanly finished a frame with LZ4F_compressEnd()
+ * can be reused, any others must be freed.
+ */
+static void
+lz4_context_put(LZ4F_compressionContext_t ctx)
+{
+    while (!rte_atomic32_cmpset(&lz4_contexts.lock, 0, 1))
+        rte_pause();
+    if (lz4_contexts.count < sizeof(lz4_contexts.list)/sizeof(lz4_contexts.list[0])) {
+        lz4_contexts.list[lz4_contexts.count++] = ctx;
+        ctx = NULL;
+    }
+    rte_wmb();
+    lz4_contexts.lock = 0;
+
+    if (ctx)
+        LZ4F_freeCompressionContext(ctx);
+}
+
+/*****************************************************************************
+ * Pick the smallest LZ4 frame block size that can hold our blocks
+ *****************************************************************************/
+static LZ4F_blockSizeID_t
+lz4_block_size_id(size_t block_size)
+{
+    if (block_size <= 64*1024)
+        return LZ4F_max64KB;
+    else if (block_size <= 256*1024)
+        return LZ4F_max256KB;
+    else if (block_size <= 1024*1024)
+        return LZ4F_max1MB;
+    else
+        return LZ4F_max4MB;
+}
+
+/*****************************************************************************
+ * Add the dictionary ID to the LZ4 frame header that LZ4F wrote, which
+ * doesn't know about dictionaries. It goes just before the header
+ * checksum, which has to be calculated again.
+ *****************************************************************************/
+static size_t
+lz4_header_dict_id(unsigned char *px, size_t length, uint32_t dict_id)
+{
+    size_t checksum_offset = length - 1;
+
+    px[4] |= 0x01;
+    px[checksum_offset + 0] = (unsigned char)(dict_id >> 0);
+    px[checksum_offset + 1] = (unsigned char)(dict_id >> 8);
+    px[checksum_offset + 2] = (unsigned char)(dict_id >> 16);
+    px[checksum_offset + 3] = (unsigned char)(dict_id >> 24);
+    px[checksum_offset + 4] = (unsigned char)(XXH32(px + 4, checksum_offset, 0) >> 8);
+    return length + 4;
+}
+
 /*****************************************************************************
  * Open a capture file for writing
  *****************************************************************************/
 struct PcapFile *
 pcapfile_openwrite(const char *capfilename, unsigned linktype, int compression_type)
 {
+    return pcapfile_openwrite_ex(capfilename, linktype, compression_type, NULL);
+}
+
+/*****************************************************************************
+ *****************************************************************************/
+struct PcapFile *
+pcapfile_openwrite_ex(const char *capfilename,
+                      unsigned linktype,
+                      int compression_type,
+                      const struct PcapFileOptions *options)
+{
+    static const struct PcapFileOptions default_options = {0};
     LZ4F_compressionContext_t ctx = 0;
+    LZ4F_preferences_t prefs = {{0}};
     char buf[] =
             "\xd4\xc3\xb2\xa1\x02\x00\x04\x00"
             "\x00\x00\x00\x00\x00\x00\x00\x00"
             "\xff\xff\x00\x00\x69\x00\x00\x00";
-    FILE *fp;
+    size_t block_size = 0;
+    int level = 0;
+    struct OutputFile *out;
+    const struct StreamCodec *codec = NULL;
+    void *encoder = NULL;
 
     buf[20] = (char)(linktype>>0);
     buf[21] = (char)(linktype>>8);
 
+    if (options == NULL)
+        options = &default_options;
+    if (compression_type == PCAPFILE_ZSTD) {
+        /* The codec has its own levels, and its own limits on them */
+        codec = &zstd_codec;
+        if (codec->init() != 0)
+            return 0;
+        block_size = options->block_size;
+        if (block_size == 0)
+            block_size = GATHER_DEFAULT_SIZE;
+        if (block_size > 4*1024*1024)
+            block_size = 4*1024*1024;
+        level = options->compression_level;
+    } else if (compression_type) {
+        block_size = options->block_size;
+        if ((compression_type == PCAPFILE_PDZ || compression_type == PCAPFILE_PDC)
+            && block_size < PDZ_MAX_PACKET)
+            block_size = PDZ_MAX_PACKET;
+        if (block_size > 4*1024*1024)
+            block_size = 4*1024*1024;
+        level = options->compression_level;
+        if (level == 0 && compression_type == PCAPFILE_LZ4SLOW)
+            level = COMPRESS_LEVEL_HC_DEFAULT;
+        if (level > COMPRESS_LEVEL_HC_MAX)
+            level = COMPRESS_LEVEL_HC_MAX;
+    }
 
     /*
      * open the file for writing
      */
-    fp = fopen(capfilename, "wb");
-    if (fp == NULL) {
-        fprintf(stderr, "Could not open capture file\n");
-        perror(capfilename);
+    out = outfile_open(capfilename, &options->output);
+    if (out == NULL)
         return 0;
-    }
     
     /*
      * Write the headers, which can consist of both the compression
      * and libpcap headers
      */
-    if (compression_type) {
+    if (codec) {
+        /* The pcap header becomes the first bytes of the stream */
+        encoder = codec->encoder_create(level, options->threads);
+        if (encoder == NULL) {
+            outfile_close(out);
+            return 0;
+        }
+    } else if (compression_type == PCAPFILE_PDZ || compression_type == PCAPFILE_PDC) {
+        unsigned char header[PDZ_FILE_HEADER_SIZE];
+
+        pdz_file_header(header,
+                        (compression_type == PCAPFILE_PDC) ? PDZ_VERSION_COLUMNS : 1,
+                        linktype, block_size);
+        if (outfile_write(out, header, sizeof(header)) != sizeof(header)) {
+            perror(capfilename);
+            outfile_close(out);
+            return 0;
+        }
+    } else if (compression_type) {
         /* Create compression context */
-        LZ4F_preferences_t prefs = {0};
         size_t err;
         size_t len;
-        size_t bytes_written;
+        ssize_t bytes_written;
         char buf2[65536];
         
-        err = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+        err = lz4_context_get(&ctx);
         if (LZ4F_isError(err)) {
-            fclose(fp);
+            outfile_close(out);
             fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(err));
             return 0;
         }
         
         prefs.autoFlush = 1;
-        prefs.compressionLevel = 0;
+        prefs.compressionLevel = level;
+        if (block_size) {
+            /* We compress the blocks ourselves, each one independent of
+             * the others, so that they can be compressed in parallel.
+             * The context is only used for the frame header and end */
+            prefs.compressionLevel = 0;
+            prefs.frameInfo.blockSizeID = lz4_block_size_id(block_size);
+            prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+        }
 
         /* Write the LZ4 magic header */
         len = LZ4F_compressBegin(ctx, buf2, sizeof(buf2), &prefs);
         if (LZ4F_isError(len)) {
             fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(len));
-            fclose(fp);
+            outfile_close(out);
             LZ4F_freeCompressionContext(ctx);
             return 0;
         }
-        bytes_written = fwrite(buf2, 1, len, fp);
-        if (bytes_written != len) {
+        if (block_size && options->dict)
+            len = lz4_header_dict_id((unsigned char *)buf2, len, options->dict->id);
+        bytes_written = outfile_write(out, buf2, len);
+        if (bytes_written != (ssize_t)len) {
             perror(capfilename);
-            fclose(fp);
-            LZ4F_freeCompressionContext(ctx);
-            return 0;
-        }
-        
-        /* Now write the compressed buffer magic header */
-        len = LZ4F_compressUpdate(ctx, buf2, sizeof(buf2), buf, 24, NULL);
-        if (LZ4F_isError(len)) {
-            fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(len));
-            fclose(fp);
+            outfile_close(out);
             LZ4F_freeCompressionContext(ctx);
             return 0;
         }
         
-        /*
-         * write the compressed data
-         */
-        bytes_written = fwrite(buf2, 1, len, fp);
-        if (bytes_written != len) {
-            perror(capfilename);
-            fclose(fp);
-            LZ4F_freeCompressionContext(ctx);
-            return 0;
+        /* When batching, the pcap header simply becomes the first
+         * bytes of the first block */
+        if (block_size == 0) {
+            /* Now write the compressed buffer magic header */
+            len = LZ4F_compressUpdate(ctx, buf2, sizeof(buf2), buf, 24, NULL);
+            if (LZ4F_isError(len)) {
+                fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(len));
+                outfile_close(out);
+                LZ4F_freeCompressionContext(ctx);
+                return 0;
+            }
+            
+            /*
+             * write the compressed data
+             */
+            bytes_written = outfile_write(out, buf2, len);
+            if (bytes_written != (ssize_t)len) {
+                perror(capfilename);
+                outfile_close(out);
+                LZ4F_freeCompressionContext(ctx);
+                return 0;
+            }
         }
 
     } else {
-        if (fwrite(buf, 1, 24, fp) != 24) {
+        if (outfile_write(out, buf, 24) != 24) {
             fprintf(stderr, "Could not write capture file header\n");
             perror(capfilename);
-            fclose(fp);
+            outfile_close(out);
             return 0;
         }
     }
@@ -773,10 +1037,96 @@ pcapfile_openwrite(const char *capfilename, unsigned linktype, int compression_t
         snprintf(capfile->filename, sizeof(capfile->filename),
                  "%s", capfilename);
 
-        capfile->fp = fp;
+        capfile->out = out;
         capfile->byte_order = CAPFILE_LITTLEENDIAN;
         capfile->linktype = linktype;
         capfile->ctx = ctx;
+
+        if (ctx && block_size == 0) {
+            /* Big enough for the largest packet */
+            capfile->outbuf_size = LZ4F_compressBound(65536+16, &prefs);
+            capfile->outbuf = malloc(capfile->outbuf_size);
+            if (capfile->outbuf == NULL)
+                exit(1);
+        }
+        if (codec) {
+            capfile->codec = codec;
+            capfile->encoder = encoder;
+            capfile->staging_size = block_size;
+            capfile->staging = malloc(block_size);
+            if (capfile->staging == NULL)
+                exit(1);
+            memcpy(capfile->staging, buf, 24);
+            capfile->staging_length = 24;
+            capfile->staging_time = pixie_gettime();
+            capfile->flush_usecs = (options->flush_msecs?options->flush_msecs:1000) * 1000ULL;
+        } else if (block_size) {
+            unsigned i;
+
+            /* With a pool, enough jobs to keep all the workers busy
+             * while we wait for the oldest to finish */
+            capfile->pool = options->pool;
+            capfile->compression_level = level;
+            capfile->control = options->control;
+            capfile->last_submit = pixie_gettime();
+            if (capfile->pool)
+                capfile->job_count = 2 * compresspool_workers(capfile->pool) + 1;
+            else
+                capfile->job_count = 1;
+            capfile->jobs = calloc(capfile->job_count, sizeof(capfile->jobs[0]));
+            if (capfile->jobs == NULL)
+                exit(1);
+            if (compression_type == PCAPFILE_PDZ) {
+                capfile->is_pdz = 1;
+                capfile->meta_size = block_size / 4;
+            } else if (compression_type == PCAPFILE_PDC) {
+                /* Small packets are almost all columns */
+                capfile->is_pdz = 1;
+                capfile->meta_size = block_size;
+                capfile->columns = pdzcol_create(linktype, block_size);
+            }
+            for (i=0; i<capfile->job_count; i++) {
+                struct CompressJob *job = &capfile->jobs[i];
+                job->src = malloc(block_size);
+                job->dst_size = compress_block_bound(block_size);
+                if (capfile->meta_size) {
+                    job->meta = malloc(capfile->meta_size);
+                    if (job->meta == NULL)
+                        exit(1);
+                    job->dst_size += compress_block_bound(capfile->meta_size);
+                }
+                job->dst = malloc(job->dst_size);
+                if (job->src == NULL || job->dst == NULL)
+                    exit(1);
+                if (!capfile->is_pdz)
+                    job->dict = options->dict;
+                job->is_done = 1;
+            }
+
+            capfile->staging_size = block_size;
+            capfile->staging = capfile->jobs[0].src;
+            capfile->meta = capfile->jobs[0].meta;
+            capfile->flush_usecs = (options->flush_msecs?options->flush_msecs:1000) * 1000ULL;
+            if (!capfile->is_pdz) {
+                memcpy(capfile->staging, buf, 24);
+                capfile->staging_length = 24;
+            }
+            capfile->staging_time = pixie_gettime();
+        }
+        if (!compression_type) {
+            capfile->gather_size = options->block_size;
+            if (capfile->gather_size == 0)
+                capfile->gather_size = GATHER_DEFAULT_SIZE;
+            if (capfile->gather_size > 4*1024*1024)
+                capfile->gather_size = 4*1024*1024;
+            capfile->gather = malloc(capfile->gather_size);
+            capfile->iov_max = GATHER_IOV_MAX;
+            capfile->iov = malloc(capfile->iov_max * sizeof(capfile->iov[0]));
+            if (capfile->gather == NULL || capfile->iov == NULL)
+                exit(1);
+            capfile->is_zerocopy = (options->is_zerocopy != 0);
+            capfile->flush_usecs = (options->flush_msecs?options->flush_msecs:1000) * 1000ULL;
+        }
         return capfile;
     }
 
@@ -898,7 +1248,7 @@ pcapfile_openappend(const char *capfilename, unsigned linktype)
         capfile->byte_order = byte_order;
         snprintf(capfile->filename, sizeof(capfile->filename),
                  "%s", capfilename);
-        capfile->fp = fp;
+        capfile->out = outfile_attach(fp);
         capfile->byte_order = byte_order;
         capfile->linktype = linktype;
     }
@@ -917,6 +1267,31 @@ void pcapfile_close(struct PcapFile *handle)
     if (handle == NULL)
         return;
     
+    /* This may be closed by another thread than the one writing, which
+     * now owns the controller, so the last block gets the last level */
+    handle->control = NULL;
+
+    /* Finish the stream, which also compresses what's staged */
+    if (handle->encoder && handle->out) {
+        if (codec_write(handle, CODEC_END) < 0)
+            perror(handle->filename);
+    }
+    
+    /* Compress whatever is left in the last block, and wait for the
+     * workers to finish with our buffers */
+    if ((handle->staging_length || handle->meta_length) && handle->out)
+        pcapfile_flush(handle);
+    if (handle->jobs)
+        write_jobs(handle, handle->jobs_submitted);
+    if (handle->gather && handle->out)
+        gather_flush(handle);
+    
+    /* The end mark */
+    if (handle->is_pdz && handle->out) {
+        if (outfile_write(handle->out, "\0\0\0\0", 4) != 4)
+            perror("close");
+    }
+
     /* Handle the compression */
     if (handle->ctx) {
         char outbuf[65536];
@@ -924,25 +1299,613 @@ void pcapfile_close(struct PcapFile *handle)
         bytes_compressed = LZ4F_compressEnd(handle->ctx, outbuf, sizeof(outbuf), NULL);
         if (LZ4F_isError(bytes_compressed)) {
             fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(bytes_compressed));
+            LZ4F_freeCompressionContext(handle->ctx);
         } else {
-            size_t bytes_written;
-            bytes_written = fwrite(outbuf, 1, bytes_compressed, handle->fp);
-            if (bytes_written != bytes_compressed) {
+            ssize_t bytes_written;
+            bytes_written = outfile_write(handle->out, outbuf, bytes_compressed);
+            if (bytes_written != (ssize_t)bytes_compressed) {
                 perror("close");
             }
+            lz4_context_put(handle->ctx);
         }
-        LZ4F_freeCompressionContext(handle->ctx);
     }
     
+    if (handle->out) {
+        if (outfile_close(handle->out) != 0)
+            perror(handle->filename);
+    }
     if (handle->fp)
         fclose(handle->fp);
+    if (handle->jobs) {
+        unsigned i;
+        for (i=0; i<handle->job_count; i++) {
+            free(handle->jobs[i].src);
+            free(handle->jobs[i].meta);
+            free(handle->jobs[i].dst);
+        }
+        free(handle->jobs);
+    }
+    if (handle->encoder) {
+        handle->codec->encoder_destroy(handle->encoder);
+        free(handle->staging);
+    }
+    pdzcol_destroy(handle->columns);
+    compress_state_cleanup(&handle->compress_state);
+    free(handle->outbuf);
+    free(handle->gather);
+    free(handle->iov);
     free(handle);
 }
 
+/**
+ * Compress a chunk of data and write it to the file, returning
+ * the number of compressed bytes written, or -1 on error.
+ */
+static ssize_t
+compress_and_write(struct PcapFile *capfile, const void *buf, size_t length)
+{
+    size_t compressed_length;
+    ssize_t bytes_written;
+
+    compressed_length = LZ4F_compressUpdate(capfile->ctx,
+                                            capfile->outbuf,
+                                            capfile->outbuf_size,
+                                            buf, length, NULL);
+    if (LZ4F_isError(compressed_length)) {
+        fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(compressed_length));
+        return -1;
+    }
+
+    bytes_written = outfile_write(capfile->out, capfile->outbuf, compressed_length);
+    if (bytes_written != (ssize_t)compressed_length)
+        return -1;
+    return bytes_written;
+}
+
+/**
+ * Write the finished jobs to the file, in the order they were submitted,
+ * until at least 'until' jobs have been written. This waits for the
+ * workers when necessary, but otherwise stops at the first job that's
+ * still being compressed.
+ * @return the number of compressed bytes written, or -1 on error, in
+ * which case the jobs are still consumed so the buffers can be reused.
+ */
+static ssize_t
+write_jobs(struct PcapFile *capfile, uint64_t until)
+{
+    ssize_t total = 0;
+
+    while (capfile->jobs_written < capfile->jobs_submitted) {
+        struct CompressJob *job;
+
+        job = &capfile->jobs[capfile->jobs_written % capfile->job_count];
+        if (!job->is_done) {
+            if (capfile->jobs_written >= until)
+                break;
+            pixie_usleep(10);
+            continue;
+        }
+        rte_rmb();
+        capfile->jobs_written++;
+
+        if (total < 0 || capfile->out == NULL)
+            continue;
+        if (outfile_write(capfile->out, job->dst, job->dst_length) != (ssize_t)job->dst_length)
+            total = -1;
+        else
+            total += (ssize_t)job->dst_length;
+    }
+    return total;
+}
+
+/**
+ * Hand the staged records to the streaming codec, which writes whatever
+ * compressed output it has ready.
+ */
+static ssize_t
+codec_write(struct PcapFile *capfile, int mode)
+{
+    ssize_t bytes_written;
+
+    bytes_written = capfile->codec->encode(capfile->encoder, capfile->out,
+                                           capfile->staging,
+                                           capfile->staging_length,
+                                           mode);
+    capfile->staging_length = 0;
+    return bytes_written;
+}
+
+/**
+ * Compress the accumulated records as a single block. Without a pool,
+ * it's compressed and written now. With a pool, it's handed to a worker,
+ * and written later, once it and all the blocks before it are done.
+ */
+static ssize_t
+submit_block(struct PcapFile *capfile)
+{
+    struct CompressJob *job;
+    ssize_t bytes_written;
+    uint64_t oldest;
+
+    if (capfile->encoder)
+        return codec_write(capfile, CODEC_CONTINUE);
+
+    job = &capfile->jobs[capfile->jobs_submitted % capfile->job_count];
+    if (capfile->columns)
+        capfile->meta_length = pdzcol_finish(capfile->columns, capfile->meta);
+    job->src_length = capfile->staging_length;
+    job->meta_length = capfile->meta_length;
+    job->level = capfile->compression_level;
+    if (capfile->control) {
+        uint64_t in_flight = capfile->jobs_submitted - capfile->jobs_written;
+        uint64_t now = pixie_gettime();
+        uint64_t elapsed = now - capfile->last_submit;
+        unsigned busy = 0;
+
+        if (capfile->pool == NULL)
+            busy = elapsed ? (unsigned)(capfile->compress_usecs * 1000 / elapsed) : 1000;
+        job->level = compresscontrol_next(capfile->control,
+                            (unsigned)(in_flight * 1000 / capfile->job_count),
+                            busy);
+        capfile->compression_level = job->level;
+        capfile->last_submit = now;
+    }
+    if (capfile->pool)
+        compresspool_submit(capfile->pool, job);
+    else {
+        uint64_t start = capfile->control ? pixie_gettime() : 0;
+
+        job->dst_length = compress_job(&capfile->compress_state, job);
+        job->is_done = 1;
+        if (capfile->control)
+            capfile->compress_usecs = pixie_gettime() - start;
+    }
+    capfile->jobs_submitted++;
+
+    /* Write what's done, waiting if necessary so that the next
+     * job's buffer is free */
+    oldest = capfile->jobs_submitted + 1;
+    oldest = (oldest > capfile->job_count) ? oldest - capfile->job_count : 0;
+    bytes_written = write_jobs(capfile, oldest);
+
+    capfile->staging = capfile->jobs[capfile->jobs_submitted % capfile->job_count].src;
+    capfile->staging_length = 0;
+    capfile->meta = capfile->jobs[capfile->jobs_submitted % capfile->job_count].meta;
+    capfile->meta_length = 0;
+    memset(&capfile->pdz_state, 0, sizeof(capfile->pdz_state));
+    return bytes_written;
+}
+
+/**
+ * Compress the accumulated records, and write out all the blocks that
+ * are still being compressed.
+ */
+ssize_t
+pcapfile_flush(struct PcapFile *capfile)
+{
+    ssize_t bytes_written = 0;
+    ssize_t x;
+
+    if (capfile == NULL || capfile->out == NULL)
+        return -1;
+    if (capfile->gather) {
+        /* These bytes were already counted when the records were added */
+        return gather_flush(capfile);
+    }
+    if (capfile->encoder)
+        return codec_write(capfile, CODEC_FLUSH);
+    if (capfile->jobs == NULL)
+        return 0;
+
+    if (capfile->staging_length || capfile->meta_length) {
+        bytes_written = submit_block(capfile);
+        if (bytes_written < 0)
+            return -1;
+    }
+    x = write_jobs(capfile, capfile->jobs_submitted);
+    if (x < 0)
+        return -1;
+    return bytes_written + x;
+}
+
+/**
+ * Write a block that's already been compressed, after whatever is
+ * waiting to be compressed.
+ */
+ssize_t
+pcapfile_writeblock(struct PcapFile *capfile, const void *block, size_t length)
+{
+    ssize_t bytes_written;
+
+    if (capfile == NULL || capfile->jobs == NULL)
+        return -1;
+    bytes_written = pcapfile_flush(capfile);
+    if (bytes_written < 0)
+        return -1;
+    if (outfile_write(capfile->out, block, length) != (ssize_t)length)
+        return -1;
+    return bytes_written + (ssize_t)length;
+}
+
+/**
+ * Flush the block if the oldest data in it is too old.
+ */
+ssize_t
+pcapfile_flush_stale(struct PcapFile *capfile)
+{
+    if (capfile && capfile->gather && capfile->out) {
+        if (capfile->iov_count
+            && pixie_gettime() - capfile->staging_time >= capfile->flush_usecs)
+            return gather_flush(capfile);
+        return 0;
+    }
+    if (capfile && capfile->encoder && capfile->out) {
+        if (capfile->staging_length
+            && pixie_gettime() - capfile->staging_time >= capfile->flush_usecs)
+            return codec_write(capfile, CODEC_FLUSH);
+        return 0;
+    }
+    if (capfile == NULL || capfile->jobs == NULL)
+        return 0;
+    if ((capfile->staging_length == 0 && capfile->meta_length == 0)
+        || pixie_gettime() - capfile->staging_time < capfile->flush_usecs) {
+        /* Not stale yet, but write any blocks the workers have done */
+        return write_jobs(capfile, 0);
+    }
+    return pcapfile_flush(capfile);
+}
+
+/**
+ * Write out the gathered records.
+ * @return 0 on success, or -1 on error
+ */
+static int
+gather_flush(struct PcapFile *capfile)
+{
+    ssize_t bytes_written;
+
+    if (capfile->iov_count == 0)
+        return 0;
+    bytes_written = outfile_writev(capfile->out, capfile->iov,
+                                   (int)capfile->iov_count);
+    capfile->iov_count = 0;
+    capfile->gather_length = 0;
+    capfile->references = 0;
+    return (bytes_written < 0) ? -1 : 0;
+}
+
+/**
+ * Write out any packets that are only pointed to.
+ */
+int
+pcapfile_release_buffers(struct PcapFile *capfile)
+{
+    if (capfile == NULL || capfile->out == NULL || capfile->references == 0)
+        return 0;
+    return gather_flush(capfile);
+}
+
+/**
+ * Copy bytes to the end of the gather buffer, extending the last piece
+ * when the bytes follow on from it.
+ */
+static void
+gather_copy(struct PcapFile *capfile, const void *buf, size_t length)
+{
+    unsigned char *px = capfile->gather + capfile->gather_length;
+    struct iovec *last = NULL;
+
+    memcpy(px, buf, length);
+    capfile->gather_length += length;
+
+    if (capfile->iov_count)
+        last = &capfile->iov[capfile->iov_count - 1];
+    if (last && (unsigned char *)last->iov_base + last->iov_len == px)
+        last->iov_len += length;
+    else {
+        last = &capfile->iov[capfile->iov_count++];
+        last->iov_base = px;
+        last->iov_len = length;
+    }
+}
+
+/**
+ * Add an uncompressed record to those waiting to be written, writing
+ * them out when there's no more room, or when they've waited too long.
+ * @return 0 on success, or -1 on error
+ */
+static int
+gather_record(struct PcapFile *capfile, const unsigned char *header,
+              const void *buffer, size_t buffer_size, uint64_t timestamp)
+{
+    int is_reference = capfile->is_zerocopy
+                        && buffer_size >= GATHER_MIN_REFERENCE;
+    size_t length = 16 + (is_reference ? 0 : buffer_size);
+
+    if (capfile->gather_length + length > capfile->gather_size
+        || capfile->iov_count + 2 > capfile->iov_max) {
+        if (gather_flush(capfile) < 0)
+            return -1;
+    }
+
+    /* Bigger than the whole buffer, so it's written by itself */
+    if (length > capfile->gather_size) {
+        if (outfile_write(capfile->out, header, 16) != 16)
+            return -1;
+        if (outfile_write(capfile->out, buffer, buffer_size) != (ssize_t)buffer_size)
+            return -1;
+        return 0;
+    }
+
+    if (capfile->iov_count == 0) {
+        capfile->staging_time = pixie_gettime();
+        capfile->gather_timestamp = timestamp;
+    }
+    gather_copy(capfile, header, 16);
+    if (is_reference) {
+        struct iovec *iov = &capfile->iov[capfile->iov_count++];
+        iov->iov_base = (void *)buffer;
+        iov->iov_len = buffer_size;
+        capfile->references++;
+    } else
+        gather_copy(capfile, buffer, buffer_size);
+
+    if (timestamp - capfile->gather_timestamp >= capfile->flush_usecs
+        && timestamp > capfile->gather_timestamp)
+        return gather_flush(capfile);
+    return 0;
+}
+
+/**
+ * Add bytes to the block being accumulated, compressing and writing the
+ * block whenever it fills up.
+ * @return the number of compressed bytes written, which will be zero
+ * most of the time, or -1 on error.
+ */
+static ssize_t
+staging_append(struct PcapFile *capfile, const void *buf, size_t length)
+{
+    const unsigned char *px = (const unsigned char *)buf;
+    ssize_t total = 0;
+
+    while (length) {
+        size_t n = capfile->staging_size - capfile->staging_length;
+        if (n > length)
+            n = length;
+
+        if (capfile->staging_length == 0)
+            capfile->staging_time = pixie_gettime();
+        memcpy(capfile->staging + capfile->staging_length, px, n);
+        capfile->staging_length += n;
+        px += n;
+        length -= n;
+
+        if (capfile->staging_length == capfile->staging_size) {
+            ssize_t bytes_written = submit_block(capfile);
+            if (bytes_written < 0)
+                return -1;
+            total += bytes_written;
+        }
+    }
+    return total;
+}
+
+
+/**
+ * Add a record to a .pdz chunk, with the header going into one stream,
+ * and the packet into the other. A record is never split across
+ * chunks, so the chunk is submitted first if either stream is full.
+ */
+static ssize_t
+pdz_append(struct PcapFile *capfile,
+           const void *buffer, unsigned buffer_size,
+           unsigned original_length, long time_sec, long time_usec)
+{
+    ssize_t bytes_written = 0;
+    size_t meta_max = capfile->columns ? PDZ_COLUMNS_MAX_RECORD : PDZ_MAX_HEADER;
+
+    if (buffer_size > capfile->staging_size)
+        buffer_size = (unsigned)capfile->staging_size;
+
+    if (capfile->staging_length + buffer_size > capfile->staging_size
+        || capfile->meta_length + meta_max > capfile->meta_size) {
+        bytes_written = submit_block(capfile);
+        if (bytes_written < 0)
+            return -1;
+    }
+
+    if (capfile->staging_length == 0 && capfile->meta_length == 0)
+        capfile->staging_time = pixie_gettime();
+    if (capfile->columns) {
+        size_t header_length;
+
+        /* The columns are only copied into 'meta' at the end, but this
+         * keeps the length for deciding when it's full */
+        header_length = pdzcol_encode(capfile->columns,
+                                      (uint32_t)time_sec, (uint32_t)time_usec,
+                                      buffer, buffer_size, original_length);
+        capfile->meta_length = pdzcol_length(capfile->columns);
+        memcpy(capfile->staging + capfile->staging_length,
+               (const unsigned char *)buffer + header_length,
+               buffer_size - header_length);
+        capfile->staging_length += buffer_size - header_length;
+    } else {
+        capfile->meta_length += pdz_encode(&capfile->pdz_state,
+                                           capfile->meta + capfile->meta_length,
+                                           (uint32_t)time_sec,
+                                           (uint32_t)time_usec,
+                                           buffer_size,
+                                           original_length);
+        memcpy(capfile->staging + capfile->staging_length, buffer, buffer_size);
+        capfile->staging_length += buffer_size;
+    }
+
+    if (pixie_gettime() - capfile->staging_time >= capfile->flush_usecs) {
+        ssize_t x = submit_block(capfile);
+        if (x < 0)
+            return -1;
+        bytes_written += x;
+    }
+    return bytes_written;
+}
+
+/**
+ * The byte order of the machine we're running on, so that when a file is
+ * in the same order, the record headers can just be copied.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CAPFILE_HOSTORDER       CAPFILE_LITTLEENDIAN
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CAPFILE_HOSTORDER       CAPFILE_BIGENDIAN
+#else
+#define CAPFILE_HOSTORDER       CAPFILE_ENDIANUNKNOWN
+#endif
+
+enum {
+    /* How many record headers are encoded at once */
+    WRITEFRAMES_BATCH = 64,
+};
+
+static void put32be(unsigned char *px, uint32_t x)
+{
+    px[0] = (unsigned char)(x>>24);
+    px[1] = (unsigned char)(x>>16);
+    px[2] = (unsigned char)(x>> 8);
+    px[3] = (unsigned char)(x>> 0);
+}
+static void put32le(unsigned char *px, uint32_t x)
+{
+    px[0] = (unsigned char)(x>> 0);
+    px[1] = (unsigned char)(x>> 8);
+    px[2] = (unsigned char)(x>>16);
+    px[3] = (unsigned char)(x>>24);
+}
+
+/**
+ * Encode the 16-byte record headers (seconds, microseconds, sliced-length,
+ * original-length) of a batch of frames, one after another. The byte
+ * order is decided once for the whole batch, and in the usual case of a
+ * file in our own byte order, each header is a straight copy of the
+ * frame descriptor.
+ * @return the total of the frames' sliced lengths
+ */
+static size_t
+encode_headers(const struct PcapFile *capfile,
+               const struct PcapFrame *frames, unsigned count,
+               unsigned char *headers)
+{
+    size_t total = 0;
+    unsigned i;
+
+    if (capfile->byte_order == CAPFILE_HOSTORDER) {
+        for (i=0; i<count; i++) {
+            memcpy(headers + i * 16, &frames[i], 16);
+            total += frames[i].buffer_size;
+        }
+    } else if (capfile->byte_order == CAPFILE_BIGENDIAN) {
+        for (i=0; i<count; i++) {
+            unsigned char *px = headers + i * 16;
+            put32be(px +  0, frames[i].time_sec);
+            put32be(px +  4, frames[i].time_usec);
+            put32be(px +  8, frames[i].buffer_size);
+            put32be(px + 12, frames[i].original_length);
+            total += frames[i].buffer_size;
+        }
+    } else {
+        for (i=0; i<count; i++) {
+            unsigned char *px = headers + i * 16;
+            put32le(px +  0, frames[i].time_sec);
+            put32le(px +  4, frames[i].time_usec);
+            put32le(px +  8, frames[i].buffer_size);
+            put32le(px + 12, frames[i].original_length);
+            total += frames[i].buffer_size;
+        }
+    }
+    return total;
+}
+
+/**
+ * Add records to the block being accumulated. When they all fit, which
+ * is nearly always, they're copied in one after another without any
+ * checks between them, otherwise the block is compressed part way
+ * through. Either way, the block is only compressed early, because the
+ * data has waited too long, after all of them have been added.
+ * @return the number of compressed bytes written, or -1 on error
+ */
+static ssize_t
+staging_append_frames(struct PcapFile *capfile,
+                      const struct PcapFrame *frames, unsigned count,
+                      const unsigned char *headers, size_t bytes)
+{
+    size_t length = 16 * (size_t)count + bytes;
+    ssize_t total = 0;
+    unsigned i;
+
+    if (capfile->staging_length + length < capfile->staging_size) {
+        unsigned char *px = capfile->staging + capfile->staging_length;
+
+        if (capfile->staging_length == 0)
+            capfile->staging_time = pixie_gettime();
+        for (i=0; i<count; i++) {
+            memcpy(px, headers + i * 16, 16);
+            memcpy(px + 16, frames[i].buffer, frames[i].buffer_size);
+            px += 16 + frames[i].buffer_size;
+        }
+        capfile->staging_length += length;
+    } else {
+        for (i=0; i<count; i++) {
+            ssize_t x;
+
+            x = staging_append(capfile, headers + i * 16, 16);
+            if (x < 0)
+                return -1;
+            total += x;
+            x = staging_append(capfile, frames[i].buffer, frames[i].buffer_size);
+            if (x < 0)
+                return -1;
+            total += x;
+        }
+    }
+
+    if (capfile->staging_length
+        && pixie_gettime() - capfile->staging_time >= capfile->flush_usecs) {
+        ssize_t x;
+
+        /* A streaming codec keeps going, but makes what it has so
+         * far readable */
+        if (capfile->encoder)
+            x = codec_write(capfile, CODEC_FLUSH);
+        else
+            x = submit_block(capfile);
+        if (x < 0)
+            return -1;
+        total += x;
+    }
+    return total;
+}
+
+/**
+ * Report why writing failed, and close the file, so that nothing more
+ * gets written to it.
+ */
+static ssize_t
+write_failed(struct PcapFile *capfile)
+{
+    if (errno)
+        fprintf(stderr, "%s:#%" PRId64 ": %s\n",
+                capfile->filename,
+                capfile->frame_number,
+                strerror(errno));
+    outfile_close(capfile->out);
+    LZ4F_freeCompressionContext(capfile->ctx);
+    capfile->out = NULL;
+    capfile->ctx = NULL;
+    return -1;
+}
 
 /**
  * Called to write a frame of data in libpcap format. This format has a
- * 16-byte header (microseconds, seconds, sliced-length, original-length)
+ * 16-byte header (seconds, microseconds, sliced-length, original-length)
  * followed by the captured data */
 ssize_t
 pcapfile_writeframe(
@@ -953,119 +1916,136 @@ pcapfile_writeframe(
     long time_sec,
     long time_usec)
 {
+    struct PcapFrame frame;
     unsigned char header[16];
 
-    if (capfile == NULL || capfile->fp == NULL)
+    if (capfile == NULL || capfile->out == NULL)
         return -1;
 
-    /*
-     * Write timestamp
-     */
-    if (capfile->byte_order == CAPFILE_BIGENDIAN) {
-        header[ 0] = (unsigned char)(time_sec>>24);
-        header[ 1] = (unsigned char)(time_sec>>16);
-        header[ 2] = (unsigned char)(time_sec>> 8);
-        header[ 3] = (unsigned char)(time_sec>> 0);
-
-        header[ 4] = (unsigned char)(time_usec>>24);
-        header[ 5] = (unsigned char)(time_usec>>16);
-        header[ 6] = (unsigned char)(time_usec>> 8);
-        header[ 7] = (unsigned char)(time_usec>> 0);
-
-        header[ 8] = (unsigned char)(buffer_size>>24);
-        header[ 9] = (unsigned char)(buffer_size>>16);
-        header[10] = (unsigned char)(buffer_size>> 8);
-        header[11] = (unsigned char)(buffer_size>> 0);
-
-        header[12] = (unsigned char)(original_length>>24);
-        header[13] = (unsigned char)(original_length>>16);
-        header[14] = (unsigned char)(original_length>> 8);
-        header[15] = (unsigned char)(original_length>> 0);
-
-    } else {
-        header[ 0] = (unsigned char)(time_sec>> 0);
-        header[ 1] = (unsigned char)(time_sec>> 8);
-        header[ 2] = (unsigned char)(time_sec>>16);
-        header[ 3] = (unsigned char)(time_sec>>24);
-
-        header[ 4] = (unsigned char)(time_usec>> 0);
-        header[ 5] = (unsigned char)(time_usec>> 8);
-        header[ 6] = (unsigned char)(time_usec>>16);
-        header[ 7] = (unsigned char)(time_usec>>24);
-
-        header[ 8] = (unsigned char)(buffer_size>> 0);
-        header[ 9] = (unsigned char)(buffer_size>> 8);
-        header[10] = (unsigned char)(buffer_size>>16);
-        header[11] = (unsigned char)(buffer_size>>24);
-
-        header[12] = (unsigned char)(original_length>> 0);
-        header[13] = (unsigned char)(original_length>> 8);
-        header[14] = (unsigned char)(original_length>>16);
-        header[15] = (unsigned char)(original_length>>24);
+    if (capfile->is_pdz) {
+        ssize_t bytes_written;
 
+        bytes_written = pdz_append(capfile, buffer, buffer_size,
+                                   original_length, time_sec, time_usec);
+        if (bytes_written < 0)
+            return write_failed(capfile);
+        return bytes_written;
     }
 
-    if (capfile->ctx) {
-        size_t compressed_length;
-        char outbuf[65536];
-        size_t bytes_written;
-        size_t header_bytes_written;
+    frame.time_sec = (uint32_t)time_sec;
+    frame.time_usec = (uint32_t)time_usec;
+    frame.buffer_size = buffer_size;
+    frame.original_length = original_length;
+    frame.buffer = buffer;
+    encode_headers(capfile, &frame, 1, header);
+
+    if (capfile->staging) {
+        ssize_t bytes_written;
 
         /*
-         * compress the frame header
-         */
-        compressed_length = LZ4F_compressUpdate(capfile->ctx, outbuf, sizeof(outbuf), header, 16, NULL);
-        if (LZ4F_isError(compressed_length)) {
-            fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(compressed_length));
-            goto closefiles;
-        }
-        
-        /*
-         * write the compressed header
+         * Add the record to the block, which only gets compressed when
+         * the block fills, or when the data has waited too long
          */
-        bytes_written = fwrite(outbuf, 1, compressed_length, capfile->fp);
-        if (bytes_written != compressed_length) {
-            goto closefiles;
-        }
-        header_bytes_written = bytes_written;
-        
+        bytes_written = staging_append_frames(capfile, &frame, 1,
+                                              header, buffer_size);
+        if (bytes_written < 0)
+            return write_failed(capfile);
+        return bytes_written;
+    } else if (capfile->ctx) {
+        ssize_t bytes_written;
+        ssize_t header_bytes_written;
+
         /*
-         * compress the frame data
+         * compress and write the frame header
          */
-        compressed_length = LZ4F_compressUpdate(capfile->ctx, outbuf, sizeof(outbuf), buffer, buffer_size, NULL);
-        if (LZ4F_isError(compressed_length)) {
-            fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(compressed_length));
-            goto closefiles;
-        }
+        header_bytes_written = compress_and_write(capfile, header, 16);
+        if (header_bytes_written < 0)
+            return write_failed(capfile);
         
         /*
-         * write the compressed header
+         * compress and write the frame data
          */
-        bytes_written = fwrite(outbuf, 1, compressed_length, capfile->fp);
-        if (bytes_written != compressed_length) {
-            goto closefiles;
-        }
+        bytes_written = compress_and_write(capfile, buffer, buffer_size);
+        if (bytes_written < 0)
+            return write_failed(capfile);
         return bytes_written + header_bytes_written;
+    } else if (capfile->gather) {
+        uint64_t timestamp = (uint64_t)time_sec * 1000000 + (uint64_t)time_usec;
+
+        if (gather_record(capfile, header, buffer, buffer_size, timestamp) < 0)
+            return write_failed(capfile);
+        return 16 + buffer_size;
     } else {
-        if (fwrite(header, 1, 16, capfile->fp) != 16)
-            goto closefiles;
+        if (outfile_write(capfile->out, header, 16) != 16)
+            return write_failed(capfile);
         
-        if (fwrite(buffer, 1, buffer_size, capfile->fp) != buffer_size)
-            goto closefiles;
+        if (outfile_write(capfile->out, buffer, buffer_size) != (ssize_t)buffer_size)
+            return write_failed(capfile);
         
         return 16 + buffer_size;
     }
-    
-closefiles:
-    if (errno)
-        fprintf(stderr, "%s:#%" PRId64 ": %s\n",
-                capfile->filename,
-                capfile->frame_number,
-                strerror(errno));
-    fclose(capfile->fp);
-    LZ4F_freeCompressionContext(capfile->ctx);
-    capfile->fp = NULL;
-    capfile->ctx = NULL;
-    return -1;
+}
+
+/**
+ * Write a batch of frames. Blocks and gathered writes take the whole
+ * batch at once, while the other ways of writing go a frame at a time.
+ */
+ssize_t
+pcapfile_writeframes(
+    struct PcapFile *capfile,
+    const struct PcapFrame *frames,
+    unsigned count)
+{
+    unsigned char headers[WRITEFRAMES_BATCH * 16];
+    ssize_t total = 0;
+    unsigned first;
+    unsigned i;
+
+    if (capfile == NULL || capfile->out == NULL)
+        return -1;
+
+    if (capfile->is_pdz || (capfile->staging == NULL && capfile->gather == NULL)) {
+        for (i=0; i<count; i++) {
+            ssize_t x;
+
+            x = pcapfile_writeframe(capfile, frames[i].buffer,
+                                    frames[i].buffer_size,
+                                    frames[i].original_length,
+                                    frames[i].time_sec,
+                                    frames[i].time_usec);
+            if (x < 0)
+                return -1;
+            total += x;
+        }
+        return total;
+    }
+
+    for (first=0; first<count; first += WRITEFRAMES_BATCH) {
+        const struct PcapFrame *batch = frames + first;
+        unsigned n = count - first;
+        size_t bytes;
+
+        if (n > WRITEFRAMES_BATCH)
+            n = WRITEFRAMES_BATCH;
+        bytes = encode_headers(capfile, batch, n, headers);
+
+        if (capfile->staging) {
+            ssize_t x = staging_append_frames(capfile, batch, n, headers, bytes);
+            if (x < 0)
+                return write_failed(capfile);
+            total += x;
+        } else {
+            for (i=0; i<n; i++) {
+                uint64_t timestamp = (uint64_t)batch[i].time_sec * 1000000
+                                    + batch[i].time_usec;
+
+                if (gather_record(capfile, headers + i * 16, batch[i].buffer,
+                                  batch[i].buffer_size, timestamp) < 0)
+                    return write_failed(capfile);
+            }
+            total += 16 * n + bytes;
+        }
+    }
+    return total;
 }
 
@@ -7,7 +7,9 @@
 extern "C" {
 #endif
 #include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
+#include "output-file.h"
 
 enum {
     PCAPFILE_NO_COMPRESSION=0,
@@ -17,8 +19,104 @@ enum {
     
     /* LZ4 maximum, and slowest, compress */
     PCAPFILE_LZ4SLOW,
+
+    /* Our own ".pdz" format, with the record headers compressed
+     * separately from the packets, see "pdz-file.h" */
+    PCAPFILE_PDZ,
+
+    /* The same, with the protocol headers split into columns, see
+     * "pdz-columns.h" */
+    PCAPFILE_PDC,
+
+    /* Zstandard, compressed as one stream, see "codec-zstd.h" */
+    PCAPFILE_ZSTD,
 };
 struct PcapFile;
+struct CompressPool;
+struct CompressControl;
+struct CompressDict;
+
+/**
+ * Optional parameters when opening a file for writing. A structure
+ * that's been zeroed means the defaults.
+ */
+struct PcapFileOptions
+{
+    /**
+     * When compressing, records are accumulated until there are this
+     * many bytes, then they are compressed all at once as a single LZ4
+     * block. Zero means each packet is compressed as it arrives and
+     * flushed to the file immediately. The maximum is 4-megabytes.
+     *
+     * Without compression, records are gathered into a buffer of this
+     * size (256k if zero), then written with a single system call.
+     *
+     * For zstd, records are likewise staged in a buffer of this size
+     * (256k if zero) before being handed to the library.
+     */
+    size_t block_size;
+
+    /**
+     * When accumulating a block, the maximum number of milliseconds that
+     * data can wait before it's compressed and written anyway, so that
+     * the file can still be read in near real time. Zero means the
+     * default of one second.
+     */
+    unsigned flush_msecs;
+
+    /**
+     * The LZ4 level, where zero is the default. Negative numbers are
+     * faster with less compression, and 3 through 12 use the slower
+     * LZ4HC compressor. If zero and PCAPFILE_LZ4SLOW was chosen, the
+     * default LZ4HC level is used. For zstd, it's the zstd level, from
+     * 1 to 22, where zero is zstd's default of 3.
+     */
+    int compression_level;
+
+    /**
+     * If not NULL, blocks are compressed by these worker threads, so
+     * that several can be compressed at once. The blocks are still
+     * written to the file in order. Only used when 'block_size' is set.
+     * The pool may be shared by many files.
+     */
+    struct CompressPool *pool;
+
+    /**
+     * If not NULL, chooses the level for each block, instead of
+     * 'compression_level', depending upon how busy we are. Only used
+     * when 'block_size' is set. It may be shared by the files written
+     * one after another by one thread, but not by files being written
+     * at the same time.
+     */
+    struct CompressControl *control;
+
+    /**
+     * If not NULL, every LZ4 block is compressed with this preset
+     * dictionary, whose ID goes in the frame header. Only used for LZ4
+     * when 'block_size' is set.
+     */
+    const struct CompressDict *dict;
+
+    /**
+     * For zstd, the number of worker threads the library compresses
+     * with, instead of our own pool. Zero means it compresses in the
+     * thread writing the file.
+     */
+    unsigned threads;
+
+    /**
+     * Without compression, the contents of larger packets aren't copied,
+     * but written from wherever the caller has them, such as the capture
+     * ring. The caller must keep them unchanged until it next calls
+     * 'pcapfile_release_buffers()', or closes or flushes the file.
+     */
+    unsigned is_zerocopy;
+
+    /**
+     * How the bytes get to the disk, such as stdio or io_uring.
+     */
+    struct OutputOptions output;
+};
 
 
 unsigned pcapfile_datalink(struct PcapFile *handle);
@@ -53,6 +151,34 @@ ssize_t pcapfile_writeframe(
     long time_usec
     );
 
+/**
+ * One packet for 'pcapfile_writeframes()'. The first four fields are in
+ * the same order as in the record header in the file.
+ */
+struct PcapFrame
+{
+    uint32_t time_sec;
+    uint32_t time_usec;
+    uint32_t buffer_size;
+    uint32_t original_length;
+    const void *buffer;
+};
+
+/**
+ * Append a batch of packets, the same as calling 'pcapfile_writeframe()'
+ * on each, but encoding all the record headers in one pass, and adding
+ * the records to the block being compressed, or the writes being
+ * gathered, all together.
+ * @return
+ *      The number of bytes written, as for 'pcapfile_writeframe()', or a
+ *      negative number if there is an error.
+ */
+ssize_t pcapfile_writeframes(
+    struct PcapFile *capfile,
+    const struct PcapFrame *frames,
+    unsigned count
+    );
+
 struct PcapFile *pcapfile_openread(const char *capfilename);
 
 
@@ -68,6 +194,49 @@ struct PcapFile *pcapfile_openread(const char *capfilename);
  *      for the LZ4 algorithm.
  */
 struct PcapFile *pcapfile_openwrite(const char *capfilename, unsigned linktype, int compression_type);
+
+/**
+ * Same as 'pcapfile_openwrite()', but with extra options, which may
+ * be NULL for the defaults.
+ */
+struct PcapFile *pcapfile_openwrite_ex(const char *capfilename,
+                                       unsigned linktype,
+                                       int compression_type,
+                                       const struct PcapFileOptions *options);
+
+/**
+ * Force any packets waiting to be compressed out to the file.
+ * @return
+ *      The number of bytes written, or -1 on error.
+ */
+ssize_t pcapfile_flush(struct PcapFile *capfile);
+
+/**
+ * With 'is_zerocopy', write out any packets that are still only being
+ * pointed to, so that the caller can reuse their memory. This does
+ * nothing if there aren't any.
+ * @return
+ *      0, or -1 on error.
+ */
+int pcapfile_release_buffers(struct PcapFile *capfile);
+
+/**
+ * Write a block of records that's already been compressed with
+ * 'compress_block()', such as one that's been kept in memory. The file
+ * must have been opened with a block size at least as big as the block
+ * was before it was compressed.
+ * @return
+ *      The number of bytes written, or -1 on error.
+ */
+ssize_t pcapfile_writeblock(struct PcapFile *capfile,
+                            const void *block, size_t length);
+
+/**
+ * Like 'pcapfile_flush()', but only if the oldest waiting packet has
+ * waited longer than the configured latency. This should be called
+ * periodically when no packets are arriving.
+ */
+ssize_t pcapfile_flush_stale(struct PcapFile *capfile);
     
 struct PcapFile *pcapfile_openappend(const char *capfilename, unsigned linktype);
 
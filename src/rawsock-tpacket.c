@@ -0,0 +1,520 @@
+/* Copyright (c) 2017 by Robert David Graham
+ * Programer(s): Robert David Graham [rdg]
+ */
+/*
+    TPACKET_V3 CAPTURE
+
+ The libpcap 'next_ex()' interface costs us a library call and a header
+ copy for every frame. At 10gbps that's too much. This module talks
+ directly to the Linux kernel's AF_PACKET socket using the version 3
+ memory-mapped ring.
+
+ The ring is divided into large blocks (1-megabyte by default). The kernel
+ packs frames into a block until it's full, or until a timeout expires,
+ then flips the block's status to "user". We then walk every frame in
+ the block, calling the handler, and then flip the status back to
+ "kernel". Thus, we only wakeup once per block rather than once per
+ packet.
+
+ To test without real hardware, create a veth pair, sniff on one end,
+ and send traffic into the other:
+
+    ip link add veth0 type veth peer name veth1
+    ip link set veth0 up; ip link set veth1 up
+    packetdump -i tpacket:veth0 -w test.pcap.lz4
+*/
+#include "rawsock-tpacket.h"
+#include "bpf-filter.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <time.h>
+
+struct TPacket
+{
+    int fd;
+    char ifname[64];
+    int linktype;
+    unsigned snaplen;
+
+    /**
+     * The memory mapped ring, consisting of 'block_count' blocks,
+     * each 'block_size' bytes long.
+     */
+    unsigned char *ring;
+    size_t ring_size;
+    unsigned block_size;
+    unsigned block_count;
+
+    /**
+     * The index of the next block we expect the kernel to give us.
+     */
+    unsigned current_block;
+
+    /**
+     * The kernel statistics are reset each time we read them, so
+     * we accumulate them here.
+     */
+    unsigned long long total_packets;
+    unsigned long long total_drops;
+
+    /**
+     * The kernel strips VLAN tags and puts them into the frame header.
+     * To record the original packet, we have to rebuild it with the
+     * tag re-inserted into this buffer. Each frame in a block gets its
+     * own space, so that like the frames in the ring, they all stay
+     * valid until the block is returned to the kernel. Since each
+     * frame takes more than 4 extra bytes in the block, one block's
+     * worth of space is enough.
+     */
+    unsigned char *vlan_buf;
+    size_t vlan_size;
+    size_t vlan_length;
+
+    /**
+     * Frames that were already in the ring when the kernel filter was
+     * attached got there unfiltered, so until we see a frame newer than
+     * that, we run the filter on them ourselves.
+     */
+    const struct BpfProgram *filter;
+    struct timespec filter_attached;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+seterr(char *errbuf, const char *ifname, const char *msg)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s: %s",
+             ifname, msg, strerror(errno));
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct TPacket *
+tpacket_open(const char *ifname,
+             unsigned snaplen,
+             int is_promiscuous,
+             unsigned block_size,
+             unsigned block_count,
+             unsigned block_timeout,
+             char *errbuf)
+{
+    struct TPacket *tp;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct ifreq ifr;
+    int version = TPACKET_V3;
+    unsigned ifindex;
+    int x;
+
+    if (strncmp(ifname, "tpacket:", 8) == 0)
+        ifname += 8;
+    if (block_size == 0)
+        block_size = TPACKET_DEFAULT_BLOCK_SIZE;
+    if (block_count == 0)
+        block_count = TPACKET_DEFAULT_BLOCK_COUNT;
+    if (block_timeout == 0)
+        block_timeout = TPACKET_DEFAULT_BLOCK_TIMEOUT;
+    if (block_size % getpagesize()) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE,
+                 "%s: ring block size %u not a multiple of page size",
+                 ifname, block_size);
+        return NULL;
+    }
+
+    tp = malloc(sizeof(*tp));
+    if (tp == NULL)
+        exit(1);
+    memset(tp, 0, sizeof(*tp));
+    tp->fd = -1;
+    snprintf(tp->ifname, sizeof(tp->ifname), "%s", ifname);
+    tp->snaplen = snaplen;
+    tp->block_size = block_size;
+    tp->block_count = block_count;
+    tp->vlan_size = block_size;
+    tp->vlan_buf = malloc(tp->vlan_size);
+    if (tp->vlan_buf == NULL)
+        exit(1);
+
+    /*
+     * Find the interface index
+     */
+    ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+        seterr(errbuf, ifname, "if_nametoindex");
+        goto fail;
+    }
+
+    /*
+     * Create the socket and tell it we want the version 3 ring
+     */
+    tp->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (tp->fd < 0) {
+        seterr(errbuf, ifname, "socket(AF_PACKET)");
+        goto fail;
+    }
+    x = setsockopt(tp->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+    if (x < 0) {
+        seterr(errbuf, ifname, "PACKET_VERSION(TPACKET_V3)");
+        goto fail;
+    }
+
+    /*
+     * Find the link type. Linux puts an Ethernet header on loopback
+     * frames too, so both are Ethernet for our purposes.
+     */
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (ioctl(tp->fd, SIOCGIFHWADDR, &ifr) < 0) {
+        seterr(errbuf, ifname, "SIOCGIFHWADDR");
+        goto fail;
+    }
+    switch (ifr.ifr_hwaddr.sa_family) {
+        case ARPHRD_ETHER:
+        case ARPHRD_LOOPBACK:
+            tp->linktype = DLT_EN10MB;
+            break;
+        default:
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: unsupported link type %u",
+                     ifname, (unsigned)ifr.ifr_hwaddr.sa_family);
+            goto fail;
+    }
+
+    /*
+     * Create the ring. In version 3, the frame size doesn't really
+     * matter, since frames are variable length within the block, but
+     * the kernel still checks the values for consistency.
+     */
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = block_count;
+    req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr = (block_size / req.tp_frame_size) * block_count;
+    req.tp_retire_blk_tov = block_timeout;
+    req.tp_feature_req_word = 0;
+    x = setsockopt(tp->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+    if (x < 0) {
+        seterr(errbuf, ifname, "PACKET_RX_RING");
+        goto fail;
+    }
+    tp->ring_size = (size_t)block_size * block_count;
+    tp->ring = mmap(NULL, tp->ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_LOCKED, tp->fd, 0);
+    if (tp->ring == MAP_FAILED) {
+        /* locking may fail because of RLIMIT_MEMLOCK, so try without */
+        tp->ring = mmap(NULL, tp->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, tp->fd, 0);
+    }
+    if (tp->ring == MAP_FAILED) {
+        tp->ring = NULL;
+        seterr(errbuf, ifname, "mmap(ring)");
+        goto fail;
+    }
+
+    /*
+     * Now bind to the interface. We don't do this until the ring is
+     * setup, otherwise packets are queued to the socket the old way.
+     */
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(tp->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        seterr(errbuf, ifname, "bind");
+        goto fail;
+    }
+
+    if (is_promiscuous) {
+        struct packet_mreq mreq;
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.mr_ifindex = ifindex;
+        mreq.mr_type = PACKET_MR_PROMISC;
+        x = setsockopt(tp->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+        if (x < 0) {
+            seterr(errbuf, ifname, "PACKET_MR_PROMISC");
+            goto fail;
+        }
+    }
+
+    LOG(1, "%s: tpacket: %u blocks of %u bytes\n", ifname, block_count, block_size);
+    return tp;
+
+fail:
+    tpacket_close(tp);
+    return NULL;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+tpacket_set_fanout(struct TPacket *tp,
+                   unsigned group_id,
+                   const char *mode,
+                   char *errbuf)
+{
+    int fanout_type;
+    int fanout_arg;
+
+    if (mode == NULL || strcmp(mode, "hash") == 0)
+        fanout_type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+    else if (strcmp(mode, "cpu") == 0)
+        fanout_type = PACKET_FANOUT_CPU;
+    else if (strcmp(mode, "rollover") == 0)
+        fanout_type = PACKET_FANOUT_ROLLOVER;
+    else {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE,
+                 "%s: unknown fanout mode '%s' (expected hash, cpu, or rollover)",
+                 tp->ifname, mode);
+        return -1;
+    }
+
+    fanout_arg = (int)(group_id & 0xFFFF) | (fanout_type << 16);
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_FANOUT,
+                   &fanout_arg, sizeof(fanout_arg)) < 0) {
+        seterr(errbuf, tp->ifname, "PACKET_FANOUT");
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+tpacket_set_filter(struct TPacket *tp,
+                   const struct BpfProgram *program,
+                   char *errbuf)
+{
+    struct sock_fprog fprog;
+
+    /* Our instructions have the same layout as the kernel's */
+    fprog.len = (unsigned short)program->count;
+    fprog.filter = (struct sock_filter *)program->insns;
+    if (setsockopt(tp->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                   &fprog, sizeof(fprog)) < 0) {
+        seterr(errbuf, tp->ifname, "SO_ATTACH_FILTER");
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &tp->filter_attached);
+    tp->filter = program;
+    return 0;
+}
+
+/***************************************************************************
+ * Call the handler on a single frame within a block, re-inserting the
+ * VLAN tag if the kernel stripped it.
+ ***************************************************************************/
+static void
+handle_frame(struct TPacket *tp, struct tpacket3_hdr *frame,
+             PCAP_HANDLE_PACKET handler, unsigned char *handle_data)
+{
+    struct pcap_pkthdr hdr;
+    const unsigned char *buf = (const unsigned char *)frame + frame->tp_mac;
+    unsigned caplen = frame->tp_snaplen;
+    unsigned len = frame->tp_len;
+
+    if (tp->filter) {
+        if (frame->tp_sec > (unsigned)tp->filter_attached.tv_sec
+            || (frame->tp_sec == (unsigned)tp->filter_attached.tv_sec
+                && frame->tp_nsec > (unsigned)tp->filter_attached.tv_nsec))
+            tp->filter = NULL;
+        else if (bpf_filter(tp->filter, buf, len, caplen) == 0)
+            return;
+    }
+
+    if ((frame->tp_status & TP_STATUS_VLAN_VALID) && caplen >= 12
+        && tp->vlan_length + caplen + 4 <= tp->vlan_size) {
+        unsigned char *px = tp->vlan_buf + tp->vlan_length;
+        unsigned tpid = ETH_P_8021Q;
+        unsigned tci = frame->hv1.tp_vlan_tci;
+
+        if (frame->tp_status & TP_STATUS_VLAN_TPID_VALID)
+            tpid = frame->hv1.tp_vlan_tpid;
+        memcpy(px, buf, 12);
+        px[12] = (unsigned char)(tpid >> 8);
+        px[13] = (unsigned char)(tpid >> 0);
+        px[14] = (unsigned char)(tci >> 8);
+        px[15] = (unsigned char)(tci >> 0);
+        memcpy(px + 16, buf + 12, caplen - 12);
+        tp->vlan_length += caplen + 4;
+        buf = px;
+        caplen += 4;
+        len += 4;
+    }
+
+    hdr.ts.tv_sec = frame->tp_sec;
+    hdr.ts.tv_usec = frame->tp_nsec / 1000;
+    hdr.caplen = (caplen < tp->snaplen) ? caplen : tp->snaplen;
+    hdr.len = len;
+
+    handler(handle_data, &hdr, buf);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+tpacket_dispatch(struct TPacket *tp,
+                 int timeout_ms,
+                 PCAP_HANDLE_PACKET handler,
+                 TPACKET_RELEASE release,
+                 unsigned char *handle_data)
+{
+    struct tpacket_block_desc *block;
+    struct tpacket3_hdr *frame;
+    unsigned count;
+    unsigned i;
+
+    block = (struct tpacket_block_desc *)
+                (tp->ring + (size_t)tp->current_block * tp->block_size);
+
+    /*
+     * Wait for the kernel to retire the block to us
+     */
+    if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+        struct pollfd pfd;
+        int x;
+
+        pfd.fd = tp->fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        x = poll(&pfd, 1, timeout_ms);
+        if (x < 0) {
+            if (errno == EINTR)
+                return 0;
+            return -1;
+        }
+        if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+            return 0;
+    }
+
+    /*
+     * Process all the frames in the block
+     */
+    count = block->hdr.bh1.num_pkts;
+    tp->vlan_length = 0;
+    frame = (struct tpacket3_hdr *)((unsigned char *)block
+                                    + block->hdr.bh1.offset_to_first_pkt);
+    for (i=0; i<count; i++) {
+        handle_frame(tp, frame, handler, handle_data);
+        frame = (struct tpacket3_hdr *)((unsigned char *)frame
+                                        + frame->tp_next_offset);
+    }
+
+    /*
+     * Return the block to the kernel, once whoever we gave the frames
+     * to is done with them
+     */
+    if (release)
+        release(handle_data);
+    __sync_synchronize();
+    block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    tp->current_block = (tp->current_block + 1) % tp->block_count;
+
+    return (int)count;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+tpacket_stats(struct TPacket *tp, struct pcap_stat *stats)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    if (getsockopt(tp->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+        return -1;
+    tp->total_packets += st.tp_packets;
+    tp->total_drops += st.tp_drops;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->ps_recv = (unsigned)tp->total_packets;
+    stats->ps_drop = (unsigned)tp->total_drops;
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+tpacket_datalink(struct TPacket *tp)
+{
+    return tp->linktype;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+tpacket_close(struct TPacket *tp)
+{
+    if (tp == NULL)
+        return;
+    if (tp->ring)
+        munmap(tp->ring, tp->ring_size);
+    if (tp->fd >= 0)
+        close(tp->fd);
+    free(tp->vlan_buf);
+    free(tp);
+}
+
+#else /* not linux */
+
+struct TPacket *
+tpacket_open(const char *ifname,
+             unsigned snaplen,
+             int is_promiscuous,
+             unsigned block_size,
+             unsigned block_count,
+             unsigned block_timeout,
+             char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: tpacket: only supported on Linux", ifname);
+    return NULL;
+}
+int
+tpacket_set_fanout(struct TPacket *tp, unsigned group_id,
+                   const char *mode, char *errbuf)
+{
+    return -1;
+}
+int
+tpacket_set_filter(struct TPacket *tp, const struct BpfProgram *program,
+                   char *errbuf)
+{
+    return -1;
+}
+int
+tpacket_dispatch(struct TPacket *tp, int timeout_ms,
+                 PCAP_HANDLE_PACKET handler, TPACKET_RELEASE release,
+                 unsigned char *handle_data)
+{
+    return -1;
+}
+int
+tpacket_stats(struct TPacket *tp, struct pcap_stat *stats)
+{
+    return -1;
+}
+int
+tpacket_datalink(struct TPacket *tp)
+{
+    return 0;
+}
+void
+tpacket_close(struct TPacket *tp)
+{
+}
+#endif
@@ -0,0 +1,137 @@
+/*
+    Native Linux AF_PACKET capture (TPACKET_V3)
+
+ This is an alternative to libpcap for high-speed capture on Linux. It
+ maps a ring of large blocks shared with the kernel. The kernel fills
+ a block with many frames, then "retires" the block to us, at which
+ point we process every frame in the block with a single wakeup, then
+ hand the block back to the kernel.
+
+ The interface mimics the libpcap functions in "rawsock-pcap.h" so that
+ the rest of the code can treat the two the same. It's selected by
+ putting "tpacket:" in front of the interface name, or with the
+ "--tpacket" option.
+
+ On platforms other than Linux, the open function simply fails.
+*/
+#ifndef RAWSOCK_TPACKET_H
+#define RAWSOCK_TPACKET_H
+#include "rawsock-pcap.h"
+
+struct TPacket;
+struct BpfProgram;
+
+/**
+ * Default ring configuration, used when the config parameters are zero.
+ * The block size must be a multiple of the page size.
+ */
+enum {
+    TPACKET_DEFAULT_BLOCK_SIZE = 1024 * 1024,
+    TPACKET_DEFAULT_BLOCK_COUNT = 64,
+    TPACKET_DEFAULT_BLOCK_TIMEOUT = 10,
+};
+
+/**
+ * Open an AF_PACKET socket on the interface with an mmap()ed TPACKET_V3
+ * receive ring.
+ * @param ifname
+ *      The name of the network interface, like "eth0". A "tpacket:" prefix
+ *      is stripped if present.
+ * @param snaplen
+ *      The maximum number of bytes per frame we report.
+ * @param is_promiscuous
+ *      Whether to put the adapter into promiscuous mode.
+ * @param block_size
+ *      Size of each ring block in bytes, or 0 for the default.
+ * @param block_count
+ *      Number of blocks in the ring, or 0 for the default.
+ * @param block_timeout
+ *      Milliseconds after which the kernel retires a partially filled
+ *      block, or 0 for the default.
+ * @param errbuf
+ *      A buffer of PCAP_ERRBUF_SIZE bytes for an error message.
+ * @return
+ *      A capture handle, or NULL on error (with errbuf filled in).
+ */
+struct TPacket *
+tpacket_open(const char *ifname,
+             unsigned snaplen,
+             int is_promiscuous,
+             unsigned block_size,
+             unsigned block_count,
+             unsigned block_timeout,
+             char *errbuf);
+
+/**
+ * Join the socket to a PACKET_FANOUT group, so that the kernel spreads
+ * packets across all the sockets in the group, one per capture thread.
+ * This must be called on each socket with the same group id.
+ * @param group_id
+ *      A 16-bit number identifying the group, unique within the system.
+ * @param mode
+ *      How packets are distributed: "hash" (by flow, the default), "cpu"
+ *      (by the CPU that received the packet), or "rollover" (fill one
+ *      socket before moving to the next).
+ * @return
+ *      0 on success, or -1 on failure (with errbuf filled in).
+ */
+int tpacket_set_fanout(struct TPacket *tp,
+                       unsigned group_id,
+                       const char *mode,
+                       char *errbuf);
+
+/**
+ * Attach a filter to the socket, so that the kernel drops the packets
+ * that don't match before they're copied into the ring. The program
+ * must stay valid until the handle is closed. Note that the kernel
+ * strips VLAN tags before running the filter.
+ * @return
+ *      0 on success, or -1 on failure (with errbuf filled in).
+ */
+int tpacket_set_filter(struct TPacket *tp,
+                       const struct BpfProgram *program,
+                       char *errbuf);
+
+/**
+ * Called after the last frame of a block, just before the block is
+ * returned to the kernel.
+ */
+typedef void (*TPACKET_RELEASE)(unsigned char *handle_data);
+
+/**
+ * Wait for the next retired block and call the handler for each frame
+ * within it, then return the block to the kernel. This matches the
+ * semantics of 'pcap_dispatch()', except that a whole block is processed
+ * rather than a count of packets.
+ * @param timeout_ms
+ *      How long to wait for a block before returning zero.
+ * @param release
+ *      If not NULL, called when the block is done. Frames given to the
+ *      handler stay where they are until then, so the handler can keep
+ *      pointers to them rather than copying them.
+ * @return
+ *      The number of packets processed, 0 on timeout, or -1 on error.
+ */
+int tpacket_dispatch(struct TPacket *tp,
+                     int timeout_ms,
+                     PCAP_HANDLE_PACKET handler,
+                     TPACKET_RELEASE release,
+                     unsigned char *handle_data);
+
+/**
+ * Get the packet/drop counters. Unlike the kernel counters, these
+ * are cumulative since the socket was opened.
+ */
+int tpacket_stats(struct TPacket *tp, struct pcap_stat *stats);
+
+/**
+ * The libpcap data-link value (DLT_EN10MB, etc.)
+ */
+int tpacket_datalink(struct TPacket *tp);
+
+/**
+ * Unmap the ring, close the socket, and free the handle.
+ */
+void tpacket_close(struct TPacket *tp);
+
+#endif
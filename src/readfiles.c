@@ -1,100 +1,577 @@
+/*
+    Reading capture files
+
+ Reads plain pcap files, LZ4 or zstd compressed pcap files, and our
+ own ".pdz" and ".pdc" files, and writes all their packets to the '-w' file, in
+ whichever format its name says. That's how compressed captures are turned back
+ into something other tools can read, and how several small captures
+ are combined into one.
+
+ The pcap records are read from a buffer that's refilled either
+ straight from the file, or by decompressing more of the file into it.
+ LZ4 frames with a dictionary ID are decoded here, block by block,
+ since the LZ4F library we have doesn't know about them.
+ A record's contents are handed out as a pointer into that buffer, so
+ they're only valid until the next record is read.
+*/
 #include "packetdump.h"
 #include "readfiles.h"
+#include "compress-dict.h"
+#include "compress-pool.h"
+#include "pdz-file.h"
+#include "rawsock-pcapfile.h"
+#include "codec-zstd.h"
+#include "stream-codec.h"
+#include "lz4/lz4.h"
 #include "lz4/lz4frame.h"
+#include "lz4/xxhash.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-void
-read_file(const struct PacketDump *conf, const char *filename)
+enum {
+    READ_BUFFER_SIZE = 1024 * 1024,
+    READ_INPUT_SIZE = 64 * 1024,
+};
+
+struct CaptureReader
 {
     FILE *fp;
-    LZ4F_errorCode_t err;
-    LZ4F_dctx *ctx = NULL;
-    char buf[65536];
-    size_t bytes_read;
-    size_t offset;
-    LZ4F_frameInfo_t frame_info;
-    
-    fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        perror(filename);
-        return;
+    char *filename;
+
+    /** For .pdz files, which have their own reader */
+    struct PdzReader *pdz;
+
+    /** For LZ4 files, the compressed bytes waiting to be decompressed */
+    LZ4F_dctx *lz4;
+
+    /** For other compressed files, such as zstd, their codec instead */
+    const struct StreamCodec *codec;
+    void *decoder;
+
+    unsigned char *in;
+    size_t in_length;
+    size_t in_offset;
+
+    /** For LZ4 frames with a dictionary, which we decode ourselves */
+    const struct CompressDict *dict;
+    size_t block_max;
+    unsigned is_block_checksum:1;
+    unsigned is_frame_done:1;
+
+    /** The pcap bytes */
+    unsigned char *buf;
+    size_t buf_size;
+    size_t buf_length;
+    size_t buf_offset;
+
+    unsigned linktype;
+    unsigned is_bigendian:1;
+    unsigned is_nanoseconds:1;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static uint32_t
+get32le(const unsigned char *px)
+{
+    return (uint32_t)px[3]<<24 | (uint32_t)px[2]<<16
+            | (uint32_t)px[1]<<8 | px[0];
+}
+static unsigned
+get32(const struct CaptureReader *reader, const unsigned char *px)
+{
+    if (reader->is_bigendian)
+        return (unsigned)px[0]<<24 | (unsigned)px[1]<<16
+                | (unsigned)px[2]<<8 | px[3];
+    else
+        return (unsigned)px[3]<<24 | (unsigned)px[2]<<16
+                | (unsigned)px[1]<<8 | px[0];
+}
+
+/***************************************************************************
+ * Decompress the next block of an LZ4 frame with a dictionary onto the
+ * end of the buffer.
+ * @return 1 on success, 0 at the end of the frame, or -1 on error
+ ***************************************************************************/
+static int
+reader_block(struct CaptureReader *reader)
+{
+    unsigned char prefix[4];
+    size_t length;
+    int x;
+
+    if (reader->is_frame_done)
+        return 0;
+    if (fread(prefix, 1, 4, reader->fp) != 4) {
+        fprintf(stderr, "%s: truncated\n", reader->filename);
+        return -1;
     }
-    
-    /*
-     * read the first chunk
-     */
-    bytes_read = fread(buf, 1, sizeof(buf), fp);
-    if (bytes_read == 0) {
-        if (feof(fp)) {
-            fprintf(stderr, "%s: empty file\n", filename);
-        } else
-            perror(filename);
-        goto closefiles;
-    }
-    
-    
-    /*
-     * Create decompression engine
-     */
-    err = LZ4F_createDecompressionContext(&ctx, LZ4F_getVersion());
-    if (LZ4F_isError(err)) {
-        fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(err));
-        goto closefiles;
-    }
-    
-    /*
-     * Read the initial parameters from the start of the first chunk
-     */
-    offset = bytes_read;
-    err = LZ4F_getFrameInfo(ctx, &frame_info, buf, &offset);
-    if (LZ4F_isError(err)) {
-        fprintf(stderr, "lz4:getframeinfo: %s\n", LZ4F_getErrorName(offset));
-        goto closefiles;
-    }
-    
-    for (;;) {
-        char dst[65536];
-        size_t sizeof_dst = sizeof(dst);
-        size_t bytes_remaining = bytes_read - offset;
-        size_t bytes_decompressed = bytes_remaining;
-        
-        err = LZ4F_decompress(ctx,
-                             dst, &sizeof_dst,
-                             buf+offset, &bytes_decompressed,
-                             NULL);
-        if (LZ4F_isError(err)) {
-            fprintf(stderr, "lz4:decompress: %s\n", LZ4F_getErrorName(offset));
-            goto closefiles;
+    length = get32le(prefix) & 0x7FFFFFFF;
+    if (length == 0 && !(prefix[3] & 0x80)) {
+        /* The end mark, after which there may be a content checksum,
+         * which we don't bother with */
+        reader->is_frame_done = 1;
+        return 0;
+    }
+    if (length > reader->block_max) {
+        fprintf(stderr, "%s: bad block length %u\n", reader->filename,
+                (unsigned)length);
+        return -1;
+    }
+
+    if (prefix[3] & 0x80) {
+        /* Stored uncompressed */
+        if (fread(reader->buf + reader->buf_length, 1, length,
+                  reader->fp) != length) {
+            fprintf(stderr, "%s: truncated\n", reader->filename);
+            return -1;
+        }
+        reader->buf_length += length;
+    } else {
+        if (fread(reader->in, 1, length, reader->fp) != length) {
+            fprintf(stderr, "%s: truncated\n", reader->filename);
+            return -1;
         }
-        
-        
+        x = LZ4_decompress_safe_usingDict((const char *)reader->in,
+                            (char *)reader->buf + reader->buf_length,
+                            (int)length, (int)reader->block_max,
+                            (const char *)reader->dict->data,
+                            (int)reader->dict->size);
+        if (x < 0) {
+            fprintf(stderr, "%s: corrupt block\n", reader->filename);
+            return -1;
+        }
+        reader->buf_length += (size_t)x;
     }
 
-    
-    
-    
-closefiles:
-    if (ctx != NULL) {
-        err = LZ4F_freeDecompressionContext(ctx);
+    if (reader->is_block_checksum && fread(prefix, 1, 4, reader->fp) != 4) {
+        fprintf(stderr, "%s: truncated\n", reader->filename);
+        return -1;
+    }
+    return 1;
+}
+
+/***************************************************************************
+ * Parse the header of an LZ4 frame that has a dictionary ID, since the
+ * library can't. We only handle independent blocks, which is what we
+ * write.
+ * @return 1 on success, or 0 on error, after printing a message
+ ***************************************************************************/
+static int
+reader_dict_frame(struct CaptureReader *reader)
+{
+    unsigned char header[4 + 2 + 8 + 4 + 1];
+    size_t length = 6;
+    unsigned flags;
+    uint32_t dict_id;
+
+    if (fread(header, 1, 6, reader->fp) != 6)
+        goto truncated;
+    flags = header[4];
+    if ((flags >> 6) != 1 || (header[5] & 0x8F) != 0) {
+        fprintf(stderr, "%s: unknown LZ4 frame version\n", reader->filename);
+        return 0;
+    }
+    if ((flags & 0x20) == 0) {
+        fprintf(stderr, "%s: linked LZ4 blocks with a dictionary aren't "
+                "supported\n", reader->filename);
+        return 0;
+    }
+    reader->is_block_checksum = (flags >> 4) & 1;
+    reader->block_max = (size_t)1 << (8 + 2 * ((header[5] >> 4) & 7));
+    if (reader->block_max < 64 * 1024) {
+        fprintf(stderr, "%s: bad LZ4 block size\n", reader->filename);
+        return 0;
+    }
+
+    /* The content size, if any, then the dictionary ID, then the
+     * header checksum */
+    if (flags & 0x08) {
+        if (fread(header + length, 1, 8, reader->fp) != 8)
+            goto truncated;
+        length += 8;
+    }
+    if (fread(header + length, 1, 5, reader->fp) != 5)
+        goto truncated;
+    dict_id = get32le(header + length);
+    if (header[length + 4] != (unsigned char)(XXH32(header + 4, length, 0) >> 8)) {
+        fprintf(stderr, "%s: bad LZ4 header checksum\n", reader->filename);
+        return 0;
+    }
+
+    reader->dict = compressdict_find(dict_id);
+    if (reader->dict == NULL) {
+        fprintf(stderr, "%s: needs dictionary %08x\n", reader->filename,
+                dict_id);
+        fprintf(stderr, "  hint: use --compress-dict with the dictionary it "
+                "was written with\n");
+        return 0;
+    }
+    return 1;
+
+truncated:
+    fprintf(stderr, "%s: truncated LZ4 header\n", reader->filename);
+    return 0;
+}
+
+/***************************************************************************
+ * Make sure there are at least this many bytes in the buffer, reading
+ * and decompressing more of the file as necessary.
+ * @return 1 on success, 0 at the end of the file, or -1 on error
+ ***************************************************************************/
+static int
+reader_fill(struct CaptureReader *reader, size_t needed)
+{
+    if (reader->buf_offset) {
+        memmove(reader->buf, reader->buf + reader->buf_offset,
+                reader->buf_length - reader->buf_offset);
+        reader->buf_length -= reader->buf_offset;
+        reader->buf_offset = 0;
+    }
+
+    while (reader->buf_length < needed) {
+        size_t space = reader->buf_size - reader->buf_length;
+
+        if (reader->dict) {
+            int x = reader_block(reader);
+            if (x <= 0)
+                return x;
+        } else if (reader->lz4 == NULL && reader->decoder == NULL) {
+            size_t bytes_read;
+
+            bytes_read = fread(reader->buf + reader->buf_length, 1, space,
+                               reader->fp);
+            if (bytes_read == 0)
+                return ferror(reader->fp) ? -1 : 0;
+            reader->buf_length += bytes_read;
+        } else {
+            size_t dst_size = space;
+            size_t src_size;
+            size_t err;
+
+            if (reader->in_offset == reader->in_length) {
+                reader->in_length = fread(reader->in, 1, READ_INPUT_SIZE,
+                                          reader->fp);
+                reader->in_offset = 0;
+                if (reader->in_length == 0)
+                    return ferror(reader->fp) ? -1 : 0;
+            }
+            src_size = reader->in_length - reader->in_offset;
+            if (reader->decoder) {
+                if (reader->codec->decode(reader->decoder,
+                                    reader->buf + reader->buf_length, &dst_size,
+                                    reader->in + reader->in_offset, &src_size) != 0)
+                    return -1;
+                reader->in_offset += src_size;
+                reader->buf_length += dst_size;
+                continue;
+            }
+            err = LZ4F_decompress(reader->lz4,
+                                  reader->buf + reader->buf_length, &dst_size,
+                                  reader->in + reader->in_offset, &src_size,
+                                  NULL);
+            if (LZ4F_isError(err)) {
+                fprintf(stderr, "%s: lz4: %s\n", reader->filename,
+                        LZ4F_getErrorName(err));
+                return -1;
+            }
+            reader->in_offset += src_size;
+            reader->buf_length += dst_size;
+        }
+    }
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct CaptureReader *
+capreader_open(const char *filename)
+{
+    struct CaptureReader *reader;
+    unsigned char magic[5] = {0};
+    const unsigned char *px;
+    int x;
+
+    reader = calloc(1, sizeof(*reader));
+    if (reader == NULL)
+        exit(1);
+    reader->filename = strdup(filename);
+    if (reader->filename == NULL)
+        exit(1);
+
+    reader->fp = fopen(filename, "rb");
+    if (reader->fp == NULL) {
+        perror(filename);
+        goto fail;
+    }
+    if (fread(magic, 1, 5, reader->fp) < 4) {
+        fprintf(stderr, "%s: empty file\n", filename);
+        goto fail;
+    }
+    rewind(reader->fp);
+
+    /* Our own format */
+    if (pdz_is_pdz(magic, 4)) {
+        fclose(reader->fp);
+        reader->fp = NULL;
+        reader->pdz = pdzreader_open(filename);
+        if (reader->pdz == NULL)
+            goto fail;
+        reader->linktype = pdzreader_linktype(reader->pdz);
+        return reader;
+    }
+
+    reader->buf_size = READ_BUFFER_SIZE;
+
+    /* An LZ4 frame around a pcap file */
+    if (memcmp(magic, "\x04\x22\x4d\x18", 4) == 0 && (magic[4] & 0x01)) {
+        if (!reader_dict_frame(reader))
+            goto fail;
+
+        /* Room for a whole block after whatever's left over */
+        reader->buf_size += reader->block_max;
+        reader->in = malloc(reader->block_max);
+        if (reader->in == NULL)
+            exit(1);
+    } else if (memcmp(magic, "\x04\x22\x4d\x18", 4) == 0) {
+        size_t err;
+
+        err = LZ4F_createDecompressionContext(&reader->lz4, LZ4F_VERSION);
         if (LZ4F_isError(err)) {
             fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(err));
+            reader->lz4 = NULL;
+            goto fail;
+        }
+        reader->in = malloc(READ_INPUT_SIZE);
+        if (reader->in == NULL)
+            exit(1);
+    } else if ((reader->codec = streamcodec_find(magic)) != NULL) {
+        if (reader->codec->init() != 0)
+            goto fail;
+        reader->decoder = reader->codec->decoder_create();
+        if (reader->decoder == NULL)
+            goto fail;
+        reader->in = malloc(READ_INPUT_SIZE);
+        if (reader->in == NULL)
+            exit(1);
+    }
+
+    reader->buf = malloc(reader->buf_size);
+    if (reader->buf == NULL)
+        exit(1);
+
+    /* The pcap file header */
+    x = reader_fill(reader, 24);
+    if (x <= 0) {
+        if (x == 0)
+            fprintf(stderr, "%s: truncated file header\n", filename);
+        goto fail;
+    }
+    px = reader->buf;
+    if (memcmp(px, "\xd4\xc3\xb2\xa1", 4) == 0)
+        ;
+    else if (memcmp(px, "\xa1\xb2\xc3\xd4", 4) == 0)
+        reader->is_bigendian = 1;
+    else if (memcmp(px, "\x4d\x3c\xb2\xa1", 4) == 0)
+        reader->is_nanoseconds = 1;
+    else if (memcmp(px, "\xa1\xb2\x3c\x4d", 4) == 0) {
+        reader->is_bigendian = 1;
+        reader->is_nanoseconds = 1;
+    } else {
+        fprintf(stderr, "%s: unknown file format\n", filename);
+        goto fail;
+    }
+    reader->linktype = get32(reader, px + 20);
+    reader->buf_offset = 24;
+    return reader;
+
+fail:
+    capreader_close(reader);
+    return NULL;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+capreader_next(struct CaptureReader *reader,
+               struct pcap_pkthdr *hdr,
+               const unsigned char **r_buf)
+{
+    const unsigned char *px;
+    unsigned caplen;
+    int x;
+
+    if (reader->pdz)
+        return pdzreader_next(reader->pdz, hdr, r_buf);
+
+    if (reader->buf_length - reader->buf_offset < 16) {
+        x = reader_fill(reader, 16);
+        if (x <= 0) {
+            if (x == 0 && reader->buf_length != 0)
+                fprintf(stderr, "%s: truncated record header\n", reader->filename);
+            return (x == 0 && reader->buf_length == 0) ? 0 : -1;
+        }
+    }
+
+    px = reader->buf + reader->buf_offset;
+    caplen = get32(reader, px + 8);
+    if (caplen > PDZ_MAX_PACKET) {
+        fprintf(stderr, "%s: corrupt record, length %u\n",
+                reader->filename, caplen);
+        return -1;
+    }
+    if (reader->buf_length - reader->buf_offset < 16 + (size_t)caplen) {
+        x = reader_fill(reader, 16 + (size_t)caplen);
+        if (x <= 0) {
+            if (x == 0)
+                fprintf(stderr, "%s: truncated record\n", reader->filename);
+            return -1;
         }
+        px = reader->buf + reader->buf_offset;
     }
+
+    hdr->ts.tv_sec = (long)get32(reader, px + 0);
+    hdr->ts.tv_usec = (long)get32(reader, px + 4);
+    if (reader->is_nanoseconds)
+        hdr->ts.tv_usec /= 1000;
+    hdr->caplen = caplen;
+    hdr->len = get32(reader, px + 12);
+    *r_buf = px + 16;
+    reader->buf_offset += 16 + (size_t)caplen;
+    return 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+capreader_linktype(const struct CaptureReader *reader)
+{
+    return reader->linktype;
 }
+
+/***************************************************************************
+ ***************************************************************************/
 void
+capreader_close(struct CaptureReader *reader)
+{
+    if (reader == NULL)
+        return;
+    if (reader->fp)
+        fclose(reader->fp);
+    if (reader->lz4)
+        LZ4F_freeDecompressionContext(reader->lz4);
+    if (reader->decoder)
+        reader->codec->decoder_destroy(reader->decoder);
+    pdzreader_close(reader->pdz);
+    free(reader->in);
+    free(reader->buf);
+    free(reader->filename);
+    free(reader);
+}
+
+/***************************************************************************
+ * Copy all the packets from one file to the output, opening the output
+ * when we see the first file's link type.
+ * @return 0 on success, or -1 on error
+ ***************************************************************************/
+static int
+read_file(const struct PacketDump *conf, const struct CompressDict *dict,
+          const char *filename,
+          struct PcapFile **r_out, unsigned *r_linktype)
+{
+    struct CaptureReader *reader;
+    struct pcap_pkthdr hdr;
+    const unsigned char *buf;
+    int x;
+
+    reader = capreader_open(filename);
+    if (reader == NULL)
+        return -1;
+
+    if (*r_out == NULL) {
+        struct PcapFileOptions options;
+        int compression_type = PCAPFILE_NO_COMPRESSION;
+
+        memset(&options, 0, sizeof(options));
+        options.block_size = (size_t)conf->compress_block_size;
+        if (options.block_size == 0)
+            options.block_size = 256 * 1024;
+        options.compression_level = (int)conf->compress_level;
+        options.dict = dict;
+        options.threads = (unsigned)conf->compress_threads;
+        if (conf->is_pdc)
+            compression_type = PCAPFILE_PDC;
+        else if (conf->is_pdz)
+            compression_type = PCAPFILE_PDZ;
+        else if (conf->is_zstd)
+            compression_type = PCAPFILE_ZSTD;
+        else if (conf->is_compression)
+            compression_type = PCAPFILE_LZ4;
+
+        *r_linktype = capreader_linktype(reader);
+        *r_out = pcapfile_openwrite_ex(conf->filename, *r_linktype,
+                                       compression_type, &options);
+        if (*r_out == NULL) {
+            capreader_close(reader);
+            return -1;
+        }
+    } else if (capreader_linktype(reader) != *r_linktype) {
+        fprintf(stderr, "%s: link type %u, but writing %u, skipping\n",
+                filename, capreader_linktype(reader), *r_linktype);
+        capreader_close(reader);
+        return -1;
+    }
+
+    while ((x = capreader_next(reader, &hdr, &buf)) > 0) {
+        if (pcapfile_writeframe(*r_out, buf, hdr.caplen, hdr.len,
+                                hdr.ts.tv_sec, hdr.ts.tv_usec) < 0) {
+            fprintf(stderr, "%s: write failed\n", conf->filename);
+            x = -1;
+            break;
+        }
+    }
+
+    capreader_close(reader);
+    return x;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
 read_files(const struct PacketDump *conf)
 {
-    size_t i;
     const char **file_list = conf->readfiles;
-    
+    const struct CompressDict *dict = NULL;
+    struct PcapFile *out = NULL;
+    unsigned linktype = 0;
+    int result = 0;
+    size_t i;
+
     if (file_list == NULL)
-        return;
-    
+        return 0;
+    if (conf->filename == NULL || conf->filename[0] == '\0') {
+        fprintf(stderr, "FAIL: no file to write the packets to\n");
+        fprintf(stderr, "  hint: use the '-w' option, such as '-w out.pcap'\n");
+        return 1;
+    }
+
+    if (conf->is_zstd && zstd_codec.init() != 0)
+        return 1;
+
+    /* Both for reading files compressed with it, and for writing */
+    if (conf->compress_dict) {
+        dict = compressdict_load(conf->compress_dict);
+        if (dict == NULL)
+            return 1;
+    }
+
     for (i=0; file_list[i]; i++) {
-        const char *filename;
-        
-        filename = file_list[i];
-        
-        read_file(conf, filename);
+        if (read_file(conf, dict, file_list[i], &out, &linktype) < 0)
+            result = 1;
     }
+
+    pcapfile_close(out);
+    compressdict_cleanup();
+    return result;
 }
@@ -1,8 +1,37 @@
 #ifndef readfiles_h
 #define readfiles_h
 #include "packetdump.h"
+#include "rawsock-pcap.h"
 
-void
+struct CaptureReader;
+
+/**
+ * Open a capture file for reading, which can be a plain pcap file, a
+ * pcap file compressed with LZ4, or a ".pdz" or ".pdc" file.
+ * @return the reader, or NULL on error, after printing a message
+ */
+struct CaptureReader *capreader_open(const char *filename);
+
+/**
+ * Get the next packet.
+ * @param r_buf
+ *      Set to the packet contents, which stay valid until the next call.
+ * @return 1 for a packet, 0 at the end of the file, or -1 on error,
+ * after printing a message
+ */
+int capreader_next(struct CaptureReader *reader,
+                   struct pcap_pkthdr *hdr,
+                   const unsigned char **r_buf);
+
+unsigned capreader_linktype(const struct CaptureReader *reader);
+
+void capreader_close(struct CaptureReader *reader);
+
+/**
+ * Read all the '-r' files, writing their packets to the '-w' file.
+ * @return 0 on success, or 1 if anything failed
+ */
+int
 read_files(const struct PacketDump *conf);
 
 #endif /* readfiles_h */
@@ -0,0 +1,277 @@
+/*
+    Protocol-aware truncation
+
+ The headers are parsed just far enough to find where the payload
+ starts, and what it is. Anything we don't understand, or that's been
+ cut short already, is left alone.
+*/
+#include "snap-policy.h"
+#include "rawsock-pcap.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    IP_PROTO_ICMP = 1,
+    IP_PROTO_TCP = 6,
+    IP_PROTO_UDP = 17,
+    IP_PROTO_ICMPV6 = 58,
+};
+
+struct SnapPolicy
+{
+    /** One bit per port, for the ports that are kept whole */
+    unsigned char tcp_ports[65536/8];
+    unsigned char udp_ports[65536/8];
+
+    unsigned is_tls:1;
+    unsigned is_http:1;
+    unsigned is_icmp:1;
+
+    unsigned payload;
+};
+
+/* The start of an HTTP request or response */
+static const char *http_starts[] = {
+    "GET ", "POST ", "PUT ", "HEAD ", "DELETE ", "OPTIONS ", "PATCH ",
+    "CONNECT ", "HTTP/1.", 0
+};
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+port_set(unsigned char *ports, unsigned port)
+{
+    ports[port >> 3] |= (unsigned char)(1 << (port & 7));
+}
+static unsigned
+port_is_set(const unsigned char *ports, unsigned port)
+{
+    return (ports[port >> 3] >> (port & 7)) & 1;
+}
+
+/***************************************************************************
+ * Parse a port number, which must be all of the string.
+ * @return the port, or -1 if it isn't one
+ ***************************************************************************/
+static int
+parse_port(const char *str, size_t length)
+{
+    unsigned port = 0;
+    size_t i;
+
+    if (length == 0 || length > 5)
+        return -1;
+    for (i=0; i<length; i++) {
+        if (!isdigit(str[i] & 0xFF))
+            return -1;
+        port = port * 10 + (unsigned)(str[i] - '0');
+    }
+    return (port <= 65535) ? (int)port : -1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct SnapPolicy *
+snappolicy_create(const char *keep, unsigned payload)
+{
+    struct SnapPolicy *policy;
+    const char *p;
+
+    if (keep == NULL)
+        keep = SNAP_DEFAULT_KEEP;
+
+    policy = calloc(1, sizeof(*policy));
+    if (policy == NULL) {
+        fprintf(stderr, "[-] out of memory\n");
+        exit(1);
+    }
+    policy->payload = (payload < 65536) ? payload : 65536;
+
+    for (p = keep; *p; ) {
+        size_t length = strcspn(p, ",");
+        int port;
+
+        if (length == 3 && memcmp(p, "dns", 3) == 0) {
+            port_set(policy->udp_ports, 53);
+            port_set(policy->tcp_ports, 53);
+            port_set(policy->udp_ports, 5353);
+            port_set(policy->tcp_ports, 5353);
+        } else if (length == 3 && memcmp(p, "tls", 3) == 0)
+            policy->is_tls = 1;
+        else if (length == 4 && memcmp(p, "http", 4) == 0)
+            policy->is_http = 1;
+        else if (length == 4 && memcmp(p, "icmp", 4) == 0)
+            policy->is_icmp = 1;
+        else if (length > 4 && memcmp(p, "tcp/", 4) == 0
+                 && (port = parse_port(p + 4, length - 4)) >= 0)
+            port_set(policy->tcp_ports, (unsigned)port);
+        else if (length > 4 && memcmp(p, "udp/", 4) == 0
+                 && (port = parse_port(p + 4, length - 4)) >= 0)
+            port_set(policy->udp_ports, (unsigned)port);
+        else if ((port = parse_port(p, length)) >= 0) {
+            port_set(policy->tcp_ports, (unsigned)port);
+            port_set(policy->udp_ports, (unsigned)port);
+        } else {
+            fprintf(stderr, "FAIL: snap-keep: unknown '%.*s'\n", (int)length, p);
+            fprintf(stderr, "  hint: expected dns, tls, http, icmp, or a port, "
+                    "like 8080, tcp/8443, or udp/123\n");
+            free(policy);
+            return NULL;
+        }
+
+        p += length;
+        if (*p == ',')
+            p++;
+    }
+    return policy;
+}
+
+/***************************************************************************
+ * Whether the TCP payload is one we keep whole, from how it starts.
+ ***************************************************************************/
+static unsigned
+is_interesting_tcp(const struct SnapPolicy *policy,
+                   const unsigned char *px, unsigned length)
+{
+    /* A TLS handshake record, TLS 1.0 or later. The hellos fit in the
+     * first segment, though long certificate chains don't */
+    if (policy->is_tls && length >= 3 && px[0] == 0x16 && px[1] == 0x03)
+        return 1;
+
+    if (policy->is_http && length >= 4) {
+        unsigned i;
+
+        for (i=0; http_starts[i]; i++) {
+            size_t n = strlen(http_starts[i]);
+            if (length >= n && memcmp(px, http_starts[i], n) == 0)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+snappolicy_caplen(const struct SnapPolicy *policy,
+                  int linktype,
+                  const unsigned char *px,
+                  unsigned caplen)
+{
+    unsigned offset = 0;
+    unsigned ethertype;
+    unsigned proto;
+    unsigned end;
+
+    /*
+     * The link layer
+     */
+    if (linktype == DLT_EN10MB) {
+        if (caplen < 14)
+            return caplen;
+        ethertype = px[12] << 8 | px[13];
+        offset = 14;
+        while ((ethertype == 0x8100 || ethertype == 0x88a8)
+               && offset + 4 <= caplen) {
+            ethertype = px[offset + 2] << 8 | px[offset + 3];
+            offset += 4;
+        }
+    } else if (linktype == DLT_RAW) {
+        if (caplen < 1)
+            return caplen;
+        ethertype = ((px[0] >> 4) == 6) ? 0x86dd : 0x0800;
+    } else
+        return caplen;
+
+    /*
+     * The network layer. Fragments after the first have no transport
+     * header, so they're payload.
+     */
+    if (ethertype == 0x0800) {
+        unsigned header_length;
+
+        if (offset + 20 > caplen || (px[offset] >> 4) != 4)
+            return caplen;
+        header_length = (px[offset] & 0x0F) * 4;
+        if (header_length < 20 || offset + header_length > caplen)
+            return caplen;
+        proto = px[offset + 9];
+        if ((px[offset + 6] & 0x1F) || px[offset + 7])
+            proto = 0;
+        offset += header_length;
+    } else if (ethertype == 0x86dd) {
+        unsigned i;
+
+        if (offset + 40 > caplen || (px[offset] >> 4) != 6)
+            return caplen;
+        proto = px[offset + 6];
+        offset += 40;
+
+        /* Skip the extension headers */
+        for (i=0; i<8; i++) {
+            if (proto == 0 || proto == 43 || proto == 60) {
+                if (offset + 8 > caplen)
+                    return caplen;
+                proto = px[offset];
+                offset += (px[offset + 1] + 1) * 8;
+            } else if (proto == 44) {
+                if (offset + 8 > caplen)
+                    return caplen;
+                proto = px[offset];
+                if ((px[offset + 2] << 8 | px[offset + 3]) & 0xFFF8)
+                    proto = 59;
+                offset += 8;
+            } else
+                break;
+        }
+        if (offset > caplen)
+            return caplen;
+    } else {
+        /* ARP, LLDP, and so on, which are small and interesting */
+        return caplen;
+    }
+
+    /*
+     * The transport layer
+     */
+    switch (proto) {
+    case IP_PROTO_TCP:
+        if (offset + 20 > caplen)
+            return caplen;
+        if (port_is_set(policy->tcp_ports, px[offset] << 8 | px[offset + 1])
+            || port_is_set(policy->tcp_ports, px[offset + 2] << 8 | px[offset + 3]))
+            return caplen;
+        offset += (px[offset + 12] >> 4) * 4;
+        if (offset > caplen)
+            return caplen;
+        if (is_interesting_tcp(policy, px + offset, caplen - offset))
+            return caplen;
+        break;
+    case IP_PROTO_UDP:
+        if (offset + 8 > caplen)
+            return caplen;
+        if (port_is_set(policy->udp_ports, px[offset] << 8 | px[offset + 1])
+            || port_is_set(policy->udp_ports, px[offset + 2] << 8 | px[offset + 3]))
+            return caplen;
+        offset += 8;
+        break;
+    case IP_PROTO_ICMP:
+    case IP_PROTO_ICMPV6:
+        if (policy->is_icmp)
+            return caplen;
+        break;
+    }
+
+    end = offset + policy->payload;
+    return (end < caplen) ? end : caplen;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+snappolicy_destroy(struct SnapPolicy *policy)
+{
+    free(policy);
+}
@@ -0,0 +1,58 @@
+/*
+    Protocol-aware truncation
+
+ A fixed snap length either keeps the bulk payload we never look at, or
+ cuts off the DNS answers, TLS handshakes, and HTTP headers we need.
+ Instead, this looks at each packet's protocol headers and decides how
+ much of it to keep: all of it for the protocols and ports we care
+ about, and only the headers plus the first few payload bytes for the
+ rest. The record keeps the packet's original length, so that tools
+ still see the true sizes.
+
+ The list of what to keep whole is a comma-separated list of:
+    dns             UDP or TCP port 53 or 5353
+    tls             TCP segments that start a TLS handshake record
+    http            TCP segments that start an HTTP request or response
+    icmp            ICMP and ICMPv6
+    <port>          that UDP or TCP port
+    tcp/<port>      that TCP port
+    udp/<port>      that UDP port
+ Packets that aren't IP, like ARP, are always kept whole.
+*/
+#ifndef SNAP_POLICY_H
+#define SNAP_POLICY_H
+
+enum {
+    SNAP_DEFAULT_PAYLOAD = 64,
+};
+
+/** The list used when none is configured */
+#define SNAP_DEFAULT_KEEP "dns,tls,http,icmp"
+
+struct SnapPolicy;
+
+/**
+ * @param keep
+ *      What to keep whole, in the format above, or NULL for the default.
+ * @param payload
+ *      How many bytes of payload to keep after the headers of the
+ *      other packets.
+ * @return the policy, or NULL on error, after printing a message
+ */
+struct SnapPolicy *snappolicy_create(const char *keep, unsigned payload);
+
+/**
+ * Decide how much of a packet to keep.
+ * @param linktype
+ *      The data link, such as DLT_EN10MB. Other link types we don't
+ *      understand are kept whole.
+ * @return the new captured length, no more than 'caplen'
+ */
+unsigned snappolicy_caplen(const struct SnapPolicy *policy,
+                           int linktype,
+                           const unsigned char *px,
+                           unsigned caplen);
+
+void snappolicy_destroy(struct SnapPolicy *policy);
+
+#endif
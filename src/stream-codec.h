@@ -0,0 +1,83 @@
+/*
+    Streaming compression codecs
+
+ LZ4 is written as independent blocks, so that we can compress them in
+ parallel on our own workers. Other codecs, like zstd, compress the
+ file as one continuous stream, and do their own multithreading. Those
+ are hidden behind this interface, so that the file writer and reader
+ don't need to know which one they're using.
+*/
+#ifndef STREAM_CODEC_H
+#define STREAM_CODEC_H
+#include <stddef.h>
+#include <sys/types.h>
+
+struct OutputFile;
+
+/**
+ * What to do after compressing the input: keep going, make everything
+ * so far decodable (for readers following the file as it's written),
+ * or finish the file.
+ */
+enum {
+    CODEC_CONTINUE = 0,
+    CODEC_FLUSH = 1,
+    CODEC_END = 2,
+};
+
+struct StreamCodec
+{
+    const char *name;
+
+    /** The first bytes of a compressed file */
+    unsigned char magic[4];
+
+    /**
+     * Load the library, if necessary.
+     * @return 0 on success, or -1 after printing a message
+     */
+    int (*init)(void);
+
+    /**
+     * @param level
+     *      The codec's own compression level, where 0 is its default.
+     * @param threads
+     *      Worker threads for the codec's own multithreading, or zero
+     *      to compress in the calling thread.
+     * @return the compressor, or NULL after printing a message
+     */
+    void *(*encoder_create)(int level, unsigned threads);
+
+    /**
+     * Compress the bytes and write whatever output is ready.
+     * @return the number of bytes written, or -1 on error
+     */
+    ssize_t (*encode)(void *encoder, struct OutputFile *out,
+                      const void *buf, size_t length, int mode);
+
+    void (*encoder_destroy)(void *encoder);
+
+    void *(*decoder_create)(void);
+
+    /**
+     * Decompress as much of the input into the output as will fit,
+     * like LZ4F_decompress().
+     * @param dst_size
+     *      The room in 'dst', set to the number of bytes produced.
+     * @param src_size
+     *      The bytes in 'src', set to the number of bytes consumed.
+     * @return 0 on success, or -1 after printing a message
+     */
+    int (*decode)(void *decoder, void *dst, size_t *dst_size,
+                  const void *src, size_t *src_size);
+
+    void (*decoder_destroy)(void *decoder);
+};
+
+/**
+ * Find the codec for a compressed file, from its first 4 bytes.
+ * @return the codec, or NULL if there's none
+ */
+const struct StreamCodec *streamcodec_find(const unsigned char *magic);
+
+#endif
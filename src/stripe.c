@@ -0,0 +1,250 @@
+/*
+    Striping output files across several disks
+
+ Weighted choice uses "smooth weighted round-robin": every time we
+ choose, each directory's credit goes up by its weight, the one with
+ the most credit is chosen, and its credit goes down by the total of
+ all the weights. That spreads the files out evenly, rather than
+ choosing the fastest disk several times in a row.
+*/
+#include "stripe.h"
+#include "pixie-threads.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct StripeRoot
+{
+    /** The directory, without a trailing slash, or an empty string */
+    char *dir;
+    size_t dir_length;
+
+    struct FileService *service;
+
+    /** Updated by the files written in this directory */
+    struct OutputCounters counters;
+
+    /** For weighted choice */
+    int64_t credit;
+};
+
+struct Stripe
+{
+    int mode;
+    unsigned count;
+    unsigned next;
+    volatile unsigned lock;
+    struct StripeRoot *roots;
+};
+
+/***************************************************************************
+ ***************************************************************************/
+int
+stripe_mode(const char *name)
+{
+    if (name == NULL || name[0] == '\0' || strcmp(name, "roundrobin") == 0)
+        return STRIPE_ROUNDROBIN;
+    if (strcmp(name, "weighted") == 0)
+        return STRIPE_WEIGHTED;
+    return -1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+stripe_add(struct Stripe *stripe, const char *dir, size_t length)
+{
+    struct StripeRoot *root;
+
+    while (length > 1 && dir[length - 1] == '/')
+        length--;
+
+    stripe->roots = realloc(stripe->roots,
+                            (stripe->count + 1) * sizeof(stripe->roots[0]));
+    if (stripe->roots == NULL)
+        exit(1);
+    root = &stripe->roots[stripe->count++];
+    memset(root, 0, sizeof(*root));
+    root->dir = malloc(length + 1);
+    if (root->dir == NULL)
+        exit(1);
+    memcpy(root->dir, dir, length);
+    root->dir[length] = '\0';
+    root->dir_length = length;
+    root->service = fileservice_create();
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct Stripe *
+stripe_create(const char *dirs, int mode)
+{
+    struct Stripe *stripe;
+
+    stripe = calloc(1, sizeof(*stripe));
+    if (stripe == NULL)
+        exit(1);
+    stripe->mode = mode;
+
+    while (dirs && *dirs) {
+        size_t length = strcspn(dirs, ",");
+        if (length)
+            stripe_add(stripe, dirs, length);
+        dirs += length;
+        if (*dirs == ',')
+            dirs++;
+    }
+    if (stripe->count == 0)
+        stripe_add(stripe, "", 0);
+    return stripe;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+stripe_destroy(struct Stripe *stripe)
+{
+    unsigned i;
+
+    if (stripe == NULL)
+        return;
+    for (i=0; i<stripe->count; i++) {
+        fileservice_destroy(stripe->roots[i].service);
+        free(stripe->roots[i].dir);
+    }
+    free(stripe->roots);
+    free(stripe);
+}
+
+/***************************************************************************
+ * How fast a directory has been written, in kilobytes/second, or 0 if
+ * we don't know yet.
+ ***************************************************************************/
+static int64_t
+stripe_speed(const struct StripeRoot *root)
+{
+    uint64_t bytes = root->counters.bytes;
+    uint64_t usecs = root->counters.usecs;
+
+    if (usecs == 0)
+        return 0;
+    return (int64_t)((bytes / 1024) * 1000000 / usecs) + 1;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static unsigned
+stripe_choose_weighted(struct Stripe *stripe)
+{
+    int64_t fastest = 1;
+    int64_t total = 0;
+    unsigned best = 0;
+    unsigned i;
+
+    for (i=0; i<stripe->count; i++) {
+        int64_t speed = stripe_speed(&stripe->roots[i]);
+        if (fastest < speed)
+            fastest = speed;
+    }
+
+    /* Until a directory has written something, assume it's as fast as
+     * the fastest, so that it gets tried */
+    for (i=0; i<stripe->count; i++) {
+        struct StripeRoot *root = &stripe->roots[i];
+        int64_t speed = stripe_speed(root);
+
+        if (speed == 0)
+            speed = fastest;
+        root->credit += speed;
+        total += speed;
+        if (root->credit > stripe->roots[best].credit)
+            best = i;
+    }
+    stripe->roots[best].credit -= total;
+    return best;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+stripe_choose(struct Stripe *stripe)
+{
+    unsigned result;
+
+    if (stripe->count == 1)
+        return 0;
+
+    while (!rte_atomic32_cmpset(&stripe->lock, 0, 1))
+        rte_pause();
+    if (stripe->mode == STRIPE_WEIGHTED)
+        result = stripe_choose_weighted(stripe);
+    else {
+        result = stripe->next;
+        stripe->next = (stripe->next + 1) % stripe->count;
+    }
+    rte_wmb();
+    stripe->lock = 0;
+
+    return result;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+char *
+stripe_filename(const struct Stripe *stripe, unsigned root,
+                const char *filename)
+{
+    const struct StripeRoot *r = &stripe->roots[root];
+    char *result;
+
+    if (r->dir_length == 0) {
+        result = strdup(filename);
+        if (result == NULL)
+            exit(1);
+        return result;
+    }
+
+    while (filename[0] == '/')
+        filename++;
+    result = malloc(r->dir_length + strlen(filename) + 2);
+    if (result == NULL)
+        exit(1);
+    sprintf(result, "%s/%s", r->dir, filename);
+    return result;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+unsigned
+stripe_find(const struct Stripe *stripe, const char *filename)
+{
+    unsigned i;
+
+    for (i=0; i<stripe->count; i++) {
+        const struct StripeRoot *r = &stripe->roots[i];
+        if (r->dir_length
+            && strncmp(filename, r->dir, r->dir_length) == 0
+            && filename[r->dir_length] == '/')
+            return i;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct FileService *
+stripe_service(struct Stripe *stripe, unsigned root)
+{
+    return stripe->roots[root].service;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+struct OutputCounters *
+stripe_counters(struct Stripe *stripe, unsigned root)
+{
+    if (stripe->mode != STRIPE_WEIGHTED)
+        return NULL;
+    return &stripe->roots[root].counters;
+}
@@ -0,0 +1,81 @@
+/*
+    Striping output files across several disks
+
+ A single NVMe drive can't keep up with 10gbps of lightly compressed
+ traffic for long. So instead of writing every file to the same place,
+ the files can be spread across several directories, each of which is
+ presumably on its own disk. Each time we rotate, the next file goes in
+ the next directory.
+
+ Each directory gets its own service thread for opening, closing, and
+ deleting files, so that a slow disk only holds up its own files.
+
+ Directories can be chosen round-robin, or "weighted", where each gets
+ a share of the files in proportion to how fast it's been writing them.
+ The speed is measured as the bytes written divided by the time spent
+ inside the calls that write them. That's not just the disk, since
+ it includes copying into the page cache, but when writing faster than
+ a disk can keep up, the kernel throttles writers to that disk, so the
+ time comes to be dominated by the disk.
+*/
+#ifndef STRIPE_H
+#define STRIPE_H
+#include "file-service.h"
+#include "output-file.h"
+struct Stripe;
+
+enum {
+    STRIPE_ROUNDROBIN,
+    STRIPE_WEIGHTED,
+};
+
+/**
+ * Convert a mode name, "roundrobin" or "weighted", into its value.
+ * A NULL or empty name means round-robin.
+ * @return the mode, or -1 if the name isn't known
+ */
+int stripe_mode(const char *name);
+
+/**
+ * Start a service thread for each directory.
+ * @param dirs
+ *      A comma-separated list of directories. If NULL or empty, there's
+ *      a single "directory" that leaves filenames unchanged.
+ */
+struct Stripe *stripe_create(const char *dirs, int mode);
+
+/**
+ * Finish everything each service thread is doing, then free everything.
+ */
+void stripe_destroy(struct Stripe *stripe);
+
+/**
+ * Choose the directory for the next file. This can be called by many
+ * threads at once.
+ */
+unsigned stripe_choose(struct Stripe *stripe);
+
+/**
+ * Put a filename into one of the directories.
+ * @return a malloced copy of the name, with the directory in front
+ */
+char *stripe_filename(const struct Stripe *stripe, unsigned root,
+                      const char *filename);
+
+/**
+ * Find which directory a filename returned by 'stripe_filename()' is in.
+ */
+unsigned stripe_find(const struct Stripe *stripe, const char *filename);
+
+/**
+ * The thread for opening and closing files in a directory.
+ */
+struct FileService *stripe_service(struct Stripe *stripe, unsigned root);
+
+/**
+ * Where files in a directory count how fast they're written, or NULL
+ * if that isn't needed.
+ */
+struct OutputCounters *stripe_counters(struct Stripe *stripe, unsigned root);
+
+#endif